@@ -0,0 +1,460 @@
+#pragma once
+
+#include "RaytracingCompat.h"
+#include "RaytracingHelper.h"
+#include "RaytracingMath.h"
+
+#include <cstring>
+
+namespace CpuRaytracing {
+
+	// Memory layout of a built acceleration structure, as written to DestAccelerationStructureData.
+	//
+	// Every section is addressed by a byte offset from the header, never by pointer, so a structure can be
+	// copied or moved as a plain block of bytes. Sections start on c_SectionAlignment boundaries, and structures
+	// on 256-byte ones as in D3D12, so every node array and leaf array begins on a cache line. Nodes are ordered
+	// depth-first and leaf data follows the order in which leaves are reached.
+
+	static const UINT c_AccelerationStructureMagic = 0x53415243;   // "CRAS"
+	static const UINT c_AccelerationStructureVersion = 5;
+	static const UINT64 c_SectionAlignment = 64;
+
+	// Upper bound on the depth of any tree the builders emit; traversal stacks are sized from it.
+	static const UINT c_MaxBvhDepth = 64;
+
+	// Binary BVH node, 32 bytes. Nodes are stored in depth-first order: the first child of an interior node,
+	// the one with the larger surface area, immediately follows it, so only the index of the second child
+	// needs to be stored.
+	struct BvhNode {
+		Aabb Bounds;
+		UINT Offset;            // Interior: index of the second child. Leaf: index of the first primitive.
+		UINT16 PrimitiveCount;  // Zero for interior nodes.
+		UINT8 SplitAxis;
+		UINT8 Reserved;
+
+		bool IsLeaf () const { return PrimitiveCount != 0; }
+	};
+	static_assert (sizeof (BvhNode) == 32, "BvhNode is expected to be half a cache line.");
+
+	// Node of a BVH collapsed to Width children (BVH4 / BVH8). Child boxes are stored as structure of arrays so
+	// one vector compare tests all of them. Slots at and after ChildCount hold empty boxes that never intersect.
+	// Interior children are other wide nodes, in depth-first order with the largest child first; leaf children
+	// reference primitives directly.
+	template <UINT Width>
+	struct WideBvhNode {
+		static const UINT c_Width = Width;
+
+		float LowerX[Width];
+		float UpperX[Width];
+		float LowerY[Width];
+		float UpperY[Width];
+		float LowerZ[Width];
+		float UpperZ[Width];
+		UINT Child[Width];              // Interior: node index. Leaf: index of the first primitive.
+		UINT16 PrimitiveCount[Width];   // Zero for interior children.
+		UINT8 ChildCount;
+		UINT8 Reserved[Width == 4 ? 7 : 15];
+
+		UINT GetChild (UINT slot) const { return Child[slot]; }
+		UINT GetPrimitiveCount (UINT slot) const { return PrimitiveCount[slot]; }
+
+		Aabb GetChildBounds (UINT slot) const {
+			return Aabb {Float3 (LowerX[slot], LowerY[slot], LowerZ[slot]), Float3 (UpperX[slot], UpperY[slot], UpperZ[slot])};
+		}
+
+		void SetChildBounds (UINT slot, const Aabb& bounds) {
+			LowerX[slot] = bounds.Lower.x;
+			LowerY[slot] = bounds.Lower.y;
+			LowerZ[slot] = bounds.Lower.z;
+			UpperX[slot] = bounds.Upper.x;
+			UpperY[slot] = bounds.Upper.y;
+			UpperZ[slot] = bounds.Upper.z;
+		}
+
+		// Bounds of the first ChildCount slots.
+		void SetChildBounds (const Aabb* childBounds) {
+			for (UINT slot = 0; slot < ChildCount; slot++) {
+				SetChildBounds (slot, childBounds[slot]);
+			}
+		}
+
+		Aabb GetBounds () const {
+			Aabb bounds = Aabb::Empty ();
+			for (UINT slot = 0; slot < ChildCount; slot++) {
+				bounds.Grow (GetChildBounds (slot));
+			}
+			return bounds;
+		}
+	};
+
+	typedef WideBvhNode<4> Bvh4Node;
+	typedef WideBvhNode<8> Bvh8Node;
+	static_assert (sizeof (Bvh4Node) == 128, "Bvh4Node is expected to be two cache lines.");
+	static_assert (sizeof (Bvh8Node) == 256, "Bvh8Node is expected to be four cache lines.");
+
+	// Quantized planes are whole steps of 2^exponent from the node origin. Steps are built from the exponent
+	// bits, and q * 2^exponent is exact for 8-bit q, so every decoder rounds a plane the same way.
+	inline float GetQuantizationStep (int exponent) {
+		UINT32 bits = static_cast<UINT32> (exponent + 127) << 23;
+		float step;
+		memcpy (&step, &bits, sizeof (step));
+		return step;
+	}
+
+	inline float DecodeQuantizedPlane (float origin, UINT quantized, int exponent) {
+		return origin + static_cast<float> (quantized) * GetQuantizationStep (exponent);
+	}
+
+	// Smallest exponent whose 255 steps from lower reach upper.
+	inline int GetQuantizationExponent (float lower, float upper) {
+		int exponent;
+		std::frexp (std::max ((upper - lower) / 255.0f, std::numeric_limits<float>::min ()), &exponent);
+		exponent = std::max (exponent, -126);
+		while (exponent < 127 && !(DecodeQuantizedPlane (lower, 255, exponent) >= upper)) {
+			exponent++;
+		}
+		return exponent;
+	}
+
+	// Largest step that does not decode above value; rounds lower planes outward.
+	inline UINT8 QuantizeLowerPlane (float origin, int exponent, float value) {
+		float steps = std::floor ((value - origin) / GetQuantizationStep (exponent));
+		UINT q = static_cast<UINT> (std::min (std::max (steps, 0.0f), 255.0f));
+		while (q > 0 && DecodeQuantizedPlane (origin, q, exponent) > value) {
+			q--;
+		}
+		while (q < 255 && DecodeQuantizedPlane (origin, q + 1, exponent) <= value) {
+			q++;
+		}
+		return static_cast<UINT8> (q);
+	}
+
+	// Smallest step that does not decode below value; rounds upper planes outward.
+	inline UINT8 QuantizeUpperPlane (float origin, int exponent, float value) {
+		float steps = std::ceil ((value - origin) / GetQuantizationStep (exponent));
+		UINT q = static_cast<UINT> (std::min (std::max (steps, 0.0f), 255.0f));
+		while (q < 255 && DecodeQuantizedPlane (origin, q, exponent) < value) {
+			q++;
+		}
+		while (q > 0 && DecodeQuantizedPlane (origin, q - 1, exponent) >= value) {
+			q--;
+		}
+		return static_cast<UINT8> (q);
+	}
+
+	// Wide node with 8-bit child planes (c_BuildFlagQuantizedNodes). The node keeps its own box at full precision
+	// as Origin plus a power-of-two step per axis, and each child plane as a step count rounded outward, so the
+	// decoded child boxes always contain the exact ones.
+	//
+	// Interior children occupy the first slots and are stored consecutively from ChildBase. The primitives of the
+	// leaf children that follow are stored consecutively from PrimitiveBase, and PrimitiveEnd holds the running
+	// primitive count after each slot, so a slot that adds no primitives is interior. Slots at and after
+	// ChildCount are unused.
+	template <UINT Width>
+	struct alignas (16) QuantizedBvhNode {
+		static const UINT c_Width = Width;
+
+		Float3 Origin;
+		int8_t Exponent[3];
+		UINT8 ChildCount;
+		UINT ChildBase;
+		UINT PrimitiveBase;
+		UINT8 PrimitiveEnd[Width];
+		UINT8 Lower[3][Width];          // Per axis, then per child.
+		UINT8 Upper[3][Width];
+
+		UINT GetPrimitiveBegin (UINT slot) const { return slot > 0 ? PrimitiveEnd[slot - 1] : 0; }
+		UINT GetPrimitiveCount (UINT slot) const { return PrimitiveEnd[slot] - GetPrimitiveBegin (slot); }
+
+		// Interior: node index. Leaf: index of the first primitive.
+		UINT GetChild (UINT slot) const {
+			const UINT begin = GetPrimitiveBegin (slot);
+			return PrimitiveEnd[slot] != begin ? PrimitiveBase + begin : ChildBase + slot;
+		}
+
+		Aabb GetChildBounds (UINT slot) const {
+			Aabb bounds;
+			for (UINT axis = 0; axis < 3; axis++) {
+				bounds.Lower[axis] = DecodeQuantizedPlane (Origin[axis], Lower[axis][slot], Exponent[axis]);
+				bounds.Upper[axis] = DecodeQuantizedPlane (Origin[axis], Upper[axis][slot], Exponent[axis]);
+			}
+			return bounds;
+		}
+
+		// Quantizes the first ChildCount slots against their union.
+		void SetChildBounds (const Aabb* childBounds) {
+			Aabb bounds = Aabb::Empty ();
+			for (UINT slot = 0; slot < ChildCount; slot++) {
+				bounds.Grow (childBounds[slot]);
+			}
+
+			Origin = bounds.Lower;
+			for (UINT axis = 0; axis < 3; axis++) {
+				const int exponent = GetQuantizationExponent (bounds.Lower[axis], bounds.Upper[axis]);
+				Exponent[axis] = static_cast<int8_t> (exponent);
+				for (UINT slot = 0; slot < Width; slot++) {
+					const bool used = slot < ChildCount;
+					Lower[axis][slot] = used ? QuantizeLowerPlane (Origin[axis], exponent, childBounds[slot].Lower[axis]) : 0;
+					Upper[axis][slot] = used ? QuantizeUpperPlane (Origin[axis], exponent, childBounds[slot].Upper[axis]) : 0;
+				}
+			}
+		}
+
+		Aabb GetBounds () const {
+			Aabb bounds = Aabb::Empty ();
+			for (UINT slot = 0; slot < ChildCount; slot++) {
+				bounds.Grow (GetChildBounds (slot));
+			}
+			return bounds;
+		}
+	};
+
+	typedef QuantizedBvhNode<4> QuantizedBvh4Node;
+	typedef QuantizedBvhNode<8> QuantizedBvh8Node;
+	static_assert (sizeof (QuantizedBvh4Node) == 64, "QuantizedBvh4Node is expected to be one cache line.");
+	static_assert (sizeof (QuantizedBvh8Node) == 80, "QuantizedBvh8Node is expected to be 80 bytes.");
+
+	// AccelerationStructureHeader::NodeFormat.
+	static const UINT c_NodeFormatFloat = 0;        // BvhNode or WideBvhNode
+	static const UINT c_NodeFormatQuantized = 1;    // QuantizedBvhNode
+
+	// Children per node selected by the c_BuildFlagBvh4 / c_BuildFlagBvh8 build flags; 2 without either.
+	inline UINT GetNodeWidth (D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS flags) {
+		ThrowIfFalse (!(flags & c_BuildFlagBvh4) || !(flags & c_BuildFlagBvh8), "CpuRaytracing: c_BuildFlagBvh4 and c_BuildFlagBvh8 are mutually exclusive.");
+		return (flags & c_BuildFlagBvh8) ? 8 : ((flags & c_BuildFlagBvh4) ? 4 : 2);
+	}
+
+	inline UINT GetNodeFormat (D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS flags) {
+		if (!(flags & c_BuildFlagQuantizedNodes)) {
+			return c_NodeFormatFloat;
+		}
+		ThrowIfFalse (GetNodeWidth (flags) != 2, "CpuRaytracing: c_BuildFlagQuantizedNodes requires c_BuildFlagBvh4 or c_BuildFlagBvh8.");
+		return c_NodeFormatQuantized;
+	}
+
+	// Spatial-split budget in eighths of the primitive count; zero without spatial splits.
+	inline UINT GetSpatialSplitBudget (D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS flags) {
+		const UINT budget = static_cast<UINT> (flags & c_SpatialSplitBudgetMask) >> c_SpatialSplitBudgetShift;
+		ThrowIfFalse (budget == 0 || (flags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_TRACE) != 0,
+			"CpuRaytracing: spatial splits require PREFER_FAST_TRACE.");
+		return budget;
+	}
+
+	// Leaf references a build may emit: each primitive once, plus the duplicates the spatial-split budget allows.
+	inline UINT GetMaxReferenceCount (D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS flags, UINT primitiveCount) {
+		const UINT64 referenceCount = primitiveCount + UINT64 (primitiveCount) * GetSpatialSplitBudget (flags) / 8;
+		ThrowIfFalse (referenceCount < (1u << 31), "CpuRaytracing: too many primitive references in one acceleration structure.");
+		return static_cast<UINT> (referenceCount);
+	}
+
+	inline UINT64 GetNodeSize (UINT nodeWidth, UINT nodeFormat) {
+		if (nodeFormat == c_NodeFormatQuantized) {
+			return nodeWidth == 8 ? sizeof (QuantizedBvh8Node) : sizeof (QuantizedBvh4Node);
+		}
+		return nodeWidth == 8 ? sizeof (Bvh8Node) : (nodeWidth == 4 ? sizeof (Bvh4Node) : sizeof (BvhNode));
+	}
+
+	// A collapsed node only stops short of Width children when all of them are leaves, and every node has at
+	// least two children unless the whole tree is one leaf. Counting slots over n leaves then bounds the number
+	// of wide nodes by (Width (n - 1) + Width - 2) / (2 Width - 2).
+	inline UINT GetMaxNodeCount (UINT nodeWidth, UINT primitiveCount) {
+		if (primitiveCount == 0) {
+			return 0;
+		}
+		if (nodeWidth == 2) {
+			return 2 * primitiveCount - 1;
+		}
+		UINT64 bound = (UINT64 (nodeWidth) * (primitiveCount - 1) + nodeWidth - 2) / (2 * nodeWidth - 2);
+		return std::max (static_cast<UINT> (bound), 1u);
+	}
+
+	struct GeometryInfo {
+		UINT Type;              // D3D12_RAYTRACING_GEOMETRY_TYPE
+		UINT Flags;             // D3D12_RAYTRACING_GEOMETRY_FLAGS
+		UINT PrimitiveCount;
+		UINT Reserved;
+	};
+
+	struct TriangleRecord {
+		Float3 V0;
+		Float3 V1;
+		Float3 V2;
+	};
+
+	static const UINT c_TriangleBlockWidth = 8;
+
+	// Leaf triangles are copied out of the vertex buffers in leaf order, into blocks of c_TriangleBlockWidth laid
+	// out per vertex, then per axis, then per triangle, so one SIMD load fetches one coordinate of a whole block.
+	// Leaf primitive i is lane i % c_TriangleBlockWidth of block i / c_TriangleBlockWidth, and the lanes after the
+	// last primitive are zero. Vertices are stored rather than edges or normals: the watertight test derives
+	// everything from the vertices relative to the ray, which is what keeps a shared edge from leaking.
+	struct alignas (32) TriangleBlock {
+		float V0[3][c_TriangleBlockWidth];
+		float V1[3][c_TriangleBlockWidth];
+		float V2[3][c_TriangleBlockWidth];
+
+		TriangleRecord GetTriangle (UINT lane) const {
+			return TriangleRecord {Float3 (V0[0][lane], V0[1][lane], V0[2][lane]), Float3 (V1[0][lane], V1[1][lane], V1[2][lane]),
+				Float3 (V2[0][lane], V2[1][lane], V2[2][lane])};
+		}
+
+		void SetTriangle (UINT lane, const TriangleRecord& triangle) {
+			for (UINT axis = 0; axis < 3; axis++) {
+				V0[axis][lane] = triangle.V0[axis];
+				V1[axis][lane] = triangle.V1[axis];
+				V2[axis][lane] = triangle.V2[axis];
+			}
+		}
+	};
+
+	// The triangle section of a structure over procedural primitives holds the Aabb of each leaf primitive
+	// instead, copied out of the AABB buffers in leaf order.
+	inline UINT64 GetLeafSectionSize (UINT geometryType, UINT primitiveCount) {
+		if (geometryType == D3D12_RAYTRACING_GEOMETRY_TYPE_PROCEDURAL_PRIMITIVE_AABBS) {
+			return UINT64 (primitiveCount) * sizeof (Aabb);
+		}
+		return UINT64 ((primitiveCount + c_TriangleBlockWidth - 1) / c_TriangleBlockWidth) * sizeof (TriangleBlock);
+	}
+
+	// Maps a leaf primitive back to the geometry desc and PrimitiveIndex () it came from.
+	struct PrimitiveRecord {
+		UINT GeometryIndex;
+		UINT PrimitiveIndex;
+	};
+
+	// Top-level leaves reference instances, which are stored in leaf order with both transforms resolved.
+	struct InstanceRecord {
+		Matrix3x4 ObjectToWorld;
+		Matrix3x4 WorldToObject;
+		D3D12_GPU_VIRTUAL_ADDRESS AccelerationStructure;
+		UINT InstanceIndex;     // Position in the InstanceDescs array, as returned by InstanceIndex ().
+		UINT InstanceID;
+		UINT InstanceContributionToHitGroupIndex;
+		UINT8 InstanceMask;
+		UINT8 Flags;            // D3D12_RAYTRACING_INSTANCE_FLAGS
+		UINT16 Reserved[5];
+	};
+	static_assert (sizeof (InstanceRecord) == 128, "InstanceRecord is expected to be two cache lines.");
+
+	struct AccelerationStructureHeader {
+		UINT Magic;
+		UINT Version;
+		UINT Type;              // D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE
+		UINT BuildFlags;        // D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS
+		UINT64 SizeInBytes;     // Bytes from the start of the header to the end of the last section.
+		Aabb Bounds;
+		UINT MaxDepth;
+		UINT NodeWidth;         // 2 (BvhNode), 4 (Bvh4Node) or 8 (Bvh8Node).
+		UINT NodeFormat;        // c_NodeFormatFloat, or c_NodeFormatQuantized for QuantizedBvhNode<NodeWidth>.
+
+		UINT GeometryCount;
+		UINT GeometryType;      // D3D12_RAYTRACING_GEOMETRY_TYPE shared by all geometries; TRIANGLES in a top-level structure.
+		UINT NodeCount;
+		UINT PrimitiveCount;
+		float SahCost;              // SAH cost of the binary hierarchy as built, relative to its root area.
+		float UnoptimizedSahCost;   // SahCost before c_BuildFlagOptimizeHierarchy; equal to SahCost without it.
+		UINT GeometryFlags;         // D3D12_RAYTRACING_GEOMETRY_FLAGS every geometry has, so OPAQUE if all are opaque.
+		UINT64 GeometryOffset;
+		UINT64 NodeOffset;
+		UINT64 TriangleOffset;
+		UINT64 PrimitiveOffset;
+		UINT64 InstanceOffset;
+
+		bool IsValid () const { return Magic == c_AccelerationStructureMagic && Version == c_AccelerationStructureVersion; }
+
+		const GeometryInfo* GetGeometries () const { return OffsetPointer<GeometryInfo> (this, GeometryOffset); }
+		const BvhNode* GetNodes () const { return OffsetPointer<BvhNode> (this, NodeOffset); }
+		template <UINT Width>
+		const WideBvhNode<Width>* GetWideNodes () const { return OffsetPointer<WideBvhNode<Width>> (this, NodeOffset); }
+		template <UINT Width>
+		const QuantizedBvhNode<Width>* GetQuantizedNodes () const { return OffsetPointer<QuantizedBvhNode<Width>> (this, NodeOffset); }
+		const TriangleBlock* GetTriangleBlocks () const { return OffsetPointer<TriangleBlock> (this, TriangleOffset); }
+		TriangleRecord GetTriangle (UINT index) const { return GetTriangleBlocks ()[index / c_TriangleBlockWidth].GetTriangle (index % c_TriangleBlockWidth); }
+		const Aabb* GetProceduralBounds () const { return OffsetPointer<Aabb> (this, TriangleOffset); }
+		const PrimitiveRecord* GetPrimitives () const { return OffsetPointer<PrimitiveRecord> (this, PrimitiveOffset); }
+		const InstanceRecord* GetInstances () const { return OffsetPointer<InstanceRecord> (this, InstanceOffset); }
+
+		GeometryInfo* GetGeometries () { return OffsetPointer<GeometryInfo> (this, GeometryOffset); }
+		BvhNode* GetNodes () { return OffsetPointer<BvhNode> (this, NodeOffset); }
+		template <UINT Width>
+		WideBvhNode<Width>* GetWideNodes () { return OffsetPointer<WideBvhNode<Width>> (this, NodeOffset); }
+		template <UINT Width>
+		QuantizedBvhNode<Width>* GetQuantizedNodes () { return OffsetPointer<QuantizedBvhNode<Width>> (this, NodeOffset); }
+		TriangleBlock* GetTriangleBlocks () { return OffsetPointer<TriangleBlock> (this, TriangleOffset); }
+		Aabb* GetProceduralBounds () { return OffsetPointer<Aabb> (this, TriangleOffset); }
+		PrimitiveRecord* GetPrimitives () { return OffsetPointer<PrimitiveRecord> (this, PrimitiveOffset); }
+		InstanceRecord* GetInstances () { return OffsetPointer<InstanceRecord> (this, InstanceOffset); }
+	};
+
+	// Section offsets of a structure holding the given number of elements. Builds lay out the worst case for
+	// their inputs; compacted copies use the counts that were actually written. Leaf primitives are triangles or
+	// procedural primitives, as geometryType says, in a bottom-level structure and instances in a top-level one,
+	// which has no geometries.
+	struct AccelerationStructureLayout {
+		UINT64 GeometryOffset;
+		UINT64 NodeOffset;
+		UINT64 TriangleOffset;
+		UINT64 PrimitiveOffset;
+		UINT64 InstanceOffset;
+		UINT64 SizeInBytes;
+	};
+
+	inline AccelerationStructureLayout GetAccelerationStructureLayout (UINT type, UINT geometryType, UINT geometryCount, UINT64 nodeSize, UINT nodeCount, UINT primitiveCount) {
+		const bool topLevel = type == D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL;
+		const UINT triangleCount = topLevel ? 0 : primitiveCount;
+		const UINT instanceCount = topLevel ? primitiveCount : 0;
+
+		AccelerationStructureLayout layout;
+		layout.GeometryOffset = Align (sizeof (AccelerationStructureHeader), c_SectionAlignment);
+		layout.NodeOffset = layout.GeometryOffset + Align (UINT64 (geometryCount) * sizeof (GeometryInfo), c_SectionAlignment);
+		layout.TriangleOffset = layout.NodeOffset + Align (nodeCount * nodeSize, c_SectionAlignment);
+		layout.PrimitiveOffset = layout.TriangleOffset + Align (GetLeafSectionSize (geometryType, triangleCount), c_SectionAlignment);
+		layout.InstanceOffset = layout.PrimitiveOffset + Align (UINT64 (primitiveCount) * sizeof (PrimitiveRecord), c_SectionAlignment);
+		layout.SizeInBytes = layout.InstanceOffset + Align (UINT64 (instanceCount) * sizeof (InstanceRecord), c_SectionAlignment);
+		return layout;
+	}
+
+	inline void SetLayout (AccelerationStructureHeader* header, const AccelerationStructureLayout& layout) {
+		header->SizeInBytes = layout.SizeInBytes;
+		header->GeometryOffset = layout.GeometryOffset;
+		header->NodeOffset = layout.NodeOffset;
+		header->TriangleOffset = layout.TriangleOffset;
+		header->PrimitiveOffset = layout.PrimitiveOffset;
+		header->InstanceOffset = layout.InstanceOffset;
+	}
+
+	// Header of a structure that has been laid out but holds no nodes yet.
+	inline void InitializeHeader (AccelerationStructureHeader* header, D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE type,
+		D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS flags, UINT geometryType, UINT geometryCount, const AccelerationStructureLayout& layout) {
+
+		header->Magic = c_AccelerationStructureMagic;
+		header->Version = c_AccelerationStructureVersion;
+		header->Type = type;
+		header->BuildFlags = flags;
+		header->Bounds = Aabb::Empty ();
+		header->MaxDepth = 0;
+		header->NodeWidth = GetNodeWidth (flags);
+		header->NodeFormat = GetNodeFormat (flags);
+		header->GeometryCount = geometryCount;
+		header->GeometryType = geometryType;
+		header->NodeCount = 0;
+		header->PrimitiveCount = 0;
+		header->SahCost = 0.0f;
+		header->UnoptimizedSahCost = 0.0f;
+		header->GeometryFlags = 0;
+		SetLayout (header, layout);
+	}
+
+	inline const AccelerationStructureHeader* GetAccelerationStructure (D3D12_GPU_VIRTUAL_ADDRESS address) {
+		auto header = GetCpuPointer<const AccelerationStructureHeader> (address);
+		ThrowIfFalse (header && header->IsValid (), "CpuRaytracing: address does not point at a built acceleration structure.");
+		return header;
+	}
+
+	inline const AccelerationStructureHeader* GetBottomLevelAccelerationStructure (D3D12_GPU_VIRTUAL_ADDRESS address) {
+		auto header = GetAccelerationStructure (address);
+		ThrowIfFalse (header->Type == D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL, "CpuRaytracing: address does not point at a bottom-level acceleration structure.");
+		return header;
+	}
+
+}
@@ -0,0 +1,319 @@
+#include "stdafx.h"
+#include "AccelerationStructureCopy.h"
+#include "GeometryReader.h"
+
+namespace CpuRaytracing {
+
+	namespace {
+
+		void ValidateCopy (const void* dest, UINT64 destSize, const AccelerationStructureHeader* source) {
+			ThrowIfFalse (dest != nullptr, "CpuRaytracing: DestAccelerationStructureData is required.");
+
+			auto destBegin = static_cast<const uint8_t*> (dest);
+			auto sourceBegin = reinterpret_cast<const uint8_t*> (source);
+			ThrowIfFalse (destBegin + destSize <= sourceBegin || sourceBegin + source->SizeInBytes <= destBegin,
+				"CpuRaytracing: the source and destination of a copy must not overlap.");
+		}
+
+		AccelerationStructureLayout GetPackedLayout (const AccelerationStructureHeader* source) {
+			return GetAccelerationStructureLayout (source->Type, source->GeometryType, source->GeometryCount, GetNodeSize (source->NodeWidth, source->NodeFormat), source->NodeCount, source->PrimitiveCount);
+		}
+
+		void WritePackedCopy (void* dest, const AccelerationStructureHeader* source, const AccelerationStructureLayout& layout) {
+			auto header = static_cast<AccelerationStructureHeader*> (dest);
+			*header = *source;
+			SetLayout (header, layout);
+
+			const bool topLevel = source->Type == D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL;
+			memcpy (header->GetGeometries (), source->GetGeometries (), source->GeometryCount * sizeof (GeometryInfo));
+			memcpy (header->GetNodes (), source->GetNodes (), source->NodeCount * GetNodeSize (source->NodeWidth, source->NodeFormat));
+			memcpy (header->GetPrimitives (), source->GetPrimitives (), source->PrimitiveCount * sizeof (PrimitiveRecord));
+			if (topLevel) {
+				memcpy (header->GetInstances (), source->GetInstances (), source->PrimitiveCount * sizeof (InstanceRecord));
+			} else {
+				memcpy (header->GetTriangleBlocks (), source->GetTriangleBlocks (), GetLeafSectionSize (source->GeometryType, source->PrimitiveCount));
+			}
+		}
+
+		typedef D3D12_SERIALIZED_RAYTRACING_ACCELERATION_STRUCTURE_HEADER SerializedHeader;
+
+		// {5E6A3C9D-1F4B-4E7A-8C2D-610F3A7B95E4}
+		const GUID c_DriverOpaqueGuid = {0x5e6a3c9d, 0x1f4b, 0x4e7a, {0x8c, 0x2d, 0x61, 0x0f, 0x3a, 0x7b, 0x95, 0xe4}};
+
+		// Versioning data: the structure version, then a byte order mark since the data is read without conversion.
+		const UINT c_ByteOrderMark = 0x01020304;
+
+		UINT64 GetInfoOffset (UINT64 pointerCount) {
+			return sizeof (SerializedHeader) + pointerCount * sizeof (D3D12_GPU_VIRTUAL_ADDRESS);
+		}
+
+		UINT64 GetStructureOffset (UINT64 pointerCount) {
+			return Align (GetInfoOffset (pointerCount) + sizeof (SerializedAccelerationStructureInfo), D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BYTE_ALIGNMENT);
+		}
+
+		const SerializedAccelerationStructureInfo* GetInfo (const SerializedHeader* header) {
+			return OffsetPointer<SerializedAccelerationStructureInfo> (header, GetInfoOffset (header->NumBottomLevelAccelerationStructurePointersAfterHeader));
+		}
+
+		bool IsValidNodeFormat (UINT nodeWidth, UINT nodeFormat) {
+			const bool validWidth = nodeWidth == 2 || nodeWidth == 4 || nodeWidth == 8;
+			return validWidth && (nodeFormat == c_NodeFormatFloat || (nodeFormat == c_NodeFormatQuantized && nodeWidth != 2));
+		}
+
+		bool IsValidGeometryType (UINT type, UINT geometryType) {
+			return geometryType == D3D12_RAYTRACING_GEOMETRY_TYPE_TRIANGLES ||
+				(geometryType == D3D12_RAYTRACING_GEOMETRY_TYPE_PROCEDURAL_PRIMITIVE_AABBS && type == D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL);
+		}
+
+		// The structure inside serialized data, or null unless the data is of this format and its headers and
+		// section offsets lie within sizeInBytes.
+		const AccelerationStructureHeader* FindSerializedStructure (const void* serialized, UINT64 sizeInBytes) {
+			if (!serialized || sizeInBytes < sizeof (SerializedHeader)) {
+				return nullptr;
+			}
+
+			auto header = static_cast<const SerializedHeader*> (serialized);
+			const UINT64 serializedSize = header->SerializedSizeInBytesIncludingHeader;
+			const UINT64 pointerCount = header->NumBottomLevelAccelerationStructurePointersAfterHeader;
+			if (CheckDriverMatchingIdentifier (D3D12_SERIALIZED_DATA_RAYTRACING_ACCELERATION_STRUCTURE, header->DriverMatchingIdentifier) != D3D12_DRIVER_MATCHING_IDENTIFIER_COMPATIBLE_WITH_DEVICE ||
+				serializedSize > sizeInBytes || pointerCount > serializedSize / sizeof (D3D12_GPU_VIRTUAL_ADDRESS) ||
+				GetStructureOffset (pointerCount) + sizeof (AccelerationStructureHeader) > serializedSize) {
+				return nullptr;
+			}
+
+			const UINT64 structureOffset = GetInfo (header)->StructureOffset;
+			if (structureOffset != GetStructureOffset (pointerCount) || header->DeserializedSizeInBytes != serializedSize - structureOffset) {
+				return nullptr;
+			}
+
+			auto structure = OffsetPointer<AccelerationStructureHeader> (serialized, structureOffset);
+			if (!structure->IsValid () || !IsValidNodeFormat (structure->NodeWidth, structure->NodeFormat) || !IsValidGeometryType (structure->Type, structure->GeometryType)) {
+				return nullptr;
+			}
+			const AccelerationStructureLayout layout = GetPackedLayout (structure);
+			const bool packed = layout.SizeInBytes == header->DeserializedSizeInBytes && layout.SizeInBytes == structure->SizeInBytes &&
+				layout.GeometryOffset == structure->GeometryOffset && layout.NodeOffset == structure->NodeOffset &&
+				layout.TriangleOffset == structure->TriangleOffset && layout.PrimitiveOffset == structure->PrimitiveOffset &&
+				layout.InstanceOffset == structure->InstanceOffset;
+			return packed ? structure : nullptr;
+		}
+
+		// Multiply-xorshift over 64-bit words. It guards against stale files, not deliberate collisions.
+		class InputHasher {
+		public:
+			void Add (UINT64 value) {
+				m_Hash = (m_Hash ^ value) * 0x9e3779b97f4a7c15ull;
+				m_Hash ^= m_Hash >> 29;
+			}
+
+			void Add (const void* data, size_t sizeInBytes) {
+				auto bytes = static_cast<const uint8_t*> (data);
+				for (; sizeInBytes >= sizeof (UINT64); bytes += sizeof (UINT64), sizeInBytes -= sizeof (UINT64)) {
+					UINT64 word;
+					memcpy (&word, bytes, sizeof (word));
+					Add (word);
+				}
+				UINT64 tail = sizeInBytes;
+				memcpy (&tail, bytes, sizeInBytes);
+				Add (tail ^ (UINT64 (sizeInBytes) << 56));
+			}
+
+			UINT64 GetHash () const {
+				UINT64 h = m_Hash;
+				h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+				h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+				return h ^ (h >> 31);
+			}
+
+		private:
+			UINT64 m_Hash = 0xcbf29ce484222325ull;
+		};
+
+	}
+
+	UINT64 GetCompactedSize (const AccelerationStructureHeader* source) {
+		return GetPackedLayout (source).SizeInBytes;
+	}
+
+	void CloneAccelerationStructure (void* dest, const AccelerationStructureHeader* source) {
+		ValidateCopy (dest, source->SizeInBytes, source);
+		memcpy (dest, source, source->SizeInBytes);
+	}
+
+	void CompactAccelerationStructure (void* dest, const AccelerationStructureHeader* source) {
+		ThrowIfFalse ((source->BuildFlags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_COMPACTION) != 0,
+			"CpuRaytracing: the compaction source was not built with ALLOW_COMPACTION.");
+
+		AccelerationStructureLayout layout = GetPackedLayout (source);
+		ValidateCopy (dest, layout.SizeInBytes, source);
+		WritePackedCopy (dest, source, layout);
+	}
+
+	D3D12_SERIALIZED_DATA_DRIVER_MATCHING_IDENTIFIER GetDriverMatchingIdentifier () {
+		D3D12_SERIALIZED_DATA_DRIVER_MATCHING_IDENTIFIER identifier = {};
+		identifier.DriverOpaqueGUID = c_DriverOpaqueGuid;
+		memcpy (identifier.DriverOpaqueVersioningData, &c_AccelerationStructureVersion, sizeof (UINT));
+		memcpy (identifier.DriverOpaqueVersioningData + sizeof (UINT), &c_ByteOrderMark, sizeof (UINT));
+		return identifier;
+	}
+
+	D3D12_DRIVER_MATCHING_IDENTIFIER_STATUS CheckDriverMatchingIdentifier (D3D12_SERIALIZED_DATA_TYPE serializedDataType,
+		const D3D12_SERIALIZED_DATA_DRIVER_MATCHING_IDENTIFIER& identifier) {
+
+		if (serializedDataType != D3D12_SERIALIZED_DATA_RAYTRACING_ACCELERATION_STRUCTURE) {
+			return D3D12_DRIVER_MATCHING_IDENTIFIER_UNSUPPORTED_TYPE;
+		}
+
+		const D3D12_SERIALIZED_DATA_DRIVER_MATCHING_IDENTIFIER current = GetDriverMatchingIdentifier ();
+		if (memcmp (&identifier.DriverOpaqueGUID, &current.DriverOpaqueGUID, sizeof (GUID)) != 0) {
+			return D3D12_DRIVER_MATCHING_IDENTIFIER_UNRECOGNIZED;
+		}
+		if (memcmp (identifier.DriverOpaqueVersioningData, current.DriverOpaqueVersioningData, sizeof (current.DriverOpaqueVersioningData)) != 0) {
+			return D3D12_DRIVER_MATCHING_IDENTIFIER_INCOMPATIBLE_VERSION;
+		}
+		return D3D12_DRIVER_MATCHING_IDENTIFIER_COMPATIBLE_WITH_DEVICE;
+	}
+
+	UINT64 GetSerializedBottomLevelPointerCount (const AccelerationStructureHeader* source) {
+		if (source->Type != D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL) {
+			return 0;
+		}
+
+		// Inactive instances have no record, so the list ends at the last active one.
+		const InstanceRecord* instances = source->GetInstances ();
+		UINT64 pointerCount = 0;
+		for (UINT i = 0; i < source->PrimitiveCount; i++) {
+			pointerCount = std::max (pointerCount, UINT64 (instances[i].InstanceIndex) + 1);
+		}
+		return pointerCount;
+	}
+
+	UINT64 GetSerializedSize (const AccelerationStructureHeader* source) {
+		return GetStructureOffset (GetSerializedBottomLevelPointerCount (source)) + GetCompactedSize (source);
+	}
+
+	void SerializeAccelerationStructure (void* dest, const AccelerationStructureHeader* source, UINT64 inputHash) {
+		const UINT64 pointerCount = GetSerializedBottomLevelPointerCount (source);
+		const UINT64 structureOffset = GetStructureOffset (pointerCount);
+		const AccelerationStructureLayout layout = GetPackedLayout (source);
+		ValidateCopy (dest, structureOffset + layout.SizeInBytes, source);
+
+		auto header = static_cast<SerializedHeader*> (dest);
+		header->DriverMatchingIdentifier = GetDriverMatchingIdentifier ();
+		header->SerializedSizeInBytesIncludingHeader = structureOffset + layout.SizeInBytes;
+		header->DeserializedSizeInBytes = layout.SizeInBytes;
+		header->NumBottomLevelAccelerationStructurePointersAfterHeader = pointerCount;
+
+		// Zero the gaps too, so that serializing the same structure always produces the same bytes.
+		memset (OffsetPointer<void> (dest, sizeof (SerializedHeader)), 0, structureOffset - sizeof (SerializedHeader));
+		SerializedAccelerationStructureInfo* info = OffsetPointer<SerializedAccelerationStructureInfo> (dest, GetInfoOffset (pointerCount));
+		info->InputHash = inputHash;
+		info->StructureOffset = structureOffset;
+
+		auto structure = OffsetPointer<AccelerationStructureHeader> (dest, structureOffset);
+		WritePackedCopy (structure, source, layout);
+
+		if (pointerCount != 0) {
+			auto pointers = OffsetPointer<D3D12_GPU_VIRTUAL_ADDRESS> (dest, sizeof (SerializedHeader));
+			InstanceRecord* instances = structure->GetInstances ();
+			for (UINT i = 0; i < structure->PrimitiveCount; i++) {
+				pointers[instances[i].InstanceIndex] = instances[i].AccelerationStructure;
+				instances[i].AccelerationStructure = 0;
+			}
+		}
+	}
+
+	void DeserializeAccelerationStructure (void* dest, const void* serialized, const D3D12_GPU_VIRTUAL_ADDRESS* bottomLevel) {
+		ThrowIfFalse (dest && serialized, "CpuRaytracing: deserialization needs a source and a destination.");
+		auto header = static_cast<const SerializedHeader*> (serialized);
+		const AccelerationStructureHeader* source = FindSerializedStructure (serialized, header->SerializedSizeInBytesIncludingHeader);
+		ThrowIfFalse (source != nullptr, "CpuRaytracing: the serialized data is not compatible with this library.");
+
+		CloneAccelerationStructure (dest, source);
+
+		auto structure = static_cast<AccelerationStructureHeader*> (dest);
+		if (structure->Type == D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL) {
+			if (!bottomLevel) {
+				bottomLevel = OffsetPointer<D3D12_GPU_VIRTUAL_ADDRESS> (serialized, sizeof (SerializedHeader));
+			}
+			InstanceRecord* instances = structure->GetInstances ();
+			for (UINT i = 0; i < structure->PrimitiveCount; i++) {
+				ThrowIfFalse (instances[i].InstanceIndex < header->NumBottomLevelAccelerationStructurePointersAfterHeader, "CpuRaytracing: the serialized data is corrupt.");
+				instances[i].AccelerationStructure = bottomLevel[instances[i].InstanceIndex];
+				GetBottomLevelAccelerationStructure (instances[i].AccelerationStructure);
+			}
+		}
+	}
+
+	UINT64 HashBuildInputs (const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs) {
+		InputHasher hasher;
+		hasher.Add (inputs.Type);
+		hasher.Add (inputs.Flags & ~D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PERFORM_UPDATE);
+		hasher.Add (inputs.NumDescs);
+
+		if (inputs.Type == D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL) {
+			for (UINT i = 0; i < inputs.NumDescs; i++) {
+				const D3D12_RAYTRACING_INSTANCE_DESC& instanceDesc = GetInstanceDesc (inputs, i);
+				hasher.Add (instanceDesc.Transform, sizeof (instanceDesc.Transform));
+				hasher.Add (instanceDesc.InstanceID | (UINT64 (instanceDesc.InstanceMask) << 24) | (UINT64 (instanceDesc.Flags) << 32) | (UINT64 (instanceDesc.AccelerationStructure != 0) << 40));
+				hasher.Add (instanceDesc.InstanceContributionToHitGroupIndex);
+
+				// The build reads only the bounds of the bottom-level structure, which a rebuild or refit changes.
+				if (instanceDesc.AccelerationStructure != 0) {
+					const Aabb& bounds = GetBottomLevelAccelerationStructure (instanceDesc.AccelerationStructure)->Bounds;
+					hasher.Add (&bounds, sizeof (bounds));
+				}
+			}
+			return hasher.GetHash ();
+		}
+
+		for (UINT geometryIndex = 0; geometryIndex < inputs.NumDescs; geometryIndex++) {
+			const D3D12_RAYTRACING_GEOMETRY_DESC& geometryDesc = GetGeometryDesc (inputs, geometryIndex);
+			hasher.Add (geometryDesc.Type | (UINT64 (geometryDesc.Flags) << 32));
+
+			// Primitives as the build fetches them, so only what can change the result is hashed.
+			if (geometryDesc.Type == D3D12_RAYTRACING_GEOMETRY_TYPE_PROCEDURAL_PRIMITIVE_AABBS) {
+				ProceduralGeometryReader reader (geometryDesc.AABBs);
+				hasher.Add (reader.GetPrimitiveCount ());
+				for (UINT primitiveIndex = 0; primitiveIndex < reader.GetPrimitiveCount (); primitiveIndex++) {
+					const Aabb bounds = reader.GetBounds (primitiveIndex);
+					hasher.Add (&bounds, sizeof (bounds));
+				}
+				continue;
+			}
+
+			TriangleGeometryReader reader (geometryDesc.Triangles);
+			hasher.Add (reader.GetPrimitiveCount ());
+			for (UINT primitiveIndex = 0; primitiveIndex < reader.GetPrimitiveCount (); primitiveIndex++) {
+				Float3 vertices[3];
+				reader.GetTriangle (primitiveIndex, vertices);
+				hasher.Add (vertices, sizeof (vertices));
+			}
+		}
+		return hasher.GetHash ();
+	}
+
+	bool IsSerializedAccelerationStructureCurrent (const void* serialized, UINT64 sizeInBytes,
+		const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs, UINT64 inputHash) {
+
+		const AccelerationStructureHeader* structure = FindSerializedStructure (serialized, sizeInBytes);
+		if (!structure || GetInfo (static_cast<const SerializedHeader*> (serialized))->InputHash != inputHash) {
+			return false;
+		}
+		const bool topLevel = inputs.Type == D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL;
+		return structure->Type == static_cast<UINT> (inputs.Type) &&
+			structure->BuildFlags == static_cast<UINT> (inputs.Flags & ~D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PERFORM_UPDATE) &&
+			(topLevel || structure->GeometryCount == inputs.NumDescs);
+	}
+
+	D3D12_GPU_VIRTUAL_ADDRESS GetSerializedBottomLevelAccelerationStructure (const void* serialized) {
+		ThrowIfFalse (serialized != nullptr);
+		auto header = static_cast<const SerializedHeader*> (serialized);
+		const AccelerationStructureHeader* structure = FindSerializedStructure (serialized, header->SerializedSizeInBytesIncludingHeader);
+		ThrowIfFalse (structure != nullptr, "CpuRaytracing: the serialized data is not compatible with this library.");
+		ThrowIfFalse (structure->Type == D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL, "CpuRaytracing: serialized top-level structures must be deserialized before use.");
+		ThrowIfFalse (GetCpuVirtualAddress (structure) % D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BYTE_ALIGNMENT == 0, "CpuRaytracing: serialized data must be 256-byte aligned to be traced in place.");
+		return GetCpuVirtualAddress (structure);
+	}
+
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "AccelerationStructure.h"
+
+namespace CpuRaytracing {
+
+	// CopyRaytracingAccelerationStructure () modes that operate on the relocatable layout.
+
+	// Size of the copy CompactAccelerationStructure () writes: the same sections, sized by the node and
+	// primitive counts of the finished build instead of the worst case the build reserved.
+	UINT64 GetCompactedSize (const AccelerationStructureHeader* source);
+
+	// Byte-for-byte copy; the result is as large as the source.
+	void CloneAccelerationStructure (void* dest, const AccelerationStructureHeader* source);
+
+	// Packs the sections of source back-to-back into dest, which must hold GetCompactedSize (source) bytes.
+	void CompactAccelerationStructure (void* dest, const AccelerationStructureHeader* source);
+
+	// Serialized data follows the D3D12 layout: a D3D12_SERIALIZED_RAYTRACING_ACCELERATION_STRUCTURE_HEADER, then
+	// for a top-level structure one bottom-level address per instance desc (zero for inactive instances), then a
+	// SerializedAccelerationStructureInfo and, 256-byte aligned, a compacted copy of the structure. Top-level copies
+	// store no addresses; deserializing takes them from the list after the header, which may be patched to the
+	// bottom-level structures of the new process first.
+	struct SerializedAccelerationStructureInfo {
+		UINT64 InputHash;           // As passed to SerializeAccelerationStructure (), zero if unknown.
+		UINT64 StructureOffset;     // Bytes from the start of the serialized data to the structure.
+	};
+
+	// Identifies the serialized format: this library and c_AccelerationStructureVersion.
+	D3D12_SERIALIZED_DATA_DRIVER_MATCHING_IDENTIFIER GetDriverMatchingIdentifier ();
+	D3D12_DRIVER_MATCHING_IDENTIFIER_STATUS CheckDriverMatchingIdentifier (D3D12_SERIALIZED_DATA_TYPE serializedDataType,
+		const D3D12_SERIALIZED_DATA_DRIVER_MATCHING_IDENTIFIER& identifier);
+
+	UINT64 GetSerializedSize (const AccelerationStructureHeader* source);
+	UINT64 GetSerializedBottomLevelPointerCount (const AccelerationStructureHeader* source);
+
+	// dest must hold GetSerializedSize (source) bytes. inputHash is recorded for IsSerializedAccelerationStructureCurrent ().
+	void SerializeAccelerationStructure (void* dest, const AccelerationStructureHeader* source, UINT64 inputHash = 0);
+
+	// Writes DeserializedSizeInBytes bytes to dest. bottomLevel, if given, replaces the address list after the header.
+	void DeserializeAccelerationStructure (void* dest, const void* serialized, const D3D12_GPU_VIRTUAL_ADDRESS* bottomLevel = nullptr);
+
+	// Hash of everything a build reads: type and flags, geometry descs with the triangles they fetch, or instance
+	// descs with the bounds of their bottom-level structures instead of the addresses, which change from run to run.
+	UINT64 HashBuildInputs (const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs);
+
+	// Warm start: whether sizeInBytes bytes of serialized data hold a structure of this format version, built
+	// from inputs with the same type and flags and recorded with inputHash. Stale or foreign data returns false
+	// and should be rebuilt. Only headers and section offsets are checked, not the trees themselves.
+	bool IsSerializedAccelerationStructureCurrent (const void* serialized, UINT64 sizeInBytes,
+		const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs, UINT64 inputHash);
+
+	// Serialized bottom-level structures reference nothing outside themselves and can be traced where they lie,
+	// e.g. in a mapped file, without deserializing. serialized must be 256-byte aligned.
+	D3D12_GPU_VIRTUAL_ADDRESS GetSerializedBottomLevelAccelerationStructure (const void* serialized);
+
+}
@@ -0,0 +1,508 @@
+#include "stdafx.h"
+#include "AccelerationStructureManager.h"
+#include "BottomLevelBuilder.h"
+#include "GeometryReader.h"
+#include "PrebuildInfo.h"
+#include "QualityReport.h"
+#include "TopLevelBuilder.h"
+
+#include <chrono>
+
+namespace CpuRaytracing {
+
+	namespace {
+
+		typedef std::chrono::steady_clock Clock;
+
+		// A background top-level build reads copies of the bottom-level headers, one per slot.
+		const UINT64 c_HeaderSlotSize = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BYTE_ALIGNMENT;
+		static_assert (sizeof (AccelerationStructureHeader) <= c_HeaderSlotSize, "An acceleration structure header must fit in a slot.");
+
+		double GetMilliseconds (Clock::time_point start) {
+			return std::chrono::duration<double, std::milli> (Clock::now () - start).count ();
+		}
+
+		void Accumulate (AccelerationStructureManager::Counters* total, const AccelerationStructureManager::Counters& frame) {
+			total->Refits += frame.Refits;
+			total->Rebuilds += frame.Rebuilds;
+			total->DeferredRebuilds += frame.DeferredRebuilds;
+			total->QueuedRebuilds += frame.QueuedRebuilds;
+			total->TopLevelRefits += frame.TopLevelRefits;
+			total->TopLevelRebuilds += frame.TopLevelRebuilds;
+			total->RefitMilliseconds += frame.RefitMilliseconds;
+			total->RebuildMilliseconds += frame.RebuildMilliseconds;
+		}
+
+		D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS GetTopLevelInputs (D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS flags,
+			const std::vector<D3D12_RAYTRACING_INSTANCE_DESC>& instanceDescs) {
+
+			D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS inputs = {};
+			inputs.Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL;
+			inputs.Flags = flags;
+			inputs.NumDescs = static_cast<UINT> (instanceDescs.size ());
+			inputs.DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY;
+			inputs.InstanceDescs = GetCpuVirtualAddress (instanceDescs.data ());
+			return inputs;
+		}
+
+		// Whether TopLevelBuilder takes the instance into the tree.
+		bool IsActiveInstance (const D3D12_RAYTRACING_INSTANCE_DESC& instanceDesc) {
+			Matrix3x4 worldToObject;
+			return instanceDesc.AccelerationStructure != 0 && Invert (*reinterpret_cast<const Matrix3x4*> (instanceDesc.Transform), &worldToObject) &&
+				!GetBottomLevelAccelerationStructure (instanceDesc.AccelerationStructure)->Bounds.IsEmpty ();
+		}
+
+	}
+
+	void AccelerationStructureManager::Buffer::Allocate (UINT64 sizeInBytes) {
+		const size_t size = static_cast<size_t> (sizeInBytes + D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BYTE_ALIGNMENT);
+		if (Storage.size () < size) {
+			Storage.assign (size, 0);
+		}
+		Address = Align (GetCpuVirtualAddress (Storage.data ()), D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BYTE_ALIGNMENT);
+	}
+
+	AccelerationStructureManager::AccelerationStructureManager (Device& device, const Settings& settings) :
+		m_Device (device), m_Settings (settings), m_HasInstances (false), m_FrameCounters (), m_TotalCounters (), m_Stopping (false) {
+
+		if (m_Settings.AsynchronousRebuilds) {
+			m_BackgroundPool.reset (new ThreadPool (m_Settings.BackgroundThreadCount));
+			m_BackgroundThread = std::thread (&AccelerationStructureManager::BackgroundMain, this);
+		}
+	}
+
+	AccelerationStructureManager::~AccelerationStructureManager () {
+		if (!m_BackgroundThread.joinable ()) {
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock (m_JobMutex);
+			m_Stopping = true;
+		}
+		m_JobAvailable.notify_one ();
+		m_BackgroundThread.join ();
+	}
+
+	UINT AccelerationStructureManager::AddBottomLevel (const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs) {
+		ThrowIfFalse (inputs.Type == D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL, "CpuRaytracing: the manager keeps bottom-level structures.");
+		ThrowIfFalse (!(inputs.Flags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PERFORM_UPDATE), "CpuRaytracing: AddBottomLevel () builds the structure.");
+
+		m_BottomLevels.emplace_back ();
+		BottomLevel& bottomLevel = m_BottomLevels.back ();
+		for (UINT i = 0; i < inputs.NumDescs; i++) {
+			bottomLevel.GeometryDescs.push_back (GetGeometryDesc (inputs, i));
+		}
+		bottomLevel.Inputs = inputs;
+		bottomLevel.Inputs.Flags |= D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_UPDATE;
+		bottomLevel.Inputs.DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY;
+		bottomLevel.Inputs.pGeometryDescs = bottomLevel.GeometryDescs.data ();
+		bottomLevel.Built = false;
+		bottomLevel.BuildSahCost = 0.0f;
+		bottomLevel.Degradation = 1.0f;
+		bottomLevel.BuildMilliseconds = 0.0;
+
+		if (m_Settings.AsynchronousRebuilds) {
+			QueueRebuild (bottomLevel);
+		} else {
+			D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO info;
+			m_Device.GetRaytracingAccelerationStructurePrebuildInfo (&bottomLevel.Inputs, &info);
+			bottomLevel.Result.Allocate (info.ResultDataMaxSizeInBytes);
+			m_Scratch.Allocate (info.ScratchDataSizeInBytes);
+			Rebuild (bottomLevel);
+		}
+		return static_cast<UINT> (m_BottomLevels.size () - 1);
+	}
+
+	D3D12_GPU_VIRTUAL_ADDRESS AccelerationStructureManager::GetBottomLevelAddress (UINT index) const {
+		ThrowIfFalse (index < m_BottomLevels.size ());
+		return m_BottomLevels[index].Built ? m_BottomLevels[index].Result.Address : 0;
+	}
+
+	float AccelerationStructureManager::GetDegradation (UINT index) const {
+		ThrowIfFalse (index < m_BottomLevels.size ());
+		return m_BottomLevels[index].Degradation;
+	}
+
+	void AccelerationStructureManager::SetInstances (UINT count, const D3D12_RAYTRACING_INSTANCE_DESC* pInstanceDescs, const UINT* pBottomLevelIndices) {
+		ThrowIfFalse (count == 0 || (pInstanceDescs != nullptr && pBottomLevelIndices != nullptr));
+		for (UINT i = 0; i < count; i++) {
+			ThrowIfFalse (pBottomLevelIndices[i] < m_BottomLevels.size (), "CpuRaytracing: an instance references a bottom-level structure the manager does not have.");
+		}
+		m_InstanceDescs.assign (pInstanceDescs, pInstanceDescs + count);
+		m_InstanceBottomLevels.assign (pBottomLevelIndices, pBottomLevelIndices + count);
+		m_HasInstances = true;
+	}
+
+	void AccelerationStructureManager::SetSettings (const Settings& settings) {
+		m_Settings.RebuildThreshold = settings.RebuildThreshold;
+		m_Settings.FrameBuildBudget = settings.FrameBuildBudget;
+		m_Settings.TopLevelFlags = settings.TopLevelFlags;
+	}
+
+	void AccelerationStructureManager::Rebuild (BottomLevel& bottomLevel) {
+		D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC desc = {};
+		desc.DestAccelerationStructureData = bottomLevel.Result.Address;
+		desc.Inputs = bottomLevel.Inputs;
+		desc.ScratchAccelerationStructureData = m_Scratch.Address;
+
+		const Clock::time_point start = Clock::now ();
+		m_Device.BuildRaytracingAccelerationStructure (&desc);
+		bottomLevel.BuildMilliseconds = GetMilliseconds (start);
+		bottomLevel.BuildSahCost = GetSahCost (GetAccelerationStructure (bottomLevel.Result.Address));
+		bottomLevel.Degradation = 1.0f;
+		bottomLevel.Built = true;
+	}
+
+	void AccelerationStructureManager::RebuildTopLevel () {
+		m_TopLevel.InstanceDescs = m_InstanceDescs;
+		m_TopLevel.InstanceBottomLevels = m_InstanceBottomLevels;
+		ResolveInstances (m_TopLevel.InstanceDescs, m_TopLevel.InstanceBottomLevels, &m_TopLevel.ActiveInstances);
+		m_TopLevel.Flags = m_Settings.TopLevelFlags | D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_UPDATE;
+
+		D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC desc = {};
+		desc.Inputs = GetTopLevelInputs (m_TopLevel.Flags, m_TopLevel.InstanceDescs);
+		D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO info;
+		m_Device.GetRaytracingAccelerationStructurePrebuildInfo (&desc.Inputs, &info);
+		m_TopLevel.Result.Allocate (info.ResultDataMaxSizeInBytes);
+		m_Scratch.Allocate (info.ScratchDataSizeInBytes);
+		desc.DestAccelerationStructureData = m_TopLevel.Result.Address;
+		desc.ScratchAccelerationStructureData = m_Scratch.Address;
+
+		const Clock::time_point start = Clock::now ();
+		m_Device.BuildRaytracingAccelerationStructure (&desc);
+		m_FrameCounters.RebuildMilliseconds += GetMilliseconds (start);
+		m_FrameCounters.TopLevelRebuilds++;
+
+		m_TopLevel.BuildSahCost = GetSahCost (GetAccelerationStructure (m_TopLevel.Result.Address));
+		m_TopLevel.Degradation = 1.0f;
+		m_TopLevel.Built = true;
+		// A background build still running started from older instances; its result is dropped with the job.
+		m_TopLevel.Pending.reset ();
+	}
+
+	void AccelerationStructureManager::ResolveInstances (std::vector<D3D12_RAYTRACING_INSTANCE_DESC>& instanceDescs, const std::vector<UINT>& instanceBottomLevels,
+		std::vector<bool>* pActiveInstances) const {
+
+		pActiveInstances->resize (instanceDescs.size ());
+		for (size_t i = 0; i < instanceDescs.size (); i++) {
+			const BottomLevel& bottomLevel = m_BottomLevels[instanceBottomLevels[i]];
+			instanceDescs[i].AccelerationStructure = bottomLevel.Built ? bottomLevel.Result.Address : 0;
+			(*pActiveInstances)[i] = IsActiveInstance (instanceDescs[i]);
+		}
+	}
+
+	void AccelerationStructureManager::Update () {
+		m_FrameCounters = Counters ();
+
+		// Finished background builds take effect first, so that the refits below bring them up to date. A failed
+		// one is only rethrown at the end: the top level still references the versions swapped out here, and
+		// their buffers become the Spare the next rebuild writes to, until UpdateTopLevel () re-points it.
+		std::exception_ptr failure;
+		for (BottomLevel& bottomLevel : m_BottomLevels) {
+			std::shared_ptr<Job> job = TakeFinishedJob (bottomLevel.Pending, failure);
+			if (!job) {
+				continue;
+			}
+			if (bottomLevel.Built) {
+				m_FrameCounters.Rebuilds++;
+				m_FrameCounters.RebuildMilliseconds += job->Milliseconds;
+			}
+			bottomLevel.Spare = std::move (bottomLevel.Result);
+			bottomLevel.Result = std::move (job->Result);
+			bottomLevel.Built = true;
+			bottomLevel.BuildSahCost = job->SahCost;
+			bottomLevel.BuildMilliseconds = job->Milliseconds;
+			bottomLevel.Degradation = 1.0f;
+		}
+
+		UpdateBottomLevels ();
+		UpdateTopLevel (failure);
+
+		Accumulate (&m_TotalCounters, m_FrameCounters);
+		if (failure) {
+			std::rethrow_exception (failure);
+		}
+	}
+
+	void AccelerationStructureManager::UpdateBottomLevels () {
+		std::vector<bool> rebuilt (m_BottomLevels.size (), false);
+		if (m_Settings.AsynchronousRebuilds) {
+			for (BottomLevel& bottomLevel : m_BottomLevels) {
+				if (bottomLevel.Built && !bottomLevel.Pending && bottomLevel.Degradation >= m_Settings.RebuildThreshold) {
+					QueueRebuild (bottomLevel);
+					m_FrameCounters.QueuedRebuilds++;
+				}
+			}
+		} else {
+			std::vector<UINT> due;
+			for (UINT i = 0; i < m_BottomLevels.size (); i++) {
+				if (m_BottomLevels[i].Degradation >= m_Settings.RebuildThreshold) {
+					due.push_back (i);
+				}
+			}
+			std::stable_sort (due.begin (), due.end (), [this] (UINT a, UINT b) {
+				return m_BottomLevels[a].Degradation > m_BottomLevels[b].Degradation;
+			});
+
+			for (UINT i : due) {
+				BottomLevel& bottomLevel = m_BottomLevels[i];
+				const bool first = m_FrameCounters.Rebuilds == 0;
+				if (!first && m_FrameCounters.RebuildMilliseconds + bottomLevel.BuildMilliseconds > m_Settings.FrameBuildBudget) {
+					m_FrameCounters.DeferredRebuilds++;
+					continue;
+				}
+				Rebuild (bottomLevel);
+				rebuilt[i] = true;
+				m_FrameCounters.Rebuilds++;
+				m_FrameCounters.RebuildMilliseconds += bottomLevel.BuildMilliseconds;
+			}
+		}
+
+		// The refits go to the device as one batch, which spreads small structures over the threads.
+		std::vector<D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC> refits;
+		std::vector<UINT> refitIndices;
+		for (UINT i = 0; i < m_BottomLevels.size (); i++) {
+			const BottomLevel& bottomLevel = m_BottomLevels[i];
+			if (rebuilt[i] || !bottomLevel.Built) {
+				continue;
+			}
+			D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC desc = {};
+			desc.DestAccelerationStructureData = bottomLevel.Result.Address;
+			desc.Inputs = bottomLevel.Inputs;
+			desc.Inputs.Flags |= D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PERFORM_UPDATE;
+			desc.SourceAccelerationStructureData = bottomLevel.Result.Address;
+			refits.push_back (desc);
+			refitIndices.push_back (i);
+		}
+
+		const Clock::time_point start = Clock::now ();
+		m_Device.BuildRaytracingAccelerationStructures (static_cast<UINT> (refits.size ()), refits.data ());
+		for (UINT i : refitIndices) {
+			BottomLevel& bottomLevel = m_BottomLevels[i];
+			const float sahCost = GetSahCost (GetAccelerationStructure (bottomLevel.Result.Address));
+			bottomLevel.Degradation = bottomLevel.BuildSahCost > 0.0f ? sahCost / bottomLevel.BuildSahCost : 1.0f;
+		}
+		m_FrameCounters.RefitMilliseconds += GetMilliseconds (start);
+		m_FrameCounters.Refits += refits.size ();
+	}
+
+	void AccelerationStructureManager::UpdateTopLevel (std::exception_ptr& failure) {
+		if (!m_HasInstances) {
+			return;
+		}
+
+		// Held until the refit below has pointed the instances away from the header copies the job built over.
+		std::shared_ptr<Job> job = TakeFinishedJob (m_TopLevel.Pending, failure);
+		if (job) {
+			m_TopLevel.Spare = std::move (m_TopLevel.Result);
+			m_TopLevel.Result = std::move (job->Result);
+			m_TopLevel.InstanceDescs = job->InstanceDescs;
+			m_TopLevel.InstanceBottomLevels = job->InstanceBottomLevels;
+			m_TopLevel.ActiveInstances = job->ActiveInstances;
+			m_TopLevel.Flags = job->Inputs.Flags;
+			m_TopLevel.BuildSahCost = job->SahCost;
+			m_TopLevel.Degradation = 1.0f;
+			m_TopLevel.Built = true;
+			m_FrameCounters.TopLevelRebuilds++;
+			m_FrameCounters.RebuildMilliseconds += job->Milliseconds;
+		}
+
+		// A refit keeps the instance count of the build, so a structure built for another count keeps its own
+		// instances until the rebuild for the new count replaces it.
+		const bool countChanged = m_InstanceDescs.size () != m_TopLevel.InstanceDescs.size ();
+		if (!countChanged) {
+			m_TopLevel.InstanceDescs = m_InstanceDescs;
+			m_TopLevel.InstanceBottomLevels = m_InstanceBottomLevels;
+		}
+		std::vector<bool> activeInstances;
+		ResolveInstances (m_TopLevel.InstanceDescs, m_TopLevel.InstanceBottomLevels, &activeInstances);
+
+		bool activated = false;
+		bool deactivated = false;
+		for (size_t i = 0; i < activeInstances.size () && i < m_TopLevel.ActiveInstances.size (); i++) {
+			activated |= activeInstances[i] && !m_TopLevel.ActiveInstances[i];
+			deactivated |= !activeInstances[i] && m_TopLevel.ActiveInstances[i];
+		}
+
+		// An instance that left the tree cannot be refit away, so that rebuild does not wait in either mode.
+		const bool due = !m_TopLevel.Built || countChanged || activated || m_TopLevel.Degradation >= m_Settings.RebuildThreshold;
+		if (deactivated || (due && !m_Settings.AsynchronousRebuilds)) {
+			RebuildTopLevel ();
+			return;
+		}
+		if (due && !m_TopLevel.Pending) {
+			QueueTopLevelRebuild ();
+			m_FrameCounters.QueuedRebuilds++;
+		}
+		if (!m_TopLevel.Built) {
+			return;
+		}
+
+		D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC desc = {};
+		desc.DestAccelerationStructureData = m_TopLevel.Result.Address;
+		desc.Inputs = GetTopLevelInputs (m_TopLevel.Flags | D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PERFORM_UPDATE, m_TopLevel.InstanceDescs);
+		desc.SourceAccelerationStructureData = m_TopLevel.Result.Address;
+
+		const Clock::time_point start = Clock::now ();
+		m_Device.BuildRaytracingAccelerationStructure (&desc);
+		const float sahCost = GetSahCost (GetAccelerationStructure (m_TopLevel.Result.Address));
+		m_TopLevel.Degradation = m_TopLevel.BuildSahCost > 0.0f ? sahCost / m_TopLevel.BuildSahCost : 1.0f;
+		m_FrameCounters.RefitMilliseconds += GetMilliseconds (start);
+		m_FrameCounters.TopLevelRefits++;
+	}
+
+	void AccelerationStructureManager::QueueRebuild (BottomLevel& bottomLevel) {
+		auto job = std::make_shared<Job> ();
+		job->Inputs = bottomLevel.Inputs;
+		job->GeometryDescs = bottomLevel.GeometryDescs;
+
+		// Triangles are copied as they are traced: transformed, non-indexed R32G32B32_FLOAT. The copies are sized
+		// first, so that the descs can point into them.
+		size_t vertexCount = 0;
+		size_t aabbCount = 0;
+		for (const D3D12_RAYTRACING_GEOMETRY_DESC& geometryDesc : job->GeometryDescs) {
+			if (geometryDesc.Type == D3D12_RAYTRACING_GEOMETRY_TYPE_PROCEDURAL_PRIMITIVE_AABBS) {
+				aabbCount += static_cast<size_t> (geometryDesc.AABBs.AABBCount);
+			} else {
+				vertexCount += 3 * size_t (GetTriangleCount (geometryDesc.Triangles));
+			}
+		}
+		job->Vertices.resize (vertexCount);
+		job->Aabbs.resize (aabbCount);
+
+		Float3* vertices = job->Vertices.data ();
+		D3D12_RAYTRACING_AABB* aabbs = job->Aabbs.data ();
+		for (D3D12_RAYTRACING_GEOMETRY_DESC& geometryDesc : job->GeometryDescs) {
+			if (geometryDesc.Type == D3D12_RAYTRACING_GEOMETRY_TYPE_PROCEDURAL_PRIMITIVE_AABBS) {
+				D3D12_RAYTRACING_GEOMETRY_AABBS_DESC& desc = geometryDesc.AABBs;
+				const UINT8* source = GetCpuPointer<const UINT8> (desc.AABBs.StartAddress);
+				for (UINT64 i = 0; i < desc.AABBCount; i++) {
+					memcpy (&aabbs[i], source + i * desc.AABBs.StrideInBytes, sizeof (D3D12_RAYTRACING_AABB));
+				}
+				desc.AABBs.StartAddress = GetCpuVirtualAddress (aabbs);
+				desc.AABBs.StrideInBytes = sizeof (D3D12_RAYTRACING_AABB);
+				aabbs += desc.AABBCount;
+			} else {
+				D3D12_RAYTRACING_GEOMETRY_TRIANGLES_DESC& desc = geometryDesc.Triangles;
+				const TriangleGeometryReader reader (desc);
+				for (UINT i = 0; i < reader.GetPrimitiveCount (); i++) {
+					reader.GetTriangle (i, vertices + 3 * size_t (i));
+				}
+				desc.Transform3x4 = 0;
+				desc.IndexFormat = DXGI_FORMAT_UNKNOWN;
+				desc.IndexCount = 0;
+				desc.IndexBuffer = 0;
+				desc.VertexFormat = DXGI_FORMAT_R32G32B32_FLOAT;
+				desc.VertexCount = 3 * reader.GetPrimitiveCount ();
+				desc.VertexBuffer.StartAddress = GetCpuVirtualAddress (vertices);
+				desc.VertexBuffer.StrideInBytes = sizeof (Float3);
+				vertices += desc.VertexCount;
+			}
+		}
+		job->Inputs.pGeometryDescs = job->GeometryDescs.data ();
+
+		D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO info;
+		GetRaytracingAccelerationStructurePrebuildInfo (job->Inputs, &info);
+		job->Result = std::move (bottomLevel.Spare);
+		job->Result.Allocate (info.ResultDataMaxSizeInBytes);
+
+		bottomLevel.Pending = job;
+		Enqueue (job);
+	}
+
+	void AccelerationStructureManager::QueueTopLevelRebuild () {
+		auto job = std::make_shared<Job> ();
+		job->InstanceDescs = m_InstanceDescs;
+		job->InstanceBottomLevels = m_InstanceBottomLevels;
+		ResolveInstances (job->InstanceDescs, job->InstanceBottomLevels, &job->ActiveInstances);
+
+		// The build reads the bounds of the bottom-level structures, which refits keep rewriting, so it reads
+		// copies of their headers. The first refit after the swap points the instances back at the live structures.
+		job->BottomLevelHeaders.Allocate (m_BottomLevels.size () * c_HeaderSlotSize);
+		for (size_t i = 0; i < m_BottomLevels.size (); i++) {
+			if (m_BottomLevels[i].Built) {
+				memcpy (GetCpuPointer<AccelerationStructureHeader> (job->BottomLevelHeaders.Address + i * c_HeaderSlotSize),
+					GetAccelerationStructure (m_BottomLevels[i].Result.Address), sizeof (AccelerationStructureHeader));
+			}
+		}
+		for (size_t i = 0; i < job->InstanceDescs.size (); i++) {
+			if (job->InstanceDescs[i].AccelerationStructure != 0) {
+				job->InstanceDescs[i].AccelerationStructure = job->BottomLevelHeaders.Address + job->InstanceBottomLevels[i] * c_HeaderSlotSize;
+			}
+		}
+
+		job->Inputs = GetTopLevelInputs (m_Settings.TopLevelFlags | D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_UPDATE, job->InstanceDescs);
+		D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO info;
+		GetRaytracingAccelerationStructurePrebuildInfo (job->Inputs, &info);
+		job->Result = std::move (m_TopLevel.Spare);
+		job->Result.Allocate (info.ResultDataMaxSizeInBytes);
+
+		m_TopLevel.Pending = job;
+		Enqueue (job);
+	}
+
+	void AccelerationStructureManager::Enqueue (const std::shared_ptr<Job>& job) {
+		{
+			std::lock_guard<std::mutex> lock (m_JobMutex);
+			m_Jobs.push_back (job);
+		}
+		m_JobAvailable.notify_one ();
+	}
+
+	std::shared_ptr<AccelerationStructureManager::Job> AccelerationStructureManager::TakeFinishedJob (std::shared_ptr<Job>& pending, std::exception_ptr& failure) {
+		if (!pending || !pending->Finished.load (std::memory_order_acquire)) {
+			return nullptr;
+		}
+		std::shared_ptr<Job> job = std::move (pending);
+		pending.reset ();
+		if (job->Exception) {
+			if (!failure) {
+				failure = job->Exception;
+			}
+			return nullptr;
+		}
+		return job;
+	}
+
+	void AccelerationStructureManager::RunJob (Job& job) {
+		try {
+			D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO info;
+			GetRaytracingAccelerationStructurePrebuildInfo (job.Inputs, &info);
+			m_BackgroundScratch.Allocate (info.ScratchDataSizeInBytes);
+
+			D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC desc = {};
+			desc.DestAccelerationStructureData = job.Result.Address;
+			desc.Inputs = job.Inputs;
+			desc.ScratchAccelerationStructureData = m_BackgroundScratch.Address;
+
+			const Clock::time_point start = Clock::now ();
+			if (job.Inputs.Type == D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL) {
+				TopLevelBuilder (*m_BackgroundPool).Build (desc);
+			} else {
+				BottomLevelBuilder (*m_BackgroundPool).Build (desc);
+			}
+			job.Milliseconds = GetMilliseconds (start);
+			job.SahCost = GetSahCost (GetAccelerationStructure (job.Result.Address));
+		} catch (...) {
+			job.Exception = std::current_exception ();
+		}
+	}
+
+	void AccelerationStructureManager::BackgroundMain () {
+		for (;;) {
+			std::shared_ptr<Job> job;
+			{
+				std::unique_lock<std::mutex> lock (m_JobMutex);
+				m_JobAvailable.wait (lock, [this] () { return m_Stopping || !m_Jobs.empty (); });
+				if (m_Stopping) {
+					return;
+				}
+				job = std::move (m_Jobs.front ());
+				m_Jobs.pop_front ();
+			}
+			RunJob (*job);
+			job->Finished.store (true, std::memory_order_release);
+		}
+	}
+
+}
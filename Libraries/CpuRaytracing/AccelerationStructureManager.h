@@ -0,0 +1,187 @@
+#pragma once
+
+#include "Device.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace CpuRaytracing {
+
+	// Keeps dynamic bottom-level structures, and a top-level structure over them, current while vertices, AABBs and
+	// instance transforms animate in place. Each frame, Update () refits or rebuilds every structure. A refit is
+	// cheap but keeps the topology of the last build, so the tree degrades as primitives move apart; a rebuild
+	// restores it at a higher cost.
+	//
+	// After every refit the SAH cost of the stored nodes (GetSahCost ()) is measured against the cost right
+	// after the last build. A structure whose ratio has reached RebuildThreshold is due for a rebuild. Due
+	// structures are rebuilt in the next Update (), most degraded first, as long as the rebuild time measured at
+	// their previous build fits in what is left of FrameBuildBudget. The others are refit once more and stay due.
+	// The first due structure is rebuilt even when it alone exceeds the budget, so no structure waits forever.
+	//
+	// With AsynchronousRebuilds, no rebuild runs inside Update (). A due structure is copied (decoded triangles,
+	// AABBs or instance descs) and rebuilt from the copy on a background thread, into a second buffer, while the
+	// current version keeps being refit and traced. The Update () after the build finishes swaps the new version
+	// in and refits it to the current frame, so an edit becomes visible a frame or two late instead of stalling
+	// one. Addresses therefore change across Update () calls; the top-level structure is kept pointing at the
+	// current bottom-level versions.
+	class AccelerationStructureManager {
+	public:
+		struct Settings {
+			float RebuildThreshold = 1.5f;      // SAH cost relative to the last build at which a rebuild is due.
+			double FrameBuildBudget = 2.0;      // Milliseconds of synchronous rebuilds per Update ().
+			D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS TopLevelFlags = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_TRACE;
+
+			// Read by the constructor only.
+			bool AsynchronousRebuilds = false;
+			UINT BackgroundThreadCount = 1;     // Counts the background thread; 0 selects the hardware concurrency.
+		};
+
+		// Decisions and the time spent on them, per Update () and in total. Rebuilds count those that took
+		// effect: asynchronous ones when they are swapped in, with the time they took in the background.
+		struct Counters {
+			UINT64 Refits;
+			UINT64 Rebuilds;
+			UINT64 DeferredRebuilds;            // Refits of structures that were due for a rebuild the budget left out.
+			UINT64 QueuedRebuilds;              // Asynchronous rebuilds handed to the background thread.
+			UINT64 TopLevelRefits;
+			UINT64 TopLevelRebuilds;
+			double RefitMilliseconds;
+			double RebuildMilliseconds;
+		};
+
+		AccelerationStructureManager (Device& device, const Settings& settings);
+		~AccelerationStructureManager ();
+
+		AccelerationStructureManager (const AccelerationStructureManager&) = delete;
+		AccelerationStructureManager& operator= (const AccelerationStructureManager&) = delete;
+
+		// Copies the geometry descs and builds the structure with ALLOW_UPDATE added to inputs.Flags; with
+		// AsynchronousRebuilds, in the background, and the structure has no address until an Update () swaps it in.
+		// The buffers the descs point at must stay valid, and keep their primitive counts, for as long as the
+		// manager does.
+		UINT AddBottomLevel (const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs);
+
+		UINT GetBottomLevelCount () const { return static_cast<UINT> (m_BottomLevels.size ()); }
+
+		// The current version; zero until the first build has been swapped in.
+		D3D12_GPU_VIRTUAL_ADDRESS GetBottomLevelAddress (UINT index) const;
+
+		// SAH cost relative to the last build, as of the last refit; 1 right after a build.
+		float GetDegradation (UINT index) const;
+
+		// The instances of the top-level structure, copied. Instance i references the bottom-level structure
+		// pBottomLevelIndices[i], whatever its AccelerationStructure holds; it stays inactive until that structure
+		// has been built. Changing only transforms and other fields refits the top-level structure; changing the
+		// instance count, or activating an instance, rebuilds it.
+		void SetInstances (UINT count, const D3D12_RAYTRACING_INSTANCE_DESC* pInstanceDescs, const UINT* pBottomLevelIndices);
+
+		// The current version; zero until the first build has been swapped in.
+		D3D12_GPU_VIRTUAL_ADDRESS GetTopLevelAddress () const { return m_TopLevel.Built ? m_TopLevel.Result.Address : 0; }
+
+		// Swaps in finished background builds, then refits or rebuilds every structure from the current contents
+		// of its buffers. Call it between frames, when nothing traces the structures. A structure whose background
+		// build failed keeps its current version; Update () finishes the frame, then rethrows the first failure.
+		void Update ();
+
+		const Settings& GetSettings () const { return m_Settings; }
+		void SetSettings (const Settings& settings);
+
+		const Counters& GetFrameCounters () const { return m_FrameCounters; }
+		const Counters& GetTotalCounters () const { return m_TotalCounters; }
+
+	private:
+		// Over-allocated so that Address is 256-byte aligned. Allocate () reuses the storage when it is large enough.
+		struct Buffer {
+			std::vector<UINT8> Storage;
+			D3D12_GPU_VIRTUAL_ADDRESS Address = 0;
+
+			void Allocate (UINT64 sizeInBytes);
+		};
+
+		// A background build over a copy of its inputs, so the caller keeps writing its buffers meanwhile.
+		struct Job {
+			D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS Inputs;        // Points at the copies below.
+			std::vector<D3D12_RAYTRACING_GEOMETRY_DESC> GeometryDescs;
+			std::vector<Float3> Vertices;
+			std::vector<D3D12_RAYTRACING_AABB> Aabbs;
+			std::vector<D3D12_RAYTRACING_INSTANCE_DESC> InstanceDescs;          // Point at BottomLevelHeaders.
+			std::vector<UINT> InstanceBottomLevels;
+			std::vector<bool> ActiveInstances;
+			Buffer BottomLevelHeaders;
+
+			Buffer Result;
+			float SahCost = 0.0f;
+			double Milliseconds = 0.0;
+			std::exception_ptr Exception;
+			std::atomic<bool> Finished {false};
+		};
+
+		struct BottomLevel {
+			std::vector<D3D12_RAYTRACING_GEOMETRY_DESC> GeometryDescs;
+			D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS Inputs;    // Points at GeometryDescs.
+			Buffer Result;
+			Buffer Spare;                       // The previous version, reused by the next asynchronous rebuild.
+			bool Built;
+			float BuildSahCost;
+			float Degradation;
+			double BuildMilliseconds;
+			std::shared_ptr<Job> Pending;
+		};
+
+		struct TopLevel {
+			std::vector<D3D12_RAYTRACING_INSTANCE_DESC> InstanceDescs;      // Those of Result, resolved every Update ().
+			std::vector<UINT> InstanceBottomLevels;
+			std::vector<bool> ActiveInstances;  // As of the build of Result; only a rebuild changes which are in the tree.
+			D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS Flags = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_NONE;
+			Buffer Result;
+			Buffer Spare;
+			bool Built = false;
+			float BuildSahCost = 0.0f;
+			float Degradation = 1.0f;
+			std::shared_ptr<Job> Pending;
+		};
+
+		void Rebuild (BottomLevel& bottomLevel);
+		void RebuildTopLevel ();
+		void UpdateBottomLevels ();
+		void UpdateTopLevel (std::exception_ptr& failure);
+		void ResolveInstances (std::vector<D3D12_RAYTRACING_INSTANCE_DESC>& instanceDescs, const std::vector<UINT>& instanceBottomLevels,
+			std::vector<bool>* pActiveInstances) const;
+
+		void QueueRebuild (BottomLevel& bottomLevel);
+		void QueueTopLevelRebuild ();
+		void Enqueue (const std::shared_ptr<Job>& job);
+		// Null while pending runs. A failed job is dropped, and its exception kept in failure unless that holds one.
+		std::shared_ptr<Job> TakeFinishedJob (std::shared_ptr<Job>& pending, std::exception_ptr& failure);
+		void RunJob (Job& job);
+		void BackgroundMain ();
+
+		Device& m_Device;
+		Settings m_Settings;
+		std::vector<BottomLevel> m_BottomLevels;
+		TopLevel m_TopLevel;
+		std::vector<D3D12_RAYTRACING_INSTANCE_DESC> m_InstanceDescs;        // As last set.
+		std::vector<UINT> m_InstanceBottomLevels;
+		bool m_HasInstances;
+		Buffer m_Scratch;                       // Shared by the synchronous rebuilds, which run one at a time.
+		Counters m_FrameCounters;
+		Counters m_TotalCounters;
+
+		// Background builds run one at a time on m_BackgroundThread, over a pool of their own, so a frame never
+		// ends up running part of one.
+		std::unique_ptr<ThreadPool> m_BackgroundPool;
+		Buffer m_BackgroundScratch;
+		std::deque<std::shared_ptr<Job>> m_Jobs;
+		std::mutex m_JobMutex;
+		std::condition_variable m_JobAvailable;
+		bool m_Stopping;
+		std::thread m_BackgroundThread;
+	};
+
+}
@@ -0,0 +1,103 @@
+#include "stdafx.h"
+#include "BatchBuilder.h"
+#include "BottomLevelBuilder.h"
+
+namespace CpuRaytracing {
+
+	namespace {
+
+		bool IsUpdate (const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC& desc) {
+			return (desc.Inputs.Flags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PERFORM_UPDATE) != 0;
+		}
+
+		void BuildBottomLevel (ThreadPool& threadPool, const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC& desc) {
+			BottomLevelBuilder builder (threadPool);
+			if (IsUpdate (desc)) {
+				builder.Update (desc);
+			} else {
+				builder.Build (desc);
+			}
+		}
+
+	}
+
+	BatchBuilder::Plan BatchBuilder::GetPlan (UINT threadCount, UINT count, const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC* pDescs) {
+		ThrowIfFalse (count == 0 || pDescs != nullptr);
+
+		Plan plan;
+		plan.ScratchSizes.assign (count, 0);
+		plan.SlotSize = 0;
+		UINT64 largeScratchSize = 0;
+
+		std::vector<UINT> primitiveCounts (count);
+		for (UINT i = 0; i < count; i++) {
+			const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC& desc = pDescs[i];
+			ThrowIfFalse (desc.Inputs.Type == D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL, "CpuRaytracing: batched builds only accept bottom-level structures.");
+
+			primitiveCounts[i] = BottomLevelBuilder::GetMaxPrimitiveCount (desc.Inputs);
+			const bool large = primitiveCounts[i] >= c_SplitPrimitiveCount;
+			(large ? plan.LargeBuilds : plan.SmallBuilds).push_back (i);
+
+			if (desc.ScratchAccelerationStructureData == 0) {
+				D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO info;
+				BottomLevelBuilder::GetPrebuildInfo (desc.Inputs, &info);
+				plan.ScratchSizes[i] = IsUpdate (desc) ? info.UpdateScratchDataSizeInBytes : info.ScratchDataSizeInBytes;
+				if (large) {
+					largeScratchSize = std::max (largeScratchSize, plan.ScratchSizes[i]);
+				} else {
+					plan.SlotSize = std::max (plan.SlotSize, plan.ScratchSizes[i]);
+				}
+			}
+		}
+
+		std::stable_sort (plan.SmallBuilds.begin (), plan.SmallBuilds.end (), [&primitiveCounts] (UINT a, UINT b) {
+			return primitiveCounts[a] > primitiveCounts[b];
+		});
+
+		// Prebuild sizes are multiples of 256 bytes, so slots stay aligned. Large builds run before any small one.
+		plan.SlotCount = std::min (std::max (threadCount, 1u), static_cast<UINT> (plan.SmallBuilds.size ()));
+		plan.PoolSize = std::max (largeScratchSize, plan.SlotSize * plan.SlotCount);
+		return plan;
+	}
+
+	UINT64 BatchBuilder::GetScratchPoolSize (UINT threadCount, UINT count, const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC* pDescs) {
+		return GetPlan (threadCount, count, pDescs).PoolSize;
+	}
+
+	void BatchBuilder::Build (UINT count, const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC* pDescs, D3D12_GPU_VIRTUAL_ADDRESS scratchPool) {
+		const Plan plan = GetPlan (m_ThreadPool.GetThreadCount (), count, pDescs);
+		ThrowIfFalse (plan.PoolSize == 0 || scratchPool != 0, "CpuRaytracing: the batch needs a scratch pool of GetScratchPoolSize () bytes.");
+
+		for (UINT i : plan.LargeBuilds) {
+			D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC desc = pDescs[i];
+			if (plan.ScratchSizes[i] != 0) {
+				desc.ScratchAccelerationStructureData = scratchPool;
+			}
+			BuildBottomLevel (m_ThreadPool, desc);
+		}
+
+		// Tasks take the next build off a shared counter, so a few slow builds do not hold up the rest.
+		std::atomic<UINT> nextBuild (0);
+		auto runTask = [&] (UINT slot) {
+			ThreadPool threadPool (1);
+			for (UINT k = nextBuild++; k < plan.SmallBuilds.size (); k = nextBuild++) {
+				const UINT i = plan.SmallBuilds[k];
+				D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC desc = pDescs[i];
+				if (plan.ScratchSizes[i] != 0) {
+					desc.ScratchAccelerationStructureData = scratchPool + slot * plan.SlotSize;
+				}
+				BuildBottomLevel (threadPool, desc);
+			}
+		};
+
+		ThreadPool::TaskGroup group (m_ThreadPool);
+		for (UINT slot = 1; slot < plan.SlotCount; slot++) {
+			group.Run ([&runTask, slot] () { runTask (slot); });
+		}
+		if (plan.SlotCount > 0) {
+			runTask (0);
+		}
+		group.Wait ();
+	}
+
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "RaytracingCompat.h"
+#include "ThreadPool.h"
+
+#include <vector>
+
+namespace CpuRaytracing {
+
+	// Builds many bottom-level structures in one call, the way a command list runs builds that no barrier
+	// separates. Structures of at least c_SplitPrimitiveCount primitives are built one after another, each
+	// spread over the whole pool by its builder. The smaller ones are built whole, one per task, by as many
+	// tasks as the pool has threads, largest first. Each task builds on a single-threaded pool of its own,
+	// so a task never waits and never picks up another task's build.
+	//
+	// Builds whose desc has no ScratchAccelerationStructureData take scratch from one pool: large builds share
+	// it one at a time, and each small-build task owns one slot of it.
+	class BatchBuilder {
+	public:
+		static const UINT c_SplitPrimitiveCount = 1u << 16;
+
+		explicit BatchBuilder (ThreadPool& threadPool) : m_ThreadPool (threadPool) {}
+
+		// Bytes of scratch pool the batch needs on a pool of threadCount threads; zero if every desc brings its own
+		// scratch.
+		static UINT64 GetScratchPoolSize (UINT threadCount, UINT count, const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC* pDescs);
+
+		// Builds or updates (PERFORM_UPDATE) every desc. Only bottom-level descs are accepted, since a top-level
+		// structure could reference a bottom-level one of the same batch before it is finished. scratchPool must
+		// be 256-byte aligned and hold GetScratchPoolSize () bytes.
+		void Build (UINT count, const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC* pDescs, D3D12_GPU_VIRTUAL_ADDRESS scratchPool);
+
+	private:
+		struct Plan {
+			std::vector<UINT> LargeBuilds;
+			std::vector<UINT> SmallBuilds;      // By decreasing primitive count.
+			std::vector<UINT64> ScratchSizes;   // Per desc; zero where the desc brings its own scratch.
+			UINT64 SlotSize;
+			UINT SlotCount;
+			UINT64 PoolSize;
+		};
+
+		static Plan GetPlan (UINT threadCount, UINT count, const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC* pDescs);
+
+		ThreadPool& m_ThreadPool;
+	};
+
+}
@@ -0,0 +1,220 @@
+#include "stdafx.h"
+#include "BinnedSahBuilder.h"
+#include "AccelerationStructure.h"
+
+#include <mutex>
+
+namespace CpuRaytracing {
+
+	BinnedSahBuilder::BinnedSahBuilder (ThreadPool& threadPool, const Settings& settings) :
+		m_ThreadPool (threadPool),
+		m_Settings (settings),
+		m_References (nullptr),
+		m_Nodes (nullptr),
+		m_NodeCount (0) {
+
+		m_Settings.BinCount = std::min (std::max (m_Settings.BinCount, 2u), c_MaxBinCount);
+		m_Settings.MaxLeafSize = std::max (m_Settings.MaxLeafSize, 1u);
+	}
+
+	UINT BinnedSahBuilder::Build (PrimitiveReference* references, UINT count, BuildNode* nodes) {
+		if (count == 0) {
+			return 0;
+		}
+
+		m_References = references;
+		m_Nodes = nodes;
+		m_NodeCount = 1;
+
+		BuildNodeRecursive (0, 0, count, 1);
+
+		return m_NodeCount.load ();
+	}
+
+	void BinnedSahBuilder::ComputeBounds (UINT begin, UINT end, Aabb* bounds, Aabb* centroidBounds) const {
+		auto Accumulate = [this] (UINT first, UINT last, Aabb* b, Aabb* cb) {
+			for (UINT i = first; i < last; i++) {
+				b->Grow (m_References[i].Bounds);
+				cb->Grow (m_References[i].Bounds.Center ());
+			}
+		};
+
+		*bounds = Aabb::Empty ();
+		*centroidBounds = Aabb::Empty ();
+		if (end - begin < c_ParallelBinningThreshold) {
+			Accumulate (begin, end, bounds, centroidBounds);
+			return;
+		}
+
+		std::mutex mutex;
+		m_ThreadPool.ParallelFor (begin, end, c_ParallelBinningThreshold / 4, [&] (UINT first, UINT last) {
+			Aabb b = Aabb::Empty ();
+			Aabb cb = Aabb::Empty ();
+			Accumulate (first, last, &b, &cb);
+
+			std::lock_guard<std::mutex> lock (mutex);
+			bounds->Grow (b);
+			centroidBounds->Grow (cb);
+		});
+	}
+
+	BinnedSahBuilder::Split BinnedSahBuilder::FindBestSplit (UINT begin, UINT end, const Aabb& centroidBounds) const {
+		const UINT binCount = m_Settings.BinCount;
+		const Float3 extent = centroidBounds.Extent ();
+
+		float scale[3];
+		for (UINT axis = 0; axis < 3; axis++) {
+			scale[axis] = extent[axis] > 0.0f ? binCount / extent[axis] : 0.0f;
+		}
+
+		Bin bins[3][c_MaxBinCount];
+		auto ClearBins = [binCount] (Bin (*b)[c_MaxBinCount]) {
+			for (UINT axis = 0; axis < 3; axis++) {
+				for (UINT i = 0; i < binCount; i++) {
+					b[axis][i] = Bin {Aabb::Empty (), 0};
+				}
+			}
+		};
+		auto FillBins = [&] (UINT first, UINT last, Bin (*b)[c_MaxBinCount]) {
+			for (UINT i = first; i < last; i++) {
+				const Aabb& primBounds = m_References[i].Bounds;
+				Float3 centroid = primBounds.Center ();
+				for (UINT axis = 0; axis < 3; axis++) {
+					Bin& bin = b[axis][GetBinIndex (centroid[axis], centroidBounds.Lower[axis], scale[axis], binCount)];
+					bin.Bounds.Grow (primBounds);
+					bin.Count++;
+				}
+			}
+		};
+
+		ClearBins (bins);
+		if (end - begin < c_ParallelBinningThreshold) {
+			FillBins (begin, end, bins);
+		} else {
+			std::mutex mutex;
+			m_ThreadPool.ParallelFor (begin, end, c_ParallelBinningThreshold / 4, [&] (UINT first, UINT last) {
+				Bin localBins[3][c_MaxBinCount];
+				ClearBins (localBins);
+				FillBins (first, last, localBins);
+
+				std::lock_guard<std::mutex> lock (mutex);
+				for (UINT axis = 0; axis < 3; axis++) {
+					for (UINT i = 0; i < binCount; i++) {
+						bins[axis][i].Bounds.Grow (localBins[axis][i].Bounds);
+						bins[axis][i].Count += localBins[axis][i].Count;
+					}
+				}
+			});
+		}
+
+		Split best = {0, 0, std::numeric_limits<float>::infinity ()};
+		for (UINT axis = 0; axis < 3; axis++) {
+			if (scale[axis] == 0.0f) {
+				continue;
+			}
+
+			// Sweep from the right to get the cost of every right-hand side, then from the left to combine.
+			float rightCost[c_MaxBinCount];
+			Aabb rightBounds = Aabb::Empty ();
+			UINT rightCount = 0;
+			for (UINT i = binCount - 1; i > 0; i--) {
+				rightBounds.Grow (bins[axis][i].Bounds);
+				rightCount += bins[axis][i].Count;
+				rightCost[i] = rightBounds.HalfArea () * rightCount;
+			}
+
+			Aabb leftBounds = Aabb::Empty ();
+			UINT leftCount = 0;
+			for (UINT i = 1; i < binCount; i++) {
+				leftBounds.Grow (bins[axis][i - 1].Bounds);
+				leftCount += bins[axis][i - 1].Count;
+				if (leftCount == 0 || leftCount == end - begin) {
+					continue;
+				}
+
+				float cost = leftBounds.HalfArea () * leftCount + rightCost[i];
+				if (cost < best.Cost) {
+					best = {axis, i, cost};
+				}
+			}
+		}
+
+		return best;
+	}
+
+	void BinnedSahBuilder::MakeLeaf (BuildNode& node, UINT begin, UINT end) const {
+		node.Children[0] = node.Children[1] = 0;
+		node.FirstPrimitive = begin;
+		node.PrimitiveCount = end - begin;
+		node.SplitAxis = 0;
+	}
+
+	void BinnedSahBuilder::BuildNodeRecursive (UINT nodeIndex, UINT begin, UINT end, UINT depth) {
+		BuildNode& node = m_Nodes[nodeIndex];
+		const UINT count = end - begin;
+
+		Aabb centroidBounds;
+		ComputeBounds (begin, end, &node.Bounds, &centroidBounds);
+
+		if (count == 1) {
+			MakeLeaf (node, begin, end);
+			return;
+		}
+
+		UINT middle = begin;
+		UINT axis = centroidBounds.LargestAxis ();
+		bool canSplit = centroidBounds.Extent ()[axis] > 0.0f;
+
+		// Past half the depth budget, fall back to median splits so the tree depth stays bounded.
+		if (canSplit && depth < c_MaxBvhDepth / 2) {
+			Split split = FindBestSplit (begin, end, centroidBounds);
+			const SahCosts& costs = m_Settings.Costs;
+			float leafCost = costs.Intersection * count;
+			float splitCost = costs.Traversal + costs.Intersection * split.Cost / node.Bounds.HalfArea ();
+
+			if (count <= m_Settings.MaxLeafSize && leafCost <= splitCost) {
+				MakeLeaf (node, begin, end);
+				return;
+			}
+
+			axis = split.Axis;
+			const float lower = centroidBounds.Lower[axis];
+			const float scale = m_Settings.BinCount / centroidBounds.Extent ()[axis];
+			const UINT binCount = m_Settings.BinCount;
+			const UINT splitBin = split.BinIndex;
+			PrimitiveReference* mid = std::partition (m_References + begin, m_References + end, [=] (const PrimitiveReference& ref) {
+				return GetBinIndex (ref.Bounds.Center ()[axis], lower, scale, binCount) < splitBin;
+			});
+			middle = static_cast<UINT> (mid - m_References);
+		} else if (count <= m_Settings.MaxLeafSize) {
+			MakeLeaf (node, begin, end);
+			return;
+		}
+
+		if (middle == begin || middle == end) {
+			// Coincident centroids (or the depth fallback): split at the object median along the widest axis.
+			middle = begin + count / 2;
+			std::nth_element (m_References + begin, m_References + middle, m_References + end, [axis] (const PrimitiveReference& a, const PrimitiveReference& b) {
+				return a.Bounds.Center ()[axis] < b.Bounds.Center ()[axis];
+			});
+		}
+
+		UINT firstChild = m_NodeCount.fetch_add (2);
+		node.Children[0] = firstChild;
+		node.Children[1] = firstChild + 1;
+		node.FirstPrimitive = 0;
+		node.PrimitiveCount = 0;
+		node.SplitAxis = axis;
+
+		if (count >= c_ParallelSubtreeThreshold && m_ThreadPool.GetThreadCount () > 1) {
+			ThreadPool::TaskGroup group (m_ThreadPool);
+			group.Run ([=] () { BuildNodeRecursive (firstChild, begin, middle, depth + 1); });
+			BuildNodeRecursive (firstChild + 1, middle, end, depth + 1);
+			group.Wait ();
+		} else {
+			BuildNodeRecursive (firstChild, begin, middle, depth + 1);
+			BuildNodeRecursive (firstChild + 1, middle, end, depth + 1);
+		}
+	}
+
+}
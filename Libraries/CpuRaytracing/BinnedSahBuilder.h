@@ -0,0 +1,54 @@
+#pragma once
+
+#include "BvhBuild.h"
+#include "ThreadPool.h"
+
+namespace CpuRaytracing {
+
+	// Top-down BVH builder that evaluates the surface area heuristic over a fixed number of centroid bins
+	// per axis. Large nodes bin in parallel, and subtrees above c_ParallelSubtreeThreshold primitives are
+	// built as independent tasks, so the top split levels spread across all threads of the pool.
+	class BinnedSahBuilder {
+	public:
+		static constexpr UINT c_MaxBinCount = 32;
+
+		struct Settings {
+			UINT BinCount = c_MaxBinCount;
+			UINT MaxLeafSize = 8;
+			SahCosts Costs;
+		};
+
+		BinnedSahBuilder (ThreadPool& threadPool, const Settings& settings);
+
+		// Builds over references[0, count), reordering them so that each leaf covers a contiguous range.
+		// nodes must have room for GetMaxBinaryNodeCount (count) entries. Returns the node count; node 0 is the root.
+		UINT Build (PrimitiveReference* references, UINT count, BuildNode* nodes);
+
+	private:
+		static constexpr UINT c_ParallelSubtreeThreshold = 4096;
+		static constexpr UINT c_ParallelBinningThreshold = 65536;
+
+		struct Bin {
+			Aabb Bounds;
+			UINT Count;
+		};
+
+		struct Split {
+			UINT Axis;
+			UINT BinIndex;
+			float Cost;
+		};
+
+		void BuildNodeRecursive (UINT nodeIndex, UINT begin, UINT end, UINT depth);
+		void ComputeBounds (UINT begin, UINT end, Aabb* bounds, Aabb* centroidBounds) const;
+		Split FindBestSplit (UINT begin, UINT end, const Aabb& centroidBounds) const;
+		void MakeLeaf (BuildNode& node, UINT begin, UINT end) const;
+
+		ThreadPool& m_ThreadPool;
+		Settings m_Settings;
+		PrimitiveReference* m_References;
+		BuildNode* m_Nodes;
+		std::atomic<UINT> m_NodeCount;
+	};
+
+}
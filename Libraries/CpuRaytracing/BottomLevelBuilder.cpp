@@ -0,0 +1,261 @@
+#include "stdafx.h"
+#include "BottomLevelBuilder.h"
+#include "GeometryReader.h"
+
+#include <optional>
+
+namespace CpuRaytracing {
+
+	namespace {
+
+		UINT GetGeometryType (const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs) {
+			return inputs.NumDescs > 0 ? static_cast<UINT> (GetGeometryDesc (inputs, 0).Type) : static_cast<UINT> (D3D12_RAYTRACING_GEOMETRY_TYPE_TRIANGLES);
+		}
+
+		// Spatial splits clip triangles, so procedural primitives are always built without them.
+		D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS GetHierarchyFlags (const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs) {
+			if (GetGeometryType (inputs) == D3D12_RAYTRACING_GEOMETRY_TYPE_PROCEDURAL_PRIMITIVE_AABBS) {
+				return inputs.Flags & ~c_SpatialSplitBudgetMask;
+			}
+			return inputs.Flags;
+		}
+
+		// Triangles of the geometry descs, for spatial splits.
+		class GeometryTriangleSource : public TriangleSource {
+		public:
+			explicit GeometryTriangleSource (const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs) {
+				for (UINT i = 0; i < inputs.NumDescs; i++) {
+					const D3D12_RAYTRACING_GEOMETRY_DESC& geometryDesc = GetGeometryDesc (inputs, i);
+					m_Readers.emplace_back (geometryDesc.Triangles);
+					m_CanDuplicate.push_back (!(geometryDesc.Flags & D3D12_RAYTRACING_GEOMETRY_FLAG_NO_DUPLICATE_ANYHIT_INVOCATION));
+				}
+			}
+
+			void GetTriangle (UINT geometryIndex, UINT primitiveIndex, Float3 vertices[3]) const override {
+				m_Readers[geometryIndex].GetTriangle (primitiveIndex, vertices);
+			}
+
+			bool CanDuplicate (UINT geometryIndex) const override {
+				return m_CanDuplicate[geometryIndex] != 0;
+			}
+
+		private:
+			std::vector<TriangleGeometryReader> m_Readers;
+			std::vector<UINT8> m_CanDuplicate;
+		};
+
+	}
+
+	UINT BottomLevelBuilder::GetMaxPrimitiveCount (const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs) {
+		const UINT geometryType = GetGeometryType (inputs);
+		ThrowIfFalse (geometryType == D3D12_RAYTRACING_GEOMETRY_TYPE_TRIANGLES || geometryType == D3D12_RAYTRACING_GEOMETRY_TYPE_PROCEDURAL_PRIMITIVE_AABBS,
+			"CpuRaytracing: unknown geometry type.");
+
+		UINT64 primitiveCount = 0;
+		for (UINT i = 0; i < inputs.NumDescs; i++) {
+			const D3D12_RAYTRACING_GEOMETRY_DESC& geometryDesc = GetGeometryDesc (inputs, i);
+			ThrowIfFalse (static_cast<UINT> (geometryDesc.Type) == geometryType, "CpuRaytracing: the geometries of a bottom-level acceleration structure must all be triangles or all procedural primitives.");
+			primitiveCount += GetGeometryPrimitiveCount (geometryDesc);
+		}
+		ThrowIfFalse (primitiveCount < (1u << 31), "CpuRaytracing: too many primitives in one bottom-level acceleration structure.");
+		return static_cast<UINT> (primitiveCount);
+	}
+
+	AccelerationStructureLayout BottomLevelBuilder::GetResultLayout (const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs, UINT maxPrimitiveCount) {
+		const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS flags = GetHierarchyFlags (inputs);
+		const UINT nodeWidth = GetNodeWidth (flags);
+		const UINT maxReferenceCount = GetMaxReferenceCount (flags, maxPrimitiveCount);
+		return GetAccelerationStructureLayout (D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL, GetGeometryType (inputs), inputs.NumDescs,
+			GetNodeSize (nodeWidth, GetNodeFormat (flags)), GetMaxNodeCount (nodeWidth, maxReferenceCount), maxReferenceCount);
+	}
+
+	void BottomLevelBuilder::GetPrebuildInfo (const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs, D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO* pInfo) {
+		UINT maxPrimitiveCount = GetMaxPrimitiveCount (inputs);
+
+		pInfo->ResultDataMaxSizeInBytes = Align (GetResultLayout (inputs, maxPrimitiveCount).SizeInBytes, D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BYTE_ALIGNMENT);
+		pInfo->ScratchDataSizeInBytes = Align (HierarchyBuilder::GetScratchLayout (GetHierarchyFlags (inputs), maxPrimitiveCount).SizeInBytes, D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BYTE_ALIGNMENT);
+		// Updates refit in place and need no scratch memory.
+		pInfo->UpdateScratchDataSizeInBytes = 0;
+	}
+
+	UINT BottomLevelBuilder::GatherPrimitiveReferences (const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs, PrimitiveReference* references) {
+		UINT base = 0;
+		for (UINT geometryIndex = 0; geometryIndex < inputs.NumDescs; geometryIndex++) {
+			const D3D12_RAYTRACING_GEOMETRY_DESC& geometryDesc = GetGeometryDesc (inputs, geometryIndex);
+			if (geometryDesc.Type == D3D12_RAYTRACING_GEOMETRY_TYPE_PROCEDURAL_PRIMITIVE_AABBS) {
+				ProceduralGeometryReader reader (geometryDesc.AABBs);
+				m_ThreadPool.ParallelFor (0, reader.GetPrimitiveCount (), 4096, [&] (UINT begin, UINT end) {
+					for (UINT primitiveIndex = begin; primitiveIndex < end; primitiveIndex++) {
+						references[base + primitiveIndex] = {reader.GetBounds (primitiveIndex), geometryIndex, primitiveIndex};
+					}
+				});
+				base += reader.GetPrimitiveCount ();
+				continue;
+			}
+
+			TriangleGeometryReader reader (geometryDesc.Triangles);
+
+			m_ThreadPool.ParallelFor (0, reader.GetPrimitiveCount (), 4096, [&] (UINT begin, UINT end) {
+				for (UINT primitiveIndex = begin; primitiveIndex < end; primitiveIndex++) {
+					Float3 vertices[3];
+					reader.GetTriangle (primitiveIndex, vertices);
+
+					PrimitiveReference& ref = references[base + primitiveIndex];
+					ref.Bounds = Aabb::Empty ();
+					if (IsActiveTriangle (vertices)) {
+						for (UINT i = 0; i < 3; i++) {
+							ref.Bounds.Grow (vertices[i]);
+						}
+					}
+					ref.GeometryIndex = geometryIndex;
+					ref.PrimitiveIndex = primitiveIndex;
+				}
+			});
+			base += reader.GetPrimitiveCount ();
+		}
+
+		// Drop inactive primitives; they can never be hit and must not contribute to the tree.
+		PrimitiveReference* end = std::remove_if (references, references + base, [] (const PrimitiveReference& ref) {
+			return ref.Bounds.IsEmpty ();
+		});
+		return static_cast<UINT> (end - references);
+	}
+
+	void BottomLevelBuilder::WriteLeaves (AccelerationStructureHeader* header, const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs) {
+		const PrimitiveRecord* primitives = header->GetPrimitives ();
+		if (header->GeometryType == D3D12_RAYTRACING_GEOMETRY_TYPE_PROCEDURAL_PRIMITIVE_AABBS) {
+			Aabb* bounds = header->GetProceduralBounds ();
+			m_ThreadPool.ParallelFor (0, header->PrimitiveCount, 4096, [&] (UINT begin, UINT end) {
+				std::optional<ProceduralGeometryReader> reader;
+				UINT readerGeometryIndex = UINT_MAX;
+				for (UINT i = begin; i < end; i++) {
+					if (primitives[i].GeometryIndex != readerGeometryIndex) {
+						readerGeometryIndex = primitives[i].GeometryIndex;
+						reader.emplace (GetGeometryDesc (inputs, readerGeometryIndex).AABBs);
+					}
+					bounds[i] = reader->GetBounds (primitives[i].PrimitiveIndex);
+				}
+			});
+			return;
+		}
+
+		TriangleBlock* blocks = header->GetTriangleBlocks ();
+		const UINT primitiveCount = header->PrimitiveCount;
+
+		// Copies leaf triangles out of the vertex buffers in leaf order, a block at a time. Leaves rarely mix
+		// geometries, so each chunk keeps the reader of the last one around.
+		const UINT blockCount = (primitiveCount + c_TriangleBlockWidth - 1) / c_TriangleBlockWidth;
+		m_ThreadPool.ParallelFor (0, blockCount, 4096 / c_TriangleBlockWidth, [&] (UINT beginBlock, UINT endBlock) {
+			std::optional<TriangleGeometryReader> reader;
+			UINT readerGeometryIndex = UINT_MAX;
+			for (UINT block = beginBlock; block < endBlock; block++) {
+				for (UINT lane = 0; lane < c_TriangleBlockWidth; lane++) {
+					const UINT i = block * c_TriangleBlockWidth + lane;
+					if (i >= primitiveCount) {
+						blocks[block].SetTriangle (lane, TriangleRecord {});
+						continue;
+					}
+					if (primitives[i].GeometryIndex != readerGeometryIndex) {
+						readerGeometryIndex = primitives[i].GeometryIndex;
+						reader.emplace (GetGeometryDesc (inputs, readerGeometryIndex).Triangles);
+					}
+
+					Float3 vertices[3];
+					reader->GetTriangle (primitives[i].PrimitiveIndex, vertices);
+					blocks[block].SetTriangle (lane, TriangleRecord {vertices[0], vertices[1], vertices[2]});
+				}
+			}
+		});
+	}
+
+	void BottomLevelBuilder::Build (const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC& desc) {
+		const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs = desc.Inputs;
+		ThrowIfFalse (!(inputs.Flags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PERFORM_UPDATE), "CpuRaytracing: updates go through BottomLevelBuilder::Update ().");
+
+		auto header = GetCpuPointer<AccelerationStructureHeader> (desc.DestAccelerationStructureData);
+		void* scratch = GetCpuPointer<void> (desc.ScratchAccelerationStructureData);
+		ThrowIfFalse (header != nullptr, "CpuRaytracing: DestAccelerationStructureData is required.");
+
+		UINT maxPrimitiveCount = GetMaxPrimitiveCount (inputs);
+		const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS hierarchyFlags = GetHierarchyFlags (inputs);
+		HierarchyBuilder::ScratchLayout scratchLayout = HierarchyBuilder::GetScratchLayout (hierarchyFlags, maxPrimitiveCount);
+		ThrowIfFalse (maxPrimitiveCount == 0 || scratch != nullptr, "CpuRaytracing: ScratchAccelerationStructureData is required.");
+
+		InitializeHeader (header, D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL, inputs.Flags, GetGeometryType (inputs), inputs.NumDescs, GetResultLayout (inputs, maxPrimitiveCount));
+
+		GeometryInfo* geometries = header->GetGeometries ();
+		header->GeometryFlags = ~0u;
+		for (UINT i = 0; i < inputs.NumDescs; i++) {
+			const D3D12_RAYTRACING_GEOMETRY_DESC& geometryDesc = GetGeometryDesc (inputs, i);
+			geometries[i] = {static_cast<UINT> (geometryDesc.Type), static_cast<UINT> (geometryDesc.Flags), static_cast<UINT> (GetGeometryPrimitiveCount (geometryDesc)), 0};
+			header->GeometryFlags &= geometries[i].Flags;
+		}
+
+		if (maxPrimitiveCount == 0) {
+			return;
+		}
+
+		UINT primitiveCount = GatherPrimitiveReferences (inputs, OffsetPointer<PrimitiveReference> (scratch, scratchLayout.ReferenceOffset));
+
+		std::optional<GeometryTriangleSource> triangles;
+		if (GetSpatialSplitBudget (hierarchyFlags) != 0) {
+			triangles.emplace (inputs);
+		}
+
+		HierarchyBuilder hierarchyBuilder (m_ThreadPool, HierarchyBuilder::Settings ());
+		hierarchyBuilder.Build (header, hierarchyFlags, scratch, scratchLayout, primitiveCount, triangles ? &*triangles : nullptr);
+
+		WriteLeaves (header, inputs);
+	}
+
+	void BottomLevelBuilder::Update (const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC& desc) {
+		const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs = desc.Inputs;
+		ThrowIfFalse ((inputs.Flags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_UPDATE) != 0, "CpuRaytracing: PERFORM_UPDATE requires ALLOW_UPDATE.");
+
+		const AccelerationStructureHeader* source = GetAccelerationStructure (desc.SourceAccelerationStructureData);
+		auto header = GetCpuPointer<AccelerationStructureHeader> (desc.DestAccelerationStructureData);
+		ThrowIfFalse (header != nullptr, "CpuRaytracing: DestAccelerationStructureData is required.");
+		ThrowIfFalse (source->Type == D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL, "CpuRaytracing: the update source is not a bottom-level acceleration structure.");
+		ThrowIfFalse ((source->BuildFlags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_UPDATE) != 0, "CpuRaytracing: the update source was not built with ALLOW_UPDATE.");
+		ThrowIfFalse (source->GeometryCount == inputs.NumDescs, "CpuRaytracing: an update must use the geometry descs of the original build.");
+
+		const GeometryInfo* geometries = source->GetGeometries ();
+		for (UINT i = 0; i < inputs.NumDescs; i++) {
+			const D3D12_RAYTRACING_GEOMETRY_DESC& geometryDesc = GetGeometryDesc (inputs, i);
+			ThrowIfFalse (geometries[i].Type == static_cast<UINT> (geometryDesc.Type) && geometries[i].PrimitiveCount == GetGeometryPrimitiveCount (geometryDesc),
+				"CpuRaytracing: an update must use the geometry descs of the original build.");
+		}
+
+		if (header != source) {
+			memcpy (header, source, source->SizeInBytes);
+		}
+		header->BuildFlags = inputs.Flags & ~D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PERFORM_UPDATE;
+
+		WriteLeaves (header, inputs);
+
+		HierarchyBuilder hierarchyBuilder (m_ThreadPool, HierarchyBuilder::Settings ());
+		if (header->GeometryType == D3D12_RAYTRACING_GEOMETRY_TYPE_PROCEDURAL_PRIMITIVE_AABBS) {
+			const Aabb* primitiveBounds = header->GetProceduralBounds ();
+			hierarchyBuilder.Refit (header, [primitiveBounds] (UINT firstPrimitive, UINT primitiveCount) {
+				Aabb bounds = Aabb::Empty ();
+				for (UINT i = firstPrimitive; i < firstPrimitive + primitiveCount; i++) {
+					bounds.Grow (primitiveBounds[i]);
+				}
+				return bounds;
+			});
+			return;
+		}
+
+		hierarchyBuilder.Refit (header, [header] (UINT firstPrimitive, UINT primitiveCount) {
+			Aabb bounds = Aabb::Empty ();
+			for (UINT i = firstPrimitive; i < firstPrimitive + primitiveCount; i++) {
+				const TriangleRecord triangle = header->GetTriangle (i);
+				bounds.Grow (triangle.V0);
+				bounds.Grow (triangle.V1);
+				bounds.Grow (triangle.V2);
+			}
+			return bounds;
+		});
+	}
+
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "AccelerationStructure.h"
+#include "HierarchyBuilder.h"
+#include "ThreadPool.h"
+
+namespace CpuRaytracing {
+
+	// Builds bottom-level acceleration structures from D3D12_RAYTRACING_GEOMETRY_DESCs, and updates those
+	// built with ALLOW_UPDATE by refitting node bounds to new vertex positions or AABBs. As in DXR, the
+	// geometries of one structure are either all triangles or all procedural primitives.
+	class BottomLevelBuilder {
+	public:
+		explicit BottomLevelBuilder (ThreadPool& threadPool) : m_ThreadPool (threadPool) {}
+
+		static void GetPrebuildInfo (const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs, D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO* pInfo);
+		static UINT GetMaxPrimitiveCount (const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs);
+
+		void Build (const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC& desc);
+
+		// PERFORM_UPDATE: refits SourceAccelerationStructureData (copied to the destination first unless the
+		// two are the same) in place. The topology is kept, and nothing is allocated.
+		void Update (const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC& desc);
+
+	private:
+		static AccelerationStructureLayout GetResultLayout (const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs, UINT maxPrimitiveCount);
+
+		UINT GatherPrimitiveReferences (const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs, PrimitiveReference* references);
+		void WriteLeaves (AccelerationStructureHeader* header, const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs);
+
+		ThreadPool& m_ThreadPool;
+	};
+
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "RaytracingCompat.h"
+#include "RaytracingMath.h"
+
+namespace CpuRaytracing {
+
+	// Types shared by the BVH builders. Builders work on PrimitiveReferences and emit an explicit-child
+	// BuildNode tree in scratch memory, which is then flattened into the BvhNode layout of the result.
+
+	struct PrimitiveReference {
+		Aabb Bounds;
+		UINT GeometryIndex;
+		UINT PrimitiveIndex;
+	};
+	static_assert (sizeof (PrimitiveReference) == 32, "PrimitiveReference is expected to be half a cache line.");
+
+	struct BuildNode {
+		Aabb Bounds;
+		UINT Children[2];
+		UINT FirstPrimitive;    // Leaf only: first PrimitiveReference covered by the leaf.
+		UINT PrimitiveCount;    // Zero for interior nodes.
+		UINT SplitAxis;
+
+		bool IsLeaf () const { return PrimitiveCount != 0; }
+	};
+
+	// Bin of a coordinate for binCount bins of width 1 / scale starting at lower; clamped to the outer bins.
+	inline UINT GetBinIndex (float coordinate, float lower, float scale, UINT binCount) {
+		int bin = static_cast<int> ((coordinate - lower) * scale);
+		return static_cast<UINT> (std::min (std::max (bin, 0), static_cast<int> (binCount) - 1));
+	}
+
+	// A binary tree over n primitives never has more than 2n - 1 nodes.
+	inline UINT GetMaxBinaryNodeCount (UINT primitiveCount) { return primitiveCount > 0 ? 2 * primitiveCount - 1 : 0; }
+
+	// Triangles behind the references of a bottom-level build, for builders that clip them against split planes.
+	class TriangleSource {
+	public:
+		virtual ~TriangleSource () = default;
+
+		virtual void GetTriangle (UINT geometryIndex, UINT primitiveIndex, Float3 vertices[3]) const = 0;
+
+		// False for geometry whose triangles must stay in a single leaf (NO_DUPLICATE_ANYHIT_INVOCATION).
+		virtual bool CanDuplicate (UINT geometryIndex) const = 0;
+	};
+
+	struct SahCosts {
+		float Traversal = 1.0f;
+		float Intersection = 1.0f;
+	};
+
+}
@@ -0,0 +1,326 @@
+#include "stdafx.h"
+#include "BvhOptimizer.h"
+#include "AccelerationStructure.h"
+
+namespace CpuRaytracing {
+
+	namespace {
+
+		// Axis along which the centers of two child boxes lie furthest apart.
+		UINT GetSeparationAxis (const Aabb& a, const Aabb& b) {
+			const Float3 offset = b.Center () - a.Center ();
+			const float x = std::fabs (offset.x);
+			const float y = std::fabs (offset.y);
+			const float z = std::fabs (offset.z);
+			return x >= y && x >= z ? 0 : (y >= z ? 1 : 2);
+		}
+
+		UINT GetLowestBitIndex (UINT value) {
+			UINT index = 0;
+			while (!(value & 1)) {
+				value >>= 1;
+				index++;
+			}
+			return index;
+		}
+
+		float GetSubtreeSahCost (const BuildNode* nodes, UINT nodeIndex, const SahCosts& costs) {
+			const BuildNode& node = nodes[nodeIndex];
+			if (node.IsLeaf ()) {
+				return costs.Intersection * node.PrimitiveCount * node.Bounds.HalfArea ();
+			}
+			return costs.Traversal * node.Bounds.HalfArea () + GetSubtreeSahCost (nodes, node.Children[0], costs) + GetSubtreeSahCost (nodes, node.Children[1], costs);
+		}
+
+	}
+
+	UINT64 BvhOptimizer::GetScratchSize (UINT nodeCount) {
+		return Align (UINT64 (nodeCount) * sizeof (NodeState), c_SectionAlignment) + Align (UINT64 (nodeCount) * sizeof (Candidate), c_SectionAlignment);
+	}
+
+	float BvhOptimizer::GetSahCost (const BuildNode* nodes, const SahCosts& costs) {
+		const float rootArea = nodes[0].Bounds.HalfArea ();
+		return rootArea > 0.0f ? GetSubtreeSahCost (nodes, 0, costs) / rootArea : 0.0f;
+	}
+
+	BvhOptimizer::BvhOptimizer (ThreadPool& threadPool, const Settings& settings) :
+		m_ThreadPool (threadPool),
+		m_Settings (settings),
+		m_Nodes (nullptr),
+		m_States (nullptr) {
+
+		m_Settings.TreeletLeafCount = std::min (std::max (m_Settings.TreeletLeafCount, 3u), c_MaxTreeletLeafCount);
+	}
+
+	void BvhOptimizer::Optimize (BuildNode* nodes, UINT nodeCount, void* scratch) {
+		// A root over two leaves has only one topology.
+		if (nodeCount <= 3) {
+			return;
+		}
+
+		m_Nodes = nodes;
+		m_States = static_cast<NodeState*> (scratch);
+		auto candidates = OffsetPointer<Candidate> (scratch, Align (UINT64 (nodeCount) * sizeof (NodeState), c_SectionAlignment));
+
+		InitializeSubtree (0, UINT_MAX, 1);
+		for (UINT pass = 0; pass < m_Settings.TreeletPassCount; pass++) {
+			RestructureSubtree (0, 1);
+		}
+
+		std::vector<SearchEntry> heap;
+		for (UINT pass = 0; pass < m_Settings.ReinsertionPassCount; pass++) {
+			// Rank interior nodes by area times how much larger they are than their smallest and their average child.
+			UINT candidateCount = 0;
+			for (UINT i = 1; i < nodeCount; i++) {
+				const BuildNode& node = nodes[i];
+				if (node.IsLeaf () || m_States[i].Parent == 0) {
+					continue;
+				}
+
+				const float area = node.Bounds.HalfArea ();
+				const float leftArea = nodes[node.Children[0]].Bounds.HalfArea ();
+				const float rightArea = nodes[node.Children[1]].Bounds.HalfArea ();
+				const float minArea = std::max (std::min (leftArea, rightArea), area * 1.0e-6f);
+				const float meanArea = std::max (0.5f * (leftArea + rightArea), area * 1.0e-6f);
+				candidates[candidateCount++] = {minArea > 0.0f ? area * (area / minArea) * (area / meanArea) : 0.0f, i};
+			}
+			if (candidateCount == 0) {
+				break;
+			}
+
+			const UINT reinsertCount = std::max (static_cast<UINT> (candidateCount * m_Settings.ReinsertionFraction), 1u);
+			auto byPriority = [] (const Candidate& a, const Candidate& b) { return a.Priority > b.Priority; };
+			std::nth_element (candidates, candidates + reinsertCount - 1, candidates + candidateCount, byPriority);
+			std::sort (candidates, candidates + reinsertCount, byPriority);
+			for (UINT i = 0; i < reinsertCount; i++) {
+				Reinsert (candidates[i].NodeIndex, heap);
+			}
+		}
+	}
+
+	void BvhOptimizer::InitializeSubtree (UINT nodeIndex, UINT parent, UINT depth) {
+		NodeState& state = m_States[nodeIndex];
+		const BuildNode& node = m_Nodes[nodeIndex];
+		state.Parent = parent;
+		if (node.IsLeaf ()) {
+			state.Height = 1;
+			state.Cost = m_Settings.Costs.Intersection * node.PrimitiveCount * node.Bounds.HalfArea ();
+			return;
+		}
+
+		const UINT left = node.Children[0];
+		const UINT right = node.Children[1];
+		if (depth < c_ParallelDepth && m_ThreadPool.GetThreadCount () > 1) {
+			ThreadPool::TaskGroup group (m_ThreadPool);
+			group.Run ([=] () { InitializeSubtree (left, nodeIndex, depth + 1); });
+			InitializeSubtree (right, nodeIndex, depth + 1);
+			group.Wait ();
+		} else {
+			InitializeSubtree (left, nodeIndex, depth + 1);
+			InitializeSubtree (right, nodeIndex, depth + 1);
+		}
+		UpdateNode (nodeIndex);
+	}
+
+	// Bottom-up, so every treelet is formed over subtrees that were already restructured. A treelet only
+	// rearranges nodes of its own subtree, so the two children of a node can be processed concurrently.
+	void BvhOptimizer::RestructureSubtree (UINT nodeIndex, UINT depth) {
+		const BuildNode& node = m_Nodes[nodeIndex];
+		if (node.IsLeaf ()) {
+			return;
+		}
+
+		const UINT left = node.Children[0];
+		const UINT right = node.Children[1];
+		if (depth < c_ParallelDepth && m_ThreadPool.GetThreadCount () > 1) {
+			ThreadPool::TaskGroup group (m_ThreadPool);
+			group.Run ([=] () { RestructureSubtree (left, depth + 1); });
+			RestructureSubtree (right, depth + 1);
+			group.Wait ();
+		} else {
+			RestructureSubtree (left, depth + 1);
+			RestructureSubtree (right, depth + 1);
+		}
+		RestructureTreelet (nodeIndex, depth);
+	}
+
+	void BvhOptimizer::RestructureTreelet (UINT nodeIndex, UINT depth) {
+		// Grow the treelet by expanding its largest interior leaf, as CollapseNode does for wide nodes.
+		UINT leaves[c_MaxTreeletLeafCount];
+		UINT internals[c_MaxTreeletLeafCount - 1];
+		UINT leafCount = 2;
+		UINT internalCount = 1;
+		leaves[0] = m_Nodes[nodeIndex].Children[0];
+		leaves[1] = m_Nodes[nodeIndex].Children[1];
+		internals[0] = nodeIndex;
+		while (leafCount < m_Settings.TreeletLeafCount) {
+			UINT expand = UINT_MAX;
+			float largestArea = -1.0f;
+			for (UINT i = 0; i < leafCount; i++) {
+				const BuildNode& leaf = m_Nodes[leaves[i]];
+				if (!leaf.IsLeaf () && leaf.Bounds.HalfArea () > largestArea) {
+					expand = i;
+					largestArea = leaf.Bounds.HalfArea ();
+				}
+			}
+			if (expand == UINT_MAX) {
+				break;
+			}
+
+			const BuildNode& expanded = m_Nodes[leaves[expand]];
+			internals[internalCount++] = leaves[expand];
+			leaves[expand] = expanded.Children[0];
+			leaves[leafCount++] = expanded.Children[1];
+		}
+		if (leafCount < 3) {
+			return;
+		}
+
+		// Optimal cost of every subset of the treelet leaves, smallest subsets first. Each split is enumerated
+		// once, as the partitions that keep the lowest leaf of the subset on the left.
+		const UINT fullSet = (1u << leafCount) - 1;
+		Aabb bounds[1u << c_MaxTreeletLeafCount];
+		float costs[1u << c_MaxTreeletLeafCount];
+		UINT heights[1u << c_MaxTreeletLeafCount];
+		UINT8 partitions[1u << c_MaxTreeletLeafCount];
+		for (UINT subset = 1; subset <= fullSet; subset++) {
+			const UINT lowest = subset & (0u - subset);
+			if (subset == lowest) {
+				const UINT leaf = leaves[GetLowestBitIndex (subset)];
+				bounds[subset] = m_Nodes[leaf].Bounds;
+				costs[subset] = m_States[leaf].Cost;
+				heights[subset] = m_States[leaf].Height;
+				continue;
+			}
+
+			float bestCost = std::numeric_limits<float>::infinity ();
+			UINT bestPartition = lowest;
+			for (UINT partition = (subset - 1) & subset; partition != 0; partition = (partition - 1) & subset) {
+				if (partition & lowest) {
+					const float cost = costs[partition] + costs[subset ^ partition];
+					if (cost < bestCost) {
+						bestCost = cost;
+						bestPartition = partition;
+					}
+				}
+			}
+
+			bounds[subset] = Union (bounds[lowest], bounds[subset ^ lowest]);
+			costs[subset] = m_Settings.Costs.Traversal * bounds[subset].HalfArea () + bestCost;
+			heights[subset] = 1 + std::max (heights[bestPartition], heights[subset ^ bestPartition]);
+			partitions[subset] = static_cast<UINT8> (bestPartition);
+		}
+
+		const NodeState& state = m_States[nodeIndex];
+		if (!(costs[fullSet] < state.Cost * (1.0f - 1.0e-6f)) || depth + heights[fullSet] - 1 > c_MaxBvhDepth) {
+			return;
+		}
+
+		UINT emittedCount = 0;
+		EmitTreelet (fullSet, leaves, internals, &emittedCount, partitions, state.Parent);
+	}
+
+	// Rebuilds the treelet subset from its optimal partitions, reusing the treelet's interior nodes. The root
+	// comes first, so it keeps its index.
+	UINT BvhOptimizer::EmitTreelet (UINT subset, const UINT* leaves, const UINT* internals, UINT* internalCount, const UINT8* partitions, UINT parent) {
+		if ((subset & (subset - 1)) == 0) {
+			const UINT leaf = leaves[GetLowestBitIndex (subset)];
+			m_States[leaf].Parent = parent;
+			return leaf;
+		}
+
+		const UINT nodeIndex = internals[(*internalCount)++];
+		const UINT partition = partitions[subset];
+		BuildNode& node = m_Nodes[nodeIndex];
+		node.Children[0] = EmitTreelet (partition, leaves, internals, internalCount, partitions, nodeIndex);
+		node.Children[1] = EmitTreelet (subset ^ partition, leaves, internals, internalCount, partitions, nodeIndex);
+		node.SplitAxis = GetSeparationAxis (m_Nodes[node.Children[0]].Bounds, m_Nodes[node.Children[1]].Bounds);
+		m_States[nodeIndex].Parent = parent;
+		UpdateNode (nodeIndex);
+		return nodeIndex;
+	}
+
+	// Detaches the node together with its parent, then searches the tree best-first for the node whose
+	// replacement by a new parent over it and the detached node adds the least interior area. Growing the
+	// ancestors of a candidate only adds area, so the search stops once that alone exceeds the best cost. The
+	// old position is among the candidates, so a reinsertion never increases the SAH cost.
+	void BvhOptimizer::Reinsert (UINT nodeIndex, std::vector<SearchEntry>& heap) {
+		const UINT parent = m_States[nodeIndex].Parent;
+		if (parent == 0 || parent == UINT_MAX) {
+			return;
+		}
+
+		const UINT grandparent = m_States[parent].Parent;
+		const BuildNode& parentNode = m_Nodes[parent];
+		const UINT sibling = parentNode.Children[0] == nodeIndex ? parentNode.Children[1] : parentNode.Children[0];
+		ReplaceChild (grandparent, parent, sibling);
+		UpdateAncestors (grandparent);
+
+		const Aabb bounds = m_Nodes[nodeIndex].Bounds;
+		const float area = bounds.HalfArea ();
+		const UINT height = m_States[nodeIndex].Height;
+		auto byCost = [] (const SearchEntry& a, const SearchEntry& b) { return a.InducedCost > b.InducedCost; };
+
+		UINT target = sibling;
+		float targetCost = std::numeric_limits<float>::infinity ();
+		heap.clear ();
+		heap.push_back ({0.0f, 0, 1});
+		while (!heap.empty ()) {
+			std::pop_heap (heap.begin (), heap.end (), byCost);
+			const SearchEntry entry = heap.back ();
+			heap.pop_back ();
+			if (entry.InducedCost + area >= targetCost) {
+				break;
+			}
+
+			// The new parent takes this node's depth, with both subtrees below it.
+			const BuildNode& node = m_Nodes[entry.NodeIndex];
+			const float cost = entry.InducedCost + Union (node.Bounds, bounds).HalfArea ();
+			if (entry.NodeIndex != 0 && cost < targetCost && entry.Depth + std::max (m_States[entry.NodeIndex].Height, height) <= c_MaxBvhDepth) {
+				target = entry.NodeIndex;
+				targetCost = cost;
+			}
+
+			const float inducedCost = cost - node.Bounds.HalfArea ();
+			if (!node.IsLeaf () && inducedCost + area < targetCost) {
+				heap.push_back ({inducedCost, node.Children[0], entry.Depth + 1});
+				std::push_heap (heap.begin (), heap.end (), byCost);
+				heap.push_back ({inducedCost, node.Children[1], entry.Depth + 1});
+				std::push_heap (heap.begin (), heap.end (), byCost);
+			}
+		}
+
+		ReplaceChild (m_States[target].Parent, target, parent);
+		BuildNode& newParent = m_Nodes[parent];
+		newParent.Children[0] = target;
+		newParent.Children[1] = nodeIndex;
+		newParent.SplitAxis = GetSeparationAxis (m_Nodes[target].Bounds, bounds);
+		m_States[target].Parent = parent;
+		m_States[nodeIndex].Parent = parent;
+		UpdateAncestors (parent);
+	}
+
+	void BvhOptimizer::UpdateNode (UINT nodeIndex) {
+		BuildNode& node = m_Nodes[nodeIndex];
+		const NodeState& left = m_States[node.Children[0]];
+		const NodeState& right = m_States[node.Children[1]];
+		node.Bounds = Union (m_Nodes[node.Children[0]].Bounds, m_Nodes[node.Children[1]].Bounds);
+
+		NodeState& state = m_States[nodeIndex];
+		state.Height = 1 + std::max (left.Height, right.Height);
+		state.Cost = m_Settings.Costs.Traversal * node.Bounds.HalfArea () + left.Cost + right.Cost;
+	}
+
+	void BvhOptimizer::UpdateAncestors (UINT nodeIndex) {
+		for (UINT i = nodeIndex; i != UINT_MAX; i = m_States[i].Parent) {
+			UpdateNode (i);
+		}
+	}
+
+	void BvhOptimizer::ReplaceChild (UINT parent, UINT child, UINT replacement) {
+		BuildNode& node = m_Nodes[parent];
+		node.Children[node.Children[0] == child ? 0 : 1] = replacement;
+		m_States[replacement].Parent = parent;
+	}
+
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "BvhBuild.h"
+#include "ThreadPool.h"
+
+namespace CpuRaytracing {
+
+	// Post-build optimization of a BuildNode tree for static geometry. Treelet restructuring (Karras and Aila
+	// 2013) replaces the topology below every interior node by the SAH-optimal binary tree over its largest
+	// descendants, bottom-up, with disjoint subtrees processed as independent tasks. Reinsertion (Bittner et al.
+	// 2013) then detaches the interior nodes that are largest relative to their children and inserts each one
+	// where it adds the least surface area. Leaves and the reference order are left untouched, so the result
+	// flattens like any other build.
+	class BvhOptimizer {
+	public:
+		static constexpr UINT c_MaxTreeletLeafCount = 7;
+
+		struct Settings {
+			UINT TreeletLeafCount = c_MaxTreeletLeafCount;
+			UINT TreeletPassCount = 3;
+			UINT ReinsertionPassCount = 3;
+			float ReinsertionFraction = 0.02f;  // Share of the interior nodes reinserted per pass.
+			SahCosts Costs;
+		};
+
+		static UINT64 GetScratchSize (UINT nodeCount);
+
+		// SAH cost of the tree rooted at nodes[0], relative to the surface area of the root.
+		static float GetSahCost (const BuildNode* nodes, const SahCosts& costs);
+
+		BvhOptimizer (ThreadPool& threadPool, const Settings& settings);
+
+		// Optimizes the nodeCount nodes of the tree rooted at nodes[0] in place. Node 0 stays the root and no
+		// path grows beyond c_MaxBvhDepth nodes. scratch must hold GetScratchSize (nodeCount) bytes.
+		void Optimize (BuildNode* nodes, UINT nodeCount, void* scratch);
+
+	private:
+		// Treelet tasks are forked down to this depth.
+		static constexpr UINT c_ParallelDepth = 6;
+
+		struct NodeState {
+			UINT Parent;    // UINT_MAX for the root.
+			UINT Height;    // Nodes on the longest path down to a leaf, this one included.
+			float Cost;     // Unnormalized SAH cost of the subtree.
+		};
+
+		struct Candidate {
+			float Priority;
+			UINT NodeIndex;
+		};
+
+		// Insertion position in the branch-and-bound search, keyed by the area its ancestors would grow by.
+		struct SearchEntry {
+			float InducedCost;
+			UINT NodeIndex;
+			UINT Depth;
+		};
+
+		void InitializeSubtree (UINT nodeIndex, UINT parent, UINT depth);
+		void RestructureSubtree (UINT nodeIndex, UINT depth);
+		void RestructureTreelet (UINT nodeIndex, UINT depth);
+		UINT EmitTreelet (UINT subset, const UINT* leaves, const UINT* internals, UINT* internalCount, const UINT8* partitions, UINT parent);
+		void Reinsert (UINT nodeIndex, std::vector<SearchEntry>& heap);
+		void UpdateNode (UINT nodeIndex);
+		void UpdateAncestors (UINT nodeIndex);
+		void ReplaceChild (UINT parent, UINT child, UINT replacement);
+
+		ThreadPool& m_ThreadPool;
+		Settings m_Settings;
+		BuildNode* m_Nodes;
+		NodeState* m_States;
+	};
+
+}
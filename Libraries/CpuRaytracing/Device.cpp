@@ -0,0 +1,145 @@
+#include "stdafx.h"
+#include "Device.h"
+#include "AccelerationStructureCopy.h"
+#include "BatchBuilder.h"
+#include "BottomLevelBuilder.h"
+#include "PrebuildInfo.h"
+#include "TopLevelBuilder.h"
+
+namespace CpuRaytracing {
+
+	namespace {
+
+		// Sections are aligned to c_SectionAlignment relative to the structure, so they are only cache-line
+		// aligned in memory if the structure itself is.
+		void CheckAlignment (D3D12_GPU_VIRTUAL_ADDRESS address, const char* message) {
+			ThrowIfFalse (address % D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BYTE_ALIGNMENT == 0, message);
+		}
+
+	}
+
+	Device::Device (UINT threadCount) :
+		m_ThreadPool (threadCount) {
+	}
+
+	void Device::GetRaytracingAccelerationStructurePrebuildInfo (const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS* pDesc,
+		D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO* pInfo) const {
+
+		ThrowIfFalse (pDesc != nullptr);
+		CpuRaytracing::GetRaytracingAccelerationStructurePrebuildInfo (*pDesc, pInfo);
+	}
+
+	void Device::BuildRaytracingAccelerationStructure (const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC* pDesc,
+		UINT numPostbuildInfoDescs, const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_DESC* pPostbuildInfoDescs) {
+
+		ThrowIfFalse (pDesc != nullptr);
+		CheckAlignment (pDesc->DestAccelerationStructureData, "CpuRaytracing: DestAccelerationStructureData must be 256-byte aligned.");
+		CheckAlignment (pDesc->SourceAccelerationStructureData, "CpuRaytracing: SourceAccelerationStructureData must be 256-byte aligned.");
+		CheckAlignment (pDesc->ScratchAccelerationStructureData, "CpuRaytracing: ScratchAccelerationStructureData must be 256-byte aligned.");
+
+		const bool update = (pDesc->Inputs.Flags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PERFORM_UPDATE) != 0;
+		if (pDesc->Inputs.Type == D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL) {
+			TopLevelBuilder builder (m_ThreadPool);
+			if (update) {
+				builder.Update (*pDesc);
+			} else {
+				builder.Build (*pDesc);
+			}
+		} else {
+			BottomLevelBuilder builder (m_ThreadPool);
+			if (update) {
+				builder.Update (*pDesc);
+			} else {
+				builder.Build (*pDesc);
+			}
+		}
+
+		ThrowIfFalse (numPostbuildInfoDescs == 0 || pPostbuildInfoDescs != nullptr);
+		for (UINT i = 0; i < numPostbuildInfoDescs; i++) {
+			EmitRaytracingAccelerationStructurePostbuildInfo (&pPostbuildInfoDescs[i], 1, &pDesc->DestAccelerationStructureData);
+		}
+	}
+
+	UINT64 Device::GetBatchScratchPoolSize (UINT numDescs, const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC* pDescs) const {
+		return BatchBuilder::GetScratchPoolSize (m_ThreadPool.GetThreadCount (), numDescs, pDescs);
+	}
+
+	void Device::BuildRaytracingAccelerationStructures (UINT numDescs, const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC* pDescs,
+		D3D12_GPU_VIRTUAL_ADDRESS scratchPool) {
+
+		ThrowIfFalse (numDescs == 0 || pDescs != nullptr);
+		CheckAlignment (scratchPool, "CpuRaytracing: the scratch pool must be 256-byte aligned.");
+		for (UINT i = 0; i < numDescs; i++) {
+			CheckAlignment (pDescs[i].DestAccelerationStructureData, "CpuRaytracing: DestAccelerationStructureData must be 256-byte aligned.");
+			CheckAlignment (pDescs[i].SourceAccelerationStructureData, "CpuRaytracing: SourceAccelerationStructureData must be 256-byte aligned.");
+			CheckAlignment (pDescs[i].ScratchAccelerationStructureData, "CpuRaytracing: ScratchAccelerationStructureData must be 256-byte aligned.");
+		}
+
+		BatchBuilder builder (m_ThreadPool);
+		builder.Build (numDescs, pDescs, scratchPool);
+	}
+
+	void Device::EmitRaytracingAccelerationStructurePostbuildInfo (const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_DESC* pDesc,
+		UINT numSourceAccelerationStructures, const D3D12_GPU_VIRTUAL_ADDRESS* pSourceAccelerationStructureData) const {
+
+		ThrowIfFalse (pDesc && pSourceAccelerationStructureData);
+		ThrowIfFalse (pDesc->DestBuffer % D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_DESC_BYTE_ALIGNMENT == 0, "CpuRaytracing: postbuild info DestBuffer is misaligned.");
+
+		for (UINT i = 0; i < numSourceAccelerationStructures; i++) {
+			const AccelerationStructureHeader* source = GetAccelerationStructure (pSourceAccelerationStructureData[i]);
+
+			switch (pDesc->InfoType) {
+			case D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_COMPACTED_SIZE:
+				ThrowIfFalse ((source->BuildFlags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_COMPACTION) != 0,
+					"CpuRaytracing: COMPACTED_SIZE requires a structure built with ALLOW_COMPACTION.");
+				GetCpuPointer<D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_COMPACTED_SIZE_DESC> (pDesc->DestBuffer)[i].CompactedSizeInBytes = GetCompactedSize (source);
+				break;
+			case D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_SERIALIZATION: {
+				auto& info = GetCpuPointer<D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_SERIALIZATION_DESC> (pDesc->DestBuffer)[i];
+				info.SerializedSizeInBytes = GetSerializedSize (source);
+				info.NumBottomLevelAccelerationStructurePointers = GetSerializedBottomLevelPointerCount (source);
+				break;
+			}
+			case D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_CURRENT_SIZE:
+				GetCpuPointer<D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_CURRENT_SIZE_DESC> (pDesc->DestBuffer)[i].CurrentSizeInBytes = source->SizeInBytes;
+				break;
+			default:
+				ThrowIfFalse (false, "CpuRaytracing: unsupported postbuild info type.");
+			}
+		}
+	}
+
+	void Device::CopyRaytracingAccelerationStructure (D3D12_GPU_VIRTUAL_ADDRESS destAccelerationStructureData,
+		D3D12_GPU_VIRTUAL_ADDRESS sourceAccelerationStructureData, D3D12_RAYTRACING_ACCELERATION_STRUCTURE_COPY_MODE mode) {
+
+		CheckAlignment (destAccelerationStructureData, "CpuRaytracing: DestAccelerationStructureData must be 256-byte aligned.");
+		void* dest = GetCpuPointer<void> (destAccelerationStructureData);
+		if (mode == D3D12_RAYTRACING_ACCELERATION_STRUCTURE_COPY_MODE_DESERIALIZE) {
+			DeserializeAccelerationStructure (dest, GetCpuPointer<const void> (sourceAccelerationStructureData));
+			return;
+		}
+
+		const AccelerationStructureHeader* source = GetAccelerationStructure (sourceAccelerationStructureData);
+		switch (mode) {
+		case D3D12_RAYTRACING_ACCELERATION_STRUCTURE_COPY_MODE_CLONE:
+			CloneAccelerationStructure (dest, source);
+			break;
+		case D3D12_RAYTRACING_ACCELERATION_STRUCTURE_COPY_MODE_COMPACT:
+			CompactAccelerationStructure (dest, source);
+			break;
+		case D3D12_RAYTRACING_ACCELERATION_STRUCTURE_COPY_MODE_SERIALIZE:
+			SerializeAccelerationStructure (dest, source);
+			break;
+		default:
+			ThrowIfFalse (false, "CpuRaytracing: unsupported copy mode.");
+		}
+	}
+
+	D3D12_DRIVER_MATCHING_IDENTIFIER_STATUS Device::CheckDriverMatchingIdentifier (D3D12_SERIALIZED_DATA_TYPE serializedDataType,
+		const D3D12_SERIALIZED_DATA_DRIVER_MATCHING_IDENTIFIER* pIdentifierToCheck) const {
+
+		ThrowIfFalse (pIdentifierToCheck != nullptr);
+		return CpuRaytracing::CheckDriverMatchingIdentifier (serializedDataType, *pIdentifierToCheck);
+	}
+
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "RaytracingCompat.h"
+#include "ThreadPool.h"
+
+namespace CpuRaytracing {
+
+	// CPU counterpart of the ID3D12Device5 / ID3D12GraphicsCommandList4 raytracing entry points used by
+	// BuildAccelerationStructures(). Builds execute synchronously on the calling thread and the device's
+	// thread pool; all D3D12_GPU_VIRTUAL_ADDRESS fields are CPU addresses.
+	class Device {
+	public:
+		// threadCount counts the calling thread; 0 selects the hardware concurrency.
+		explicit Device (UINT threadCount = 0);
+
+		void GetRaytracingAccelerationStructurePrebuildInfo (const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS* pDesc,
+			D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO* pInfo) const;
+
+		// Postbuild info descs are emitted for the destination once the build has finished.
+		void BuildRaytracingAccelerationStructure (const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC* pDesc,
+			UINT numPostbuildInfoDescs = 0, const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_DESC* pPostbuildInfoDescs = nullptr);
+
+		// Builds or updates numDescs bottom-level structures at once (see BatchBuilder): small ones concurrently, one
+		// per thread, large ones one after another on all threads. Descs whose ScratchAccelerationStructureData is
+		// zero take scratch from scratchPool, which must hold GetBatchScratchPoolSize () bytes.
+		UINT64 GetBatchScratchPoolSize (UINT numDescs, const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC* pDescs) const;
+		void BuildRaytracingAccelerationStructures (UINT numDescs, const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC* pDescs,
+			D3D12_GPU_VIRTUAL_ADDRESS scratchPool = 0);
+
+		// Writes one info struct per source structure, consecutively from pDesc->DestBuffer. COMPACTED_SIZE
+		// requires ALLOW_COMPACTION; CURRENT_SIZE reports how many bytes the structure occupies now; SERIALIZATION
+		// reports the size of a serialized copy and the length of its bottom-level address list.
+		void EmitRaytracingAccelerationStructurePostbuildInfo (const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_DESC* pDesc,
+			UINT numSourceAccelerationStructures, const D3D12_GPU_VIRTUAL_ADDRESS* pSourceAccelerationStructureData) const;
+
+		// CLONE, COMPACT, SERIALIZE and DESERIALIZE. A compacted copy needs the CompactedSizeInBytes reported for its
+		// source. DESERIALIZE reads serialized data from the source address (see SerializeAccelerationStructure ()).
+		void CopyRaytracingAccelerationStructure (D3D12_GPU_VIRTUAL_ADDRESS destAccelerationStructureData,
+			D3D12_GPU_VIRTUAL_ADDRESS sourceAccelerationStructureData, D3D12_RAYTRACING_ACCELERATION_STRUCTURE_COPY_MODE mode);
+
+		D3D12_DRIVER_MATCHING_IDENTIFIER_STATUS CheckDriverMatchingIdentifier (D3D12_SERIALIZED_DATA_TYPE serializedDataType,
+			const D3D12_SERIALIZED_DATA_DRIVER_MATCHING_IDENTIFIER* pIdentifierToCheck) const;
+
+		ThreadPool& GetThreadPool () { return m_ThreadPool; }
+
+	private:
+		ThreadPool m_ThreadPool;
+	};
+
+}
@@ -0,0 +1,159 @@
+#include "stdafx.h"
+#include "GeometryReader.h"
+
+namespace CpuRaytracing {
+
+	namespace {
+
+		// IEEE half to float, including denormals, infinities and NaN.
+		float HalfToFloat (UINT16 half) {
+			const UINT32 sign = UINT32 (half & 0x8000) << 16;
+			UINT32 exponent = (half >> 10) & 0x1F;
+			UINT32 mantissa = half & 0x3FF;
+			UINT32 bits;
+			if (exponent == 0x1F) {
+				bits = sign | 0x7F800000 | (mantissa << 13);
+			} else if (exponent != 0) {
+				bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+			} else if (mantissa != 0) {
+				// Normalize the denormal: shift the leading one into the implicit bit.
+				exponent = 113;
+				while (!(mantissa & 0x400)) {
+					mantissa <<= 1;
+					exponent--;
+				}
+				bits = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
+			} else {
+				bits = sign;
+			}
+			float value;
+			memcpy (&value, &bits, sizeof (value));
+			return value;
+		}
+
+		// As the input assembler converts it: -32768 and -32767 both map to -1.
+		float SnormToFloat (int16_t value) {
+			return std::max (value / 32767.0f, -1.0f);
+		}
+
+		bool IsSupportedVertexFormat (DXGI_FORMAT format) {
+			switch (format) {
+			case DXGI_FORMAT_R32G32B32_FLOAT:
+			case DXGI_FORMAT_R32G32_FLOAT:
+			case DXGI_FORMAT_R16G16B16A16_FLOAT:
+			case DXGI_FORMAT_R16G16_FLOAT:
+			case DXGI_FORMAT_R16G16B16A16_SNORM:
+			case DXGI_FORMAT_R16G16_SNORM:
+				return true;
+			default:
+				return false;
+			}
+		}
+
+	}
+
+	TriangleGeometryReader::TriangleGeometryReader (const D3D12_RAYTRACING_GEOMETRY_TRIANGLES_DESC& desc) :
+		m_Indices (GetCpuPointer<const uint8_t> (desc.IndexBuffer)),
+		m_Vertices (GetCpuPointer<const uint8_t> (desc.VertexBuffer.StartAddress)),
+		m_VertexStride (desc.VertexBuffer.StrideInBytes),
+		m_IndexFormat (desc.IndexFormat),
+		m_VertexFormat (desc.VertexFormat),
+		m_PrimitiveCount (GetTriangleCount (desc)),
+		m_HasTransform (desc.Transform3x4 != 0),
+		m_Transform (Matrix3x4::Identity ()) {
+
+		ThrowIfFalse (desc.IndexFormat == DXGI_FORMAT_R16_UINT || desc.IndexFormat == DXGI_FORMAT_R32_UINT || desc.IndexFormat == DXGI_FORMAT_UNKNOWN,
+			"CpuRaytracing: index buffers must be DXGI_FORMAT_R16_UINT or DXGI_FORMAT_R32_UINT, or DXGI_FORMAT_UNKNOWN without one.");
+		ThrowIfFalse (desc.IndexFormat != DXGI_FORMAT_UNKNOWN || (desc.IndexBuffer == 0 && desc.IndexCount == 0),
+			"CpuRaytracing: non-indexed triangle geometry must not have an index buffer or IndexCount.");
+		ThrowIfFalse (IsSupportedVertexFormat (desc.VertexFormat), "CpuRaytracing: unsupported vertex position format.");
+		ThrowIfFalse (desc.Transform3x4 % D3D12_RAYTRACING_TRANSFORM3X4_BYTE_ALIGNMENT == 0, "CpuRaytracing: Transform3x4 must be 16-byte aligned.");
+		ThrowIfFalse (m_PrimitiveCount == 0 || ((m_Indices || m_IndexFormat == DXGI_FORMAT_UNKNOWN) && m_Vertices),
+			"CpuRaytracing: triangle geometry is missing its index or vertex buffer.");
+
+		// Read once per reader, so an update picks up a transform that changed since the build.
+		if (m_HasTransform) {
+			memcpy (&m_Transform, GetCpuPointer<const void> (desc.Transform3x4), sizeof (m_Transform));
+		}
+	}
+
+	Float3 TriangleGeometryReader::LoadVertex (UINT vertexIndex) const {
+		const uint8_t* vertex = m_Vertices + vertexIndex * m_VertexStride;
+		switch (m_VertexFormat) {
+		case DXGI_FORMAT_R32G32_FLOAT: {
+			float xy[2];
+			memcpy (xy, vertex, sizeof (xy));
+			return Float3 (xy[0], xy[1], 0.0f);
+		}
+		case DXGI_FORMAT_R16G16B16A16_FLOAT:
+		case DXGI_FORMAT_R16G16_FLOAT: {
+			const bool hasZ = m_VertexFormat == DXGI_FORMAT_R16G16B16A16_FLOAT;
+			UINT16 xyz[3] = {};
+			memcpy (xyz, vertex, (hasZ ? 3 : 2) * sizeof (UINT16));
+			return Float3 (HalfToFloat (xyz[0]), HalfToFloat (xyz[1]), HalfToFloat (xyz[2]));
+		}
+		case DXGI_FORMAT_R16G16B16A16_SNORM:
+		case DXGI_FORMAT_R16G16_SNORM: {
+			const bool hasZ = m_VertexFormat == DXGI_FORMAT_R16G16B16A16_SNORM;
+			int16_t xyz[3] = {};
+			memcpy (xyz, vertex, (hasZ ? 3 : 2) * sizeof (int16_t));
+			return Float3 (SnormToFloat (xyz[0]), SnormToFloat (xyz[1]), SnormToFloat (xyz[2]));
+		}
+		default: {
+			Float3 position;
+			memcpy (&position, vertex, sizeof (position));
+			return position;
+		}
+		}
+	}
+
+	void TriangleGeometryReader::GetIndices (UINT primitiveIndex, UINT indices[3]) const {
+		if (m_IndexFormat == DXGI_FORMAT_R32_UINT) {
+			memcpy (indices, m_Indices + primitiveIndex * 3 * sizeof (UINT32), 3 * sizeof (UINT32));
+		} else if (m_IndexFormat == DXGI_FORMAT_R16_UINT) {
+			UINT16 indices16[3];
+			memcpy (indices16, m_Indices + primitiveIndex * sizeof (indices16), sizeof (indices16));
+			for (UINT i = 0; i < 3; i++) {
+				indices[i] = indices16[i];
+			}
+		} else {
+			for (UINT i = 0; i < 3; i++) {
+				indices[i] = 3 * primitiveIndex + i;
+			}
+		}
+	}
+
+	void TriangleGeometryReader::GetTriangle (UINT primitiveIndex, Float3 vertices[3]) const {
+		UINT indices[3];
+		GetIndices (primitiveIndex, indices);
+
+		for (UINT i = 0; i < 3; i++) {
+			vertices[i] = LoadVertex (indices[i]);
+		}
+		if (m_HasTransform) {
+			for (UINT i = 0; i < 3; i++) {
+				vertices[i] = m_Transform.TransformPoint (vertices[i]);
+			}
+		}
+	}
+
+	ProceduralGeometryReader::ProceduralGeometryReader (const D3D12_RAYTRACING_GEOMETRY_AABBS_DESC& desc) :
+		m_Aabbs (GetCpuPointer<const uint8_t> (desc.AABBs.StartAddress)),
+		m_Stride (desc.AABBs.StrideInBytes),
+		m_PrimitiveCount (static_cast<UINT> (desc.AABBCount)) {
+
+		ThrowIfFalse (m_Stride % D3D12_RAYTRACING_AABB_BYTE_ALIGNMENT == 0 && (m_PrimitiveCount <= 1 || m_Stride >= sizeof (D3D12_RAYTRACING_AABB)),
+			"CpuRaytracing: AABB strides must be a multiple of 8 bytes and cover a D3D12_RAYTRACING_AABB.");
+		ThrowIfFalse (m_PrimitiveCount == 0 || m_Aabbs, "CpuRaytracing: procedural geometry is missing its AABB buffer.");
+	}
+
+	Aabb ProceduralGeometryReader::GetBounds (UINT primitiveIndex) const {
+		D3D12_RAYTRACING_AABB box;
+		memcpy (&box, m_Aabbs + primitiveIndex * m_Stride, sizeof (box));
+		if (box.MinX != box.MinX) {
+			return Aabb::Empty ();
+		}
+		return Aabb {Float3 (box.MinX, box.MinY, box.MinZ), Float3 (box.MaxX, box.MaxY, box.MaxZ)};
+	}
+
+}
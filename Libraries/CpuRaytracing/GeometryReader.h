@@ -0,0 +1,78 @@
+#pragma once
+
+#include "RaytracingCompat.h"
+#include "RaytracingMath.h"
+
+namespace CpuRaytracing {
+
+	inline const D3D12_RAYTRACING_GEOMETRY_DESC& GetGeometryDesc (const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs, UINT geometryIndex) {
+		return inputs.DescsLayout == D3D12_ELEMENTS_LAYOUT_ARRAY ? inputs.pGeometryDescs[geometryIndex] : *inputs.ppGeometryDescs[geometryIndex];
+	}
+
+	inline const D3D12_RAYTRACING_INSTANCE_DESC& GetInstanceDesc (const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs, UINT instanceIndex) {
+		if (inputs.DescsLayout == D3D12_ELEMENTS_LAYOUT_ARRAY) {
+			return GetCpuPointer<const D3D12_RAYTRACING_INSTANCE_DESC> (inputs.InstanceDescs)[instanceIndex];
+		}
+		return *GetCpuPointer<const D3D12_RAYTRACING_INSTANCE_DESC> (GetCpuPointer<const D3D12_GPU_VIRTUAL_ADDRESS> (inputs.InstanceDescs)[instanceIndex]);
+	}
+
+	// Triangles without an index buffer (IndexFormat DXGI_FORMAT_UNKNOWN) take three consecutive vertices each.
+	inline UINT GetTriangleCount (const D3D12_RAYTRACING_GEOMETRY_TRIANGLES_DESC& desc) {
+		return (desc.IndexFormat == DXGI_FORMAT_UNKNOWN ? desc.VertexCount : desc.IndexCount) / 3;
+	}
+
+	// Triangles or procedural primitives of a geometry desc, whichever its type is.
+	inline UINT64 GetGeometryPrimitiveCount (const D3D12_RAYTRACING_GEOMETRY_DESC& geometryDesc) {
+		return geometryDesc.Type == D3D12_RAYTRACING_GEOMETRY_TYPE_PROCEDURAL_PRIMITIVE_AABBS ? geometryDesc.AABBs.AABBCount : GetTriangleCount (geometryDesc.Triangles);
+	}
+
+	// Fetches triangle vertices from the index and vertex buffers referenced by a geometry desc. Indices are
+	// R16_UINT, R32_UINT or absent; positions are any vertex format DXR accepts, R32G32B32_FLOAT, R32G32_FLOAT,
+	// R16G16B16A16_FLOAT, R16G16_FLOAT, R16G16B16A16_SNORM or R16G16_SNORM, with z = 0 for two-component formats.
+	// Vertices are returned in the space of the bottom-level structure: a Transform3x4 is applied to them.
+	class TriangleGeometryReader {
+	public:
+		explicit TriangleGeometryReader (const D3D12_RAYTRACING_GEOMETRY_TRIANGLES_DESC& desc);
+
+		UINT GetPrimitiveCount () const { return m_PrimitiveCount; }
+
+		// The vertex indices of a triangle, for the closest-hit stage to fetch and interpolate vertex attributes.
+		void GetIndices (UINT primitiveIndex, UINT indices[3]) const;
+
+		void GetTriangle (UINT primitiveIndex, Float3 vertices[3]) const;
+
+	private:
+		Float3 LoadVertex (UINT vertexIndex) const;
+
+		const uint8_t* m_Indices;
+		const uint8_t* m_Vertices;
+		UINT64 m_VertexStride;
+		DXGI_FORMAT m_IndexFormat;
+		DXGI_FORMAT m_VertexFormat;
+		UINT m_PrimitiveCount;
+		bool m_HasTransform;
+		Matrix3x4 m_Transform;
+	};
+
+	// Fetches the boxes of procedural primitives from the AABB buffer referenced by a geometry desc.
+	class ProceduralGeometryReader {
+	public:
+		explicit ProceduralGeometryReader (const D3D12_RAYTRACING_GEOMETRY_AABBS_DESC& desc);
+
+		UINT GetPrimitiveCount () const { return m_PrimitiveCount; }
+
+		// Empty for an inactive primitive, whose MinX is NaN.
+		Aabb GetBounds (UINT primitiveIndex) const;
+
+	private:
+		const uint8_t* m_Aabbs;
+		UINT64 m_Stride;
+		UINT m_PrimitiveCount;
+	};
+
+	// Primitives whose vertices contain NaN are inactive and never enter the tree, as in DXR.
+	inline bool IsActiveTriangle (const Float3 vertices[3]) {
+		return vertices[0].x == vertices[0].x && vertices[1].x == vertices[1].x && vertices[2].x == vertices[2].x;
+	}
+
+}
@@ -0,0 +1,336 @@
+#include "stdafx.h"
+#include "HierarchyBuilder.h"
+#include "BinnedSahBuilder.h"
+#include "BvhOptimizer.h"
+#include "LbvhBuilder.h"
+#include "SpatialSplitBuilder.h"
+
+namespace CpuRaytracing {
+
+	HierarchyBuilder::ScratchLayout HierarchyBuilder::GetScratchLayout (D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS flags, UINT maxPrimitiveCount) {
+		ScratchLayout layout;
+		layout.MaxReferenceCount = GetMaxReferenceCount (flags, maxPrimitiveCount);
+		layout.ReferenceOffset = 0;
+		layout.BuildNodeOffset = Align (UINT64 (layout.MaxReferenceCount) * sizeof (PrimitiveReference), c_SectionAlignment);
+		layout.BuilderOffset = layout.BuildNodeOffset + Align (UINT64 (GetMaxBinaryNodeCount (layout.MaxReferenceCount)) * sizeof (BuildNode), c_SectionAlignment);
+		layout.SizeInBytes = layout.BuilderOffset;
+		if (UseLinearBuilder (flags)) {
+			layout.SizeInBytes += LbvhBuilder::GetScratchSize (maxPrimitiveCount);
+		} else if (GetSpatialSplitBudget (flags) != 0) {
+			layout.SizeInBytes += Align (UINT64 (layout.MaxReferenceCount) * sizeof (PrimitiveReference), c_SectionAlignment);
+		}
+		if (UseOptimizer (flags)) {
+			// The optimizer runs after the builder and reuses its working memory.
+			layout.SizeInBytes = std::max (layout.SizeInBytes, layout.BuilderOffset + BvhOptimizer::GetScratchSize (GetMaxBinaryNodeCount (layout.MaxReferenceCount)));
+		}
+		return layout;
+	}
+
+	bool HierarchyBuilder::UseLinearBuilder (D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS flags) {
+		ThrowIfFalse (!(flags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_TRACE) || !(flags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_BUILD),
+			"CpuRaytracing: PREFER_FAST_TRACE and PREFER_FAST_BUILD are mutually exclusive.");
+		return (flags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_BUILD) != 0;
+	}
+
+	bool HierarchyBuilder::UseOptimizer (D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS flags) {
+		ThrowIfFalse (!(flags & c_BuildFlagOptimizeHierarchy) || (flags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_TRACE),
+			"CpuRaytracing: c_BuildFlagOptimizeHierarchy requires PREFER_FAST_TRACE.");
+		return (flags & c_BuildFlagOptimizeHierarchy) != 0;
+	}
+
+	void HierarchyBuilder::Build (AccelerationStructureHeader* header, D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS flags,
+		void* scratch, const ScratchLayout& layout, UINT primitiveCount, const TriangleSource* triangles) {
+
+		header->NodeCount = 0;
+		header->PrimitiveCount = 0;
+		header->MaxDepth = 0;
+		header->Bounds = Aabb::Empty ();
+		header->SahCost = 0.0f;
+		header->UnoptimizedSahCost = 0.0f;
+		if (primitiveCount == 0) {
+			return;
+		}
+
+		auto references = OffsetPointer<PrimitiveReference> (scratch, layout.ReferenceOffset);
+		auto buildNodes = OffsetPointer<BuildNode> (scratch, layout.BuildNodeOffset);
+		UINT buildNodeCount = 0;
+
+		if (UseLinearBuilder (flags)) {
+			LbvhBuilder::Settings settings;
+			if (m_Settings.MaxLeafSize != 0) {
+				settings.MaxLeafSize = m_Settings.MaxLeafSize;
+			}
+
+			LbvhBuilder builder (m_ThreadPool, settings);
+			buildNodeCount = builder.Build (references, primitiveCount, buildNodes, OffsetPointer<void> (scratch, layout.BuilderOffset));
+		} else if (GetSpatialSplitBudget (flags) != 0) {
+			ThrowIfFalse (triangles != nullptr, "CpuRaytracing: spatial splits are only supported in bottom-level builds.");
+
+			SpatialSplitBuilder::Settings settings;
+			if (m_Settings.MaxLeafSize != 0) {
+				settings.MaxLeafSize = m_Settings.MaxLeafSize;
+			}
+			settings.Costs = m_Settings.Costs;
+
+			SpatialSplitBuilder builder (m_ThreadPool, settings, *triangles);
+			buildNodeCount = builder.Build (references, primitiveCount, layout.MaxReferenceCount, OffsetPointer<PrimitiveReference> (scratch, layout.BuilderOffset), buildNodes);
+		} else {
+			// PREFER_FAST_TRACE pays for the full bin count; the default settles for a coarser sweep.
+			BinnedSahBuilder::Settings settings;
+			if (!(flags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_TRACE)) {
+				settings.BinCount = 8;
+			}
+			if (m_Settings.MaxLeafSize != 0) {
+				settings.MaxLeafSize = m_Settings.MaxLeafSize;
+			}
+			settings.Costs = m_Settings.Costs;
+
+			BinnedSahBuilder builder (m_ThreadPool, settings);
+			buildNodeCount = builder.Build (references, primitiveCount, buildNodes);
+		}
+
+		header->UnoptimizedSahCost = BvhOptimizer::GetSahCost (buildNodes, m_Settings.Costs);
+		header->SahCost = header->UnoptimizedSahCost;
+		if (UseOptimizer (flags)) {
+			BvhOptimizer::Settings settings;
+			settings.Costs = m_Settings.Costs;
+
+			BvhOptimizer optimizer (m_ThreadPool, settings);
+			optimizer.Optimize (buildNodes, buildNodeCount, OffsetPointer<void> (scratch, layout.BuilderOffset));
+			header->SahCost = BvhOptimizer::GetSahCost (buildNodes, m_Settings.Costs);
+		}
+
+		if (header->NodeFormat == c_NodeFormatQuantized) {
+			if (header->NodeWidth == 4) {
+				WriteQuantizedNodes<4> (header, buildNodes, references);
+			} else {
+				WriteQuantizedNodes<8> (header, buildNodes, references);
+			}
+		} else if (header->NodeWidth == 4) {
+			WriteWideNodes<4> (header, buildNodes, references);
+		} else if (header->NodeWidth == 8) {
+			WriteWideNodes<8> (header, buildNodes, references);
+		} else {
+			WriteNodes (header, buildNodes, references);
+		}
+
+		// Traversal stacks are sized for c_MaxBvhDepth; the builders keep within it, and this keeps them honest.
+		ThrowIfFalse (header->MaxDepth <= c_MaxBvhDepth, "CpuRaytracing: the hierarchy is deeper than c_MaxBvhDepth.");
+	}
+
+	void HierarchyBuilder::WriteNodes (AccelerationStructureHeader* header, const BuildNode* buildNodes, const PrimitiveReference* references) {
+		struct StackEntry {
+			UINT BuildNodeIndex;
+			UINT ParentIndex;   // Flattened parent whose second-child offset points here, or UINT_MAX.
+			UINT Depth;
+		};
+
+		BvhNode* nodes = header->GetNodes ();
+		PrimitiveRecord* primitives = header->GetPrimitives ();
+		UINT nodeCount = 0;
+		UINT primitiveCount = 0;
+		UINT maxDepth = 0;
+
+		// Pre-order walk so that every first child lands directly after its parent. The child with the larger
+		// surface area, which more rays enter, goes first, so the likeliest path down the tree reads
+		// consecutive nodes.
+		std::vector<StackEntry> stack;
+		stack.push_back ({0, UINT_MAX, 1});
+		while (!stack.empty ()) {
+			StackEntry entry = stack.back ();
+			stack.pop_back ();
+
+			const BuildNode& buildNode = buildNodes[entry.BuildNodeIndex];
+			UINT nodeIndex = nodeCount++;
+			if (entry.ParentIndex != UINT_MAX) {
+				nodes[entry.ParentIndex].Offset = nodeIndex;
+			}
+			maxDepth = std::max (maxDepth, entry.Depth);
+
+			BvhNode& node = nodes[nodeIndex];
+			node.Bounds = buildNode.Bounds;
+			node.SplitAxis = static_cast<UINT8> (buildNode.SplitAxis);
+			node.Reserved = 0;
+			if (buildNode.IsLeaf ()) {
+				node.Offset = primitiveCount;
+				node.PrimitiveCount = static_cast<UINT16> (buildNode.PrimitiveCount);
+				for (UINT i = 0; i < buildNode.PrimitiveCount; i++) {
+					const PrimitiveReference& ref = references[buildNode.FirstPrimitive + i];
+					primitives[primitiveCount++] = {ref.GeometryIndex, ref.PrimitiveIndex};
+				}
+			} else {
+				UINT first = buildNode.Children[0];
+				UINT second = buildNode.Children[1];
+				if (buildNodes[second].Bounds.HalfArea () > buildNodes[first].Bounds.HalfArea ()) {
+					std::swap (first, second);
+				}
+
+				node.PrimitiveCount = 0;
+				stack.push_back ({second, nodeIndex, entry.Depth + 1});
+				stack.push_back ({first, UINT_MAX, entry.Depth + 1});
+			}
+		}
+
+		header->NodeCount = nodeCount;
+		header->PrimitiveCount = primitiveCount;
+		header->MaxDepth = maxDepth;
+		header->Bounds = nodes[0].Bounds;
+	}
+
+	template <UINT Width>
+	void HierarchyBuilder::WriteWideNodes (AccelerationStructureHeader* header, const BuildNode* buildNodes, const PrimitiveReference* references) {
+		FlattenState state = {buildNodes, references, header->GetPrimitives (), 0, 0, 0};
+		WriteWideNode (header->GetWideNodes<Width> (), 0, 1, &state);
+
+		header->NodeCount = state.NodeCount;
+		header->PrimitiveCount = state.PrimitiveCount;
+		header->MaxDepth = state.MaxDepth;
+		header->Bounds = header->GetWideNodes<Width> ()[0].GetBounds ();
+	}
+
+	// Collapses the binary subtree at buildNodeIndex into the build nodes of one wide node: the interior child
+	// with the largest surface area is replaced by its two children until all Width slots are used or only
+	// leaves remain. Slots are returned by decreasing surface area, so the subtree rays most likely enter is
+	// written directly after its parent.
+	template <UINT Width>
+	UINT HierarchyBuilder::CollapseNode (const BuildNode* buildNodes, UINT buildNodeIndex, UINT* slots) {
+		UINT slotCount = 0;
+		if (buildNodes[buildNodeIndex].IsLeaf ()) {
+			slots[slotCount++] = buildNodeIndex;
+		} else {
+			slots[slotCount++] = buildNodes[buildNodeIndex].Children[0];
+			slots[slotCount++] = buildNodes[buildNodeIndex].Children[1];
+		}
+
+		while (slotCount < Width) {
+			UINT expand = UINT_MAX;
+			float largestArea = -1.0f;
+			for (UINT slot = 0; slot < slotCount; slot++) {
+				const BuildNode& child = buildNodes[slots[slot]];
+				if (!child.IsLeaf () && child.Bounds.HalfArea () > largestArea) {
+					expand = slot;
+					largestArea = child.Bounds.HalfArea ();
+				}
+			}
+			if (expand == UINT_MAX) {
+				break;
+			}
+
+			const BuildNode& child = buildNodes[slots[expand]];
+			std::copy_backward (slots + expand + 1, slots + slotCount, slots + slotCount + 1);
+			slots[expand] = child.Children[0];
+			slots[expand + 1] = child.Children[1];
+			slotCount++;
+		}
+
+		std::sort (slots, slots + slotCount, [buildNodes] (UINT a, UINT b) {
+			return buildNodes[a].Bounds.HalfArea () > buildNodes[b].Bounds.HalfArea ();
+		});
+		return slotCount;
+	}
+
+	// Nodes are numbered in pre-order and primitives are written in leaf order, as in the binary layout.
+	template <UINT Width>
+	UINT HierarchyBuilder::WriteWideNode (WideBvhNode<Width>* nodes, UINT buildNodeIndex, UINT depth, FlattenState* state) {
+		const BuildNode* buildNodes = state->BuildNodes;
+		UINT slots[Width];
+		const UINT slotCount = CollapseNode<Width> (buildNodes, buildNodeIndex, slots);
+
+		const UINT nodeIndex = state->NodeCount++;
+		state->MaxDepth = std::max (state->MaxDepth, depth);
+
+		WideBvhNode<Width>& node = nodes[nodeIndex];
+		node.ChildCount = static_cast<UINT8> (slotCount);
+		std::fill (std::begin (node.Reserved), std::end (node.Reserved), UINT8 (0));
+		for (UINT slot = 0; slot < Width; slot++) {
+			if (slot >= slotCount) {
+				node.SetChildBounds (slot, Aabb::Empty ());
+				node.Child[slot] = 0;
+				node.PrimitiveCount[slot] = 0;
+				continue;
+			}
+
+			const BuildNode& child = buildNodes[slots[slot]];
+			node.SetChildBounds (slot, child.Bounds);
+			if (child.IsLeaf ()) {
+				node.Child[slot] = state->PrimitiveCount;
+				node.PrimitiveCount[slot] = static_cast<UINT16> (child.PrimitiveCount);
+				for (UINT i = 0; i < child.PrimitiveCount; i++) {
+					const PrimitiveReference& ref = state->References[child.FirstPrimitive + i];
+					state->Primitives[state->PrimitiveCount++] = {ref.GeometryIndex, ref.PrimitiveIndex};
+				}
+			} else {
+				node.PrimitiveCount[slot] = 0;
+				node.Child[slot] = WriteWideNode (nodes, slots[slot], depth + 1, state);
+			}
+		}
+		return nodeIndex;
+	}
+
+	template <UINT Width>
+	void HierarchyBuilder::WriteQuantizedNodes (AccelerationStructureHeader* header, const BuildNode* buildNodes, const PrimitiveReference* references) {
+		FlattenState state = {buildNodes, references, header->GetPrimitives (), 1, 0, 0};
+		WriteQuantizedNode (header->GetQuantizedNodes<Width> (), 0, 0, 1, &state);
+
+		header->NodeCount = state.NodeCount;
+		header->PrimitiveCount = state.PrimitiveCount;
+		header->MaxDepth = state.MaxDepth;
+		header->Bounds = buildNodes[0].Bounds;
+	}
+
+	// Same collapse as WriteWideNode, but interior children are moved to the front and allocated as one block,
+	// and the primitives of the leaf children are written before any of the subtrees, so both are consecutive.
+	template <UINT Width>
+	void HierarchyBuilder::WriteQuantizedNode (QuantizedBvhNode<Width>* nodes, UINT nodeIndex, UINT buildNodeIndex, UINT depth, FlattenState* state) {
+		const BuildNode* buildNodes = state->BuildNodes;
+		UINT slots[Width];
+		const UINT slotCount = CollapseNode<Width> (buildNodes, buildNodeIndex, slots);
+		const UINT interiorCount = static_cast<UINT> (std::stable_partition (slots, slots + slotCount, [buildNodes] (UINT slot) {
+			return !buildNodes[slot].IsLeaf ();
+		}) - slots);
+		state->MaxDepth = std::max (state->MaxDepth, depth);
+
+		QuantizedBvhNode<Width>& node = nodes[nodeIndex];
+		memset (&node, 0, sizeof (node));
+		node.ChildCount = static_cast<UINT8> (slotCount);
+		node.ChildBase = state->NodeCount;
+		node.PrimitiveBase = state->PrimitiveCount;
+		state->NodeCount += interiorCount;
+
+		Aabb childBounds[Width];
+		UINT primitiveEnd = 0;
+		for (UINT slot = 0; slot < slotCount; slot++) {
+			const BuildNode& child = buildNodes[slots[slot]];
+			childBounds[slot] = child.Bounds;
+			for (UINT i = 0; i < child.PrimitiveCount; i++) {
+				const PrimitiveReference& ref = state->References[child.FirstPrimitive + i];
+				state->Primitives[state->PrimitiveCount++] = {ref.GeometryIndex, ref.PrimitiveIndex};
+			}
+			primitiveEnd += child.PrimitiveCount;
+			ThrowIfFalse (primitiveEnd <= UINT8_MAX, "CpuRaytracing: the leaves of a quantized node hold at most 255 primitives.");
+			node.PrimitiveEnd[slot] = static_cast<UINT8> (primitiveEnd);
+		}
+		node.SetChildBounds (childBounds);
+
+		for (UINT slot = 0; slot < interiorCount; slot++) {
+			WriteQuantizedNode (nodes, node.ChildBase + slot, slots[slot], depth + 1, state);
+		}
+	}
+
+	UINT HierarchyBuilder::GetRefitTaskDepth (UINT nodeWidth) {
+		// Deep enough for up to c_MaxRefitTaskCount task roots: 6 binary levels, 3 of BVH4, 2 of BVH8.
+		const UINT levelBits = nodeWidth == 8 ? 3 : (nodeWidth == 4 ? 2 : 1);
+		return 6 / levelBits;
+	}
+
+	void HierarchyBuilder::CollectRefitTasks (const BvhNode* nodes, UINT nodeIndex, UINT depth, UINT taskDepth, UINT* roots, UINT* rootCount) {
+		const BvhNode& node = nodes[nodeIndex];
+		if (depth == taskDepth || node.IsLeaf ()) {
+			roots[(*rootCount)++] = nodeIndex;
+			return;
+		}
+		CollectRefitTasks (nodes, nodeIndex + 1, depth + 1, taskDepth, roots, rootCount);
+		CollectRefitTasks (nodes, node.Offset, depth + 1, taskDepth, roots, rootCount);
+	}
+
+}
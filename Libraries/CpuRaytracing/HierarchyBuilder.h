@@ -0,0 +1,195 @@
+#pragma once
+
+#include "AccelerationStructure.h"
+#include "BvhBuild.h"
+#include "ThreadPool.h"
+
+namespace CpuRaytracing {
+
+	// The part of a build that does not depend on what the leaves hold: scratch layout, selection of the
+	// hierarchy builder from the build flags, the optional BvhOptimizer pass, flattening of the BuildNode tree
+	// into the node and PrimitiveRecord sections (collapsing it to 4- or 8-wide nodes, optionally quantized, on
+	// request), and refitting of node bounds for updates. The bottom- and top-level builders gather PrimitiveReferences and
+	// write their leaf data around it.
+	class HierarchyBuilder {
+	public:
+		struct Settings {
+			UINT MaxLeafSize = 0;   // Zero keeps the default of the selected builder.
+			SahCosts Costs;
+		};
+
+		struct ScratchLayout {
+			UINT MaxReferenceCount; // Primitives plus the duplicates spatial splits may add.
+			UINT64 ReferenceOffset;
+			UINT64 BuildNodeOffset;
+			UINT64 BuilderOffset;   // Builder-specific working memory.
+			UINT64 SizeInBytes;
+		};
+
+		static ScratchLayout GetScratchLayout (D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS flags, UINT maxPrimitiveCount);
+
+		HierarchyBuilder (ThreadPool& threadPool, const Settings& settings) : m_ThreadPool (threadPool), m_Settings (settings) {}
+
+		// Builds over the first primitiveCount references of a scratch buffer laid out by GetScratchLayout () and
+		// writes the node and primitive sections of header, along with its node count, primitive count, depth,
+		// bounds and SAH cost. header->NodeWidth and header->NodeFormat select the node type. Spatial splits clip
+		// the triangles supplied by triangles and may leave more leaf primitives than there were references.
+		void Build (AccelerationStructureHeader* header, D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS flags,
+			void* scratch, const ScratchLayout& layout, UINT primitiveCount, const TriangleSource* triangles = nullptr);
+
+		// Recomputes node bounds from leafBounds (firstPrimitive, primitiveCount) -> Aabb. The subtrees below the
+		// top few levels are refit as independent tasks, the levels above them afterwards. Nothing is allocated.
+		template <typename LeafBounds>
+		void Refit (AccelerationStructureHeader* header, const LeafBounds& leafBounds);
+
+	private:
+		// Subtrees rooted at most c_MaxRefitTaskCount nodes below the root are refit as independent tasks.
+		static const UINT c_MaxRefitTaskCount = 64;
+
+		struct FlattenState {
+			const BuildNode* BuildNodes;
+			const PrimitiveReference* References;
+			PrimitiveRecord* Primitives;
+			UINT NodeCount;
+			UINT PrimitiveCount;
+			UINT MaxDepth;
+		};
+
+		static bool UseLinearBuilder (D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS flags);
+		static bool UseOptimizer (D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS flags);
+		static void WriteNodes (AccelerationStructureHeader* header, const BuildNode* buildNodes, const PrimitiveReference* references);
+		template <UINT Width>
+		static void WriteWideNodes (AccelerationStructureHeader* header, const BuildNode* buildNodes, const PrimitiveReference* references);
+		template <UINT Width>
+		static UINT CollapseNode (const BuildNode* buildNodes, UINT buildNodeIndex, UINT* slots);
+		template <UINT Width>
+		static UINT WriteWideNode (WideBvhNode<Width>* nodes, UINT buildNodeIndex, UINT depth, FlattenState* state);
+		template <UINT Width>
+		static void WriteQuantizedNodes (AccelerationStructureHeader* header, const BuildNode* buildNodes, const PrimitiveReference* references);
+		template <UINT Width>
+		static void WriteQuantizedNode (QuantizedBvhNode<Width>* nodes, UINT nodeIndex, UINT buildNodeIndex, UINT depth, FlattenState* state);
+
+		static UINT GetRefitTaskDepth (UINT nodeWidth);
+		static void CollectRefitTasks (const BvhNode* nodes, UINT nodeIndex, UINT depth, UINT taskDepth, UINT* roots, UINT* rootCount);
+		template <typename LeafBounds>
+		static void RefitSubtree (BvhNode* nodes, UINT nodeIndex, UINT depth, UINT stopDepth, const LeafBounds& leafBounds);
+
+		// The wide refit works on WideBvhNode and QuantizedBvhNode alike.
+		template <typename Node>
+		static void CollectWideRefitTasks (const Node* nodes, UINT nodeIndex, UINT depth, UINT taskDepth, UINT* roots, UINT* rootCount);
+		template <typename Node, typename LeafBounds>
+		static Aabb RefitWideSubtree (Node* nodes, UINT nodeIndex, UINT depth, UINT stopDepth, const LeafBounds& leafBounds);
+		template <typename Node, typename LeafBounds>
+		void RefitWide (AccelerationStructureHeader* header, Node* nodes, const LeafBounds& leafBounds);
+
+		ThreadPool& m_ThreadPool;
+		Settings m_Settings;
+	};
+
+	template <typename LeafBounds>
+	void HierarchyBuilder::Refit (AccelerationStructureHeader* header, const LeafBounds& leafBounds) {
+		if (header->NodeCount == 0) {
+			return;
+		}
+		if (header->NodeFormat == c_NodeFormatQuantized) {
+			if (header->NodeWidth == 4) {
+				RefitWide (header, header->GetQuantizedNodes<4> (), leafBounds);
+			} else {
+				RefitWide (header, header->GetQuantizedNodes<8> (), leafBounds);
+			}
+			return;
+		}
+		if (header->NodeWidth == 4) {
+			RefitWide (header, header->GetWideNodes<4> (), leafBounds);
+			return;
+		}
+		if (header->NodeWidth == 8) {
+			RefitWide (header, header->GetWideNodes<8> (), leafBounds);
+			return;
+		}
+
+		BvhNode* nodes = header->GetNodes ();
+		const UINT taskDepth = GetRefitTaskDepth (2);
+		UINT roots[c_MaxRefitTaskCount];
+		UINT rootCount = 0;
+		CollectRefitTasks (nodes, 0, 0, taskDepth, roots, &rootCount);
+
+		m_ThreadPool.ParallelFor (0, rootCount, 1, [&] (UINT begin, UINT end) {
+			for (UINT i = begin; i < end; i++) {
+				RefitSubtree (nodes, roots[i], 0, UINT_MAX, leafBounds);
+			}
+		});
+		RefitSubtree (nodes, 0, 0, taskDepth, leafBounds);
+
+		header->Bounds = nodes[0].Bounds;
+	}
+
+	template <typename LeafBounds>
+	void HierarchyBuilder::RefitSubtree (BvhNode* nodes, UINT nodeIndex, UINT depth, UINT stopDepth, const LeafBounds& leafBounds) {
+		BvhNode& node = nodes[nodeIndex];
+		if (depth == stopDepth) {
+			return;
+		}
+
+		if (node.IsLeaf ()) {
+			node.Bounds = leafBounds (node.Offset, node.PrimitiveCount);
+			return;
+		}
+
+		RefitSubtree (nodes, nodeIndex + 1, depth + 1, stopDepth, leafBounds);
+		RefitSubtree (nodes, node.Offset, depth + 1, stopDepth, leafBounds);
+		node.Bounds = Union (nodes[nodeIndex + 1].Bounds, nodes[node.Offset].Bounds);
+	}
+
+	template <typename Node>
+	void HierarchyBuilder::CollectWideRefitTasks (const Node* nodes, UINT nodeIndex, UINT depth, UINT taskDepth, UINT* roots, UINT* rootCount) {
+		if (depth == taskDepth) {
+			roots[(*rootCount)++] = nodeIndex;
+			return;
+		}
+		const Node& node = nodes[nodeIndex];
+		for (UINT slot = 0; slot < node.ChildCount; slot++) {
+			if (node.GetPrimitiveCount (slot) == 0) {
+				CollectWideRefitTasks (nodes, node.GetChild (slot), depth + 1, taskDepth, roots, rootCount);
+			}
+		}
+	}
+
+	// A wide node's own bounds are the union of its child slots, so a subtree that stops at stopDepth reads the
+	// slots its task already refit. Quantized nodes decode those slots, which only ever grows the bounds, and
+	// are requantized against the exact union of their children everywhere else.
+	template <typename Node, typename LeafBounds>
+	Aabb HierarchyBuilder::RefitWideSubtree (Node* nodes, UINT nodeIndex, UINT depth, UINT stopDepth, const LeafBounds& leafBounds) {
+		Node& node = nodes[nodeIndex];
+		if (depth == stopDepth) {
+			return node.GetBounds ();
+		}
+
+		Aabb childBounds[Node::c_Width];
+		Aabb bounds = Aabb::Empty ();
+		for (UINT slot = 0; slot < node.ChildCount; slot++) {
+			const UINT primitiveCount = node.GetPrimitiveCount (slot);
+			childBounds[slot] = primitiveCount != 0 ? leafBounds (node.GetChild (slot), primitiveCount)
+				: RefitWideSubtree (nodes, node.GetChild (slot), depth + 1, stopDepth, leafBounds);
+			bounds.Grow (childBounds[slot]);
+		}
+		node.SetChildBounds (childBounds);
+		return bounds;
+	}
+
+	template <typename Node, typename LeafBounds>
+	void HierarchyBuilder::RefitWide (AccelerationStructureHeader* header, Node* nodes, const LeafBounds& leafBounds) {
+		const UINT taskDepth = GetRefitTaskDepth (Node::c_Width);
+		UINT roots[c_MaxRefitTaskCount];
+		UINT rootCount = 0;
+		CollectWideRefitTasks (nodes, 0, 0, taskDepth, roots, &rootCount);
+
+		m_ThreadPool.ParallelFor (0, rootCount, 1, [&] (UINT begin, UINT end) {
+			for (UINT i = begin; i < end; i++) {
+				RefitWideSubtree (nodes, roots[i], 0, UINT_MAX, leafBounds);
+			}
+		});
+		header->Bounds = RefitWideSubtree (nodes, 0, 0, taskDepth, leafBounds);
+	}
+
+}
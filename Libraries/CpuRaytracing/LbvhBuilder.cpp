@@ -0,0 +1,292 @@
+#include "stdafx.h"
+#include "LbvhBuilder.h"
+#include "AccelerationStructure.h"
+#include "RadixSort.h"
+
+namespace CpuRaytracing {
+
+	namespace {
+
+		static const UINT c_GrainSize = 4096;
+
+		template <typename Key>
+		struct MortonTraits;
+
+		template <>
+		struct MortonTraits<UINT32> {
+			static const UINT c_BitsPerAxis = 10;
+		};
+
+		template <>
+		struct MortonTraits<UINT64> {
+			static const UINT c_BitsPerAxis = 21;
+		};
+
+		// Interleaves x, y and z with x in the most significant position.
+		template <typename Key>
+		inline Key GetMortonCode (const Float3& normalized) {
+			const float cellCount = static_cast<float> (1u << MortonTraits<Key>::c_BitsPerAxis);
+			Key code = 0;
+			for (UINT axis = 0; axis < 3; axis++) {
+				float cell = std::min (std::max (normalized[axis] * cellCount, 0.0f), cellCount - 1.0f);
+				code |= ExpandBits (static_cast<Key> (cell)) << (2 - axis);
+			}
+			return code;
+		}
+
+	}
+
+	LbvhBuilder::LbvhBuilder (ThreadPool& threadPool, const Settings& settings) :
+		m_ThreadPool (threadPool),
+		m_Settings (settings) {
+
+		m_Settings.MaxLeafSize = std::max (m_Settings.MaxLeafSize, 1u);
+	}
+
+	UINT64 LbvhBuilder::GetScratchSize (UINT primitiveCount) {
+		UINT64 keySize = primitiveCount > c_WideMortonCodeThreshold ? sizeof (UINT64) : sizeof (UINT32);
+		UINT64 size = 0;
+		size += 2 * Align (primitiveCount * keySize, c_SectionAlignment);                                    // Keys
+		size += 2 * Align (primitiveCount * UINT64 (sizeof (UINT)), c_SectionAlignment);                     // Values
+		size += Align (primitiveCount * UINT64 (sizeof (PrimitiveReference)), c_SectionAlignment);           // Sorted references
+		size += Align (GetMaxBinaryNodeCount (primitiveCount) * UINT64 (sizeof (UINT)), c_SectionAlignment); // Parents
+		size += Align (primitiveCount * UINT64 (sizeof (std::atomic<UINT>)), c_SectionAlignment);            // Visit counters
+		size += Align (primitiveCount * UINT64 (sizeof (UINT)), c_SectionAlignment);                         // Subtree heights
+		return size;
+	}
+
+	UINT LbvhBuilder::Build (PrimitiveReference* references, UINT count, BuildNode* nodes, void* scratch) {
+		if (count == 0) {
+			return 0;
+		}
+
+		if (count > c_WideMortonCodeThreshold) {
+			BuildHierarchy<UINT64> (references, count, nodes, scratch);
+		} else {
+			BuildHierarchy<UINT32> (references, count, nodes, scratch);
+		}
+		return GetMaxBinaryNodeCount (count);
+	}
+
+	template <typename Key>
+	void LbvhBuilder::BuildHierarchy (PrimitiveReference* references, UINT count, BuildNode* nodes, void* scratch) {
+		const int keyBits = sizeof (Key) * 8;
+		const UINT internalCount = count - 1;
+
+		uint8_t* cursor = static_cast<uint8_t*> (scratch);
+		auto Allocate = [&cursor] (UINT64 size) {
+			void* p = cursor;
+			cursor += Align (size, c_SectionAlignment);
+			return p;
+		};
+		auto keys = static_cast<Key*> (Allocate (count * sizeof (Key)));
+		auto tempKeys = static_cast<Key*> (Allocate (count * sizeof (Key)));
+		auto values = static_cast<UINT*> (Allocate (count * sizeof (UINT)));
+		auto tempValues = static_cast<UINT*> (Allocate (count * sizeof (UINT)));
+		auto sortedReferences = static_cast<PrimitiveReference*> (Allocate (count * sizeof (PrimitiveReference)));
+		auto parents = static_cast<UINT*> (Allocate (GetMaxBinaryNodeCount (count) * sizeof (UINT)));
+		auto visits = static_cast<std::atomic<UINT>*> (Allocate (count * sizeof (std::atomic<UINT>)));
+		auto heights = static_cast<UINT*> (Allocate (count * sizeof (UINT)));
+
+		// Morton codes of the centroids, quantized against the centroid bounds.
+		Aabb centroidBounds = Aabb::Empty ();
+		{
+			std::mutex mutex;
+			m_ThreadPool.ParallelFor (0, count, c_GrainSize, [&] (UINT begin, UINT end) {
+				Aabb bounds = Aabb::Empty ();
+				for (UINT i = begin; i < end; i++) {
+					bounds.Grow (references[i].Bounds.Center ());
+				}
+				std::lock_guard<std::mutex> lock (mutex);
+				centroidBounds.Grow (bounds);
+			});
+		}
+
+		Float3 extent = centroidBounds.Extent ();
+		Float3 scale (extent.x > 0.0f ? 1.0f / extent.x : 0.0f, extent.y > 0.0f ? 1.0f / extent.y : 0.0f, extent.z > 0.0f ? 1.0f / extent.z : 0.0f);
+		m_ThreadPool.ParallelFor (0, count, c_GrainSize, [&] (UINT begin, UINT end) {
+			for (UINT i = begin; i < end; i++) {
+				keys[i] = GetMortonCode<Key> ((references[i].Bounds.Center () - centroidBounds.Lower) * scale);
+				values[i] = i;
+			}
+		});
+
+		RadixSort (m_ThreadPool, keys, values, tempKeys, tempValues, count, 3 * MortonTraits<Key>::c_BitsPerAxis);
+
+		m_ThreadPool.ParallelFor (0, count, c_GrainSize, [&] (UINT begin, UINT end) {
+			for (UINT i = begin; i < end; i++) {
+				sortedReferences[i] = references[values[i]];
+			}
+		});
+		m_ThreadPool.ParallelFor (0, count, c_GrainSize, [&] (UINT begin, UINT end) {
+			std::copy (sortedReferences + begin, sortedReferences + end, references + begin);
+		});
+
+		// Internal node i lives at nodes[i] and leaf j at nodes[internalCount + j], so the root is node 0.
+		// Duplicate codes are disambiguated by their position in the sorted order.
+		auto Delta = [&] (int i, int j) -> int {
+			if (j < 0 || j >= static_cast<int> (count)) {
+				return -1;
+			}
+			if (keys[i] == keys[j]) {
+				return keyBits + static_cast<int> (CountLeadingZeros (static_cast<UINT32> (i ^ j)));
+			}
+			return static_cast<int> (CountLeadingZeros (keys[i] ^ keys[j]));
+		};
+
+		m_ThreadPool.ParallelFor (0, count, c_GrainSize, [&] (UINT begin, UINT end) {
+			for (UINT j = begin; j < end; j++) {
+				BuildNode& leaf = nodes[internalCount + j];
+				leaf.Bounds = references[j].Bounds;
+				leaf.Children[0] = leaf.Children[1] = 0;
+				leaf.FirstPrimitive = j;
+				leaf.PrimitiveCount = 1;
+				leaf.SplitAxis = 0;
+			}
+		});
+
+		m_ThreadPool.ParallelFor (0, internalCount, c_GrainSize, [&] (UINT begin, UINT end) {
+			for (UINT node = begin; node < end; node++) {
+				const int i = static_cast<int> (node);
+
+				// Direction of the range and an upper bound on its length.
+				const int d = Delta (i, i + 1) - Delta (i, i - 1) >= 0 ? 1 : -1;
+				const int deltaMin = Delta (i, i - d);
+				int lengthMax = 2;
+				while (Delta (i, i + lengthMax * d) > deltaMin) {
+					lengthMax *= 2;
+				}
+
+				// Binary search for the other end of the range.
+				int length = 0;
+				for (int t = lengthMax / 2; t >= 1; t /= 2) {
+					if (Delta (i, i + (length + t) * d) > deltaMin) {
+						length += t;
+					}
+				}
+				const int j = i + length * d;
+
+				// Binary search for the split position within the range.
+				const int deltaNode = Delta (i, j);
+				int split = 0;
+				for (int divisor = 2, t = (length + 1) / 2; ; divisor *= 2, t = (length + divisor - 1) / divisor) {
+					if (Delta (i, i + (split + t) * d) > deltaNode) {
+						split += t;
+					}
+					if (t <= 1) {
+						break;
+					}
+				}
+				const int gamma = i + split * d + std::min (d, 0);
+
+				const UINT first = static_cast<UINT> (std::min (i, j));
+				const UINT last = static_cast<UINT> (std::max (i, j));
+				BuildNode& buildNode = nodes[node];
+				buildNode.Children[0] = (first == static_cast<UINT> (gamma)) ? internalCount + gamma : gamma;
+				buildNode.Children[1] = (last == static_cast<UINT> (gamma) + 1) ? internalCount + gamma + 1 : gamma + 1;
+				parents[buildNode.Children[0]] = node;
+				parents[buildNode.Children[1]] = node;
+
+				// The first differing Morton bit tells which axis this node splits.
+				const int bit = keyBits - 1 - deltaNode;
+				buildNode.SplitAxis = bit >= 0 ? 2 - bit % 3 : 0;
+
+				// Small subtrees cover contiguous sorted ranges, so they collapse into a single leaf in place.
+				buildNode.FirstPrimitive = first;
+				buildNode.PrimitiveCount = (last - first + 1 <= m_Settings.MaxLeafSize) ? last - first + 1 : 0;
+			}
+		});
+
+		// Bottom-up bounds and heights: the second thread to arrive at a node has both children ready and
+		// continues upward. Collapsed subtrees count as leaves.
+		m_ThreadPool.ParallelFor (0, internalCount, c_GrainSize, [&] (UINT begin, UINT end) {
+			for (UINT i = begin; i < end; i++) {
+				new (&visits[i]) std::atomic<UINT> (0);
+			}
+		});
+		m_ThreadPool.ParallelFor (0, internalCount > 0 ? count : 0, c_GrainSize, [&] (UINT begin, UINT end) {
+			for (UINT j = begin; j < end; j++) {
+				UINT node = parents[internalCount + j];
+				for (;;) {
+					if (visits[node].fetch_add (1, std::memory_order_acq_rel) == 0) {
+						break;
+					}
+					BuildNode& buildNode = nodes[node];
+					buildNode.Bounds = Union (nodes[buildNode.Children[0]].Bounds, nodes[buildNode.Children[1]].Bounds);
+					const UINT first = buildNode.Children[0];
+					const UINT second = buildNode.Children[1];
+					heights[node] = buildNode.IsLeaf () ? 1 : 1 + std::max (first < internalCount ? heights[first] : 1, second < internalCount ? heights[second] : 1);
+					if (node == 0) {
+						break;
+					}
+					node = parents[node];
+				}
+			}
+		});
+
+		LimitDepth (nodes, count, heights);
+	}
+
+	void LbvhBuilder::LimitDepth (BuildNode* nodes, UINT count, const UINT* heights) const {
+		struct StackEntry {
+			UINT NodeIndex;
+			UINT Depth;
+		};
+
+		// Only the paths into subtrees that exceed the budget are walked.
+		const UINT internalCount = count - 1;
+		std::vector<StackEntry> stack;
+		if (internalCount > 0) {
+			stack.push_back ({0, 1});
+		}
+		while (!stack.empty ()) {
+			const StackEntry entry = stack.back ();
+			stack.pop_back ();
+			if (entry.NodeIndex >= internalCount || entry.Depth - 1 + heights[entry.NodeIndex] <= c_MaxBvhDepth) {
+				continue;
+			}
+
+			const BuildNode& node = nodes[entry.NodeIndex];
+			if (entry.Depth >= c_MaxBvhDepth / 2) {
+				UINT last = node.Children[1];
+				while (last < internalCount) {
+					last = nodes[last].Children[1];
+				}
+				BuildMedianSubtree (nodes, internalCount, entry.NodeIndex, node.FirstPrimitive, last - internalCount);
+				continue;
+			}
+			stack.push_back ({node.Children[0], entry.Depth + 1});
+			stack.push_back ({node.Children[1], entry.Depth + 1});
+		}
+	}
+
+	// Rebuilds the subtree over the sorted range [first, last] with median splits, numbered as the radix tree
+	// numbers any binary tree over a range: the left child by its last primitive, the right child by its first.
+	// The subtree therefore reuses exactly the internal nodes it had, and its depth is logarithmic in its size.
+	void LbvhBuilder::BuildMedianSubtree (BuildNode* nodes, UINT internalCount, UINT nodeIndex, UINT first, UINT last) const {
+		BuildNode& node = nodes[nodeIndex];
+		node.FirstPrimitive = first;
+		if (last - first + 1 <= m_Settings.MaxLeafSize) {
+			node.PrimitiveCount = last - first + 1;
+			node.Bounds = Aabb::Empty ();
+			for (UINT j = first; j <= last; j++) {
+				node.Bounds.Grow (nodes[internalCount + j].Bounds);
+			}
+			return;
+		}
+
+		const UINT split = first + (last - first) / 2;
+		node.Children[0] = split == first ? internalCount + split : split;
+		node.Children[1] = split + 1 == last ? internalCount + split + 1 : split + 1;
+		node.PrimitiveCount = 0;
+		if (split != first) {
+			BuildMedianSubtree (nodes, internalCount, split, first, split);
+		}
+		if (split + 1 != last) {
+			BuildMedianSubtree (nodes, internalCount, split + 1, split + 1, last);
+		}
+		node.Bounds = Union (nodes[node.Children[0]].Bounds, nodes[node.Children[1]].Bounds);
+		node.SplitAxis = node.Bounds.LargestAxis ();
+	}
+
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "BvhBuild.h"
+#include "ThreadPool.h"
+
+namespace CpuRaytracing {
+
+	// Linear BVH builder for PREFER_FAST_BUILD. Primitive centroids are sorted by Morton code (30-bit, or
+	// 63-bit for large meshes) and the hierarchy is emitted in three data-parallel passes over the sorted
+	// order: radix tree topology (Karras 2012), bottom-up bounds, and collapsing of small subtrees to leaves.
+	// Clustered or coincident centroids can make the radix tree far deeper than c_MaxBvhDepth; past half the
+	// depth budget, subtrees that would exceed it are rebuilt with median splits of their sorted range.
+	class LbvhBuilder {
+	public:
+		struct Settings {
+			UINT MaxLeafSize = 4;
+		};
+
+		LbvhBuilder (ThreadPool& threadPool, const Settings& settings);
+
+		// Working memory needed on top of the reference and node arrays.
+		static UINT64 GetScratchSize (UINT primitiveCount);
+
+		// Same contract as BinnedSahBuilder::Build (); scratch must hold GetScratchSize (count) bytes.
+		UINT Build (PrimitiveReference* references, UINT count, BuildNode* nodes, void* scratch);
+
+	private:
+		static const UINT c_WideMortonCodeThreshold = 1 << 21;
+
+		template <typename Key>
+		void BuildHierarchy (PrimitiveReference* references, UINT count, BuildNode* nodes, void* scratch);
+		void LimitDepth (BuildNode* nodes, UINT count, const UINT* heights) const;
+		void BuildMedianSubtree (BuildNode* nodes, UINT internalCount, UINT nodeIndex, UINT first, UINT last) const;
+
+		ThreadPool& m_ThreadPool;
+		Settings m_Settings;
+	};
+
+}
@@ -0,0 +1,83 @@
+#include "stdafx.h"
+#include "MappedFile.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace CpuRaytracing {
+
+#ifdef _WIN32
+
+	bool MappedFile::Open (const char* path) {
+		Close ();
+
+		HANDLE file = CreateFileA (path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+
+		LARGE_INTEGER size;
+		HANDLE mapping = nullptr;
+		if (GetFileSizeEx (file, &size) && size.QuadPart > 0) {
+			mapping = CreateFileMappingA (file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		}
+		CloseHandle (file);
+		if (!mapping) {
+			return false;
+		}
+
+		// The view keeps the mapping alive.
+		m_Data = MapViewOfFile (mapping, FILE_MAP_READ, 0, 0, 0);
+		CloseHandle (mapping);
+		m_Size = m_Data ? static_cast<UINT64> (size.QuadPart) : 0;
+		return m_Data != nullptr;
+	}
+
+	void MappedFile::Close () {
+		if (m_Data) {
+			UnmapViewOfFile (m_Data);
+		}
+		m_Data = nullptr;
+		m_Size = 0;
+	}
+
+#else
+
+	bool MappedFile::Open (const char* path) {
+		Close ();
+
+		int file = open (path, O_RDONLY);
+		if (file < 0) {
+			return false;
+		}
+
+		struct stat status;
+		void* data = MAP_FAILED;
+		if (fstat (file, &status) == 0 && status.st_size > 0) {
+			data = mmap (nullptr, static_cast<size_t> (status.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+		}
+		close (file);
+		if (data == MAP_FAILED) {
+			return false;
+		}
+
+		m_Data = data;
+		m_Size = static_cast<UINT64> (status.st_size);
+		return true;
+	}
+
+	void MappedFile::Close () {
+		if (m_Data) {
+			munmap (m_Data, static_cast<size_t> (m_Size));
+		}
+		m_Data = nullptr;
+		m_Size = 0;
+	}
+
+#endif
+
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "RaytracingCompat.h"
+
+namespace CpuRaytracing {
+
+	// Read-only view of a whole file. Mapping rather than reading serialized acceleration structures lets a warm
+	// start skip the copy: pages are shared with the file cache and only brought in as traversal touches them.
+	// The view is page aligned, so structures at 256-byte offsets can be traced in place.
+	class MappedFile {
+	public:
+		MappedFile () = default;
+		~MappedFile () { Close (); }
+
+		MappedFile (const MappedFile&) = delete;
+		MappedFile& operator= (const MappedFile&) = delete;
+
+		// Returns false if the file does not exist, is empty or cannot be mapped.
+		bool Open (const char* path);
+		void Close ();
+
+		const void* GetData () const { return m_Data; }
+		UINT64 GetSize () const { return m_Size; }
+
+	private:
+		void* m_Data = nullptr;
+		UINT64 m_Size = 0;
+	};
+
+}
@@ -0,0 +1,46 @@
+#include "stdafx.h"
+#include "PrebuildInfo.h"
+#include "BottomLevelBuilder.h"
+#include "TopLevelBuilder.h"
+
+namespace CpuRaytracing {
+
+	void GetRaytracingAccelerationStructurePrebuildInfo (const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs,
+		D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO* pInfo) {
+
+		ThrowIfFalse (pInfo != nullptr);
+		if (inputs.Type == D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL) {
+			TopLevelBuilder::GetPrebuildInfo (inputs, pInfo);
+		} else {
+			BottomLevelBuilder::GetPrebuildInfo (inputs, pInfo);
+		}
+	}
+
+	AccelerationStructureMemoryPlan PlanAccelerationStructureMemory (UINT count, const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS* pInputs,
+		D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO* pInfos, UINT64* pResultOffsets, UINT64* pScratchOffsets) {
+
+		ThrowIfFalse (count == 0 || pInputs != nullptr);
+
+		AccelerationStructureMemoryPlan plan = {};
+		for (UINT i = 0; i < count; i++) {
+			D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO info;
+			GetRaytracingAccelerationStructurePrebuildInfo (pInputs[i], &info);
+
+			if (pInfos) {
+				pInfos[i] = info;
+			}
+			if (pResultOffsets) {
+				pResultOffsets[i] = plan.ResultDataSizeInBytes;
+			}
+			if (pScratchOffsets) {
+				pScratchOffsets[i] = plan.ScratchDataTotalSizeInBytes;
+			}
+			plan.ResultDataSizeInBytes += info.ResultDataMaxSizeInBytes;
+			plan.ScratchDataTotalSizeInBytes += info.ScratchDataSizeInBytes;
+			plan.ScratchDataMaxSizeInBytes = std::max (plan.ScratchDataMaxSizeInBytes, info.ScratchDataSizeInBytes);
+			plan.UpdateScratchDataMaxSizeInBytes = std::max (plan.UpdateScratchDataMaxSizeInBytes, info.UpdateScratchDataSizeInBytes);
+		}
+		return plan;
+	}
+
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "RaytracingCompat.h"
+
+namespace CpuRaytracing {
+
+	// Prebuild info without a Device. Only descriptor fields are read, never the buffers they point at, so a call
+	// costs O(NumDescs) for a bottom-level structure and O(1) for a top-level one. The sizes are exactly those the
+	// portable builder lays out, aligned to D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BYTE_ALIGNMENT.
+	void GetRaytracingAccelerationStructurePrebuildInfo (const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs,
+		D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO* pInfo);
+
+	// Memory for building a set of structures from one result and one scratch allocation. Results are placed
+	// back-to-back. Scratch is either one buffer reused by builds that run one after another, or suballocated
+	// back-to-back for builds that run concurrently.
+	struct AccelerationStructureMemoryPlan {
+		UINT64 ResultDataSizeInBytes;
+		UINT64 ScratchDataMaxSizeInBytes;       // Sequential builds.
+		UINT64 ScratchDataTotalSizeInBytes;     // Concurrent builds.
+		UINT64 UpdateScratchDataMaxSizeInBytes;
+	};
+
+	// pInfos, pResultOffsets and pScratchOffsets are optional and receive count entries: the prebuild info of each
+	// structure and its offsets into the result and (concurrent) scratch allocations.
+	AccelerationStructureMemoryPlan PlanAccelerationStructureMemory (UINT count, const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS* pInputs,
+		D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO* pInfos = nullptr, UINT64* pResultOffsets = nullptr, UINT64* pScratchOffsets = nullptr);
+
+}
@@ -0,0 +1,249 @@
+#include "stdafx.h"
+#include "QualityReport.h"
+#include "AccelerationStructureCopy.h"
+
+#include <cstdio>
+
+namespace CpuRaytracing {
+
+	namespace {
+
+		// Sums in unnormalized surface area; divided by the root area at the end.
+		struct StatisticsState {
+			AccelerationStructureStatistics* Statistics;
+			double Overlap;
+			double DepthSum;
+		};
+
+		void AddLeaf (StatisticsState* state, UINT primitiveCount, UINT depth) {
+			AccelerationStructureStatistics& statistics = *state->Statistics;
+			if (statistics.LeafSizeHistogram.size () <= primitiveCount) {
+				statistics.LeafSizeHistogram.resize (primitiveCount + 1, 0);
+			}
+			if (statistics.LeafDepthHistogram.size () <= depth) {
+				statistics.LeafDepthHistogram.resize (depth + 1, 0);
+			}
+			statistics.LeafSizeHistogram[primitiveCount]++;
+			statistics.LeafDepthHistogram[depth]++;
+			statistics.LeafCount++;
+			state->DepthSum += depth;
+		}
+
+		double GetOverlap (const Aabb* childBounds, UINT childCount) {
+			double overlap = 0.0;
+			for (UINT i = 0; i < childCount; i++) {
+				for (UINT j = i + 1; j < childCount; j++) {
+					overlap += Intersection (childBounds[i], childBounds[j]).HalfArea ();
+				}
+			}
+			return overlap;
+		}
+
+		void VisitBinaryNode (const BvhNode* nodes, UINT nodeIndex, UINT depth, StatisticsState* state) {
+			const BvhNode& node = nodes[nodeIndex];
+			if (node.IsLeaf ()) {
+				AddLeaf (state, node.PrimitiveCount, depth);
+				return;
+			}
+
+			const Aabb childBounds[2] = {nodes[nodeIndex + 1].Bounds, nodes[node.Offset].Bounds};
+			state->Overlap += GetOverlap (childBounds, 2);
+			VisitBinaryNode (nodes, nodeIndex + 1, depth + 1, state);
+			VisitBinaryNode (nodes, node.Offset, depth + 1, state);
+		}
+
+		// WideBvhNode and QuantizedBvhNode alike.
+		template <typename Node>
+		void VisitWideNode (const Node* nodes, UINT nodeIndex, UINT depth, StatisticsState* state) {
+			const Node& node = nodes[nodeIndex];
+			Aabb childBounds[Node::c_Width];
+			for (UINT slot = 0; slot < node.ChildCount; slot++) {
+				childBounds[slot] = node.GetChildBounds (slot);
+			}
+			state->Overlap += GetOverlap (childBounds, node.ChildCount);
+
+			for (UINT slot = 0; slot < node.ChildCount; slot++) {
+				const UINT primitiveCount = node.GetPrimitiveCount (slot);
+				if (primitiveCount != 0) {
+					AddLeaf (state, primitiveCount, depth);
+				} else {
+					VisitWideNode (nodes, node.GetChild (slot), depth + 1, state);
+				}
+			}
+		}
+
+		// Every node is fetched once on its way to the leaves below it, so the cost sums over the node array in any
+		// order: the area of each node plus, for its leaves, their area times their primitive count.
+		double GetBinarySahCost (const BvhNode* nodes, UINT nodeCount) {
+			double cost = 0.0;
+			for (UINT i = 0; i < nodeCount; i++) {
+				cost += double (nodes[i].Bounds.HalfArea ()) * std::max<UINT> (nodes[i].PrimitiveCount, 1);
+			}
+			return cost;
+		}
+
+		template <typename Node>
+		double GetWideSahCost (const Node* nodes, UINT nodeCount) {
+			double cost = 0.0;
+			for (UINT i = 0; i < nodeCount; i++) {
+				const Node& node = nodes[i];
+				cost += node.GetBounds ().HalfArea ();
+				for (UINT slot = 0; slot < node.ChildCount; slot++) {
+					const UINT primitiveCount = node.GetPrimitiveCount (slot);
+					if (primitiveCount != 0) {
+						cost += double (node.GetChildBounds (slot).HalfArea ()) * primitiveCount;
+					}
+				}
+			}
+			return cost;
+		}
+
+		// Appends "Name": value members, separated and indented for a one-member-per-line object.
+		class JsonWriter {
+		public:
+			explicit JsonWriter (std::string* text) : m_Text (text), m_First (true) {
+				m_Text->append ("{");
+			}
+
+			void Write (const char* name, UINT64 value) {
+				WriteName (name);
+				m_Text->append (std::to_string (value));
+			}
+
+			void Write (const char* name, double value) {
+				WriteName (name);
+				if (!std::isfinite (value)) {
+					m_Text->append ("null");
+					return;
+				}
+				char buffer[32];
+				snprintf (buffer, sizeof (buffer), "%.9g", value);
+				m_Text->append (buffer);
+			}
+
+			void Write (const char* name, const char* value) {
+				WriteName (name);
+				m_Text->append ("\"").append (value).append ("\"");
+			}
+
+			void Write (const char* name, const std::vector<UINT>& values) {
+				WriteName (name);
+				m_Text->append ("[");
+				for (size_t i = 0; i < values.size (); i++) {
+					m_Text->append (i > 0 ? ", " : "").append (std::to_string (values[i]));
+				}
+				m_Text->append ("]");
+			}
+
+			void Close () {
+				m_Text->append ("\n}\n");
+			}
+
+		private:
+			void WriteName (const char* name) {
+				m_Text->append (m_First ? "\n\t\"" : ",\n\t\"").append (name).append ("\": ");
+				m_First = false;
+			}
+
+			std::string* m_Text;
+			bool m_First;
+		};
+
+	}
+
+	AccelerationStructureStatistics GetAccelerationStructureStatistics (const AccelerationStructureHeader* header) {
+		ThrowIfFalse (header != nullptr && header->IsValid (), "CpuRaytracing: not an acceleration structure.");
+
+		const bool topLevel = header->Type == D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL;
+		AccelerationStructureStatistics statistics = {};
+		statistics.Type = header->Type;
+		statistics.BuildFlags = header->BuildFlags;
+		statistics.NodeWidth = header->NodeWidth;
+		statistics.NodeFormat = header->NodeFormat;
+		statistics.NodeCount = header->NodeCount;
+		statistics.PrimitiveCount = header->PrimitiveCount;
+		statistics.MaxDepth = header->MaxDepth;
+		statistics.BuildSahCost = header->SahCost;
+		statistics.UnoptimizedBuildSahCost = header->UnoptimizedSahCost;
+		statistics.NodeBytes = UINT64 (header->NodeCount) * GetNodeSize (header->NodeWidth, header->NodeFormat);
+		statistics.LeafBytes = topLevel ? UINT64 (header->PrimitiveCount) * sizeof (InstanceRecord) : GetLeafSectionSize (header->GeometryType, header->PrimitiveCount);
+		statistics.PrimitiveBytes = UINT64 (header->PrimitiveCount) * sizeof (PrimitiveRecord);
+		statistics.SizeInBytes = header->SizeInBytes;
+		statistics.CompactedSizeInBytes = GetCompactedSize (header);
+		if (header->NodeCount == 0) {
+			return statistics;
+		}
+
+		StatisticsState state = {&statistics, 0.0, 0.0};
+		if (header->NodeFormat == c_NodeFormatQuantized) {
+			if (header->NodeWidth == 4) {
+				VisitWideNode (header->GetQuantizedNodes<4> (), 0, 1, &state);
+			} else {
+				VisitWideNode (header->GetQuantizedNodes<8> (), 0, 1, &state);
+			}
+		} else if (header->NodeWidth == 4) {
+			VisitWideNode (header->GetWideNodes<4> (), 0, 1, &state);
+		} else if (header->NodeWidth == 8) {
+			VisitWideNode (header->GetWideNodes<8> (), 0, 1, &state);
+		} else {
+			VisitBinaryNode (header->GetNodes (), 0, 1, &state);
+		}
+
+		const double rootArea = header->Bounds.HalfArea ();
+		statistics.SahCost = GetSahCost (header);
+		statistics.SiblingOverlap = rootArea > 0.0 ? static_cast<float> (state.Overlap / rootArea) : 0.0f;
+		statistics.MeanLeafDepth = statistics.LeafCount > 0 ? state.DepthSum / statistics.LeafCount : 0.0;
+		statistics.MeanLeafSize = statistics.LeafCount > 0 ? double (statistics.PrimitiveCount) / statistics.LeafCount : 0.0;
+		return statistics;
+	}
+
+	float GetSahCost (const AccelerationStructureHeader* header) {
+		ThrowIfFalse (header != nullptr && header->IsValid (), "CpuRaytracing: not an acceleration structure.");
+
+		const double rootArea = header->Bounds.HalfArea ();
+		if (header->NodeCount == 0 || !(rootArea > 0.0)) {
+			return 0.0f;
+		}
+
+		double cost;
+		if (header->NodeFormat == c_NodeFormatQuantized) {
+			cost = header->NodeWidth == 4 ? GetWideSahCost (header->GetQuantizedNodes<4> (), header->NodeCount) : GetWideSahCost (header->GetQuantizedNodes<8> (), header->NodeCount);
+		} else if (header->NodeWidth == 4) {
+			cost = GetWideSahCost (header->GetWideNodes<4> (), header->NodeCount);
+		} else if (header->NodeWidth == 8) {
+			cost = GetWideSahCost (header->GetWideNodes<8> (), header->NodeCount);
+		} else {
+			cost = GetBinarySahCost (header->GetNodes (), header->NodeCount);
+		}
+		return static_cast<float> (cost / rootArea);
+	}
+
+	std::string FormatQualityReport (const AccelerationStructureStatistics& statistics) {
+		std::string text;
+		JsonWriter writer (&text);
+		writer.Write ("Type", statistics.Type == D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL ? "TOP_LEVEL" : "BOTTOM_LEVEL");
+		writer.Write ("BuildFlags", UINT64 (statistics.BuildFlags));
+		writer.Write ("NodeWidth", UINT64 (statistics.NodeWidth));
+		writer.Write ("NodeFormat", statistics.NodeFormat == c_NodeFormatQuantized ? "QUANTIZED" : "FLOAT");
+		writer.Write ("NodeCount", UINT64 (statistics.NodeCount));
+		writer.Write ("LeafCount", UINT64 (statistics.LeafCount));
+		writer.Write ("PrimitiveCount", UINT64 (statistics.PrimitiveCount));
+		writer.Write ("MaxDepth", UINT64 (statistics.MaxDepth));
+		writer.Write ("MeanLeafDepth", statistics.MeanLeafDepth);
+		writer.Write ("MeanLeafSize", statistics.MeanLeafSize);
+		writer.Write ("LeafSizeHistogram", statistics.LeafSizeHistogram);
+		writer.Write ("LeafDepthHistogram", statistics.LeafDepthHistogram);
+		writer.Write ("SahCost", double (statistics.SahCost));
+		writer.Write ("BuildSahCost", double (statistics.BuildSahCost));
+		writer.Write ("UnoptimizedBuildSahCost", double (statistics.UnoptimizedBuildSahCost));
+		writer.Write ("SiblingOverlap", double (statistics.SiblingOverlap));
+		writer.Write ("NodeBytes", statistics.NodeBytes);
+		writer.Write ("LeafBytes", statistics.LeafBytes);
+		writer.Write ("PrimitiveBytes", statistics.PrimitiveBytes);
+		writer.Write ("SizeInBytes", statistics.SizeInBytes);
+		writer.Write ("CompactedSizeInBytes", statistics.CompactedSizeInBytes);
+		writer.Close ();
+		return text;
+	}
+
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "AccelerationStructure.h"
+
+#include <string>
+#include <vector>
+
+namespace CpuRaytracing {
+
+	// Structural statistics of a finished acceleration structure. Everything except the build-time SAH costs is
+	// computed from the stored nodes, so the statistics describe the structure as traversal sees it, whether it
+	// was built here, cloned, compacted or deserialized.
+	//
+	// Depths count the nodes fetched on the way to a leaf, the root being 1, which matches MaxDepth: a binary
+	// leaf is a node of its own, while the leaves of a wide node are slots of it. SAH costs use unit traversal
+	// and intersection costs and are relative to the surface area of the root.
+	struct AccelerationStructureStatistics {
+		UINT Type;                      // D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE
+		UINT BuildFlags;
+		UINT NodeWidth;
+		UINT NodeFormat;
+
+		UINT NodeCount;
+		UINT LeafCount;
+		UINT PrimitiveCount;            // Leaf references, including spatial-split duplicates.
+		UINT MaxDepth;
+		double MeanLeafDepth;
+		double MeanLeafSize;
+		std::vector<UINT> LeafSizeHistogram;    // Leaves by primitive count.
+		std::vector<UINT> LeafDepthHistogram;   // Leaves by depth.
+
+		float SahCost;                  // Of the stored nodes, after collapsing and quantization.
+		float BuildSahCost;             // AccelerationStructureHeader::SahCost, of the binary hierarchy.
+		float UnoptimizedBuildSahCost;  // AccelerationStructureHeader::UnoptimizedSahCost.
+		float SiblingOverlap;           // Summed surface area of the pairwise overlaps of the children of every node.
+
+		UINT64 NodeBytes;
+		UINT64 LeafBytes;               // Triangle blocks, procedural-primitive or instance records.
+		UINT64 PrimitiveBytes;
+		UINT64 SizeInBytes;
+		UINT64 CompactedSizeInBytes;
+	};
+
+	AccelerationStructureStatistics GetAccelerationStructureStatistics (const AccelerationStructureHeader* header);
+
+	// AccelerationStructureStatistics::SahCost alone, in one linear pass over the nodes, cheap enough to track
+	// how refits degrade a structure.
+	float GetSahCost (const AccelerationStructureHeader* header);
+
+	// A JSON object with one member per statistic, in a fixed order with one member per line, so that reports of
+	// two builds can be diffed line by line.
+	std::string FormatQualityReport (const AccelerationStructureStatistics& statistics);
+
+	inline std::string GetQualityReport (D3D12_GPU_VIRTUAL_ADDRESS accelerationStructure) {
+		return FormatQualityReport (GetAccelerationStructureStatistics (GetAccelerationStructure (accelerationStructure)));
+	}
+
+}
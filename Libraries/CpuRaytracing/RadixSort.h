@@ -0,0 +1,82 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include "RaytracingCompat.h"
+#include "ThreadPool.h"
+
+namespace CpuRaytracing {
+
+	// Stable parallel LSD radix sort of (key, value) pairs, eight bits per pass. Only the low keyBits bits
+	// of each key are considered. The sorted result ends up in keys/values; the temporary arrays must be
+	// as large as the input and are clobbered.
+	template <typename Key>
+	void RadixSort (ThreadPool& threadPool, Key* keys, UINT* values, Key* tempKeys, UINT* tempValues, UINT count, UINT keyBits) {
+		static const UINT c_RadixBits = 8;
+		static const UINT c_RadixSize = 1 << c_RadixBits;
+		static const UINT c_MinChunkSize = 16384;
+
+		if (count <= 1) {
+			return;
+		}
+
+		const UINT chunkCount = std::max (1u, std::min (threadPool.GetThreadCount () * 2, count / c_MinChunkSize));
+		const UINT chunkSize = (count + chunkCount - 1) / chunkCount;
+		std::vector<UINT> offsets (chunkCount * c_RadixSize);
+
+		Key* srcKeys = keys;
+		UINT* srcValues = values;
+		Key* dstKeys = tempKeys;
+		UINT* dstValues = tempValues;
+
+		const UINT passCount = (keyBits + c_RadixBits - 1) / c_RadixBits;
+		for (UINT pass = 0; pass < passCount; pass++) {
+			const UINT shift = pass * c_RadixBits;
+
+			threadPool.ParallelFor (0, chunkCount, 1, [&] (UINT firstChunk, UINT lastChunk) {
+				for (UINT chunk = firstChunk; chunk < lastChunk; chunk++) {
+					UINT* histogram = &offsets[chunk * c_RadixSize];
+					std::fill (histogram, histogram + c_RadixSize, 0u);
+					UINT end = std::min (count, (chunk + 1) * chunkSize);
+					for (UINT i = chunk * chunkSize; i < end; i++) {
+						histogram[(srcKeys[i] >> shift) & (c_RadixSize - 1)]++;
+					}
+				}
+			});
+
+			// Exclusive scan in digit-major, chunk-minor order keeps the sort stable across chunks.
+			UINT sum = 0;
+			for (UINT digit = 0; digit < c_RadixSize; digit++) {
+				for (UINT chunk = 0; chunk < chunkCount; chunk++) {
+					UINT digitCount = offsets[chunk * c_RadixSize + digit];
+					offsets[chunk * c_RadixSize + digit] = sum;
+					sum += digitCount;
+				}
+			}
+
+			threadPool.ParallelFor (0, chunkCount, 1, [&] (UINT firstChunk, UINT lastChunk) {
+				for (UINT chunk = firstChunk; chunk < lastChunk; chunk++) {
+					UINT* offset = &offsets[chunk * c_RadixSize];
+					UINT end = std::min (count, (chunk + 1) * chunkSize);
+					for (UINT i = chunk * chunkSize; i < end; i++) {
+						UINT destination = offset[(srcKeys[i] >> shift) & (c_RadixSize - 1)]++;
+						dstKeys[destination] = srcKeys[i];
+						dstValues[destination] = srcValues[i];
+					}
+				}
+			});
+
+			std::swap (srcKeys, dstKeys);
+			std::swap (srcValues, dstValues);
+		}
+
+		if (srcKeys != keys) {
+			threadPool.ParallelFor (0, count, c_MinChunkSize, [&] (UINT begin, UINT end) {
+				std::copy (srcKeys + begin, srcKeys + end, keys + begin);
+				std::copy (srcValues + begin, srcValues + end, values + begin);
+			});
+		}
+	}
+
+}
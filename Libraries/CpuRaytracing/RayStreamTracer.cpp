@@ -0,0 +1,102 @@
+#include "stdafx.h"
+#include "RayStreamTracer.h"
+#include "RadixSort.h"
+
+#include <mutex>
+
+namespace CpuRaytracing {
+
+	namespace {
+
+		static const UINT c_GrainSize = 4096;
+		static const UINT c_PacketsPerTask = 64;
+
+		static const UINT c_OriginBitsPerAxis = 9;
+		static const UINT c_KeyBits = 3 + 3 * c_OriginBitsPerAxis;
+
+		// Direction octant in the top bits, then the Morton code of the origin, x in the most significant position.
+		inline UINT GetSortKey (const RayDesc& ray, const Float3& originLower, const Float3& originScale) {
+			const float cellCount = static_cast<float> (1u << c_OriginBitsPerAxis);
+			UINT key = 0;
+			for (UINT axis = 0; axis < 3; axis++) {
+				key |= (ray.Direction[axis] < 0.0f ? 1u : 0u) << (c_KeyBits - 1 - axis);
+				const float cell = std::min (std::max ((ray.Origin[axis] - originLower[axis]) * originScale[axis] * cellCount, 0.0f), cellCount - 1.0f);
+				key |= ExpandBits (static_cast<UINT32> (cell)) << (2 - axis);
+			}
+			return key;
+		}
+
+	}
+
+	RayStreamTracer::RayStreamTracer (ThreadPool& threadPool) :
+		m_ThreadPool (threadPool) {
+	}
+
+	void RayStreamTracer::Sort (UINT rayCount, const RayDesc* pRays) {
+		Aabb originBounds = Aabb::Empty ();
+		{
+			std::mutex mutex;
+			m_ThreadPool.ParallelFor (0, rayCount, c_GrainSize, [&] (UINT begin, UINT end) {
+				Aabb bounds = Aabb::Empty ();
+				for (UINT i = begin; i < end; i++) {
+					bounds.Grow (pRays[i].Origin);
+				}
+				std::lock_guard<std::mutex> lock (mutex);
+				originBounds.Grow (bounds);
+			});
+		}
+
+		m_Keys.resize (rayCount);
+		m_Order.resize (rayCount);
+		m_TempKeys.resize (rayCount);
+		m_TempOrder.resize (rayCount);
+
+		const Float3 extent = originBounds.Extent ();
+		const Float3 scale (extent.x > 0.0f ? 1.0f / extent.x : 0.0f, extent.y > 0.0f ? 1.0f / extent.y : 0.0f, extent.z > 0.0f ? 1.0f / extent.z : 0.0f);
+		m_ThreadPool.ParallelFor (0, rayCount, c_GrainSize, [&] (UINT begin, UINT end) {
+			for (UINT i = begin; i < end; i++) {
+				m_Keys[i] = GetSortKey (pRays[i], originBounds.Lower, scale);
+				m_Order[i] = i;
+			}
+		});
+		RadixSort (m_ThreadPool, m_Keys.data (), m_Order.data (), m_TempKeys.data (), m_TempOrder.data (), rayCount, c_KeyBits);
+	}
+
+	void RayStreamTracer::Trace (const AccelerationStructureHeader* accelerationStructure, UINT rayCount, const RayDesc* pRays, const UINT* pPayloadIndices,
+		UINT rayFlags, UINT instanceInclusionMask, const HitGroupTable& hitGroups, RayStreamHit* pHits) {
+
+		ThrowIfFalse (accelerationStructure && accelerationStructure->IsValid ());
+		ThrowIfFalse (rayCount == 0 || (pRays && pHits));
+		if (rayCount == 0) {
+			return;
+		}
+
+		Sort (rayCount, pRays);
+
+		const UINT packetCount = (rayCount + c_MaxRayPacketSize - 1) / c_MaxRayPacketSize;
+		m_ThreadPool.ParallelFor (0, packetCount, c_PacketsPerTask, [&] (UINT firstPacket, UINT lastPacket) {
+			RayDesc rays[c_MaxRayPacketSize];
+			RayHit hits[c_MaxRayPacketSize];
+			for (UINT packet = firstPacket; packet < lastPacket; packet++) {
+				const UINT first = packet * c_MaxRayPacketSize;
+				const UINT count = std::min (rayCount - first, c_MaxRayPacketSize);
+				for (UINT lane = 0; lane < count; lane++) {
+					rays[lane] = pRays[m_Order[first + lane]];
+				}
+
+				const UINT hitMask = TraceRayPacketClosestHit (accelerationStructure, count, rays, rayFlags, instanceInclusionMask, hitGroups, hits);
+				for (UINT lane = 0; lane < count; lane++) {
+					const UINT rayIndex = m_Order[first + lane];
+					RayStreamHit& streamHit = pHits[first + lane];
+					streamHit.PayloadIndex = pPayloadIndices ? pPayloadIndices[rayIndex] : rayIndex;
+					streamHit.RayIndex = rayIndex;
+					streamHit.Found = ((hitMask >> lane) & 1) != 0;
+					if (streamHit.Found) {
+						streamHit.Hit = hits[lane];
+					}
+				}
+			}
+		});
+	}
+
+}
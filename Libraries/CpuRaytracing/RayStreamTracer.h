@@ -0,0 +1,49 @@
+#pragma once
+
+#include "ThreadPool.h"
+#include "Traversal.h"
+
+#include <vector>
+
+namespace CpuRaytracing {
+
+	// The result of one ray of a stream.
+	struct RayStreamHit {
+		UINT PayloadIndex;          // As passed with the ray.
+		UINT RayIndex;              // Of the ray in the batch.
+		bool Found;
+		RayHit Hit;                 // Written only when Found.
+	};
+
+	// Traces large batches of incoherent rays, such as secondary and shadow rays, which rarely share nodes with the
+	// rays next to them in the order they were generated. Each batch is sorted by direction octant, then by the
+	// Morton code of the ray origin in a 512^3 grid over the origins of the batch, and traced in that order as
+	// packets of consecutive rays (TraceRayPacketClosestHit ()), so rays that are traced together mostly start in
+	// the same place heading the same way, and visit the same nodes.
+	//
+	// The hits come back in the sorted order, each with the payload index and batch index of its ray, so shading
+	// them visits the payloads with the same coherence. The sorting buffers are kept from batch to batch.
+	class RayStreamTracer {
+	public:
+		// Sorting and tracing run on threadPool; hit-group shaders must then be safe to call concurrently.
+		explicit RayStreamTracer (ThreadPool& threadPool);
+
+		RayStreamTracer (const RayStreamTracer&) = delete;
+		RayStreamTracer& operator= (const RayStreamTracer&) = delete;
+
+		// Traces rayCount rays with the semantics of TraceRayClosestHit (), and writes one hit per ray to pHits.
+		// pPayloadIndices may be null, in which case every ray carries its batch index.
+		void Trace (const AccelerationStructureHeader* accelerationStructure, UINT rayCount, const RayDesc* pRays, const UINT* pPayloadIndices,
+			UINT rayFlags, UINT instanceInclusionMask, const HitGroupTable& hitGroups, RayStreamHit* pHits);
+
+	private:
+		void Sort (UINT rayCount, const RayDesc* pRays);
+
+		ThreadPool& m_ThreadPool;
+		std::vector<UINT> m_Keys;
+		std::vector<UINT> m_Order;              // Batch indices of the rays in the sorted order.
+		std::vector<UINT> m_TempKeys;
+		std::vector<UINT> m_TempOrder;
+	};
+
+}
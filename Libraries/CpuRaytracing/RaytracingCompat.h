@@ -0,0 +1,277 @@
+#pragma once
+
+// On Windows the real d3d12.h declarations are used. Everywhere else the subset of d3d12.h the
+// acceleration structure builder consumes is declared here with identical names, values and layouts,
+// so descriptors filled in the style of BuildAccelerationStructures() can be handed over unchanged.
+//
+// D3D12_GPU_VIRTUAL_ADDRESS fields are interpreted as CPU addresses (see GetCpuVirtualAddress ()).
+
+#include <cstdint>
+
+#ifdef _WIN32
+#include <d3d12.h>
+#else
+
+typedef uint8_t BYTE;
+typedef uint8_t UINT8;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef uint32_t UINT;
+typedef uint64_t UINT64;
+typedef float FLOAT;
+
+typedef UINT64 D3D12_GPU_VIRTUAL_ADDRESS;
+
+#ifndef GUID_DEFINED
+#define GUID_DEFINED
+struct GUID {
+	UINT32 Data1;
+	UINT16 Data2;
+	UINT16 Data3;
+	UINT8 Data4[8];
+};
+#endif
+
+#ifndef DEFINE_ENUM_FLAG_OPERATORS
+#define DEFINE_ENUM_FLAG_OPERATORS(ENUMTYPE) \
+inline ENUMTYPE operator | (ENUMTYPE a, ENUMTYPE b) { return ENUMTYPE (static_cast<UINT> (a) | static_cast<UINT> (b)); } \
+inline ENUMTYPE& operator |= (ENUMTYPE& a, ENUMTYPE b) { return a = a | b; } \
+inline ENUMTYPE operator & (ENUMTYPE a, ENUMTYPE b) { return ENUMTYPE (static_cast<UINT> (a) & static_cast<UINT> (b)); } \
+inline ENUMTYPE& operator &= (ENUMTYPE& a, ENUMTYPE b) { return a = a & b; } \
+inline ENUMTYPE operator ~ (ENUMTYPE a) { return ENUMTYPE (~static_cast<UINT> (a)); }
+#endif
+
+enum DXGI_FORMAT {
+	DXGI_FORMAT_UNKNOWN = 0,
+	DXGI_FORMAT_R32G32B32_FLOAT = 6,
+	DXGI_FORMAT_R16G16B16A16_FLOAT = 10,
+	DXGI_FORMAT_R16G16B16A16_SNORM = 13,
+	DXGI_FORMAT_R32G32_FLOAT = 16,
+	DXGI_FORMAT_R16G16_FLOAT = 34,
+	DXGI_FORMAT_R16G16_SNORM = 37,
+	DXGI_FORMAT_R32_UINT = 42,
+	DXGI_FORMAT_R16_UINT = 57
+};
+
+#define D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BYTE_ALIGNMENT (256)
+#define D3D12_RAYTRACING_INSTANCE_DESCS_BYTE_ALIGNMENT (16)
+#define D3D12_RAYTRACING_TRANSFORM3X4_BYTE_ALIGNMENT (16)
+
+enum D3D12_RAYTRACING_GEOMETRY_FLAGS {
+	D3D12_RAYTRACING_GEOMETRY_FLAG_NONE = 0,
+	D3D12_RAYTRACING_GEOMETRY_FLAG_OPAQUE = 0x1,
+	D3D12_RAYTRACING_GEOMETRY_FLAG_NO_DUPLICATE_ANYHIT_INVOCATION = 0x2
+};
+DEFINE_ENUM_FLAG_OPERATORS (D3D12_RAYTRACING_GEOMETRY_FLAGS)
+
+enum D3D12_RAYTRACING_GEOMETRY_TYPE {
+	D3D12_RAYTRACING_GEOMETRY_TYPE_TRIANGLES = 0,
+	D3D12_RAYTRACING_GEOMETRY_TYPE_PROCEDURAL_PRIMITIVE_AABBS = 1
+};
+
+enum D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS {
+	D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_NONE = 0,
+	D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_UPDATE = 0x1,
+	D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_COMPACTION = 0x2,
+	D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_TRACE = 0x4,
+	D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_BUILD = 0x8,
+	D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_MINIMIZE_MEMORY = 0x10,
+	D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PERFORM_UPDATE = 0x20
+};
+DEFINE_ENUM_FLAG_OPERATORS (D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS)
+
+enum D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE {
+	D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL = 0,
+	D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL = 0x1
+};
+
+enum D3D12_ELEMENTS_LAYOUT {
+	D3D12_ELEMENTS_LAYOUT_ARRAY = 0,
+	D3D12_ELEMENTS_LAYOUT_ARRAY_OF_POINTERS = 0x1
+};
+
+struct D3D12_GPU_VIRTUAL_ADDRESS_AND_STRIDE {
+	D3D12_GPU_VIRTUAL_ADDRESS StartAddress;
+	UINT64 StrideInBytes;
+};
+
+struct D3D12_RAYTRACING_GEOMETRY_TRIANGLES_DESC {
+	D3D12_GPU_VIRTUAL_ADDRESS Transform3x4;
+	DXGI_FORMAT IndexFormat;
+	DXGI_FORMAT VertexFormat;
+	UINT IndexCount;
+	UINT VertexCount;
+	D3D12_GPU_VIRTUAL_ADDRESS IndexBuffer;
+	D3D12_GPU_VIRTUAL_ADDRESS_AND_STRIDE VertexBuffer;
+};
+
+struct D3D12_RAYTRACING_AABB {
+	FLOAT MinX;
+	FLOAT MinY;
+	FLOAT MinZ;
+	FLOAT MaxX;
+	FLOAT MaxY;
+	FLOAT MaxZ;
+};
+
+struct D3D12_RAYTRACING_GEOMETRY_AABBS_DESC {
+	UINT64 AABBCount;
+	D3D12_GPU_VIRTUAL_ADDRESS_AND_STRIDE AABBs;
+};
+
+struct D3D12_RAYTRACING_GEOMETRY_DESC {
+	D3D12_RAYTRACING_GEOMETRY_TYPE Type;
+	D3D12_RAYTRACING_GEOMETRY_FLAGS Flags;
+	union {
+		D3D12_RAYTRACING_GEOMETRY_TRIANGLES_DESC Triangles;
+		D3D12_RAYTRACING_GEOMETRY_AABBS_DESC AABBs;
+	};
+};
+
+#define D3D12_RAYTRACING_AABB_BYTE_ALIGNMENT (8)
+#define D3D12_RAYTRACING_MAX_ATTRIBUTE_SIZE_IN_BYTES (32)
+
+enum D3D12_HIT_GROUP_TYPE {
+	D3D12_HIT_GROUP_TYPE_TRIANGLES = 0,
+	D3D12_HIT_GROUP_TYPE_PROCEDURAL_PRIMITIVE = 0x1
+};
+
+enum D3D12_RAYTRACING_INSTANCE_FLAGS {
+	D3D12_RAYTRACING_INSTANCE_FLAG_NONE = 0,
+	D3D12_RAYTRACING_INSTANCE_FLAG_TRIANGLE_CULL_DISABLE = 0x1,
+	D3D12_RAYTRACING_INSTANCE_FLAG_TRIANGLE_FRONT_COUNTERCLOCKWISE = 0x2,
+	D3D12_RAYTRACING_INSTANCE_FLAG_FORCE_OPAQUE = 0x4,
+	D3D12_RAYTRACING_INSTANCE_FLAG_FORCE_NON_OPAQUE = 0x8
+};
+DEFINE_ENUM_FLAG_OPERATORS (D3D12_RAYTRACING_INSTANCE_FLAGS)
+
+struct D3D12_RAYTRACING_INSTANCE_DESC {
+	FLOAT Transform[3][4];
+	UINT InstanceID : 24;
+	UINT InstanceMask : 8;
+	UINT InstanceContributionToHitGroupIndex : 24;
+	UINT Flags : 8;
+	D3D12_GPU_VIRTUAL_ADDRESS AccelerationStructure;
+};
+
+struct D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS {
+	D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE Type;
+	D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS Flags;
+	UINT NumDescs;
+	D3D12_ELEMENTS_LAYOUT DescsLayout;
+	union {
+		D3D12_GPU_VIRTUAL_ADDRESS InstanceDescs;
+		const D3D12_RAYTRACING_GEOMETRY_DESC* pGeometryDescs;
+		const D3D12_RAYTRACING_GEOMETRY_DESC* const* ppGeometryDescs;
+	};
+};
+
+struct D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC {
+	D3D12_GPU_VIRTUAL_ADDRESS DestAccelerationStructureData;
+	D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS Inputs;
+	D3D12_GPU_VIRTUAL_ADDRESS SourceAccelerationStructureData;
+	D3D12_GPU_VIRTUAL_ADDRESS ScratchAccelerationStructureData;
+};
+
+struct D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO {
+	UINT64 ResultDataMaxSizeInBytes;
+	UINT64 ScratchDataSizeInBytes;
+	UINT64 UpdateScratchDataSizeInBytes;
+};
+
+#define D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_DESC_BYTE_ALIGNMENT (8)
+
+enum D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_TYPE {
+	D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_COMPACTED_SIZE = 0,
+	D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_TOOLS_VISUALIZATION = 0x1,
+	D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_SERIALIZATION = 0x2,
+	D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_CURRENT_SIZE = 0x3
+};
+
+struct D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_DESC {
+	D3D12_GPU_VIRTUAL_ADDRESS DestBuffer;
+	D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_TYPE InfoType;
+};
+
+struct D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_COMPACTED_SIZE_DESC {
+	UINT64 CompactedSizeInBytes;
+};
+
+struct D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_SERIALIZATION_DESC {
+	UINT64 SerializedSizeInBytes;
+	UINT64 NumBottomLevelAccelerationStructurePointers;
+};
+
+struct D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_CURRENT_SIZE_DESC {
+	UINT64 CurrentSizeInBytes;
+};
+
+enum D3D12_RAYTRACING_ACCELERATION_STRUCTURE_COPY_MODE {
+	D3D12_RAYTRACING_ACCELERATION_STRUCTURE_COPY_MODE_CLONE = 0,
+	D3D12_RAYTRACING_ACCELERATION_STRUCTURE_COPY_MODE_COMPACT = 0x1,
+	D3D12_RAYTRACING_ACCELERATION_STRUCTURE_COPY_MODE_VISUALIZATION_DECODE_FOR_TOOLS = 0x2,
+	D3D12_RAYTRACING_ACCELERATION_STRUCTURE_COPY_MODE_SERIALIZE = 0x3,
+	D3D12_RAYTRACING_ACCELERATION_STRUCTURE_COPY_MODE_DESERIALIZE = 0x4
+};
+
+enum D3D12_SERIALIZED_DATA_TYPE {
+	D3D12_SERIALIZED_DATA_RAYTRACING_ACCELERATION_STRUCTURE = 0
+};
+
+enum D3D12_DRIVER_MATCHING_IDENTIFIER_STATUS {
+	D3D12_DRIVER_MATCHING_IDENTIFIER_COMPATIBLE_WITH_DEVICE = 0,
+	D3D12_DRIVER_MATCHING_IDENTIFIER_UNSUPPORTED_TYPE = 0x1,
+	D3D12_DRIVER_MATCHING_IDENTIFIER_UNRECOGNIZED = 0x2,
+	D3D12_DRIVER_MATCHING_IDENTIFIER_INCOMPATIBLE_VERSION = 0x3,
+	D3D12_DRIVER_MATCHING_IDENTIFIER_INCOMPATIBLE_TYPE = 0x4
+};
+
+struct D3D12_SERIALIZED_DATA_DRIVER_MATCHING_IDENTIFIER {
+	GUID DriverOpaqueGUID;
+	BYTE DriverOpaqueVersioningData[16];
+};
+
+struct D3D12_SERIALIZED_RAYTRACING_ACCELERATION_STRUCTURE_HEADER {
+	D3D12_SERIALIZED_DATA_DRIVER_MATCHING_IDENTIFIER DriverMatchingIdentifier;
+	UINT64 SerializedSizeInBytesIncludingHeader;
+	UINT64 DeserializedSizeInBytes;
+	UINT64 NumBottomLevelAccelerationStructurePointersAfterHeader;
+};
+#endif
+
+static_assert (sizeof (D3D12_RAYTRACING_INSTANCE_DESC) == 64, "D3D12_RAYTRACING_INSTANCE_DESC must match the layout of d3d12.h.");
+static_assert (sizeof (D3D12_SERIALIZED_RAYTRACING_ACCELERATION_STRUCTURE_HEADER) == 56, "D3D12_SERIALIZED_RAYTRACING_ACCELERATION_STRUCTURE_HEADER must match the layout of d3d12.h.");
+
+namespace CpuRaytracing {
+
+	// The portable layer addresses buffers directly, so "GPU" virtual addresses are plain CPU pointers.
+	inline D3D12_GPU_VIRTUAL_ADDRESS GetCpuVirtualAddress (const void* pData) {
+		return static_cast<D3D12_GPU_VIRTUAL_ADDRESS> (reinterpret_cast<uintptr_t> (pData));
+	}
+
+	template <typename T>
+	inline T* GetCpuPointer (D3D12_GPU_VIRTUAL_ADDRESS address) {
+		return reinterpret_cast<T*> (static_cast<uintptr_t> (address));
+	}
+
+	// Build flags in bits D3D12 leaves unused. They select options of the portable builder and may be combined
+	// with the D3D12 flags in D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS::Flags.
+	static const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS c_BuildFlagBvh4 = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS (0x10000);   // Collapse to 4-wide nodes.
+	static const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS c_BuildFlagBvh8 = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS (0x20000);   // Collapse to 8-wide nodes.
+	static const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS c_BuildFlagQuantizedNodes = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS (0x40000);   // 8-bit child boxes; needs Bvh4 or Bvh8.
+	static const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS c_BuildFlagOptimizeHierarchy = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS (0x80000);   // Treelet restructuring and reinsertion; needs PREFER_FAST_TRACE.
+
+	// Spatial splits (SBVH) for bottom-level builds with PREFER_FAST_TRACE: triangles straddling a split plane are
+	// clipped and referenced from both sides. The 4-bit field at c_SpatialSplitBudgetShift caps the extra
+	// references at that many eighths of the primitive count; zero disables spatial splits.
+	static const UINT c_SpatialSplitBudgetShift = 20;
+	static const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS c_SpatialSplitBudgetMask = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS (0xFu << c_SpatialSplitBudgetShift);
+	static const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS c_BuildFlagSpatialSplits = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS (2u << c_SpatialSplitBudgetShift);   // A quarter more references.
+
+	// Spatial-split flags for a budget of extra references relative to the primitive count, rounded to eighths (up to 15/8).
+	inline D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS GetSpatialSplitBuildFlags (float budget) {
+		const float eighths = budget > 0.0f ? budget * 8.0f + 0.5f : 0.0f;
+		return D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS ((eighths < 15.0f ? static_cast<UINT> (eighths) : 15u) << c_SpatialSplitBudgetShift);
+	}
+
+}
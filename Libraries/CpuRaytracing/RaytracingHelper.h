@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stdexcept>
+
+#include "RaytracingCompat.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace CpuRaytracing {
+
+	inline void ThrowIfFalse (bool value, const char* msg = "CpuRaytracing: invalid argument") {
+		if (!value) {
+			throw std::invalid_argument (msg);
+		}
+	}
+
+	inline UINT64 Align (UINT64 size, UINT64 alignment) {
+		return (size + (alignment - 1)) & ~(alignment - 1);
+	}
+
+	inline UINT CountLeadingZeros (UINT32 value) {
+#ifdef _MSC_VER
+		unsigned long index;
+		return _BitScanReverse (&index, value) ? 31 - index : 32;
+#else
+		return value ? __builtin_clz (value) : 32;
+#endif
+	}
+
+	inline UINT CountLeadingZeros (UINT64 value) {
+#ifdef _MSC_VER
+		unsigned long index;
+		return _BitScanReverse64 (&index, value) ? 63 - index : 64;
+#else
+		return value ? __builtin_clzll (value) : 64;
+#endif
+	}
+
+	// value must be nonzero.
+	inline UINT CountTrailingZeros (UINT32 value) {
+#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanForward (&index, value);
+		return index;
+#else
+		return __builtin_ctz (value);
+#endif
+	}
+
+	inline UINT CountBits (UINT32 value) {
+#ifdef _MSC_VER
+		UINT count = 0;
+		for (; value != 0; value &= value - 1) {
+			count++;
+		}
+		return count;
+#else
+		return __builtin_popcount (value);
+#endif
+	}
+
+	// Spreads the low 10 bits of v so that there are two zero bits between each of them.
+	inline UINT32 ExpandBits (UINT32 v) {
+		v = (v * 0x00010001u) & 0xFF0000FFu;
+		v = (v * 0x00000101u) & 0x0F00F00Fu;
+		v = (v * 0x00000011u) & 0xC30C30C3u;
+		v = (v * 0x00000005u) & 0x49249249u;
+		return v;
+	}
+
+	// Spreads the low 21 bits of v so that there are two zero bits between each of them.
+	inline UINT64 ExpandBits (UINT64 v) {
+		v &= 0x1fffff;
+		v = (v | v << 32) & 0x1f00000000ffffull;
+		v = (v | v << 16) & 0x1f0000ff0000ffull;
+		v = (v | v << 8) & 0x100f00f00f00f00full;
+		v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+		v = (v | v << 2) & 0x1249249249249249ull;
+		return v;
+	}
+
+	template <typename T>
+	inline T* OffsetPointer (void* base, UINT64 offsetInBytes) {
+		return reinterpret_cast<T*> (static_cast<uint8_t*> (base) + offsetInBytes);
+	}
+
+	template <typename T>
+	inline const T* OffsetPointer (const void* base, UINT64 offsetInBytes) {
+		return reinterpret_cast<const T*> (static_cast<const uint8_t*> (base) + offsetInBytes);
+	}
+
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "RaytracingCompat.h"
+
+namespace CpuRaytracing {
+
+	struct Float3 {
+		float x;
+		float y;
+		float z;
+
+		Float3 () = default;
+		constexpr Float3 (float _x, float _y, float _z) : x (_x), y (_y), z (_z) {}
+		explicit constexpr Float3 (float s) : x (s), y (s), z (s) {}
+
+		float operator[] (UINT axis) const { return (&x)[axis]; }
+		float& operator[] (UINT axis) { return (&x)[axis]; }
+
+		Float3 operator+ (const Float3& v) const { return Float3 (x + v.x, y + v.y, z + v.z); }
+		Float3 operator- (const Float3& v) const { return Float3 (x - v.x, y - v.y, z - v.z); }
+		Float3 operator* (const Float3& v) const { return Float3 (x * v.x, y * v.y, z * v.z); }
+		Float3 operator* (float s) const { return Float3 (x * s, y * s, z * s); }
+		Float3 operator- () const { return Float3 (-x, -y, -z); }
+		Float3& operator+= (const Float3& v) { x += v.x; y += v.y; z += v.z; return *this; }
+	};
+
+	inline Float3 Min (const Float3& a, const Float3& b) { return Float3 (std::min (a.x, b.x), std::min (a.y, b.y), std::min (a.z, b.z)); }
+	inline Float3 Max (const Float3& a, const Float3& b) { return Float3 (std::max (a.x, b.x), std::max (a.y, b.y), std::max (a.z, b.z)); }
+	inline float Dot (const Float3& a, const Float3& b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+	inline Float3 Cross (const Float3& a, const Float3& b) { return Float3 (a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x); }
+
+	// Axis-aligned bounding box. An empty box has Lower > Upper so that growing it by any point yields that point.
+	struct Aabb {
+		Float3 Lower;
+		Float3 Upper;
+
+		static Aabb Empty () {
+			const float inf = std::numeric_limits<float>::infinity ();
+			return Aabb {Float3 (inf), Float3 (-inf)};
+		}
+
+		void Grow (const Float3& p) { Lower = Min (Lower, p); Upper = Max (Upper, p); }
+		void Grow (const Aabb& b) { Lower = Min (Lower, b.Lower); Upper = Max (Upper, b.Upper); }
+
+		bool IsEmpty () const { return !(Lower.x <= Upper.x && Lower.y <= Upper.y && Lower.z <= Upper.z); }
+		Float3 Extent () const { return Upper - Lower; }
+		Float3 Center () const { return (Lower + Upper) * 0.5f; }
+
+		// Half the surface area; SAH only ever compares ratios of areas.
+		float HalfArea () const {
+			if (IsEmpty ()) {
+				return 0.0f;
+			}
+			Float3 e = Extent ();
+			return e.x * e.y + e.y * e.z + e.z * e.x;
+		}
+
+		UINT LargestAxis () const {
+			Float3 e = Extent ();
+			return (e.x >= e.y && e.x >= e.z) ? 0 : (e.y >= e.z ? 1 : 2);
+		}
+	};
+
+	inline Aabb Union (const Aabb& a, const Aabb& b) { return Aabb {Min (a.Lower, b.Lower), Max (a.Upper, b.Upper)}; }
+	inline Aabb Intersection (const Aabb& a, const Aabb& b) { return Aabb {Max (a.Lower, b.Lower), Min (a.Upper, b.Upper)}; }
+
+	// Row-major affine 3x4 transform, laid out like D3D12_RAYTRACING_INSTANCE_DESC::Transform and the
+	// Transform3x4 buffers of triangle geometry: p' = M * (p, 1).
+	struct Matrix3x4 {
+		float m[3][4];
+
+		static Matrix3x4 Identity () {
+			return Matrix3x4 {{{1.0f, 0.0f, 0.0f, 0.0f}, {0.0f, 1.0f, 0.0f, 0.0f}, {0.0f, 0.0f, 1.0f, 0.0f}}};
+		}
+
+		Float3 TransformPoint (const Float3& p) const {
+			return Float3 (m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+				m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+				m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]);
+		}
+
+		Float3 TransformVector (const Float3& v) const {
+			return Float3 (m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+				m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+				m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z);
+		}
+
+		// Bounds of the transformed box, from the transformed center and the absolute linear part (Arvo).
+		Aabb TransformAabb (const Aabb& b) const {
+			if (b.IsEmpty ()) {
+				return b;
+			}
+			Float3 center = TransformPoint (b.Center ());
+			Float3 halfExtent = b.Extent () * 0.5f;
+			Float3 radius;
+			for (UINT row = 0; row < 3; row++) {
+				radius[row] = std::fabs (m[row][0]) * halfExtent.x + std::fabs (m[row][1]) * halfExtent.y + std::fabs (m[row][2]) * halfExtent.z;
+			}
+			return Aabb {center - radius, center + radius};
+		}
+	};
+
+	// Returns false, leaving inverse untouched, if the linear part of m is singular.
+	inline bool Invert (const Matrix3x4& m, Matrix3x4* inverse) {
+		const Float3 c0 (m.m[0][0], m.m[1][0], m.m[2][0]);
+		const Float3 c1 (m.m[0][1], m.m[1][1], m.m[2][1]);
+		const Float3 c2 (m.m[0][2], m.m[1][2], m.m[2][2]);
+		const Float3 r0 = Cross (c1, c2);
+		const Float3 r1 = Cross (c2, c0);
+		const Float3 r2 = Cross (c0, c1);
+		const float det = Dot (c0, r0);
+		if (!(std::fabs (det) > 0.0f) || !std::isfinite (det)) {
+			return false;
+		}
+
+		const float invDet = 1.0f / det;
+		const Float3 rows[3] = {r0 * invDet, r1 * invDet, r2 * invDet};
+		const Float3 t (m.m[0][3], m.m[1][3], m.m[2][3]);
+		for (UINT row = 0; row < 3; row++) {
+			inverse->m[row][0] = rows[row].x;
+			inverse->m[row][1] = rows[row].y;
+			inverse->m[row][2] = rows[row].z;
+			inverse->m[row][3] = -Dot (rows[row], t);
+		}
+		return true;
+	}
+
+}
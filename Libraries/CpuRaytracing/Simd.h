@@ -0,0 +1,193 @@
+#pragma once
+
+// Minimal fixed-width float vectors for the traversal kernels. SimdFloat<4> maps to SSE or NEON, SimdFloat<8> to
+// AVX and SimdFloat<16> to AVX-512 where the compiler targets them; otherwise they fall back to narrower vectors
+// or plain arrays with the same interface, so kernels are written once per width.
+
+#include "RaytracingCompat.h"
+
+#if defined(__AVX__)
+#define CPU_RAYTRACING_AVX 1
+#endif
+
+#if defined(__AVX512F__)
+#define CPU_RAYTRACING_AVX512 1
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CPU_RAYTRACING_SSE 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && (defined(__aarch64__) || defined(_M_ARM64))
+#define CPU_RAYTRACING_NEON 1
+#include <arm_neon.h>
+#endif
+
+#include <algorithm>
+#include <cstring>
+
+namespace CpuRaytracing {
+
+	template <UINT Width>
+	struct SimdFloat;
+
+	template <>
+	struct SimdFloat<4> {
+#if defined(CPU_RAYTRACING_SSE)
+		__m128 v;
+
+		static SimdFloat Load (const float* p) { return {_mm_loadu_ps (p)}; }
+		static SimdFloat Broadcast (float s) { return {_mm_set1_ps (s)}; }
+
+		// Converts four unsigned bytes.
+		static SimdFloat LoadUint8 (const UINT8* p) {
+			int bytes;
+			memcpy (&bytes, p, sizeof (bytes));
+			const __m128i zero = _mm_setzero_si128 ();
+			return {_mm_cvtepi32_ps (_mm_unpacklo_epi16 (_mm_unpacklo_epi8 (_mm_cvtsi32_si128 (bytes), zero), zero))};
+		}
+		void Store (float* p) const { _mm_storeu_ps (p, v); }
+
+		friend SimdFloat operator+ (SimdFloat a, SimdFloat b) { return {_mm_add_ps (a.v, b.v)}; }
+		friend SimdFloat operator- (SimdFloat a, SimdFloat b) { return {_mm_sub_ps (a.v, b.v)}; }
+		friend SimdFloat operator* (SimdFloat a, SimdFloat b) { return {_mm_mul_ps (a.v, b.v)}; }
+		friend SimdFloat operator/ (SimdFloat a, SimdFloat b) { return {_mm_div_ps (a.v, b.v)}; }
+		friend SimdFloat Min (SimdFloat a, SimdFloat b) { return {_mm_min_ps (a.v, b.v)}; }
+		friend SimdFloat Max (SimdFloat a, SimdFloat b) { return {_mm_max_ps (a.v, b.v)}; }
+
+		// Bit i is set where a[i] <= b[i]; false for NaN lanes.
+		friend UINT LessEqualMask (SimdFloat a, SimdFloat b) { return static_cast<UINT> (_mm_movemask_ps (_mm_cmple_ps (a.v, b.v))); }
+#elif defined(CPU_RAYTRACING_NEON)
+		float32x4_t v;
+
+		static SimdFloat Load (const float* p) { return {vld1q_f32 (p)}; }
+		static SimdFloat Broadcast (float s) { return {vdupq_n_f32 (s)}; }
+
+		static SimdFloat LoadUint8 (const UINT8* p) {
+			uint32_t bytes;
+			memcpy (&bytes, p, sizeof (bytes));
+			return {vcvtq_f32_u32 (vmovl_u16 (vget_low_u16 (vmovl_u8 (vreinterpret_u8_u32 (vdup_n_u32 (bytes))))))};
+		}
+		void Store (float* p) const { vst1q_f32 (p, v); }
+
+		friend SimdFloat operator+ (SimdFloat a, SimdFloat b) { return {vaddq_f32 (a.v, b.v)}; }
+		friend SimdFloat operator- (SimdFloat a, SimdFloat b) { return {vsubq_f32 (a.v, b.v)}; }
+		friend SimdFloat operator* (SimdFloat a, SimdFloat b) { return {vmulq_f32 (a.v, b.v)}; }
+		friend SimdFloat operator/ (SimdFloat a, SimdFloat b) { return {vdivq_f32 (a.v, b.v)}; }
+		friend SimdFloat Min (SimdFloat a, SimdFloat b) { return {vminq_f32 (a.v, b.v)}; }
+		friend SimdFloat Max (SimdFloat a, SimdFloat b) { return {vmaxq_f32 (a.v, b.v)}; }
+
+		friend UINT LessEqualMask (SimdFloat a, SimdFloat b) {
+			static const uint32_t bits[4] = {1, 2, 4, 8};
+			return vaddvq_u32 (vandq_u32 (vcleq_f32 (a.v, b.v), vld1q_u32 (bits)));
+		}
+#else
+		float v[4];
+
+		static SimdFloat Load (const float* p) { SimdFloat r; std::copy (p, p + 4, r.v); return r; }
+		static SimdFloat Broadcast (float s) { return {{s, s, s, s}}; }
+		static SimdFloat LoadUint8 (const UINT8* p) { return {{float (p[0]), float (p[1]), float (p[2]), float (p[3])}}; }
+		void Store (float* p) const { std::copy (v, v + 4, p); }
+
+		friend SimdFloat operator+ (SimdFloat a, SimdFloat b) { return {{a.v[0] + b.v[0], a.v[1] + b.v[1], a.v[2] + b.v[2], a.v[3] + b.v[3]}}; }
+		friend SimdFloat operator- (SimdFloat a, SimdFloat b) { return {{a.v[0] - b.v[0], a.v[1] - b.v[1], a.v[2] - b.v[2], a.v[3] - b.v[3]}}; }
+		friend SimdFloat operator* (SimdFloat a, SimdFloat b) { return {{a.v[0] * b.v[0], a.v[1] * b.v[1], a.v[2] * b.v[2], a.v[3] * b.v[3]}}; }
+		friend SimdFloat operator/ (SimdFloat a, SimdFloat b) { return {{a.v[0] / b.v[0], a.v[1] / b.v[1], a.v[2] / b.v[2], a.v[3] / b.v[3]}}; }
+		friend SimdFloat Min (SimdFloat a, SimdFloat b) { return {{std::min (a.v[0], b.v[0]), std::min (a.v[1], b.v[1]), std::min (a.v[2], b.v[2]), std::min (a.v[3], b.v[3])}}; }
+		friend SimdFloat Max (SimdFloat a, SimdFloat b) { return {{std::max (a.v[0], b.v[0]), std::max (a.v[1], b.v[1]), std::max (a.v[2], b.v[2]), std::max (a.v[3], b.v[3])}}; }
+
+		friend UINT LessEqualMask (SimdFloat a, SimdFloat b) {
+			UINT mask = 0;
+			for (UINT i = 0; i < 4; i++) {
+				mask |= (a.v[i] <= b.v[i] ? 1u : 0u) << i;
+			}
+			return mask;
+		}
+#endif
+	};
+
+	template <>
+	struct SimdFloat<8> {
+#if defined(CPU_RAYTRACING_AVX)
+		__m256 v;
+
+		static SimdFloat Load (const float* p) { return {_mm256_loadu_ps (p)}; }
+		static SimdFloat Broadcast (float s) { return {_mm256_set1_ps (s)}; }
+
+		static SimdFloat LoadUint8 (const UINT8* p) {
+#if defined(__AVX2__)
+			return {_mm256_cvtepi32_ps (_mm256_cvtepu8_epi32 (_mm_loadl_epi64 (reinterpret_cast<const __m128i*> (p))))};
+#else
+			return {_mm256_insertf128_ps (_mm256_castps128_ps256 (SimdFloat<4>::LoadUint8 (p).v), SimdFloat<4>::LoadUint8 (p + 4).v, 1)};
+#endif
+		}
+		void Store (float* p) const { _mm256_storeu_ps (p, v); }
+
+		friend SimdFloat operator+ (SimdFloat a, SimdFloat b) { return {_mm256_add_ps (a.v, b.v)}; }
+		friend SimdFloat operator- (SimdFloat a, SimdFloat b) { return {_mm256_sub_ps (a.v, b.v)}; }
+		friend SimdFloat operator* (SimdFloat a, SimdFloat b) { return {_mm256_mul_ps (a.v, b.v)}; }
+		friend SimdFloat operator/ (SimdFloat a, SimdFloat b) { return {_mm256_div_ps (a.v, b.v)}; }
+		friend SimdFloat Min (SimdFloat a, SimdFloat b) { return {_mm256_min_ps (a.v, b.v)}; }
+		friend SimdFloat Max (SimdFloat a, SimdFloat b) { return {_mm256_max_ps (a.v, b.v)}; }
+
+		friend UINT LessEqualMask (SimdFloat a, SimdFloat b) { return static_cast<UINT> (_mm256_movemask_ps (_mm256_cmp_ps (a.v, b.v, _CMP_LE_OQ))); }
+#else
+		SimdFloat<4> lo;
+		SimdFloat<4> hi;
+
+		static SimdFloat Load (const float* p) { return {SimdFloat<4>::Load (p), SimdFloat<4>::Load (p + 4)}; }
+		static SimdFloat Broadcast (float s) { return {SimdFloat<4>::Broadcast (s), SimdFloat<4>::Broadcast (s)}; }
+		static SimdFloat LoadUint8 (const UINT8* p) { return {SimdFloat<4>::LoadUint8 (p), SimdFloat<4>::LoadUint8 (p + 4)}; }
+		void Store (float* p) const { lo.Store (p); hi.Store (p + 4); }
+
+		friend SimdFloat operator+ (SimdFloat a, SimdFloat b) { return {a.lo + b.lo, a.hi + b.hi}; }
+		friend SimdFloat operator- (SimdFloat a, SimdFloat b) { return {a.lo - b.lo, a.hi - b.hi}; }
+		friend SimdFloat operator* (SimdFloat a, SimdFloat b) { return {a.lo * b.lo, a.hi * b.hi}; }
+		friend SimdFloat operator/ (SimdFloat a, SimdFloat b) { return {a.lo / b.lo, a.hi / b.hi}; }
+		friend SimdFloat Min (SimdFloat a, SimdFloat b) { return {Min (a.lo, b.lo), Min (a.hi, b.hi)}; }
+		friend SimdFloat Max (SimdFloat a, SimdFloat b) { return {Max (a.lo, b.lo), Max (a.hi, b.hi)}; }
+
+		friend UINT LessEqualMask (SimdFloat a, SimdFloat b) { return LessEqualMask (a.lo, b.lo) | (LessEqualMask (a.hi, b.hi) << 4); }
+#endif
+	};
+
+	template <>
+	struct SimdFloat<16> {
+#if defined(CPU_RAYTRACING_AVX512)
+		__m512 v;
+
+		static SimdFloat Load (const float* p) { return {_mm512_loadu_ps (p)}; }
+		static SimdFloat Broadcast (float s) { return {_mm512_set1_ps (s)}; }
+		static SimdFloat LoadUint8 (const UINT8* p) { return {_mm512_cvtepi32_ps (_mm512_cvtepu8_epi32 (_mm_loadu_si128 (reinterpret_cast<const __m128i*> (p))))}; }
+		void Store (float* p) const { _mm512_storeu_ps (p, v); }
+
+		friend SimdFloat operator+ (SimdFloat a, SimdFloat b) { return {_mm512_add_ps (a.v, b.v)}; }
+		friend SimdFloat operator- (SimdFloat a, SimdFloat b) { return {_mm512_sub_ps (a.v, b.v)}; }
+		friend SimdFloat operator* (SimdFloat a, SimdFloat b) { return {_mm512_mul_ps (a.v, b.v)}; }
+		friend SimdFloat operator/ (SimdFloat a, SimdFloat b) { return {_mm512_div_ps (a.v, b.v)}; }
+		// GCC 12 defines _mm512_min_ps and _mm512_max_ps over an undefined pass-through, which -Wuninitialized
+		// reports; the zero-masking forms over all lanes compile to the same instructions.
+		friend SimdFloat Min (SimdFloat a, SimdFloat b) { return {_mm512_maskz_min_ps (__mmask16 (0xFFFF), a.v, b.v)}; }
+		friend SimdFloat Max (SimdFloat a, SimdFloat b) { return {_mm512_maskz_max_ps (__mmask16 (0xFFFF), a.v, b.v)}; }
+
+		friend UINT LessEqualMask (SimdFloat a, SimdFloat b) { return static_cast<UINT> (_mm512_cmp_ps_mask (a.v, b.v, _CMP_LE_OQ)); }
+#else
+		SimdFloat<8> lo;
+		SimdFloat<8> hi;
+
+		static SimdFloat Load (const float* p) { return {SimdFloat<8>::Load (p), SimdFloat<8>::Load (p + 8)}; }
+		static SimdFloat Broadcast (float s) { return {SimdFloat<8>::Broadcast (s), SimdFloat<8>::Broadcast (s)}; }
+		static SimdFloat LoadUint8 (const UINT8* p) { return {SimdFloat<8>::LoadUint8 (p), SimdFloat<8>::LoadUint8 (p + 8)}; }
+		void Store (float* p) const { lo.Store (p); hi.Store (p + 8); }
+
+		friend SimdFloat operator+ (SimdFloat a, SimdFloat b) { return {a.lo + b.lo, a.hi + b.hi}; }
+		friend SimdFloat operator- (SimdFloat a, SimdFloat b) { return {a.lo - b.lo, a.hi - b.hi}; }
+		friend SimdFloat operator* (SimdFloat a, SimdFloat b) { return {a.lo * b.lo, a.hi * b.hi}; }
+		friend SimdFloat operator/ (SimdFloat a, SimdFloat b) { return {a.lo / b.lo, a.hi / b.hi}; }
+		friend SimdFloat Min (SimdFloat a, SimdFloat b) { return {Min (a.lo, b.lo), Min (a.hi, b.hi)}; }
+		friend SimdFloat Max (SimdFloat a, SimdFloat b) { return {Max (a.lo, b.lo), Max (a.hi, b.hi)}; }
+
+		friend UINT LessEqualMask (SimdFloat a, SimdFloat b) { return LessEqualMask (a.lo, b.lo) | (LessEqualMask (a.hi, b.hi) << 8); }
+#endif
+	};
+
+}
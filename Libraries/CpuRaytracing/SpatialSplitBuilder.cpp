@@ -0,0 +1,384 @@
+#include "stdafx.h"
+#include "SpatialSplitBuilder.h"
+#include "AccelerationStructure.h"
+
+namespace CpuRaytracing {
+
+	namespace {
+
+		struct ObjectBin {
+			Aabb Bounds;
+			UINT Count;
+		};
+
+		struct SpatialBin {
+			Aabb Bounds;
+			UINT Entries;   // References whose first bin this is.
+			UINT Exits;     // References whose last bin this is.
+		};
+
+		// Plane between bins binIndex - 1 and binIndex. Binning and partitioning must place it identically.
+		inline float GetSplitPlane (const Aabb& bounds, UINT axis, UINT binIndex, UINT binCount) {
+			return bounds.Lower[axis] + bounds.Extent ()[axis] * (static_cast<float> (binIndex) / static_cast<float> (binCount));
+		}
+
+		// Bounds of the parts of a triangle on either side of a plane, clipped to the bounds of its reference.
+		// Edge crossings are rounded, so they are widened by a few ulps off the split axis to stay conservative.
+		void SplitTriangleBounds (const Aabb& bounds, const Float3 vertices[3], UINT axis, float position, Aabb* left, Aabb* right) {
+			*left = Aabb::Empty ();
+			*right = Aabb::Empty ();
+			for (UINT i = 0; i < 3; i++) {
+				const Float3& a = vertices[i];
+				const Float3& b = vertices[i == 2 ? 0 : i + 1];
+				if (a[axis] <= position) {
+					left->Grow (a);
+				}
+				if (a[axis] >= position) {
+					right->Grow (a);
+				}
+				if ((a[axis] < position && b[axis] > position) || (a[axis] > position && b[axis] < position)) {
+					Float3 crossing = a + (b - a) * ((position - a[axis]) / (b[axis] - a[axis]));
+					crossing[axis] = position;
+					Float3 pad = Float3 (std::fabs (crossing.x), std::fabs (crossing.y), std::fabs (crossing.z)) * 1.0e-6f;
+					pad[axis] = 0.0f;
+					left->Grow (crossing - pad);
+					left->Grow (crossing + pad);
+					right->Grow (crossing - pad);
+					right->Grow (crossing + pad);
+				}
+			}
+			*left = Intersection (*left, bounds);
+			*right = Intersection (*right, bounds);
+		}
+
+	}
+
+	SpatialSplitBuilder::SpatialSplitBuilder (ThreadPool& threadPool, const Settings& settings, const TriangleSource& triangles) :
+		m_ThreadPool (threadPool),
+		m_Settings (settings),
+		m_Triangles (triangles),
+		m_References (nullptr),
+		m_Temp (nullptr),
+		m_Nodes (nullptr),
+		m_RootArea (0.0f),
+		m_NodeCount (0) {
+
+		m_Settings.BinCount = std::min (std::max (m_Settings.BinCount, 2u), c_MaxBinCount);
+		m_Settings.MaxLeafSize = std::max (m_Settings.MaxLeafSize, 1u);
+	}
+
+	UINT SpatialSplitBuilder::Build (PrimitiveReference* references, UINT count, UINT capacity, PrimitiveReference* temp, BuildNode* nodes) {
+		if (count == 0) {
+			return 0;
+		}
+
+		m_References = references;
+		m_Temp = temp;
+		m_Nodes = nodes;
+		m_NodeCount = 1;
+
+		Aabb rootBounds = Aabb::Empty ();
+		for (UINT i = 0; i < count; i++) {
+			rootBounds.Grow (references[i].Bounds);
+		}
+		m_RootArea = rootBounds.HalfArea ();
+
+		BuildNodeRecursive (0, 0, count, std::max (capacity, count), 1);
+
+		return m_NodeCount.load ();
+	}
+
+	SpatialSplitBuilder::ObjectSplit SpatialSplitBuilder::FindObjectSplit (UINT begin, UINT end, const Aabb& centroidBounds) const {
+		const UINT binCount = m_Settings.BinCount;
+		const Float3 extent = centroidBounds.Extent ();
+
+		ObjectSplit best = {0, 0, std::numeric_limits<float>::infinity (), Aabb::Empty (), Aabb::Empty ()};
+		for (UINT axis = 0; axis < 3; axis++) {
+			if (!(extent[axis] > 0.0f)) {
+				continue;
+			}
+
+			const float scale = binCount / extent[axis];
+			ObjectBin bins[c_MaxBinCount];
+			for (UINT i = 0; i < binCount; i++) {
+				bins[i] = ObjectBin {Aabb::Empty (), 0};
+			}
+			for (UINT i = begin; i < end; i++) {
+				const Aabb& bounds = m_References[i].Bounds;
+				ObjectBin& bin = bins[GetBinIndex (bounds.Center ()[axis], centroidBounds.Lower[axis], scale, binCount)];
+				bin.Bounds.Grow (bounds);
+				bin.Count++;
+			}
+
+			Aabb rightBounds[c_MaxBinCount];
+			UINT rightCount[c_MaxBinCount];
+			Aabb bounds = Aabb::Empty ();
+			UINT count = 0;
+			for (UINT i = binCount - 1; i > 0; i--) {
+				bounds.Grow (bins[i].Bounds);
+				count += bins[i].Count;
+				rightBounds[i] = bounds;
+				rightCount[i] = count;
+			}
+
+			Aabb leftBounds = Aabb::Empty ();
+			UINT leftCount = 0;
+			for (UINT i = 1; i < binCount; i++) {
+				leftBounds.Grow (bins[i - 1].Bounds);
+				leftCount += bins[i - 1].Count;
+				if (leftCount == 0 || rightCount[i] == 0) {
+					continue;
+				}
+
+				float cost = leftBounds.HalfArea () * leftCount + rightBounds[i].HalfArea () * rightCount[i];
+				if (cost < best.Cost) {
+					best = {axis, i, cost, leftBounds, rightBounds[i]};
+				}
+			}
+		}
+
+		return best;
+	}
+
+	SpatialSplitBuilder::SpatialSplit SpatialSplitBuilder::FindSpatialSplit (UINT begin, UINT end, const Aabb& bounds) const {
+		const UINT binCount = m_Settings.BinCount;
+		const Float3 extent = bounds.Extent ();
+
+		SpatialSplit best = {0, 0, std::numeric_limits<float>::infinity (), 0, 0};
+		for (UINT axis = 0; axis < 3; axis++) {
+			if (!(extent[axis] > 0.0f)) {
+				continue;
+			}
+
+			const float scale = binCount / extent[axis];
+			SpatialBin bins[c_MaxBinCount];
+			for (UINT i = 0; i < binCount; i++) {
+				bins[i] = SpatialBin {Aabb::Empty (), 0, 0};
+			}
+
+			// Each reference enters the bin of its lower bound and leaves from the bin of its upper bound. In
+			// between, the triangle is chopped at every bin boundary and each piece grows its own bin.
+			for (UINT i = begin; i < end; i++) {
+				const PrimitiveReference& ref = m_References[i];
+				UINT first = GetBinIndex (ref.Bounds.Lower[axis], bounds.Lower[axis], scale, binCount);
+				UINT last = GetBinIndex (ref.Bounds.Upper[axis], bounds.Lower[axis], scale, binCount);
+				if (first != last && !m_Triangles.CanDuplicate (ref.GeometryIndex)) {
+					first = last = GetBinIndex (ref.Bounds.Center ()[axis], bounds.Lower[axis], scale, binCount);
+				}
+
+				if (first == last) {
+					bins[first].Bounds.Grow (ref.Bounds);
+				} else {
+					Float3 vertices[3];
+					m_Triangles.GetTriangle (ref.GeometryIndex, ref.PrimitiveIndex, vertices);
+
+					Aabb remainder = ref.Bounds;
+					for (UINT bin = first; bin < last; bin++) {
+						Aabb piece;
+						SplitTriangleBounds (remainder, vertices, axis, GetSplitPlane (bounds, axis, bin + 1, binCount), &piece, &remainder);
+						bins[bin].Bounds.Grow (piece);
+					}
+					bins[last].Bounds.Grow (remainder);
+				}
+				bins[first].Entries++;
+				bins[last].Exits++;
+			}
+
+			Aabb rightBounds = Aabb::Empty ();
+			float rightCost[c_MaxBinCount];
+			UINT rightCount[c_MaxBinCount];
+			UINT count = 0;
+			for (UINT i = binCount - 1; i > 0; i--) {
+				rightBounds.Grow (bins[i].Bounds);
+				count += bins[i].Exits;
+				rightCost[i] = rightBounds.HalfArea () * count;
+				rightCount[i] = count;
+			}
+
+			Aabb leftBounds = Aabb::Empty ();
+			UINT leftCount = 0;
+			for (UINT i = 1; i < binCount; i++) {
+				leftBounds.Grow (bins[i - 1].Bounds);
+				leftCount += bins[i - 1].Entries;
+				if (leftCount == 0 || rightCount[i] == 0) {
+					continue;
+				}
+
+				float cost = leftBounds.HalfArea () * leftCount + rightCost[i];
+				if (cost < best.Cost) {
+					best = {axis, i, cost, leftCount, rightCount[i]};
+				}
+			}
+		}
+
+		return best;
+	}
+
+	SpatialSplitBuilder::Partition SpatialSplitBuilder::PartitionObjects (UINT begin, UINT end, UINT limit, UINT middle) const {
+		// The left child keeps its references in place; the right one moves up by the left child's spare slots.
+		Partition partition;
+		partition.LeftCount = middle - begin;
+		partition.RightCount = end - middle;
+		partition.RightBegin = middle + static_cast<UINT> (UINT64 (limit - end) * partition.LeftCount / (end - begin));
+		memmove (m_References + partition.RightBegin, m_References + middle, partition.RightCount * sizeof (PrimitiveReference));
+		return partition;
+	}
+
+	SpatialSplitBuilder::Partition SpatialSplitBuilder::PartitionSpatial (UINT begin, UINT end, UINT limit, const Aabb& bounds, const SpatialSplit& split) const {
+		const UINT binCount = m_Settings.BinCount;
+		const UINT axis = split.Axis;
+		const float scale = binCount / bounds.Extent ()[axis];
+		const float position = GetSplitPlane (bounds, axis, split.BinIndex, binCount);
+
+		// Left references are written upward from begin and right ones downward from limit, out of a copy of the
+		// node's references. split counts every straddling reference on both sides, so the two never meet.
+		memcpy (m_Temp + begin, m_References + begin, (end - begin) * sizeof (PrimitiveReference));
+		UINT left = begin;
+		UINT right = limit;
+		for (UINT i = begin; i < end; i++) {
+			const PrimitiveReference& ref = m_Temp[i];
+			UINT first = GetBinIndex (ref.Bounds.Lower[axis], bounds.Lower[axis], scale, binCount);
+			UINT last = GetBinIndex (ref.Bounds.Upper[axis], bounds.Lower[axis], scale, binCount);
+			if (first != last && !m_Triangles.CanDuplicate (ref.GeometryIndex)) {
+				first = last = GetBinIndex (ref.Bounds.Center ()[axis], bounds.Lower[axis], scale, binCount);
+			}
+
+			if (last < split.BinIndex) {
+				m_References[left++] = ref;
+			} else if (first >= split.BinIndex) {
+				m_References[--right] = ref;
+			} else {
+				Float3 vertices[3];
+				m_Triangles.GetTriangle (ref.GeometryIndex, ref.PrimitiveIndex, vertices);
+
+				Aabb leftBounds;
+				Aabb rightBounds;
+				SplitTriangleBounds (ref.Bounds, vertices, axis, position, &leftBounds, &rightBounds);
+				if (!leftBounds.IsEmpty ()) {
+					m_References[left++] = {leftBounds, ref.GeometryIndex, ref.PrimitiveIndex};
+				}
+				if (!rightBounds.IsEmpty ()) {
+					m_References[--right] = {rightBounds, ref.GeometryIndex, ref.PrimitiveIndex};
+				} else if (leftBounds.IsEmpty ()) {
+					m_References[left++] = ref;
+				}
+			}
+		}
+
+		Partition partition;
+		partition.LeftCount = left - begin;
+		partition.RightCount = limit - right;
+		if (partition.LeftCount == 0 || partition.RightCount == 0) {
+			// Rounding emptied a side; the caller falls back to an object split of the original references.
+			memcpy (m_References + begin, m_Temp + begin, (end - begin) * sizeof (PrimitiveReference));
+			return partition;
+		}
+
+		const UINT spare = (limit - begin) - partition.LeftCount - partition.RightCount;
+		partition.RightBegin = left + static_cast<UINT> (UINT64 (spare) * partition.LeftCount / (partition.LeftCount + partition.RightCount));
+		memmove (m_References + partition.RightBegin, m_References + right, partition.RightCount * sizeof (PrimitiveReference));
+		return partition;
+	}
+
+	void SpatialSplitBuilder::MakeLeaf (BuildNode& node, UINT begin, UINT end) const {
+		node.Children[0] = node.Children[1] = 0;
+		node.FirstPrimitive = begin;
+		node.PrimitiveCount = end - begin;
+		node.SplitAxis = 0;
+	}
+
+	void SpatialSplitBuilder::BuildNodeRecursive (UINT nodeIndex, UINT begin, UINT end, UINT limit, UINT depth) {
+		BuildNode& node = m_Nodes[nodeIndex];
+		const UINT count = end - begin;
+
+		node.Bounds = Aabb::Empty ();
+		Aabb centroidBounds = Aabb::Empty ();
+		for (UINT i = begin; i < end; i++) {
+			node.Bounds.Grow (m_References[i].Bounds);
+			centroidBounds.Grow (m_References[i].Bounds.Center ());
+		}
+
+		if (count == 1) {
+			MakeLeaf (node, begin, end);
+			return;
+		}
+
+		UINT axis = centroidBounds.LargestAxis ();
+		Partition partition = {0, 0, 0};
+
+		// Past half the depth budget, fall back to median splits so the tree depth stays bounded.
+		if (depth < c_MaxBvhDepth / 2) {
+			const ObjectSplit objectSplit = FindObjectSplit (begin, end, centroidBounds);
+
+			// Spatial splits only pay off where object split children overlap, or where centroids coincide, and
+			// are only possible while the node has spare slots for duplicates.
+			SpatialSplit spatialSplit = {0, 0, std::numeric_limits<float>::infinity (), 0, 0};
+			const float overlap = Intersection (objectSplit.LeftBounds, objectSplit.RightBounds).HalfArea ();
+			if (limit > end && (objectSplit.Cost == std::numeric_limits<float>::infinity () || overlap > m_Settings.MinOverlap * m_RootArea)) {
+				spatialSplit = FindSpatialSplit (begin, end, node.Bounds);
+			}
+
+			const SahCosts& costs = m_Settings.Costs;
+			float leafCost = costs.Intersection * count;
+			float splitCost = costs.Traversal + costs.Intersection * std::min (objectSplit.Cost, spatialSplit.Cost) / node.Bounds.HalfArea ();
+			if (count <= m_Settings.MaxLeafSize && leafCost <= splitCost) {
+				MakeLeaf (node, begin, end);
+				return;
+			}
+
+			// A spatial split must fit its duplicates into the node's spare slots.
+			if (spatialSplit.Cost < objectSplit.Cost && spatialSplit.LeftCount + spatialSplit.RightCount <= limit - begin) {
+				partition = PartitionSpatial (begin, end, limit, node.Bounds, spatialSplit);
+				axis = spatialSplit.Axis;
+			}
+
+			if (partition.LeftCount == 0 && objectSplit.Cost < std::numeric_limits<float>::infinity ()) {
+				axis = objectSplit.Axis;
+				const float lower = centroidBounds.Lower[axis];
+				const float scale = m_Settings.BinCount / centroidBounds.Extent ()[axis];
+				const UINT binCount = m_Settings.BinCount;
+				const UINT splitBin = objectSplit.BinIndex;
+				PrimitiveReference* mid = std::partition (m_References + begin, m_References + end, [=] (const PrimitiveReference& ref) {
+					return GetBinIndex (ref.Bounds.Center ()[axis], lower, scale, binCount) < splitBin;
+				});
+				const UINT middle = static_cast<UINT> (mid - m_References);
+				if (middle != begin && middle != end) {
+					partition = PartitionObjects (begin, end, limit, middle);
+				}
+			}
+		} else if (count <= m_Settings.MaxLeafSize) {
+			MakeLeaf (node, begin, end);
+			return;
+		}
+
+		if (partition.LeftCount == 0) {
+			// Coincident centroids (or the depth fallback): split at the object median along the widest axis.
+			const UINT middle = begin + count / 2;
+			std::nth_element (m_References + begin, m_References + middle, m_References + end, [axis] (const PrimitiveReference& a, const PrimitiveReference& b) {
+				return a.Bounds.Center ()[axis] < b.Bounds.Center ()[axis];
+			});
+			partition = PartitionObjects (begin, end, limit, middle);
+		}
+
+		UINT firstChild = m_NodeCount.fetch_add (2);
+		node.Children[0] = firstChild;
+		node.Children[1] = firstChild + 1;
+		node.FirstPrimitive = 0;
+		node.PrimitiveCount = 0;
+		node.SplitAxis = axis;
+
+		const UINT leftEnd = begin + partition.LeftCount;
+		const UINT rightBegin = partition.RightBegin;
+		const UINT rightEnd = rightBegin + partition.RightCount;
+		if (count >= c_ParallelSubtreeThreshold && m_ThreadPool.GetThreadCount () > 1) {
+			ThreadPool::TaskGroup group (m_ThreadPool);
+			group.Run ([=] () { BuildNodeRecursive (firstChild, begin, leftEnd, rightBegin, depth + 1); });
+			BuildNodeRecursive (firstChild + 1, rightBegin, rightEnd, limit, depth + 1);
+			group.Wait ();
+		} else {
+			BuildNodeRecursive (firstChild, begin, leftEnd, rightBegin, depth + 1);
+			BuildNodeRecursive (firstChild + 1, rightBegin, rightEnd, limit, depth + 1);
+		}
+	}
+
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "BvhBuild.h"
+#include "ThreadPool.h"
+
+namespace CpuRaytracing {
+
+	// Top-down SBVH builder (Stich et al. 2009). Every node evaluates binned object splits as BinnedSahBuilder
+	// does. Where the children of the best object split overlap, it also evaluates spatial splits: triangles are
+	// chopped into bins along each axis by their clipped bounds, and a reference straddling the chosen plane goes
+	// to both children with its bounds clipped to each side.
+	//
+	// References live in one array with room for duplicates. A node owns [begin, limit) of it: its references
+	// followed by spare slots, which a split divides between the children in proportion to their references, so
+	// the budget is spent where the splits happen and subtrees can be built in parallel.
+	class SpatialSplitBuilder {
+	public:
+		static constexpr UINT c_MaxBinCount = 32;
+
+		struct Settings {
+			UINT BinCount = c_MaxBinCount;
+			UINT MaxLeafSize = 8;
+			SahCosts Costs;
+			// Spatial splits are only tried where the object split children overlap by at least this fraction of
+			// the root area.
+			float MinOverlap = 1.0e-5f;
+		};
+
+		SpatialSplitBuilder (ThreadPool& threadPool, const Settings& settings, const TriangleSource& triangles);
+
+		// Builds over references[0, count), which may grow to capacity entries. Leaves cover contiguous ranges,
+		// with unused slots between them. temp must hold capacity references and nodes GetMaxBinaryNodeCount
+		// (capacity) entries. Returns the node count; node 0 is the root.
+		UINT Build (PrimitiveReference* references, UINT count, UINT capacity, PrimitiveReference* temp, BuildNode* nodes);
+
+	private:
+		static constexpr UINT c_ParallelSubtreeThreshold = 4096;
+
+		struct ObjectSplit {
+			UINT Axis;
+			UINT BinIndex;
+			float Cost;
+			Aabb LeftBounds;
+			Aabb RightBounds;
+		};
+
+		struct SpatialSplit {
+			UINT Axis;
+			UINT BinIndex;
+			float Cost;
+			UINT LeftCount;
+			UINT RightCount;
+		};
+
+		// Where the references of a split ended up: [begin, begin + LeftCount) and [RightBegin, RightBegin + RightCount).
+		struct Partition {
+			UINT LeftCount;
+			UINT RightBegin;
+			UINT RightCount;
+		};
+
+		void BuildNodeRecursive (UINT nodeIndex, UINT begin, UINT end, UINT limit, UINT depth);
+		ObjectSplit FindObjectSplit (UINT begin, UINT end, const Aabb& centroidBounds) const;
+		SpatialSplit FindSpatialSplit (UINT begin, UINT end, const Aabb& bounds) const;
+		Partition PartitionObjects (UINT begin, UINT end, UINT limit, UINT middle) const;
+		Partition PartitionSpatial (UINT begin, UINT end, UINT limit, const Aabb& bounds, const SpatialSplit& split) const;
+		void MakeLeaf (BuildNode& node, UINT begin, UINT end) const;
+
+		ThreadPool& m_ThreadPool;
+		Settings m_Settings;
+		const TriangleSource& m_Triangles;
+		PrimitiveReference* m_References;
+		PrimitiveReference* m_Temp;
+		BuildNode* m_Nodes;
+		float m_RootArea;
+		std::atomic<UINT> m_NodeCount;
+	};
+
+}
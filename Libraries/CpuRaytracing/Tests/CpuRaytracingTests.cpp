@@ -0,0 +1,2127 @@
+// Checks every builder and node layout, the copy modes, the manager and the trace entry points against brute-force
+// intersection of the same primitives. Returns nonzero if any check fails.
+
+#include "AccelerationStructureCopy.h"
+#include "AccelerationStructureManager.h"
+#include "Device.h"
+#include "GeometryReader.h"
+#include "MappedFile.h"
+#include "PrebuildInfo.h"
+#include "QualityReport.h"
+#include "RayStreamTracer.h"
+#include "Traversal.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <limits>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace CpuRaytracing;
+
+namespace {
+
+	UINT g_FailureCount = 0;
+
+	void Check (bool condition, const std::string& what) {
+		if (!condition) {
+			if (g_FailureCount < 20) {
+				fprintf (stderr, "FAILED: %s\n", what.c_str ());
+			}
+			g_FailureCount++;
+		}
+	}
+
+	bool Throws (const std::function<void ()>& function) {
+		try {
+			function ();
+		} catch (const std::exception&) {
+			return true;
+		}
+		return false;
+	}
+
+	// Memory at the 256-byte alignment DXR requires of structures and scratch.
+	class AlignedBuffer {
+	public:
+		explicit AlignedBuffer (UINT64 sizeInBytes = 0) { Resize (sizeInBytes); }
+
+		void Resize (UINT64 sizeInBytes) { m_Storage.assign (size_t (sizeInBytes) + D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BYTE_ALIGNMENT, 0); }
+		UINT8* GetData () {
+			const uintptr_t address = reinterpret_cast<uintptr_t> (m_Storage.data ());
+			const uintptr_t alignment = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BYTE_ALIGNMENT;
+			return reinterpret_cast<UINT8*> ((address + alignment - 1) & ~(alignment - 1));
+		}
+		D3D12_GPU_VIRTUAL_ADDRESS GetAddress () { return GetCpuVirtualAddress (GetData ()); }
+		const AccelerationStructureHeader* GetHeader () { return reinterpret_cast<const AccelerationStructureHeader*> (GetData ()); }
+
+	private:
+		std::vector<UINT8> m_Storage;
+	};
+
+	// Builds, or updates in place with PERFORM_UPDATE, the structure in result.
+	void Build (Device& device, const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs, AlignedBuffer& result) {
+		D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO prebuildInfo = {};
+		device.GetRaytracingAccelerationStructurePrebuildInfo (&inputs, &prebuildInfo);
+		const bool update = (inputs.Flags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PERFORM_UPDATE) != 0;
+		if (!update) {
+			result.Resize (prebuildInfo.ResultDataMaxSizeInBytes);
+		}
+		AlignedBuffer scratch (update ? prebuildInfo.UpdateScratchDataSizeInBytes : prebuildInfo.ScratchDataSizeInBytes);
+
+		D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC buildDesc = {};
+		buildDesc.DestAccelerationStructureData = result.GetAddress ();
+		buildDesc.Inputs = inputs;
+		buildDesc.SourceAccelerationStructureData = update ? result.GetAddress () : 0;
+		buildDesc.ScratchAccelerationStructureData = scratch.GetAddress ();
+		device.BuildRaytracingAccelerationStructure (&buildDesc);
+	}
+
+	D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS GetBottomLevelInputs (UINT geometryCount, const D3D12_RAYTRACING_GEOMETRY_DESC* pGeometryDescs,
+		D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS flags) {
+
+		D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS inputs = {};
+		inputs.Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL;
+		inputs.Flags = flags;
+		inputs.NumDescs = geometryCount;
+		inputs.DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY;
+		inputs.pGeometryDescs = pGeometryDescs;
+		return inputs;
+	}
+
+	// Two opaque triangle geometries over R16_UINT indices.
+	struct Mesh {
+		std::vector<Float3> Vertices[2];
+		std::vector<UINT16> Indices[2];
+		D3D12_RAYTRACING_GEOMETRY_DESC GeometryDescs[2];
+
+		UINT GetTriangleCount (UINT geometryIndex) const { return UINT (Indices[geometryIndex].size () / 3); }
+
+		void GetTriangle (UINT geometryIndex, UINT primitiveIndex, Float3 vertices[3]) const {
+			for (UINT i = 0; i < 3; i++) {
+				vertices[i] = Vertices[geometryIndex][Indices[geometryIndex][primitiveIndex * 3 + i]];
+			}
+		}
+
+		D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS GetInputs (D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS flags) {
+			for (UINT i = 0; i < 2; i++) {
+				D3D12_RAYTRACING_GEOMETRY_DESC& desc = GeometryDescs[i];
+				desc = {};
+				desc.Type = D3D12_RAYTRACING_GEOMETRY_TYPE_TRIANGLES;
+				desc.Flags = D3D12_RAYTRACING_GEOMETRY_FLAG_OPAQUE;
+				desc.Triangles.IndexFormat = DXGI_FORMAT_R16_UINT;
+				desc.Triangles.VertexFormat = DXGI_FORMAT_R32G32B32_FLOAT;
+				desc.Triangles.IndexCount = UINT (Indices[i].size ());
+				desc.Triangles.VertexCount = UINT (Vertices[i].size ());
+				desc.Triangles.IndexBuffer = GetCpuVirtualAddress (Indices[i].data ());
+				desc.Triangles.VertexBuffer.StartAddress = GetCpuVirtualAddress (Vertices[i].data ());
+				desc.Triangles.VertexBuffer.StrideInBytes = sizeof (Float3);
+			}
+			return GetBottomLevelInputs (2, GeometryDescs, flags);
+		}
+	};
+
+	Float3 RandomPoint (std::mt19937& random, float lower, float upper) {
+		std::uniform_real_distribution<float> distribution (lower, upper);
+		const float x = distribution (random);
+		const float y = distribution (random);
+		return Float3 (x, y, distribution (random));
+	}
+
+	// Small triangles of three vertices each, scattered through [0, 10]^3 and alternating between the geometries.
+	Mesh CreateMesh (UINT triangleCount, UINT seed) {
+		std::mt19937 random (seed);
+		Mesh mesh;
+		for (UINT i = 0; i < triangleCount; i++) {
+			const Float3 center = RandomPoint (random, 0.0f, 10.0f);
+			const UINT geometryIndex = i % 2;
+			for (UINT vertex = 0; vertex < 3; vertex++) {
+				mesh.Indices[geometryIndex].push_back (UINT16 (mesh.Vertices[geometryIndex].size ()));
+				mesh.Vertices[geometryIndex].push_back (center + RandomPoint (random, -0.4f, 0.4f));
+			}
+		}
+		return mesh;
+	}
+
+	// A height field over [0, 10]^2 of quadsPerSide^2 quads, two triangles each, whose vertices are shared through
+	// the index buffers. The rows below the middle form geometry 0 and the others geometry 1, which repeats the
+	// vertices of the middle row. A flat grid lies at z = 5.
+	Mesh CreateGridMesh (UINT quadsPerSide, bool flat, UINT seed) {
+		std::mt19937 random (seed);
+		std::uniform_real_distribution<float> height (4.0f, 6.0f);
+		std::vector<float> heights ((quadsPerSide + 1) * (quadsPerSide + 1));
+		for (float& z : heights) {
+			z = flat ? 5.0f : height (random);
+		}
+
+		Mesh mesh;
+		const float spacing = 10.0f / quadsPerSide;
+		const UINT middle = quadsPerSide / 2;
+		for (UINT geometryIndex = 0; geometryIndex < 2; geometryIndex++) {
+			const UINT firstRow = geometryIndex == 0 ? 0 : middle;
+			const UINT endRow = geometryIndex == 0 ? middle : quadsPerSide;
+			for (UINT y = firstRow; y <= endRow; y++) {
+				for (UINT x = 0; x <= quadsPerSide; x++) {
+					mesh.Vertices[geometryIndex].push_back (Float3 (x * spacing, y * spacing, heights[y * (quadsPerSide + 1) + x]));
+				}
+			}
+			for (UINT y = 0; y < endRow - firstRow; y++) {
+				for (UINT x = 0; x < quadsPerSide; x++) {
+					const UINT16 a = UINT16 (y * (quadsPerSide + 1) + x);
+					const UINT16 b = UINT16 (a + 1);
+					const UINT16 c = UINT16 (a + quadsPerSide + 1);
+					const UINT16 d = UINT16 (c + 1);
+					const UINT16 indices[6] = {a, b, d, a, d, c};
+					mesh.Indices[geometryIndex].insert (mesh.Indices[geometryIndex].end (), indices, indices + 6);
+				}
+			}
+		}
+		return mesh;
+	}
+
+	// Rays from outside [0, 10]^3 toward random points inside, with finite TMax for some.
+	std::vector<RayDesc> CreateRays (UINT rayCount, UINT seed) {
+		std::mt19937 random (seed);
+		std::vector<RayDesc> rays (rayCount);
+		for (UINT i = 0; i < rayCount; i++) {
+			const Float3 origin = RandomPoint (random, -5.0f, 15.0f) * Float3 (1.0f, 1.0f, 0.0f) + Float3 (0.0f, 0.0f, -6.0f);
+			const Float3 target = RandomPoint (random, 0.0f, 10.0f);
+			rays[i] = {origin, 0.0f, target - origin, i % 3 == 0 ? 0.9f : std::numeric_limits<float>::infinity ()};
+		}
+		return rays;
+	}
+
+	bool Contains (const Aabb& box, const Float3& point) {
+		return box.Lower.x <= point.x && point.x <= box.Upper.x && box.Lower.y <= point.y && point.y <= box.Upper.y &&
+			box.Lower.z <= point.z && point.z <= box.Upper.z;
+	}
+
+	bool Contains (const Aabb& box, const Aabb& inner) {
+		return inner.IsEmpty () || (Contains (box, inner.Lower) && Contains (box, inner.Upper));
+	}
+
+	// Walks a binary hierarchy: every box holds those of its children, the larger child comes first, no leaf lies
+	// deeper than MaxDepth, and every triangle of mesh is referenced by one leaf whose box holds it. A refit keeps
+	// the child order of the build, and the leaf boxes of a spatial-split build hold only the clipped parts of the
+	// triangles they reference, which may be referenced more than once.
+	void ValidateHierarchy (const std::string& name, const AccelerationStructureHeader* header, const Mesh& mesh, bool refit = false) {
+		const bool spatialSplits = (header->BuildFlags & c_SpatialSplitBudgetMask) != 0;
+		std::vector<UINT> referenceCounts[2];
+		for (UINT geometryIndex = 0; geometryIndex < 2; geometryIndex++) {
+			referenceCounts[geometryIndex].assign (mesh.GetTriangleCount (geometryIndex), 0);
+		}
+
+		struct StackEntry {
+			UINT Node;
+			UINT Depth;
+			Aabb ParentBounds;
+		};
+		const BvhNode* nodes = header->GetNodes ();
+		const PrimitiveRecord* primitives = header->GetPrimitives ();
+		std::vector<StackEntry> stack = {{0, 1, header->Bounds}};
+		UINT visitedCount = 0;
+		UINT maxDepth = 0;
+		while (!stack.empty () && visitedCount++ < header->NodeCount) {
+			const StackEntry entry = stack.back ();
+			stack.pop_back ();
+			if (entry.Node >= header->NodeCount) {
+				Check (false, name + ": node index out of range");
+				continue;
+			}
+			const BvhNode& node = nodes[entry.Node];
+			Check (Contains (entry.ParentBounds, node.Bounds), name + ": node box outside its parent, node " + std::to_string (entry.Node));
+			maxDepth = std::max (maxDepth, entry.Depth);
+			if (!node.IsLeaf ()) {
+				if (!refit && node.Offset < header->NodeCount) {
+					Check (nodes[entry.Node + 1].Bounds.HalfArea () >= nodes[node.Offset].Bounds.HalfArea (), name + ": smaller child first, node " + std::to_string (entry.Node));
+				}
+				stack.push_back ({entry.Node + 1, entry.Depth + 1, node.Bounds});
+				stack.push_back ({node.Offset, entry.Depth + 1, node.Bounds});
+				continue;
+			}
+			for (UINT i = 0; i < node.PrimitiveCount; i++) {
+				const PrimitiveRecord& primitive = primitives[node.Offset + i];
+				if (primitive.GeometryIndex > 1 || primitive.PrimitiveIndex >= mesh.GetTriangleCount (primitive.GeometryIndex)) {
+					Check (false, name + ": primitive record out of range");
+					continue;
+				}
+				referenceCounts[primitive.GeometryIndex][primitive.PrimitiveIndex]++;
+				Float3 vertices[3];
+				mesh.GetTriangle (primitive.GeometryIndex, primitive.PrimitiveIndex, vertices);
+				for (const Float3& vertex : vertices) {
+					Check (spatialSplits || Contains (node.Bounds, vertex), name + ": leaf box misses its triangle, node " + std::to_string (entry.Node));
+				}
+			}
+		}
+		Check (stack.empty (), name + ": the hierarchy has more nodes than NodeCount");
+		Check (maxDepth <= header->MaxDepth && header->MaxDepth <= c_MaxBvhDepth, name + ": depth " + std::to_string (maxDepth));
+		for (UINT geometryIndex = 0; geometryIndex < 2; geometryIndex++) {
+			for (UINT primitiveIndex = 0; primitiveIndex < mesh.GetTriangleCount (geometryIndex); primitiveIndex++) {
+				const UINT count = referenceCounts[geometryIndex][primitiveIndex];
+				Check (spatialSplits ? count >= 1 : count == 1, name + ": references of triangle " + std::to_string (primitiveIndex));
+			}
+		}
+	}
+
+	// Double-precision Moller-Trumbore. Hits within margin of an edge, which a watertight test may resolve either
+	// way, are reported as ambiguous.
+	enum class ReferenceResult { Miss, Hit, Ambiguous };
+
+	ReferenceResult IntersectReference (const Float3 vertices[3], const RayDesc& ray, double* t) {
+		const double margin = 1e-4;
+		double v0[3], e1[3], e2[3], o[3], d[3];
+		for (UINT axis = 0; axis < 3; axis++) {
+			v0[axis] = vertices[0][axis];
+			e1[axis] = double (vertices[1][axis]) - v0[axis];
+			e2[axis] = double (vertices[2][axis]) - v0[axis];
+			o[axis] = ray.Origin[axis];
+			d[axis] = ray.Direction[axis];
+		}
+		const auto cross = [] (const double* a, const double* b, double* c) {
+			c[0] = a[1] * b[2] - a[2] * b[1];
+			c[1] = a[2] * b[0] - a[0] * b[2];
+			c[2] = a[0] * b[1] - a[1] * b[0];
+		};
+		const auto dot = [] (const double* a, const double* b) { return a[0] * b[0] + a[1] * b[1] + a[2] * b[2]; };
+		double p[3], q[3], s[3];
+		cross (d, e2, p);
+		const double determinant = dot (e1, p);
+		if (std::fabs (determinant) < 1e-12) {
+			return ReferenceResult::Miss;
+		}
+		for (UINT axis = 0; axis < 3; axis++) {
+			s[axis] = o[axis] - v0[axis];
+		}
+		cross (s, e1, q);
+		const double u = dot (s, p) / determinant;
+		const double v = dot (d, q) / determinant;
+		*t = dot (e2, q) / determinant;
+		const double edge = std::min (std::min (u, v), 1.0 - u - v);
+		const double tScale = 1e-4 * (1.0 + std::fabs (*t));
+		if (edge < -margin || *t < ray.TMin - tScale || *t > double (ray.TMax) + tScale) {
+			return ReferenceResult::Miss;
+		}
+		if (edge < margin || *t < ray.TMin + tScale || *t > double (ray.TMax) - tScale) {
+			return ReferenceResult::Ambiguous;
+		}
+		return ReferenceResult::Hit;
+	}
+
+	// Whether the vertices appear clockwise from the ray origin, which makes the Moller-Trumbore determinant positive.
+	bool IsClockwise (const Float3 vertices[3], const RayDesc& ray) {
+		double e1[3], e2[3];
+		for (UINT axis = 0; axis < 3; axis++) {
+			e1[axis] = double (vertices[1][axis]) - vertices[0][axis];
+			e2[axis] = double (vertices[2][axis]) - vertices[0][axis];
+		}
+		const Float3& d = ray.Direction;
+		const double p[3] = {d.y * e2[2] - d.z * e2[1], d.z * e2[0] - d.x * e2[2], d.x * e2[1] - d.y * e2[0]};
+		return e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2] > 0.0;
+	}
+
+	struct ReferenceHit {
+		bool Found;
+		bool Ambiguous;     // An edge or range boundary decides the outcome; such rays are not compared.
+		double T;
+	};
+
+	ReferenceHit TraceReference (const Mesh& mesh, const RayDesc& ray, const Float3& offset = Float3 (0.0f)) {
+		ReferenceHit result = {false, false, std::numeric_limits<double>::infinity ()};
+		for (UINT geometryIndex = 0; geometryIndex < 2; geometryIndex++) {
+			for (UINT primitiveIndex = 0; primitiveIndex < mesh.GetTriangleCount (geometryIndex); primitiveIndex++) {
+				Float3 vertices[3];
+				mesh.GetTriangle (geometryIndex, primitiveIndex, vertices);
+				for (Float3& vertex : vertices) {
+					vertex += offset;
+				}
+				double t;
+				const ReferenceResult hit = IntersectReference (vertices, ray, &t);
+				if (hit == ReferenceResult::Ambiguous) {
+					result.Ambiguous = true;
+				} else if (hit == ReferenceResult::Hit && t < result.T) {
+					result.Found = true;
+					result.T = t;
+				}
+			}
+		}
+		return result;
+	}
+
+	bool IsSameDistance (double t, double reference) {
+		return std::fabs (t - reference) <= 1e-4 * (1.0 + std::fabs (reference));
+	}
+
+	// The reported primitive must lie at the reported distance.
+	bool IsConsistentHit (const Mesh& mesh, const RayDesc& ray, const RayHit& hit, const Float3& offset = Float3 (0.0f)) {
+		if (hit.GeometryIndex > 1 || hit.PrimitiveIndex >= mesh.GetTriangleCount (hit.GeometryIndex)) {
+			return false;
+		}
+		Float3 vertices[3];
+		mesh.GetTriangle (hit.GeometryIndex, hit.PrimitiveIndex, vertices);
+		for (Float3& vertex : vertices) {
+			vertex += offset;
+		}
+		double t;
+		return IntersectReference (vertices, ray, &t) != ReferenceResult::Miss && IsSameDistance (hit.T, t);
+	}
+
+	// Closest hits and occlusion of every ray against the reference, tracing accelerationStructure directly.
+	void CheckTraces (const std::string& name, const AccelerationStructureHeader* accelerationStructure, const Mesh& mesh, const std::vector<RayDesc>& rays) {
+		UINT hitCount = 0;
+		for (UINT i = 0; i < rays.size (); i++) {
+			const ReferenceHit reference = TraceReference (mesh, rays[i]);
+			if (reference.Ambiguous) {
+				continue;
+			}
+			RayHit hit;
+			const bool found = TraceRayClosestHit (accelerationStructure, rays[i], 0xFF, &hit);
+			Check (found == reference.Found, name + ": closest hit found, ray " + std::to_string (i));
+			if (found && reference.Found) {
+				Check (IsSameDistance (hit.T, reference.T), name + ": closest hit distance, ray " + std::to_string (i));
+				Check (IsConsistentHit (mesh, rays[i], hit), name + ": closest hit primitive, ray " + std::to_string (i));
+				hitCount++;
+			}
+			Check (TraceRayOcclusion (accelerationStructure, rays[i], 0xFF) == reference.Found, name + ": occlusion, ray " + std::to_string (i));
+		}
+		Check (hitCount > rays.size () / 8, name + ": too few rays hit to be meaningful");
+	}
+
+	// Rays packed as TraceRayPacketClosestHit () takes them must find the hits they find one by one.
+	void CheckPackets (const std::string& name, const AccelerationStructureHeader* accelerationStructure, const std::vector<RayDesc>& rays) {
+		const HitGroupTable noHitGroups = {nullptr, 0, 0, 0};
+		for (UINT first = 0; first < rays.size (); first += c_MaxRayPacketSize) {
+			const UINT rayCount = std::min (c_MaxRayPacketSize - first / c_MaxRayPacketSize % 3, UINT (rays.size ()) - first);
+			RayHit hits[c_MaxRayPacketSize];
+			const UINT hitMask = TraceRayPacketClosestHit (accelerationStructure, rayCount, &rays[first], 0, 0xFF, noHitGroups, hits);
+			for (UINT lane = 0; lane < rayCount; lane++) {
+				RayHit hit;
+				const bool found = TraceRayClosestHit (accelerationStructure, rays[first + lane], 0xFF, &hit);
+				Check (((hitMask >> lane) & 1) == UINT (found), name + ": packet hit mask, ray " + std::to_string (first + lane));
+				if (found && ((hitMask >> lane) & 1)) {
+					Check (hits[lane].T == hit.T, name + ": packet hit distance, ray " + std::to_string (first + lane));
+				}
+			}
+		}
+	}
+
+	D3D12_RAYTRACING_INSTANCE_DESC GetInstanceDesc (const Float3& offset, UINT instanceID, UINT flags, D3D12_GPU_VIRTUAL_ADDRESS bottomLevel) {
+		D3D12_RAYTRACING_INSTANCE_DESC desc = {};
+		desc.Transform[0][0] = desc.Transform[1][1] = desc.Transform[2][2] = 1.0f;
+		desc.Transform[0][3] = offset.x;
+		desc.Transform[1][3] = offset.y;
+		desc.Transform[2][3] = offset.z;
+		desc.InstanceID = instanceID;
+		desc.InstanceMask = 0xFF;
+		desc.Flags = flags;
+		desc.AccelerationStructure = bottomLevel;
+		return desc;
+	}
+
+	D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS GetTopLevelInputs (const std::vector<D3D12_RAYTRACING_INSTANCE_DESC>& instanceDescs,
+		D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS flags) {
+
+		D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS inputs = {};
+		inputs.Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL;
+		inputs.Flags = flags;
+		inputs.NumDescs = UINT (instanceDescs.size ());
+		inputs.DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY;
+		inputs.InstanceDescs = GetCpuVirtualAddress (instanceDescs.data ());
+		return inputs;
+	}
+
+	// Instance i of a top-level structure: the mesh translated by Offset, with InstanceID 100 + i.
+	struct SceneInstance {
+		const Mesh* pMesh;
+		Float3 Offset;
+		UINT Flags;         // D3D12_RAYTRACING_INSTANCE_FLAGS
+	};
+
+	std::vector<D3D12_RAYTRACING_INSTANCE_DESC> GetInstanceDescs (const std::vector<SceneInstance>& instances, D3D12_GPU_VIRTUAL_ADDRESS bottomLevel) {
+		std::vector<D3D12_RAYTRACING_INSTANCE_DESC> instanceDescs;
+		for (UINT i = 0; i < instances.size (); i++) {
+			instanceDescs.push_back (GetInstanceDesc (instances[i].Offset, 100 + i, instances[i].Flags, bottomLevel));
+		}
+		return instanceDescs;
+	}
+
+	// Whether the facing culls of rayFlags skip a triangle of an instance with instanceFlags, and the face it is
+	// hit on.
+	bool IsCulled (UINT instanceFlags, UINT rayFlags, bool clockwise, bool* frontFace) {
+		*frontFace = clockwise != ((instanceFlags & D3D12_RAYTRACING_INSTANCE_FLAG_TRIANGLE_FRONT_COUNTERCLOCKWISE) != 0);
+		if (instanceFlags & D3D12_RAYTRACING_INSTANCE_FLAG_TRIANGLE_CULL_DISABLE) {
+			return false;
+		}
+		return ((rayFlags & RAY_FLAG_CULL_BACK_FACING_TRIANGLES) && !*frontFace) || ((rayFlags & RAY_FLAG_CULL_FRONT_FACING_TRIANGLES) && *frontFace);
+	}
+
+	struct SceneReferenceHit {
+		ReferenceHit Hit;
+		UINT InstanceIndex;
+		bool FrontFace;
+	};
+
+	SceneReferenceHit TraceSceneReference (const std::vector<SceneInstance>& instances, const RayDesc& ray, UINT rayFlags) {
+		SceneReferenceHit result = {{false, false, std::numeric_limits<double>::infinity ()}, 0, false};
+		for (UINT instanceIndex = 0; instanceIndex < instances.size (); instanceIndex++) {
+			const SceneInstance& instance = instances[instanceIndex];
+			for (UINT geometryIndex = 0; geometryIndex < 2; geometryIndex++) {
+				for (UINT primitiveIndex = 0; primitiveIndex < instance.pMesh->GetTriangleCount (geometryIndex); primitiveIndex++) {
+					Float3 vertices[3];
+					instance.pMesh->GetTriangle (geometryIndex, primitiveIndex, vertices);
+					for (Float3& vertex : vertices) {
+						vertex += instance.Offset;
+					}
+					double t;
+					const ReferenceResult hit = IntersectReference (vertices, ray, &t);
+					bool frontFace;
+					if (hit == ReferenceResult::Miss || IsCulled (instance.Flags, rayFlags, IsClockwise (vertices, ray), &frontFace)) {
+						continue;
+					}
+					if (hit == ReferenceResult::Ambiguous) {
+						result.Hit.Ambiguous = true;
+					} else if (t < result.Hit.T) {
+						result.Hit.Found = true;
+						result.Hit.T = t;
+						result.InstanceIndex = instanceIndex;
+						result.FrontFace = frontFace;
+					}
+				}
+			}
+		}
+		return result;
+	}
+
+	// Closest hits, hit kinds, occlusion and the instance mask of every ray against the reference.
+	void CheckSceneTraces (const std::string& name, const AccelerationStructureHeader* topLevel, const std::vector<SceneInstance>& instances,
+		const std::vector<RayDesc>& rays, UINT rayFlags = RAY_FLAG_NONE) {
+
+		const HitGroupTable noHitGroups = {nullptr, 0, 0, 0};
+		UINT hitCount = 0;
+		for (UINT i = 0; i < rays.size (); i++) {
+			const SceneReferenceHit reference = TraceSceneReference (instances, rays[i], rayFlags);
+			if (reference.Hit.Ambiguous) {
+				continue;
+			}
+			RayHit hit;
+			const bool found = TraceRayClosestHit (topLevel, rays[i], rayFlags, 0xFF, noHitGroups, &hit);
+			Check (found == reference.Hit.Found, name + ": closest hit found, ray " + std::to_string (i));
+			if (found && reference.Hit.Found) {
+				Check (IsSameDistance (hit.T, reference.Hit.T), name + ": closest hit distance, ray " + std::to_string (i));
+				Check (hit.InstanceIndex == reference.InstanceIndex && hit.InstanceID == 100 + reference.InstanceIndex, name + ": instance, ray " + std::to_string (i));
+				Check (hit.HitKind == (reference.FrontFace ? c_HitKindTriangleFrontFace : c_HitKindTriangleBackFace), name + ": hit kind, ray " + std::to_string (i));
+				const SceneInstance& instance = instances[std::min (hit.InstanceIndex, UINT (instances.size ()) - 1)];
+				Check (IsConsistentHit (*instance.pMesh, rays[i], hit, instance.Offset), name + ": closest hit primitive, ray " + std::to_string (i));
+				hitCount++;
+			}
+			Check (TraceRayOcclusion (topLevel, rays[i], rayFlags, 0xFF, noHitGroups) == reference.Hit.Found, name + ": occlusion, ray " + std::to_string (i));
+			Check (!TraceRayClosestHit (topLevel, rays[i], 0, &hit), name + ": instance mask, ray " + std::to_string (i));
+		}
+		Check (hitCount > rays.size () / 8, name + ": too few rays hit to be meaningful");
+	}
+
+	// Rays toward the instances in turn.
+	std::vector<RayDesc> CreateSceneRays (const std::vector<SceneInstance>& instances, UINT rayCount, UINT seed) {
+		std::vector<RayDesc> rays = CreateRays (rayCount, seed);
+		for (UINT i = 0; i < rays.size (); i++) {
+			rays[i].Origin += instances[i % instances.size ()].Offset;
+		}
+		return rays;
+	}
+
+	struct Layout {
+		const char* Name;
+		D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS Flags;
+	};
+
+	const Layout c_Layouts[] = {
+		{"binary", D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_NONE},
+		{"BVH4", c_BuildFlagBvh4},
+		{"BVH8", c_BuildFlagBvh8},
+		{"quantized BVH4", c_BuildFlagBvh4 | c_BuildFlagQuantizedNodes},
+		{"quantized BVH8", c_BuildFlagBvh8 | c_BuildFlagQuantizedNodes},
+	};
+
+	const Layout c_Builders[] = {
+		{"binned SAH", D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_NONE},
+		{"LBVH", D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_BUILD},
+		{"fast trace", D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_TRACE},
+		{"SBVH", D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_TRACE | c_BuildFlagSpatialSplits},
+		{"optimized", D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_TRACE | c_BuildFlagOptimizeHierarchy},
+		{"optimized SBVH", D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_TRACE | c_BuildFlagSpatialSplits | c_BuildFlagOptimizeHierarchy},
+	};
+
+	void TestBuildFlags (Device& device) {
+		Mesh mesh = CreateMesh (3000, 1);
+		const std::vector<RayDesc> rays = CreateRays (400, 2);
+		for (const Layout& builder : c_Builders) {
+			for (const Layout& layout : c_Layouts) {
+				const std::string name = std::string (builder.Name) + ", " + layout.Name;
+				AlignedBuffer result;
+				Build (device, mesh.GetInputs (builder.Flags | layout.Flags), result);
+				if (result.GetHeader ()->NodeWidth == 2) {
+					ValidateHierarchy (name, result.GetHeader (), mesh);
+				}
+				Check (result.GetHeader ()->MaxDepth <= c_MaxBvhDepth, name + ": depth");
+				Check (result.GetHeader ()->SahCost <= result.GetHeader ()->UnoptimizedSahCost * 1.0001f, name + ": the optimizer raised the SAH cost");
+				CheckTraces (name, result.GetHeader (), mesh, rays);
+				CheckPackets (name, result.GetHeader (), rays);
+			}
+		}
+	}
+
+	// Above 2^21 primitives the LBVH sorts 63-bit Morton codes. Coincident centroids and a chain of codes that differ
+	// in one bit each make its radix tree deeper than the traversal stacks unless the builder limits it.
+	void TestDeepLbvh (Device& device) {
+		Mesh mesh;
+		const auto addTriangle = [&mesh] (UINT geometryIndex, const Float3& corner) {
+			const Float3 vertices[3] = {corner, corner + Float3 (0.25f, 0.0f, 0.0f), corner + Float3 (0.0f, 0.25f, 0.0f)};
+			for (const Float3& vertex : vertices) {
+				mesh.Indices[geometryIndex].push_back (UINT16 (mesh.Vertices[geometryIndex].size ()));
+				mesh.Vertices[geometryIndex].push_back (vertex);
+			}
+		};
+		for (UINT bit = 0; bit <= 20; bit++) {
+			const float coordinate = float (1u << bit);
+			addTriangle (0, Float3 (coordinate, 0.0f, 0.0f));
+			addTriangle (0, Float3 (0.0f, coordinate, 0.0f));
+			addTriangle (0, Float3 (0.0f, 0.0f, coordinate));
+		}
+		addTriangle (0, Float3 (float ((1u << 21) - 1)));
+
+		// The coincident triangles share the three vertices of the first.
+		addTriangle (1, Float3 (0.0f));
+		mesh.Indices[1].resize (3 * ((1u << 21) + 50000));
+		for (size_t i = 3; i < mesh.Indices[1].size (); i++) {
+			mesh.Indices[1][i] = mesh.Indices[1][i % 3];
+		}
+
+		AlignedBuffer result;
+		Build (device, mesh.GetInputs (D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_BUILD), result);
+		ValidateHierarchy ("deep LBVH", result.GetHeader (), mesh);
+
+		// Down onto the chain triangles along z, and onto the coincident ones at the origin.
+		for (UINT bit = 0; bit <= 20; bit++) {
+			const Float3 corner (float (1u << bit), 0.0f, 0.0f);
+			const RayDesc ray = {corner + Float3 (0.05f, 0.05f, -1.0f), 0.0f, Float3 (0.0f, 0.0f, 1.0f), 10.0f};
+			RayHit hit;
+			Check (TraceRayClosestHit (result.GetHeader (), ray, 0xFF, &hit) && IsSameDistance (hit.T, 1.0), "deep LBVH: chain ray " + std::to_string (bit));
+			Check (TraceRayOcclusion (result.GetHeader (), ray, 0xFF), "deep LBVH: chain occlusion " + std::to_string (bit));
+		}
+		const RayDesc ray = {Float3 (0.05f, 0.05f, 0.5f), 0.0f, Float3 (0.0f, 0.0f, -1.0f), 10.0f};
+		RayHit hit;
+		Check (TraceRayClosestHit (result.GetHeader (), ray, 0xFF, &hit) && IsSameDistance (hit.T, 0.5), "deep LBVH: ray at the origin");
+	}
+
+	// Updates follow moved vertices in every layout.
+	void TestRefit (Device& device) {
+		Mesh mesh = CreateMesh (2000, 3);
+		const std::vector<RayDesc> rays = CreateRays (300, 4);
+		for (const Layout& layout : c_Layouts) {
+			const std::string name = std::string ("refit ") + layout.Name;
+			const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS flags = layout.Flags | D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_UPDATE;
+			Mesh moved = mesh;
+			AlignedBuffer result;
+			Build (device, moved.GetInputs (flags), result);
+
+			std::mt19937 random (5);
+			for (UINT geometryIndex = 0; geometryIndex < 2; geometryIndex++) {
+				for (Float3& vertex : moved.Vertices[geometryIndex]) {
+					vertex = Float3 (vertex.x * 0.8f + 1.0f, vertex.y, vertex.z) + RandomPoint (random, -0.2f, 0.2f);
+				}
+			}
+			Build (device, moved.GetInputs (flags | D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PERFORM_UPDATE), result);
+			if (result.GetHeader ()->NodeWidth == 2) {
+				ValidateHierarchy (name, result.GetHeader (), moved, true);
+			}
+			CheckTraces (name, result.GetHeader (), moved, rays);
+		}
+	}
+
+	// A compacted copy is no larger than reported and keeps what the rays hit.
+	void TestCompaction (Device& device) {
+		Mesh mesh = CreateMesh (2000, 8);
+		const std::vector<RayDesc> rays = CreateRays (200, 9);
+		for (const Layout& layout : c_Layouts) {
+			const std::string name = std::string ("compacted ") + layout.Name;
+			AlignedBuffer result;
+			Build (device, mesh.GetInputs (layout.Flags | D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_COMPACTION), result);
+			const D3D12_GPU_VIRTUAL_ADDRESS source = result.GetAddress ();
+
+			AlignedBuffer postbuildInfo (sizeof (D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_COMPACTED_SIZE_DESC));
+			const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_DESC infoDesc = {postbuildInfo.GetAddress (), D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_COMPACTED_SIZE};
+			device.EmitRaytracingAccelerationStructurePostbuildInfo (&infoDesc, 1, &source);
+			const UINT64 compactedSize = reinterpret_cast<const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_COMPACTED_SIZE_DESC*> (postbuildInfo.GetData ())->CompactedSizeInBytes;
+			Check (compactedSize <= result.GetHeader ()->SizeInBytes, name + ": compacted size");
+
+			AlignedBuffer compacted (compactedSize);
+			device.CopyRaytracingAccelerationStructure (compacted.GetAddress (), source, D3D12_RAYTRACING_ACCELERATION_STRUCTURE_COPY_MODE_COMPACT);
+			Check (compacted.GetHeader ()->SizeInBytes <= compactedSize, name + ": size of the copy");
+			if (compacted.GetHeader ()->NodeWidth == 2) {
+				ValidateHierarchy (name, compacted.GetHeader (), mesh);
+			}
+			CheckTraces (name, compacted.GetHeader (), mesh, rays);
+		}
+	}
+
+	// Instances of one bottom-level structure at different places.
+	void TestTopLevel (Device& device) {
+		Mesh mesh = CreateMesh (2000, 6);
+		const std::vector<SceneInstance> instances = {{&mesh, Float3 (0.0f), 0}, {&mesh, Float3 (12.0f, 0.0f, 0.0f), 0}, {&mesh, Float3 (0.0f, 12.0f, 0.0f), 0}};
+		const std::vector<RayDesc> rays = CreateSceneRays (instances, 600, 7);
+		for (const Layout& layout : c_Layouts) {
+			const std::string name = std::string ("top level ") + layout.Name;
+			AlignedBuffer bottomLevel;
+			Build (device, mesh.GetInputs (layout.Flags), bottomLevel);
+			const std::vector<D3D12_RAYTRACING_INSTANCE_DESC> instanceDescs = GetInstanceDescs (instances, bottomLevel.GetAddress ());
+			AlignedBuffer topLevel;
+			Build (device, GetTopLevelInputs (instanceDescs, layout.Flags), topLevel);
+			CheckSceneTraces (name, topLevel.GetHeader (), instances, rays);
+			CheckPackets (name, topLevel.GetHeader (), rays);
+		}
+	}
+
+	// Triangles one unit deep along x, every 16 units up to x = 240, at whole-number coordinates: 8-bit planes over
+	// whole-number node origins then hold their boxes exactly, with no outward rounding to spare. Rays clip the
+	// corner of each box at the vertex of largest x and least y, entering through the lower y plane a few millionths
+	// before leaving through the upper x plane, while the node origins lie tens of units away. Quantized nodes must
+	// find every hit the float layout finds.
+	void TestGrazingQuantized (Device& device) {
+		Mesh mesh;
+		std::vector<RayDesc> rays;
+		for (UINT i = 1; i <= 15; i++) {
+			for (UINT row = 0; row < 2; row++) {
+				const Float3 vertex (float (16 * i), 0.0f, float (2 * row));
+				const Float3 vertices[3] = {vertex, vertex + Float3 (-1.0f, 1.0f, 0.0f), vertex + Float3 (-1.0f, 0.0f, 1.0f)};
+				for (const Float3& v : vertices) {
+					mesh.Indices[row].push_back (UINT16 (mesh.Vertices[row].size ()));
+					mesh.Vertices[row].push_back (v);
+				}
+				// Inside the box over the last 3a of the unit run in x and y, where it hits the triangle at
+				// vertex + (-2a, a, a).
+				for (int exponent = -21; exponent <= -14; exponent++) {
+					const float a = std::ldexp (1.0f, exponent);
+					rays.push_back ({vertex + Float3 (-1.0f, 3.0f * a - 1.0f, a), 0.0f, Float3 (0.7f, 0.7f, 0.0f), std::numeric_limits<float>::infinity ()});
+				}
+			}
+		}
+
+		const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS c_Widths[] = {c_BuildFlagBvh4, c_BuildFlagBvh8};
+		for (const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS width : c_Widths) {
+			const std::string name = width == c_BuildFlagBvh4 ? "grazing quantized BVH4" : "grazing quantized BVH8";
+			AlignedBuffer floatNodes;
+			Build (device, mesh.GetInputs (width), floatNodes);
+			AlignedBuffer quantizedNodes;
+			Build (device, mesh.GetInputs (width | c_BuildFlagQuantizedNodes), quantizedNodes);
+
+			UINT hitCount = 0;
+			for (UINT i = 0; i < rays.size (); i++) {
+				RayHit floatHit;
+				RayHit quantizedHit;
+				const bool found = TraceRayClosestHit (floatNodes.GetHeader (), rays[i], 0xFF, &floatHit);
+				Check (TraceRayClosestHit (quantizedNodes.GetHeader (), rays[i], 0xFF, &quantizedHit) == found && (!found || quantizedHit.T == floatHit.T),
+					name + ": closest hit, ray " + std::to_string (i));
+				Check (TraceRayOcclusion (quantizedNodes.GetHeader (), rays[i], 0xFF) == found, name + ": occlusion, ray " + std::to_string (i));
+				hitCount += found ? 1 : 0;
+			}
+			Check (hitCount == rays.size (), name + ": the float layout missed " + std::to_string (rays.size () - hitCount) + " rays");
+		}
+	}
+
+	// Serialization through a file mapped back in, and deserialization, keep what the rays hit.
+	void TestSerialization (Device& device) {
+		Mesh mesh = CreateMesh (2000, 8);
+		const std::vector<RayDesc> rays = CreateRays (200, 9);
+		for (const Layout& layout : c_Layouts) {
+			const std::string name = std::string ("serialized ") + layout.Name;
+			const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS inputs = mesh.GetInputs (layout.Flags);
+			AlignedBuffer result;
+			Build (device, inputs, result);
+			const D3D12_GPU_VIRTUAL_ADDRESS source = result.GetAddress ();
+
+			AlignedBuffer postbuildInfo (sizeof (D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_SERIALIZATION_DESC));
+			const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_DESC infoDesc = {postbuildInfo.GetAddress (), D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_SERIALIZATION};
+			device.EmitRaytracingAccelerationStructurePostbuildInfo (&infoDesc, 1, &source);
+			const UINT64 serializedSize = reinterpret_cast<const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_SERIALIZATION_DESC*> (postbuildInfo.GetData ())->SerializedSizeInBytes;
+			AlignedBuffer serialized (serializedSize);
+			const UINT64 inputHash = HashBuildInputs (inputs);
+			SerializeAccelerationStructure (serialized.GetData (), result.GetHeader (), inputHash);
+			Check (IsSerializedAccelerationStructureCurrent (serialized.GetData (), serializedSize, inputs, inputHash), name + ": serialized data is current");
+
+			auto header = reinterpret_cast<const D3D12_SERIALIZED_RAYTRACING_ACCELERATION_STRUCTURE_HEADER*> (serialized.GetData ());
+			AlignedBuffer deserialized (header->DeserializedSizeInBytes);
+			device.CopyRaytracingAccelerationStructure (deserialized.GetAddress (), serialized.GetAddress (), D3D12_RAYTRACING_ACCELERATION_STRUCTURE_COPY_MODE_DESERIALIZE);
+			CheckTraces (name + " deserialized", deserialized.GetHeader (), mesh, rays);
+
+			const std::string path = "CpuRaytracingTests.serialized";
+			FILE* file = fopen (path.c_str (), "wb");
+			Check (file && fwrite (serialized.GetData (), 1, size_t (serializedSize), file) == serializedSize, name + ": writing the serialized file");
+			if (file) {
+				fclose (file);
+			}
+			MappedFile mappedFile;
+			Check (mappedFile.Open (path.c_str ()), name + ": mapping the serialized file");
+			if (mappedFile.GetData ()) {
+				Check (IsSerializedAccelerationStructureCurrent (mappedFile.GetData (), mappedFile.GetSize (), inputs, inputHash), name + ": mapped data is current");
+				const D3D12_GPU_VIRTUAL_ADDRESS mapped = GetSerializedBottomLevelAccelerationStructure (mappedFile.GetData ());
+				CheckTraces (name + " mapped", GetCpuPointer<const AccelerationStructureHeader> (mapped), mesh, rays);
+			}
+			mappedFile.Close ();
+			remove (path.c_str ());
+
+			mesh.Vertices[1][0].x += 1.0f;
+			Check (HashBuildInputs (inputs) != inputHash, name + ": input hash follows the vertices");
+			mesh.Vertices[1][0].x -= 1.0f;
+		}
+	}
+
+	// A top-level build reads the bounds of its bottom-level structures, so rebuilding one over edited vertices, in
+	// place, makes a serialized top level stale although no instance desc changed.
+	void TestSerializedTopLevel (Device& device) {
+		Mesh mesh = CreateMesh (1000, 19);
+		AlignedBuffer bottomLevel;
+		Build (device, mesh.GetInputs (D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_NONE), bottomLevel);
+		const std::vector<SceneInstance> instances = {{&mesh, Float3 (0.0f), 0}, {&mesh, Float3 (12.0f, 0.0f, 0.0f), 0}};
+		const std::vector<D3D12_RAYTRACING_INSTANCE_DESC> instanceDescs = GetInstanceDescs (instances, bottomLevel.GetAddress ());
+		const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS inputs = GetTopLevelInputs (instanceDescs, D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_NONE);
+		AlignedBuffer topLevel;
+		Build (device, inputs, topLevel);
+
+		const UINT64 serializedSize = GetSerializedSize (topLevel.GetHeader ());
+		AlignedBuffer serialized (serializedSize);
+		SerializeAccelerationStructure (serialized.GetData (), topLevel.GetHeader (), HashBuildInputs (inputs));
+		Check (IsSerializedAccelerationStructureCurrent (serialized.GetData (), serializedSize, inputs, HashBuildInputs (inputs)), "serialized top level: current");
+
+		auto header = reinterpret_cast<const D3D12_SERIALIZED_RAYTRACING_ACCELERATION_STRUCTURE_HEADER*> (serialized.GetData ());
+		const std::vector<D3D12_GPU_VIRTUAL_ADDRESS> bottomLevels (size_t (header->NumBottomLevelAccelerationStructurePointersAfterHeader), bottomLevel.GetAddress ());
+		AlignedBuffer deserialized (header->DeserializedSizeInBytes);
+		DeserializeAccelerationStructure (deserialized.GetData (), serialized.GetData (), bottomLevels.data ());
+		CheckSceneTraces ("serialized top level", deserialized.GetHeader (), instances, CreateSceneRays (instances, 200, 20));
+
+		const std::vector<Float3> vertices = mesh.Vertices[0];
+		for (Float3& vertex : mesh.Vertices[0]) {
+			vertex = vertex * 1.5f;
+		}
+		Build (device, mesh.GetInputs (D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_NONE), bottomLevel);
+		Check (instanceDescs[0].AccelerationStructure == bottomLevel.GetAddress (), "serialized top level: the bottom level was rebuilt in place");
+		Check (!IsSerializedAccelerationStructureCurrent (serialized.GetData (), serializedSize, inputs, HashBuildInputs (inputs)),
+			"serialized top level: current after a bottom-level rebuild");
+
+		mesh.Vertices[0] = vertices;
+		Build (device, mesh.GetInputs (D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_NONE), bottomLevel);
+		Check (IsSerializedAccelerationStructureCurrent (serialized.GetData (), serializedSize, inputs, HashBuildInputs (inputs)),
+			"serialized top level: stale once the bottom level is restored");
+	}
+
+	bool IsSamePrebuildInfo (const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO& a, const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO& b) {
+		return a.ResultDataMaxSizeInBytes == b.ResultDataMaxSizeInBytes && a.ScratchDataSizeInBytes == b.ScratchDataSizeInBytes &&
+			a.UpdateScratchDataSizeInBytes == b.UpdateScratchDataSizeInBytes;
+	}
+
+	// For every combination of builder, layout and update and compaction flags, and for top levels, the estimate
+	// matches the device and covers the build. Every structure is built where a plan over all of them places it.
+	void TestPrebuildInfo (Device& device) {
+		Mesh mesh = CreateMesh (1000, 21);
+		const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS c_Options[] = {
+			D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_NONE,
+			D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_UPDATE,
+			D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_COMPACTION,
+			D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_UPDATE | D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_COMPACTION,
+		};
+		AlignedBuffer bottomLevel;
+		Build (device, mesh.GetInputs (D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_NONE), bottomLevel);
+		std::vector<D3D12_RAYTRACING_INSTANCE_DESC> instanceDescs;
+		for (UINT i = 0; i < 5; i++) {
+			instanceDescs.push_back (GetInstanceDesc (Float3 (12.0f * i, 0.0f, 0.0f), i, 0, bottomLevel.GetAddress ()));
+		}
+
+		std::vector<D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS> inputs;
+		std::vector<std::string> names;
+		for (const Layout& layout : c_Layouts) {
+			for (const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS option : c_Options) {
+				for (const Layout& builder : c_Builders) {
+					inputs.push_back (mesh.GetInputs (builder.Flags | layout.Flags | option));
+					names.push_back (std::string ("prebuild ") + builder.Name + ", " + layout.Name + ", options " + std::to_string (option));
+				}
+				inputs.push_back (GetTopLevelInputs (instanceDescs, layout.Flags | option));
+				names.push_back (std::string ("prebuild top level ") + layout.Name + ", options " + std::to_string (option));
+			}
+		}
+
+		const UINT count = UINT (inputs.size ());
+		std::vector<D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO> infos (count);
+		std::vector<UINT64> resultOffsets (count);
+		std::vector<UINT64> scratchOffsets (count);
+		const AccelerationStructureMemoryPlan plan = PlanAccelerationStructureMemory (count, inputs.data (), infos.data (), resultOffsets.data (), scratchOffsets.data ());
+		AlignedBuffer results (plan.ResultDataSizeInBytes);
+		AlignedBuffer scratch (plan.ScratchDataTotalSizeInBytes);
+
+		UINT64 resultSize = 0;
+		UINT64 scratchSize = 0;
+		UINT64 maxScratchSize = 0;
+		UINT64 maxUpdateScratchSize = 0;
+		for (UINT i = 0; i < count; i++) {
+			D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO deviceInfo;
+			device.GetRaytracingAccelerationStructurePrebuildInfo (&inputs[i], &deviceInfo);
+			D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO estimate;
+			GetRaytracingAccelerationStructurePrebuildInfo (inputs[i], &estimate);
+			Check (IsSamePrebuildInfo (estimate, deviceInfo), names[i] + ": the estimate differs from the device");
+			Check (IsSamePrebuildInfo (infos[i], deviceInfo), names[i] + ": the plan differs from the device");
+			Check (resultOffsets[i] == resultSize && scratchOffsets[i] == scratchSize, names[i] + ": offsets");
+			resultSize += infos[i].ResultDataMaxSizeInBytes;
+			scratchSize += infos[i].ScratchDataSizeInBytes;
+			maxScratchSize = std::max (maxScratchSize, infos[i].ScratchDataSizeInBytes);
+			maxUpdateScratchSize = std::max (maxUpdateScratchSize, infos[i].UpdateScratchDataSizeInBytes);
+
+			D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC buildDesc = {};
+			buildDesc.DestAccelerationStructureData = results.GetAddress () + resultOffsets[i];
+			buildDesc.Inputs = inputs[i];
+			buildDesc.ScratchAccelerationStructureData = scratch.GetAddress () + scratchOffsets[i];
+			device.BuildRaytracingAccelerationStructure (&buildDesc);
+			const AccelerationStructureHeader* header = GetAccelerationStructure (buildDesc.DestAccelerationStructureData);
+			Check (header->SizeInBytes <= deviceInfo.ResultDataMaxSizeInBytes, names[i] + ": the build outgrew the estimate");
+		}
+		Check (plan.ResultDataSizeInBytes == resultSize && plan.ScratchDataTotalSizeInBytes == scratchSize, "prebuild: plan totals");
+		Check (plan.ScratchDataMaxSizeInBytes == maxScratchSize && plan.UpdateScratchDataMaxSizeInBytes == maxUpdateScratchSize, "prebuild: plan maxima");
+	}
+
+	// Sections start on cache lines, and builds reject destinations that are not 256-byte aligned.
+	void TestAlignment (Device& device) {
+		Mesh mesh = CreateMesh (500, 22);
+		for (const Layout& layout : c_Layouts) {
+			const std::string name = std::string ("alignment ") + layout.Name;
+			const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS inputs = mesh.GetInputs (layout.Flags);
+			AlignedBuffer result;
+			Build (device, inputs, result);
+			const AccelerationStructureHeader* header = result.GetHeader ();
+			for (const UINT64 offset : {header->GeometryOffset, header->NodeOffset, header->TriangleOffset, header->PrimitiveOffset, header->InstanceOffset}) {
+				Check (offset % c_SectionAlignment == 0, name + ": section offset " + std::to_string (offset));
+			}
+
+			D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO prebuildInfo;
+			device.GetRaytracingAccelerationStructurePrebuildInfo (&inputs, &prebuildInfo);
+			AlignedBuffer misaligned (prebuildInfo.ResultDataMaxSizeInBytes + c_SectionAlignment);
+			AlignedBuffer scratch (prebuildInfo.ScratchDataSizeInBytes);
+			D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC buildDesc = {};
+			buildDesc.DestAccelerationStructureData = misaligned.GetAddress () + c_SectionAlignment;
+			buildDesc.Inputs = inputs;
+			buildDesc.ScratchAccelerationStructureData = scratch.GetAddress ();
+			Check (Throws ([&] () { device.BuildRaytracingAccelerationStructure (&buildDesc); }), name + ": misaligned destination accepted");
+		}
+	}
+
+	// Whether text is one JSON value, strictly.
+	class JsonValidator {
+	public:
+		explicit JsonValidator (const std::string& text) : m_Text (text), m_Position (0) {}
+
+		bool IsValid () {
+			if (!ParseValue ()) {
+				return false;
+			}
+			SkipSpace ();
+			return m_Position == m_Text.size ();
+		}
+
+	private:
+		void SkipSpace () {
+			while (m_Position < m_Text.size () && strchr (" \t\r\n", m_Text[m_Position]) != nullptr) {
+				m_Position++;
+			}
+		}
+
+		bool Consume (char c) {
+			SkipSpace ();
+			if (m_Position < m_Text.size () && m_Text[m_Position] == c) {
+				m_Position++;
+				return true;
+			}
+			return false;
+		}
+
+		bool ParseString () {
+			if (!Consume ('"')) {
+				return false;
+			}
+			while (m_Position < m_Text.size () && m_Text[m_Position] != '"') {
+				if (UINT8 (m_Text[m_Position]) < 0x20) {
+					return false;
+				}
+				m_Position += m_Text[m_Position] == '\\' ? 2 : 1;
+			}
+			return Consume ('"');
+		}
+
+		// JSON numbers: no leading '+', no leading zeros, no bare '.', no hex, infinities or NaN.
+		bool ParseNumber () {
+			size_t position = m_Position;
+			const auto digits = [this, &position] () {
+				const size_t start = position;
+				while (position < m_Text.size () && m_Text[position] >= '0' && m_Text[position] <= '9') {
+					position++;
+				}
+				return position - start;
+			};
+			if (position < m_Text.size () && m_Text[position] == '-') {
+				position++;
+			}
+			const size_t integerStart = position;
+			const size_t integerDigits = digits ();
+			if (integerDigits == 0 || (integerDigits > 1 && m_Text[integerStart] == '0')) {
+				return false;
+			}
+			if (position < m_Text.size () && m_Text[position] == '.') {
+				position++;
+				if (digits () == 0) {
+					return false;
+				}
+			}
+			if (position < m_Text.size () && (m_Text[position] == 'e' || m_Text[position] == 'E')) {
+				position++;
+				if (position < m_Text.size () && (m_Text[position] == '+' || m_Text[position] == '-')) {
+					position++;
+				}
+				if (digits () == 0) {
+					return false;
+				}
+			}
+			m_Position = position;
+			return true;
+		}
+
+		bool ParseLiteral (const char* literal) {
+			if (m_Text.compare (m_Position, strlen (literal), literal) != 0) {
+				return false;
+			}
+			m_Position += strlen (literal);
+			return true;
+		}
+
+		template <typename ParseElement>
+		bool ParseList (char open, char close, const ParseElement& parseElement) {
+			if (!Consume (open)) {
+				return false;
+			}
+			if (Consume (close)) {
+				return true;
+			}
+			do {
+				if (!parseElement ()) {
+					return false;
+				}
+			} while (Consume (','));
+			return Consume (close);
+		}
+
+		bool ParseValue () {
+			SkipSpace ();
+			if (m_Position >= m_Text.size ()) {
+				return false;
+			}
+			switch (m_Text[m_Position]) {
+			case '{':
+				return ParseList ('{', '}', [this] () { return ParseString () && Consume (':') && ParseValue (); });
+			case '[':
+				return ParseList ('[', ']', [this] () { return ParseValue (); });
+			case '"':
+				return ParseString ();
+			case 't':
+				return ParseLiteral ("true");
+			case 'f':
+				return ParseLiteral ("false");
+			case 'n':
+				return ParseLiteral ("null");
+			default:
+				return ParseNumber ();
+			}
+		}
+
+		const std::string& m_Text;
+		size_t m_Position;
+	};
+
+	// Reports are JSON, their histograms add up, and a deserialized structure reports what the original did.
+	void TestQualityReport (Device& device) {
+		Mesh mesh = CreateMesh (2000, 23);
+		for (const Layout& builder : c_Builders) {
+			for (const Layout& layout : c_Layouts) {
+				const std::string name = std::string ("report ") + builder.Name + ", " + layout.Name;
+				AlignedBuffer result;
+				Build (device, mesh.GetInputs (builder.Flags | layout.Flags), result);
+				const AccelerationStructureStatistics statistics = GetAccelerationStructureStatistics (result.GetHeader ());
+				const std::string report = FormatQualityReport (statistics);
+				Check (JsonValidator (report).IsValid (), name + ": not JSON");
+
+				UINT sizeLeafCount = 0;
+				UINT64 primitiveCount = 0;
+				for (UINT size = 0; size < statistics.LeafSizeHistogram.size (); size++) {
+					sizeLeafCount += statistics.LeafSizeHistogram[size];
+					primitiveCount += UINT64 (size) * statistics.LeafSizeHistogram[size];
+				}
+				UINT depthLeafCount = 0;
+				for (UINT depth = 0; depth < statistics.LeafDepthHistogram.size (); depth++) {
+					depthLeafCount += statistics.LeafDepthHistogram[depth];
+					Check (depth <= statistics.MaxDepth || statistics.LeafDepthHistogram[depth] == 0, name + ": leaf below MaxDepth");
+				}
+				Check (sizeLeafCount == statistics.LeafCount && depthLeafCount == statistics.LeafCount, name + ": histograms against LeafCount");
+				Check (primitiveCount == statistics.PrimitiveCount && statistics.PrimitiveCount >= 2000, name + ": leaf sizes against PrimitiveCount");
+
+				// Serialized copies are compacted, which only changes the size.
+				AlignedBuffer serialized (GetSerializedSize (result.GetHeader ()));
+				SerializeAccelerationStructure (serialized.GetData (), result.GetHeader ());
+				auto header = reinterpret_cast<const D3D12_SERIALIZED_RAYTRACING_ACCELERATION_STRUCTURE_HEADER*> (serialized.GetData ());
+				AlignedBuffer deserialized (header->DeserializedSizeInBytes);
+				DeserializeAccelerationStructure (deserialized.GetData (), serialized.GetData ());
+				AccelerationStructureStatistics compacted = statistics;
+				compacted.SizeInBytes = statistics.CompactedSizeInBytes;
+				Check (GetQualityReport (deserialized.GetAddress ()) == FormatQualityReport (compacted), name + ": the deserialized structure reports differently");
+			}
+		}
+	}
+
+	// Structures of very different sizes built in one batch, some updated in place and some on pooled scratch, match
+	// those built one by one.
+	void TestBatchBuild (Device& device) {
+		std::vector<Mesh> meshes;
+		for (const UINT triangleCount : {10u, 150u, 2000u, 6000u}) {
+			meshes.push_back (CreateMesh (triangleCount, 24 + triangleCount));
+		}
+		meshes.push_back (CreateGridMesh (182, false, 25));
+		meshes.push_back (CreateMesh (3000, 26));
+		meshes.push_back (CreateMesh (40, 27));
+		const UINT gridIndex = 4;
+		Check (meshes[gridIndex].GetTriangleCount (0) + meshes[gridIndex].GetTriangleCount (1) >= (1u << 16), "batch: the grid is not large enough");
+
+		// The last two are built, moved, then updated in the batch.
+		const UINT count = UINT (meshes.size ());
+		const UINT firstUpdate = count - 2;
+		const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS flags = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_UPDATE;
+		std::vector<AlignedBuffer> results (count);
+		std::vector<AlignedBuffer> references (count);
+		for (UINT i = firstUpdate; i < count; i++) {
+			Build (device, meshes[i].GetInputs (flags), results[i]);
+			Build (device, meshes[i].GetInputs (flags), references[i]);
+			for (Float3& vertex : meshes[i].Vertices[0]) {
+				vertex = vertex * 0.9f + Float3 (0.5f);
+			}
+		}
+
+		// Every other desc brings its own scratch; the others take theirs from the pool.
+		std::vector<AlignedBuffer> scratch (count);
+		std::vector<D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC> buildDescs (count);
+		for (UINT i = 0; i < count; i++) {
+			const bool update = i >= firstUpdate;
+			D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC& buildDesc = buildDescs[i];
+			buildDesc = {};
+			buildDesc.Inputs = meshes[i].GetInputs (update ? flags | D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PERFORM_UPDATE : flags);
+			D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO prebuildInfo;
+			device.GetRaytracingAccelerationStructurePrebuildInfo (&buildDesc.Inputs, &prebuildInfo);
+			if (!update) {
+				results[i].Resize (prebuildInfo.ResultDataMaxSizeInBytes);
+			}
+			buildDesc.DestAccelerationStructureData = results[i].GetAddress ();
+			buildDesc.SourceAccelerationStructureData = update ? results[i].GetAddress () : 0;
+			if (i % 2 == 0) {
+				scratch[i].Resize (update ? prebuildInfo.UpdateScratchDataSizeInBytes : prebuildInfo.ScratchDataSizeInBytes);
+				buildDesc.ScratchAccelerationStructureData = scratch[i].GetAddress ();
+			}
+		}
+		AlignedBuffer scratchPool (device.GetBatchScratchPoolSize (count, buildDescs.data ()));
+		device.BuildRaytracingAccelerationStructures (count, buildDescs.data (), scratchPool.GetAddress ());
+
+		const std::vector<RayDesc> rays = CreateRays (300, 28);
+		for (UINT i = 0; i < count; i++) {
+			const std::string name = "batch " + std::to_string (i);
+			Build (device, buildDescs[i].Inputs, references[i]);
+			Check (results[i].GetHeader ()->PrimitiveCount == references[i].GetHeader ()->PrimitiveCount, name + ": primitive count");
+			for (UINT ray = 0; ray < rays.size (); ray++) {
+				RayHit hit;
+				RayHit reference;
+				const bool found = TraceRayClosestHit (references[i].GetHeader (), rays[ray], 0xFF, &reference);
+				Check (TraceRayClosestHit (results[i].GetHeader (), rays[ray], 0xFF, &hit) == found && (!found || hit.T == reference.T),
+					name + ": closest hit, ray " + std::to_string (ray));
+			}
+		}
+		CheckTraces ("batch grid", results[gridIndex].GetHeader (), meshes[gridIndex], rays);
+		CheckTraces ("batch update", results[firstUpdate].GetHeader (), meshes[firstUpdate], rays);
+	}
+
+	// Boxes tested by an intersection shader that reports where the ray enters them.
+	struct BoxIntersection {
+		static bool Intersect (const Aabb& box, const Float3& origin, const Float3& direction, float tMin, float* t) {
+			float tNear = tMin;
+			float tFar = std::numeric_limits<float>::infinity ();
+			for (UINT axis = 0; axis < 3; axis++) {
+				const float inverse = 1.0f / direction[axis];
+				float t0 = (box.Lower[axis] - origin[axis]) * inverse;
+				float t1 = (box.Upper[axis] - origin[axis]) * inverse;
+				if (t0 > t1) {
+					std::swap (t0, t1);
+				}
+				tNear = std::max (tNear, t0);
+				tFar = std::min (tFar, t1);
+			}
+			*t = tNear;
+			return tNear <= tFar;
+		}
+	};
+
+	std::vector<D3D12_RAYTRACING_AABB> CreateBoxes (UINT count, UINT seed) {
+		std::mt19937 random (seed);
+		std::vector<D3D12_RAYTRACING_AABB> boxes (count);
+		for (D3D12_RAYTRACING_AABB& box : boxes) {
+			const Float3 center = RandomPoint (random, 0.0f, 10.0f);
+			const Float3 extent = RandomPoint (random, 0.05f, 0.3f);
+			box = {center.x - extent.x, center.y - extent.y, center.z - extent.z, center.x + extent.x, center.y + extent.y, center.z + extent.z};
+		}
+		return boxes;
+	}
+
+	D3D12_RAYTRACING_GEOMETRY_DESC GetBoxGeometryDesc (const std::vector<D3D12_RAYTRACING_AABB>& boxes, D3D12_RAYTRACING_GEOMETRY_FLAGS flags) {
+		D3D12_RAYTRACING_GEOMETRY_DESC geometryDesc = {};
+		geometryDesc.Type = D3D12_RAYTRACING_GEOMETRY_TYPE_PROCEDURAL_PRIMITIVE_AABBS;
+		geometryDesc.Flags = flags;
+		geometryDesc.AABBs.AABBCount = boxes.size ();
+		geometryDesc.AABBs.AABBs = {GetCpuVirtualAddress (boxes.data ()), sizeof (D3D12_RAYTRACING_AABB)};
+		return geometryDesc;
+	}
+
+	HitGroup CreateBoxHitGroup () {
+		HitGroup hitGroup;
+		hitGroup.SetHitGroupType (D3D12_HIT_GROUP_TYPE_PROCEDURAL_PRIMITIVE);
+		hitGroup.SetIntersectionShaderImport ([] (IntersectionContext& context) {
+			float t;
+			if (BoxIntersection::Intersect (context.PrimitiveBounds (), context.ObjectRayOrigin (), context.ObjectRayDirection (), context.RayTMin (), &t)) {
+				context.ReportHit (t, 0, context.PrimitiveIndex ());
+			}
+		});
+		return hitGroup;
+	}
+
+	// The box the ray enters first within [TMin, TMax], by the float test the intersection shader runs.
+	bool TraceBoxReference (const std::vector<D3D12_RAYTRACING_AABB>& boxes, const RayDesc& ray, float* t) {
+		bool found = false;
+		*t = ray.TMax;
+		for (const D3D12_RAYTRACING_AABB& box : boxes) {
+			float boxT;
+			const Aabb bounds = {Float3 (box.MinX, box.MinY, box.MinZ), Float3 (box.MaxX, box.MaxY, box.MaxZ)};
+			if (BoxIntersection::Intersect (bounds, ray.Origin, ray.Direction, ray.TMin, &boxT) && boxT <= *t) {
+				*t = boxT;
+				found = true;
+			}
+		}
+		return found;
+	}
+
+	void TestProcedural (Device& device) {
+		std::vector<D3D12_RAYTRACING_AABB> boxes = CreateBoxes (1000, 10);
+		const D3D12_RAYTRACING_GEOMETRY_DESC geometryDesc = GetBoxGeometryDesc (boxes, D3D12_RAYTRACING_GEOMETRY_FLAG_OPAQUE);
+		const HitGroup hitGroup = CreateBoxHitGroup ();
+		const HitGroup* records[] = {&hitGroup};
+		const HitGroupTable hitGroups = {records, 1, 0, 0};
+
+		const std::vector<RayDesc> rays = CreateRays (300, 11);
+		for (const Layout& layout : c_Layouts) {
+			const std::string name = std::string ("procedural ") + layout.Name;
+			const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS inputs = GetBottomLevelInputs (1, &geometryDesc, layout.Flags);
+			AlignedBuffer result;
+			Build (device, inputs, result);
+
+			for (UINT i = 0; i < rays.size (); i++) {
+				float referenceT;
+				const bool referenceFound = TraceBoxReference (boxes, rays[i], &referenceT);
+				RayHit hit;
+				const bool found = TraceRayClosestHit (result.GetHeader (), rays[i], 0, 0xFF, hitGroups, &hit);
+				Check (found == referenceFound && (!found || hit.T == referenceT), name + ": closest hit, ray " + std::to_string (i));
+				Check (TraceRayOcclusion (result.GetHeader (), rays[i], 0, 0xFF, hitGroups) == referenceFound, name + ": occlusion, ray " + std::to_string (i));
+			}
+
+			const UINT64 inputHash = HashBuildInputs (inputs);
+			Check (HashBuildInputs (inputs) == inputHash, name + ": input hash is stable");
+			boxes[0].MaxX += 1.0f;
+			Check (HashBuildInputs (inputs) != inputHash, name + ": input hash follows the boxes");
+			boxes[0].MaxX -= 1.0f;
+		}
+	}
+
+	// Exact for the normal halves the tests store.
+	UINT16 FloatToHalf (float value) {
+		if (value == 0.0f) {
+			return 0;
+		}
+		int exponent;
+		const float mantissa = std::frexp (std::fabs (value), &exponent);
+		const UINT16 bits = UINT16 (((exponent + 14) << 10) | (UINT (mantissa * 2048.0f) & 0x3FF));
+		return value < 0.0f ? UINT16 (bits | 0x8000) : bits;
+	}
+
+	// A 17 x 17 lattice over [-1, 1]^2, two triangles per cell, in whole 64ths so that halves hold it exactly, stored
+	// in each supported vertex and index format. Each must read and trace as the R32G32B32_FLOAT / R32_UINT copy of
+	// the positions it decodes to.
+	void TestFormats (Device& device) {
+		struct Format {
+			const char* Name;
+			DXGI_FORMAT VertexFormat;
+			DXGI_FORMAT IndexFormat;
+		};
+		const Format c_Formats[] = {
+			{"R32G32B32_FLOAT, R16_UINT", DXGI_FORMAT_R32G32B32_FLOAT, DXGI_FORMAT_R16_UINT},
+			{"R32G32B32_FLOAT, R32_UINT", DXGI_FORMAT_R32G32B32_FLOAT, DXGI_FORMAT_R32_UINT},
+			{"R32G32B32_FLOAT, non-indexed", DXGI_FORMAT_R32G32B32_FLOAT, DXGI_FORMAT_UNKNOWN},
+			{"R32G32_FLOAT, R16_UINT", DXGI_FORMAT_R32G32_FLOAT, DXGI_FORMAT_R16_UINT},
+			{"R16G16_FLOAT, R32_UINT", DXGI_FORMAT_R16G16_FLOAT, DXGI_FORMAT_R32_UINT},
+			{"R16G16B16A16_FLOAT, R16_UINT", DXGI_FORMAT_R16G16B16A16_FLOAT, DXGI_FORMAT_R16_UINT},
+			{"R16G16B16A16_FLOAT, non-indexed", DXGI_FORMAT_R16G16B16A16_FLOAT, DXGI_FORMAT_UNKNOWN},
+			{"R16G16_SNORM, R16_UINT", DXGI_FORMAT_R16G16_SNORM, DXGI_FORMAT_R16_UINT},
+			{"R16G16_SNORM, non-indexed", DXGI_FORMAT_R16G16_SNORM, DXGI_FORMAT_UNKNOWN},
+			{"R16G16B16A16_SNORM, R32_UINT", DXGI_FORMAT_R16G16B16A16_SNORM, DXGI_FORMAT_R32_UINT},
+		};
+
+		std::mt19937 random (29);
+		std::uniform_int_distribution<int> heights (-32, 32);
+		std::vector<Float3> lattice;
+		for (int y = 0; y <= 16; y++) {
+			for (int x = 0; x <= 16; x++) {
+				lattice.push_back (Float3 ((x - 8) / 8.0f, (y - 8) / 8.0f, heights (random) / 64.0f));
+			}
+		}
+		std::vector<UINT> latticeIndices;
+		for (UINT y = 0; y < 16; y++) {
+			for (UINT x = 0; x < 16; x++) {
+				const UINT a = y * 17 + x;
+				const UINT indices[6] = {a, a + 1, a + 18, a, a + 18, a + 17};
+				latticeIndices.insert (latticeIndices.end (), indices, indices + 6);
+			}
+		}
+
+		std::vector<RayDesc> rays;
+		for (UINT i = 0; i < 300; i++) {
+			const Float3 origin = RandomPoint (random, -1.5f, 1.5f) * Float3 (1.0f, 1.0f, 0.0f) + Float3 (0.0f, 0.0f, -3.0f);
+			const Float3 target = RandomPoint (random, -1.0f, 1.0f) * Float3 (1.0f, 1.0f, 0.5f);
+			rays.push_back ({origin, 0.0f, target - origin, std::numeric_limits<float>::infinity ()});
+		}
+
+		for (const Format& format : c_Formats) {
+			const std::string name = std::string ("format ") + format.Name;
+			const bool twoComponents = format.VertexFormat == DXGI_FORMAT_R32G32_FLOAT || format.VertexFormat == DXGI_FORMAT_R16G16_FLOAT ||
+				format.VertexFormat == DXGI_FORMAT_R16G16_SNORM;
+			const bool indexed = format.IndexFormat != DXGI_FORMAT_UNKNOWN;
+
+			// The positions as decoded, one per vertex of the buffer, and the indices that reference them.
+			std::vector<Float3> positions = lattice;
+			std::vector<UINT> indices = latticeIndices;
+			if (!indexed) {
+				positions.clear ();
+				for (UINT i = 0; i < latticeIndices.size (); i++) {
+					positions.push_back (lattice[latticeIndices[i]]);
+					indices[i] = i;
+				}
+			}
+			UINT stride = 0;
+			std::vector<UINT8> vertices;
+			for (Float3& position : positions) {
+				if (twoComponents) {
+					position.z = 0.0f;
+				}
+				UINT8 encoded[16];
+				switch (format.VertexFormat) {
+				case DXGI_FORMAT_R16G16_FLOAT:
+				case DXGI_FORMAT_R16G16B16A16_FLOAT: {
+					const UINT16 halves[4] = {FloatToHalf (position.x), FloatToHalf (position.y), FloatToHalf (position.z), FloatToHalf (1.0f)};
+					stride = twoComponents ? 4 : 8;
+					memcpy (encoded, halves, stride);
+					break;
+				}
+				case DXGI_FORMAT_R16G16_SNORM:
+				case DXGI_FORMAT_R16G16B16A16_SNORM: {
+					int16_t snorms[4] = {0, 0, 0, 32767};
+					for (UINT axis = 0; axis < 3; axis++) {
+						snorms[axis] = int16_t (std::lround (position[axis] * 32767.0f));
+						position[axis] = std::max (snorms[axis] / 32767.0f, -1.0f);
+					}
+					stride = twoComponents ? 4 : 8;
+					memcpy (encoded, snorms, stride);
+					break;
+				}
+				default:
+					stride = twoComponents ? 8 : 12;
+					memcpy (encoded, &position, stride);
+					break;
+				}
+				vertices.insert (vertices.end (), encoded, encoded + stride);
+			}
+			const std::vector<UINT16> shortIndices (indices.begin (), indices.end ());
+
+			D3D12_RAYTRACING_GEOMETRY_DESC geometryDesc = {};
+			geometryDesc.Type = D3D12_RAYTRACING_GEOMETRY_TYPE_TRIANGLES;
+			geometryDesc.Flags = D3D12_RAYTRACING_GEOMETRY_FLAG_OPAQUE;
+			geometryDesc.Triangles.VertexFormat = format.VertexFormat;
+			geometryDesc.Triangles.VertexCount = UINT (positions.size ());
+			geometryDesc.Triangles.VertexBuffer = {GetCpuVirtualAddress (vertices.data ()), stride};
+			geometryDesc.Triangles.IndexFormat = format.IndexFormat;
+			if (indexed) {
+				geometryDesc.Triangles.IndexCount = UINT (indices.size ());
+				geometryDesc.Triangles.IndexBuffer = format.IndexFormat == DXGI_FORMAT_R16_UINT ? GetCpuVirtualAddress (shortIndices.data ()) : GetCpuVirtualAddress (indices.data ());
+			}
+
+			D3D12_RAYTRACING_GEOMETRY_DESC referenceDesc = {};
+			referenceDesc.Type = D3D12_RAYTRACING_GEOMETRY_TYPE_TRIANGLES;
+			referenceDesc.Flags = D3D12_RAYTRACING_GEOMETRY_FLAG_OPAQUE;
+			referenceDesc.Triangles.VertexFormat = DXGI_FORMAT_R32G32B32_FLOAT;
+			referenceDesc.Triangles.VertexCount = UINT (positions.size ());
+			referenceDesc.Triangles.VertexBuffer = {GetCpuVirtualAddress (positions.data ()), sizeof (Float3)};
+			referenceDesc.Triangles.IndexFormat = DXGI_FORMAT_R32_UINT;
+			referenceDesc.Triangles.IndexCount = UINT (indices.size ());
+			referenceDesc.Triangles.IndexBuffer = GetCpuVirtualAddress (indices.data ());
+
+			const TriangleGeometryReader reader (geometryDesc.Triangles);
+			const TriangleGeometryReader referenceReader (referenceDesc.Triangles);
+			Check (reader.GetPrimitiveCount () == 512 && referenceReader.GetPrimitiveCount () == 512, name + ": primitive count");
+			for (UINT primitiveIndex = 0; primitiveIndex < std::min (reader.GetPrimitiveCount (), 512u); primitiveIndex++) {
+				UINT triangleIndices[3];
+				UINT referenceIndices[3];
+				reader.GetIndices (primitiveIndex, triangleIndices);
+				referenceReader.GetIndices (primitiveIndex, referenceIndices);
+				Float3 triangle[3];
+				Float3 referenceTriangle[3];
+				reader.GetTriangle (primitiveIndex, triangle);
+				referenceReader.GetTriangle (primitiveIndex, referenceTriangle);
+				Check (memcmp (triangleIndices, referenceIndices, sizeof (triangleIndices)) == 0, name + ": indices of triangle " + std::to_string (primitiveIndex));
+				Check (memcmp (triangle, referenceTriangle, sizeof (triangle)) == 0, name + ": vertices of triangle " + std::to_string (primitiveIndex));
+			}
+
+			AlignedBuffer result;
+			Build (device, GetBottomLevelInputs (1, &geometryDesc, D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_NONE), result);
+			AlignedBuffer reference;
+			Build (device, GetBottomLevelInputs (1, &referenceDesc, D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_NONE), reference);
+			UINT hitCount = 0;
+			for (UINT i = 0; i < rays.size (); i++) {
+				RayHit hit;
+				RayHit referenceHit;
+				const bool found = TraceRayClosestHit (reference.GetHeader (), rays[i], 0xFF, &referenceHit);
+				Check (TraceRayClosestHit (result.GetHeader (), rays[i], 0xFF, &hit) == found &&
+					(!found || (hit.T == referenceHit.T && hit.PrimitiveIndex == referenceHit.PrimitiveIndex)), name + ": closest hit, ray " + std::to_string (i));
+				hitCount += found ? 1 : 0;
+			}
+			Check (hitCount > rays.size () / 2, name + ": too few rays hit to be meaningful");
+		}
+	}
+
+	// Two geometries over one vertex and index buffer, placed apart by their Transform3x4, which builds apply and
+	// updates read again.
+	void TestTransforms (Device& device) {
+		const Mesh shared = CreateMesh (3000, 30);
+		struct alignas (16) Transform {
+			float Rows[3][4];
+		};
+		Transform transforms[2] = {
+			{{{1.0f, 0.0f, 0.0f, 0.0f}, {0.0f, 1.0f, 0.0f, 0.0f}, {0.0f, 0.0f, 1.0f, 0.0f}}},
+			{{{0.0f, -0.5f, 0.0f, 10.0f}, {0.5f, 0.0f, 0.0f, 2.0f}, {0.0f, 0.0f, 0.5f, 3.0f}}},
+		};
+
+		D3D12_RAYTRACING_GEOMETRY_DESC geometryDescs[2];
+		for (UINT i = 0; i < 2; i++) {
+			D3D12_RAYTRACING_GEOMETRY_DESC& desc = geometryDescs[i];
+			desc = {};
+			desc.Type = D3D12_RAYTRACING_GEOMETRY_TYPE_TRIANGLES;
+			desc.Flags = D3D12_RAYTRACING_GEOMETRY_FLAG_OPAQUE;
+			desc.Triangles.Transform3x4 = GetCpuVirtualAddress (&transforms[i]);
+			desc.Triangles.IndexFormat = DXGI_FORMAT_R16_UINT;
+			desc.Triangles.VertexFormat = DXGI_FORMAT_R32G32B32_FLOAT;
+			desc.Triangles.IndexCount = UINT (shared.Indices[0].size ());
+			desc.Triangles.VertexCount = UINT (shared.Vertices[0].size ());
+			desc.Triangles.IndexBuffer = GetCpuVirtualAddress (shared.Indices[0].data ());
+			desc.Triangles.VertexBuffer = {GetCpuVirtualAddress (shared.Vertices[0].data ()), sizeof (Float3)};
+		}
+
+		// The reference holds the transformed vertices.
+		const auto transformMesh = [&shared, &transforms] () {
+			Mesh mesh;
+			for (UINT i = 0; i < 2; i++) {
+				const float (*rows)[4] = transforms[i].Rows;
+				mesh.Indices[i] = shared.Indices[0];
+				for (const Float3& v : shared.Vertices[0]) {
+					mesh.Vertices[i].push_back (Float3 (rows[0][0] * v.x + rows[0][1] * v.y + rows[0][2] * v.z + rows[0][3],
+						rows[1][0] * v.x + rows[1][1] * v.y + rows[1][2] * v.z + rows[1][3], rows[2][0] * v.x + rows[2][1] * v.y + rows[2][2] * v.z + rows[2][3]));
+				}
+			}
+			return mesh;
+		};
+
+		const std::vector<RayDesc> rays = CreateRays (400, 31);
+		for (const Layout& layout : c_Layouts) {
+			const std::string name = std::string ("transform ") + layout.Name;
+			const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS flags = layout.Flags | D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_UPDATE;
+			transforms[1].Rows[2][3] = 3.0f;
+			AlignedBuffer result;
+			Build (device, GetBottomLevelInputs (2, geometryDescs, flags), result);
+			CheckTraces (name, result.GetHeader (), transformMesh (), rays);
+
+			transforms[1].Rows[2][3] = 5.0f;
+			Build (device, GetBottomLevelInputs (2, geometryDescs, flags | D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PERFORM_UPDATE), result);
+			CheckTraces (name + " updated", result.GetHeader (), transformMesh (), rays);
+		}
+	}
+
+	// The facing culls under each combination of TRIANGLE_CULL_DISABLE and TRIANGLE_FRONT_COUNTERCLOCKWISE, which
+	// also flips HitKind (), and opacity forced either way by the instance.
+	void TestInstanceFlags (Device& device) {
+		Mesh mesh = CreateMesh (2000, 32);
+		const UINT cullDisable = D3D12_RAYTRACING_INSTANCE_FLAG_TRIANGLE_CULL_DISABLE;
+		const UINT counterclockwise = D3D12_RAYTRACING_INSTANCE_FLAG_TRIANGLE_FRONT_COUNTERCLOCKWISE;
+		const std::vector<SceneInstance> instances = {
+			{&mesh, Float3 (0.0f), D3D12_RAYTRACING_INSTANCE_FLAG_NONE},
+			{&mesh, Float3 (12.0f, 0.0f, 0.0f), cullDisable},
+			{&mesh, Float3 (0.0f, 12.0f, 0.0f), counterclockwise},
+			{&mesh, Float3 (12.0f, 12.0f, 0.0f), cullDisable | counterclockwise},
+		};
+		const std::vector<RayDesc> rays = CreateSceneRays (instances, 800, 33);
+		const UINT c_RayFlags[] = {RAY_FLAG_NONE, RAY_FLAG_CULL_BACK_FACING_TRIANGLES, RAY_FLAG_CULL_FRONT_FACING_TRIANGLES};
+
+		// Ignores every candidate, so that a ray hits only opaque triangles.
+		UINT anyHitCount = 0;
+		HitGroup hitGroup;
+		hitGroup.SetAnyHitShaderImport ([&anyHitCount] (AnyHitContext& context) {
+			anyHitCount++;
+			context.IgnoreHit ();
+		});
+		const HitGroup* records[] = {&hitGroup};
+		const HitGroupTable hitGroups = {records, 1, 0, 0};
+
+		struct Opacity {
+			D3D12_RAYTRACING_GEOMETRY_FLAGS GeometryFlags;
+			UINT InstanceFlags;
+			bool Opaque;
+		};
+		const Opacity c_Opacities[] = {
+			{D3D12_RAYTRACING_GEOMETRY_FLAG_OPAQUE, D3D12_RAYTRACING_INSTANCE_FLAG_NONE, true},
+			{D3D12_RAYTRACING_GEOMETRY_FLAG_NONE, D3D12_RAYTRACING_INSTANCE_FLAG_NONE, false},
+			{D3D12_RAYTRACING_GEOMETRY_FLAG_NONE, D3D12_RAYTRACING_INSTANCE_FLAG_FORCE_OPAQUE, true},
+			{D3D12_RAYTRACING_GEOMETRY_FLAG_OPAQUE, D3D12_RAYTRACING_INSTANCE_FLAG_FORCE_NON_OPAQUE, false},
+		};
+
+		for (const Layout& layout : c_Layouts) {
+			AlignedBuffer bottomLevel;
+			Build (device, mesh.GetInputs (layout.Flags), bottomLevel);
+			const std::vector<D3D12_RAYTRACING_INSTANCE_DESC> instanceDescs = GetInstanceDescs (instances, bottomLevel.GetAddress ());
+			AlignedBuffer topLevel;
+			Build (device, GetTopLevelInputs (instanceDescs, layout.Flags), topLevel);
+			for (const UINT rayFlags : c_RayFlags) {
+				CheckSceneTraces (std::string ("instance flags ") + layout.Name + ", ray flags " + std::to_string (rayFlags), topLevel.GetHeader (), instances, rays, rayFlags);
+			}
+
+			for (const Opacity& opacity : c_Opacities) {
+				const std::string name = std::string ("instance opacity ") + layout.Name + ", instance flags " + std::to_string (opacity.InstanceFlags) +
+					", geometry flags " + std::to_string (opacity.GeometryFlags);
+				const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS inputs = mesh.GetInputs (layout.Flags);
+				mesh.GeometryDescs[0].Flags = mesh.GeometryDescs[1].Flags = opacity.GeometryFlags;
+				Build (device, inputs, bottomLevel);
+				const std::vector<D3D12_RAYTRACING_INSTANCE_DESC> opacityDescs = {GetInstanceDesc (Float3 (0.0f), 100, opacity.InstanceFlags, bottomLevel.GetAddress ())};
+				Build (device, GetTopLevelInputs (opacityDescs, layout.Flags), topLevel);
+
+				for (UINT i = 0; i < rays.size (); i += 4) {
+					const ReferenceHit reference = TraceReference (mesh, rays[i]);
+					if (reference.Ambiguous) {
+						continue;
+					}
+					anyHitCount = 0;
+					RayHit hit;
+					const bool found = TraceRayClosestHit (topLevel.GetHeader (), rays[i], 0, 0xFF, hitGroups, &hit);
+					Check (found == (opacity.Opaque && reference.Found) && (anyHitCount != 0) == (!opacity.Opaque && reference.Found),
+						name + ": closest hit, ray " + std::to_string (i));
+					anyHitCount = 0;
+					Check (TraceRayOcclusion (topLevel.GetHeader (), rays[i], 0, 0xFF, hitGroups) == (opacity.Opaque && reference.Found) &&
+						(anyHitCount != 0) == (!opacity.Opaque && reference.Found), name + ": occlusion, ray " + std::to_string (i));
+				}
+			}
+		}
+	}
+
+	// Moves every triangle of a mesh made by CreateMesh () by a random offset of up to distance from where it started.
+	void ScatterTriangles (Mesh& mesh, const Mesh& start, float distance, std::mt19937& random) {
+		for (UINT geometryIndex = 0; geometryIndex < 2; geometryIndex++) {
+			for (UINT vertex = 0; vertex < mesh.Vertices[geometryIndex].size (); vertex += 3) {
+				const Float3 offset = RandomPoint (random, -distance, distance);
+				for (UINT i = vertex; i < vertex + 3; i++) {
+					mesh.Vertices[geometryIndex][i] = start.Vertices[geometryIndex][i] + offset;
+				}
+			}
+		}
+	}
+
+	const AccelerationStructureHeader* GetTopLevel (const AccelerationStructureManager& manager) {
+		return GetAccelerationStructure (manager.GetTopLevelAddress ());
+	}
+
+	// Refits while the SAH cost stays below RebuildThreshold, then rebuilds the structures that crossed it within
+	// FrameBuildBudget, most degraded first, deferring the others; and rebuilds the top level when the instance
+	// count changes.
+	void TestManager (Device& device) {
+		const Mesh starts[2] = {CreateMesh (1500, 34), CreateMesh (1500, 35)};
+		Mesh meshes[2] = {starts[0], starts[1]};
+		AccelerationStructureManager::Settings settings;
+		settings.RebuildThreshold = 1.5f;
+		settings.FrameBuildBudget = 1e6;
+		AccelerationStructureManager manager (device, settings);
+		for (Mesh& mesh : meshes) {
+			manager.AddBottomLevel (mesh.GetInputs (D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_TRACE));
+		}
+		std::vector<SceneInstance> instances = {{&meshes[0], Float3 (0.0f), 0}, {&meshes[1], Float3 (12.0f, 0.0f, 0.0f), 0}};
+		const UINT bottomLevelIndices[3] = {0, 1, 0};
+		manager.SetInstances (2, GetInstanceDescs (instances, 0).data (), bottomLevelIndices);
+		manager.Update ();
+		const AccelerationStructureManager::Counters& counters = manager.GetFrameCounters ();
+		Check (counters.Refits == 2 && counters.Rebuilds == 0 && counters.TopLevelRebuilds == 1, "manager: first update");
+		const std::vector<RayDesc> rays = CreateSceneRays (instances, 200, 36);
+		CheckSceneTraces ("manager: first update", GetTopLevel (manager), instances, rays);
+
+		// Mesh 0 drifts apart frame by frame, and is rebuilt in the Update () after the refit that crossed the
+		// threshold.
+		std::mt19937 random (37);
+		bool rebuilt = false;
+		for (UINT frame = 0; frame < 40 && !rebuilt; frame++) {
+			const std::string name = "manager: frame " + std::to_string (frame);
+			ScatterTriangles (meshes[0], starts[0], 0.25f * (frame + 1), random);
+			rebuilt = manager.GetDegradation (0) >= settings.RebuildThreshold;
+			manager.Update ();
+			Check (counters.Rebuilds == (rebuilt ? 1u : 0u) && counters.Refits == (rebuilt ? 1u : 2u) && counters.DeferredRebuilds == 0, name + ": counters");
+			Check (!rebuilt || manager.GetDegradation (0) == 1.0f, name + ": degradation after the rebuild");
+			Check (counters.TopLevelRefits + counters.TopLevelRebuilds == 1, name + ": top level");
+			CheckSceneTraces (name, GetTopLevel (manager), instances, rays);
+		}
+		Check (rebuilt, "manager: the refits never degraded the structure past RebuildThreshold");
+
+		// With both due and no budget, the more degraded one is rebuilt, and the other in the next Update ().
+		AccelerationStructureManager::Settings lenient = settings;
+		lenient.RebuildThreshold = 1e9f;
+		manager.SetSettings (lenient);
+		for (UINT frame = 0; frame < 40 && std::min (manager.GetDegradation (0), manager.GetDegradation (1)) < settings.RebuildThreshold; frame++) {
+			ScatterTriangles (meshes[0], starts[0], 0.25f * (frame + 1), random);
+			ScatterTriangles (meshes[1], starts[1], 0.5f * (frame + 1), random);
+			manager.Update ();
+		}
+		Check (std::min (manager.GetDegradation (0), manager.GetDegradation (1)) >= settings.RebuildThreshold, "manager: both structures due");
+		const UINT moreDegraded = manager.GetDegradation (0) >= manager.GetDegradation (1) ? 0 : 1;
+		AccelerationStructureManager::Settings noBudget = settings;
+		noBudget.FrameBuildBudget = 0.0;
+		manager.SetSettings (noBudget);
+		manager.Update ();
+		Check (counters.Rebuilds == 1 && counters.DeferredRebuilds == 1 && counters.Refits == 1, "manager: no budget");
+		Check (manager.GetDegradation (moreDegraded) == 1.0f && manager.GetDegradation (1 - moreDegraded) >= settings.RebuildThreshold,
+			"manager: the more degraded structure goes first");
+		manager.Update ();
+		Check (counters.Rebuilds == 1 && counters.DeferredRebuilds == 0, "manager: the deferred rebuild");
+		CheckSceneTraces ("manager: after the deferred rebuild", GetTopLevel (manager), instances, rays);
+
+		// Moving an instance refits the top level; adding one rebuilds it.
+		manager.SetSettings (settings);
+		instances[1].Offset = Float3 (12.0f, 0.5f, 0.0f);
+		manager.SetInstances (2, GetInstanceDescs (instances, 0).data (), bottomLevelIndices);
+		manager.Update ();
+		Check (counters.TopLevelRefits == 1 && counters.TopLevelRebuilds == 0, "manager: moved instance");
+		CheckSceneTraces ("manager: moved instance", GetTopLevel (manager), instances, rays);
+		instances.push_back ({&meshes[0], Float3 (0.0f, 12.0f, 0.0f), 0});
+		manager.SetInstances (3, GetInstanceDescs (instances, 0).data (), bottomLevelIndices);
+		manager.Update ();
+		Check (counters.TopLevelRefits == 0 && counters.TopLevelRebuilds == 1, "manager: added instance");
+		CheckSceneTraces ("manager: added instance", GetTopLevel (manager), instances, CreateSceneRays (instances, 300, 38));
+		Check (manager.GetTotalCounters ().Rebuilds >= 3 && manager.GetTotalCounters ().DeferredRebuilds == 1, "manager: total counters");
+	}
+
+	// The top level must reference the current version of every bottom level, never the copies of their headers
+	// a background top-level build works from.
+	void CheckInstanceAddresses (const std::string& name, const AccelerationStructureManager& manager, const UINT* bottomLevelIndices) {
+		const AccelerationStructureHeader* topLevel = GetTopLevel (manager);
+		for (UINT i = 0; i < topLevel->PrimitiveCount; i++) {
+			const InstanceRecord& instance = topLevel->GetInstances ()[i];
+			Check (instance.AccelerationStructure == manager.GetBottomLevelAddress (bottomLevelIndices[instance.InstanceIndex]), name + ": instance " + std::to_string (i));
+		}
+	}
+
+	// Calls Update () until done () holds, for a few seconds at most.
+	bool UpdateUntil (AccelerationStructureManager& manager, const std::function<bool ()>& done) {
+		for (UINT attempt = 0; attempt < 5000; attempt++) {
+			manager.Update ();
+			if (done ()) {
+				return true;
+			}
+			std::this_thread::sleep_for (std::chrono::milliseconds (1));
+		}
+		return false;
+	}
+
+	// Rebuilds run in the background into a second buffer while Update () refits the current version, and a later
+	// Update () swaps them in and points the top level at them. Every frame traces as brute force does.
+	void TestAsyncManager (Device& device) {
+		const Mesh starts[2] = {CreateMesh (1500, 39), CreateMesh (1500, 40)};
+		Mesh meshes[2] = {starts[0], starts[1]};
+		AccelerationStructureManager::Settings settings;
+		settings.RebuildThreshold = 1.5f;
+		settings.AsynchronousRebuilds = true;
+		AccelerationStructureManager manager (device, settings);
+		for (Mesh& mesh : meshes) {
+			manager.AddBottomLevel (mesh.GetInputs (D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_TRACE));
+		}
+		Check (manager.GetBottomLevelAddress (0) == 0, "async manager: address before the first swap");
+		Check (UpdateUntil (manager, [&manager] () { return manager.GetBottomLevelAddress (0) != 0 && manager.GetBottomLevelAddress (1) != 0; }),
+			"async manager: first builds");
+
+		std::vector<SceneInstance> instances = {{&meshes[0], Float3 (0.0f), 0}, {&meshes[1], Float3 (12.0f, 0.0f, 0.0f), 0}};
+		const UINT bottomLevelIndices[3] = {0, 1, 1};
+		manager.SetInstances (2, GetInstanceDescs (instances, 0).data (), bottomLevelIndices);
+		Check (UpdateUntil (manager, [&manager] () { return manager.GetTopLevelAddress () != 0; }), "async manager: first top-level build");
+		CheckInstanceAddresses ("async manager: first top level", manager, bottomLevelIndices);
+		const std::vector<RayDesc> rays = CreateSceneRays (instances, 200, 41);
+		CheckSceneTraces ("async manager: first top level", GetTopLevel (manager), instances, rays);
+
+		// Mesh 0 drifts apart until a rebuild is queued, then holds still until it is swapped in.
+		std::mt19937 random (42);
+		for (UINT cycle = 0; cycle < 2; cycle++) {
+			const std::string name = "async manager: rebuild " + std::to_string (cycle);
+			const D3D12_GPU_VIRTUAL_ADDRESS previous = manager.GetBottomLevelAddress (0);
+			const UINT64 rebuilds = manager.GetTotalCounters ().Rebuilds;
+			const UINT64 queuedRebuilds = manager.GetTotalCounters ().QueuedRebuilds;
+			UINT frame = 0;
+			const bool swapped = UpdateUntil (manager, [&] () {
+				const std::string frameName = name + ", frame " + std::to_string (frame);
+				CheckInstanceAddresses (frameName, manager, bottomLevelIndices);
+				CheckSceneTraces (frameName, GetTopLevel (manager), instances, rays);
+				if (manager.GetTotalCounters ().QueuedRebuilds == queuedRebuilds) {
+					ScatterTriangles (meshes[0], starts[0], 0.25f * ++frame, random);
+				}
+				return manager.GetTotalCounters ().Rebuilds > rebuilds;
+			});
+			Check (swapped, name + ": never swapped in");
+			Check (manager.GetBottomLevelAddress (0) != previous, name + ": swapped into the buffer it replaced");
+			Check (manager.GetDegradation (0) < settings.RebuildThreshold, name + ": degradation after the swap");
+		}
+
+		// Adding an instance rebuilds the top level in the background too.
+		instances.push_back ({&meshes[1], Float3 (0.0f, 12.0f, 0.0f), 0});
+		manager.SetInstances (3, GetInstanceDescs (instances, 0).data (), bottomLevelIndices);
+		Check (UpdateUntil (manager, [&manager] () { return GetTopLevel (manager)->PrimitiveCount == 3; }), "async manager: top-level rebuild");
+		CheckInstanceAddresses ("async manager: rebuilt top level", manager, bottomLevelIndices);
+		CheckSceneTraces ("async manager: rebuilt top level", GetTopLevel (manager), instances, CreateSceneRays (instances, 300, 43));
+	}
+
+	// Triangles of an opaque and a non-opaque geometry, whose any-hit shader ignores odd primitives, and non-opaque
+	// boxes in a second instance, traced with the culling, opacity and skip flags alone and combined.
+	void TestRayFlags (Device& device) {
+		Mesh mesh = CreateMesh (2000, 44);
+		const std::vector<D3D12_RAYTRACING_AABB> boxes = CreateBoxes (300, 45);
+		const D3D12_RAYTRACING_GEOMETRY_DESC boxDesc = GetBoxGeometryDesc (boxes, D3D12_RAYTRACING_GEOMETRY_FLAG_NONE);
+
+		HitGroup triangleGroup;
+		triangleGroup.SetAnyHitShaderImport ([] (AnyHitContext& context) {
+			if (context.PrimitiveIndex () % 2 != 0) {
+				context.IgnoreHit ();
+			}
+		});
+		const HitGroup boxGroup = CreateBoxHitGroup ();
+		const HitGroup* records[] = {&triangleGroup, &boxGroup};
+		const HitGroupTable hitGroups = {records, 2, 0, 0};
+
+		const UINT c_RayFlags[] = {
+			RAY_FLAG_NONE,
+			RAY_FLAG_CULL_BACK_FACING_TRIANGLES,
+			RAY_FLAG_CULL_FRONT_FACING_TRIANGLES,
+			RAY_FLAG_CULL_OPAQUE,
+			RAY_FLAG_CULL_NON_OPAQUE,
+			RAY_FLAG_SKIP_TRIANGLES,
+			RAY_FLAG_SKIP_PROCEDURAL_PRIMITIVES,
+			RAY_FLAG_FORCE_OPAQUE,
+			RAY_FLAG_FORCE_NON_OPAQUE,
+			RAY_FLAG_FORCE_OPAQUE | RAY_FLAG_CULL_FRONT_FACING_TRIANGLES,
+			RAY_FLAG_CULL_NON_OPAQUE | RAY_FLAG_SKIP_PROCEDURAL_PRIMITIVES,
+			RAY_FLAG_CULL_OPAQUE | RAY_FLAG_SKIP_TRIANGLES,
+			RAY_FLAG_FORCE_NON_OPAQUE | RAY_FLAG_CULL_BACK_FACING_TRIANGLES | RAY_FLAG_SKIP_PROCEDURAL_PRIMITIVES,
+		};
+
+		const std::vector<RayDesc> rays = CreateRays (300, 46);
+		for (const Layout& layout : c_Layouts) {
+			const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS inputs = mesh.GetInputs (layout.Flags);
+			mesh.GeometryDescs[1].Flags = D3D12_RAYTRACING_GEOMETRY_FLAG_NONE;
+			AlignedBuffer triangles;
+			Build (device, inputs, triangles);
+			AlignedBuffer procedural;
+			Build (device, GetBottomLevelInputs (1, &boxDesc, layout.Flags), procedural);
+			std::vector<D3D12_RAYTRACING_INSTANCE_DESC> instanceDescs = {
+				GetInstanceDesc (Float3 (0.0f), 100, 0, triangles.GetAddress ()),
+				GetInstanceDesc (Float3 (0.0f), 101, 0, procedural.GetAddress ()),
+			};
+			instanceDescs[1].InstanceContributionToHitGroupIndex = 1;
+			AlignedBuffer topLevel;
+			Build (device, GetTopLevelInputs (instanceDescs, layout.Flags), topLevel);
+
+			for (const UINT rayFlags : c_RayFlags) {
+				const std::string name = std::string ("ray flags ") + std::to_string (rayFlags) + ", " + layout.Name;
+				const auto isOpaque = [rayFlags] (bool opaque) {
+					return (rayFlags & RAY_FLAG_FORCE_OPAQUE) != 0 || (opaque && !(rayFlags & RAY_FLAG_FORCE_NON_OPAQUE));
+				};
+				const auto isOpacityCulled = [rayFlags] (bool opaque) {
+					return ((rayFlags & RAY_FLAG_CULL_OPAQUE) && opaque) || ((rayFlags & RAY_FLAG_CULL_NON_OPAQUE) && !opaque);
+				};
+				for (UINT i = 0; i < rays.size (); i++) {
+					SceneReferenceHit reference = {{false, false, std::numeric_limits<double>::infinity ()}, 0, false};
+					for (UINT geometryIndex = 0; geometryIndex < 2 && !(rayFlags & RAY_FLAG_SKIP_TRIANGLES); geometryIndex++) {
+						const bool opaque = isOpaque (geometryIndex == 0);
+						if (isOpacityCulled (opaque)) {
+							continue;
+						}
+						for (UINT primitiveIndex = 0; primitiveIndex < mesh.GetTriangleCount (geometryIndex); primitiveIndex++) {
+							Float3 vertices[3];
+							mesh.GetTriangle (geometryIndex, primitiveIndex, vertices);
+							double t;
+							const ReferenceResult hit = IntersectReference (vertices, rays[i], &t);
+							bool frontFace;
+							if (hit == ReferenceResult::Miss || (!opaque && primitiveIndex % 2 != 0) || IsCulled (0, rayFlags, IsClockwise (vertices, rays[i]), &frontFace)) {
+								continue;
+							}
+							if (hit == ReferenceResult::Ambiguous) {
+								reference.Hit.Ambiguous = true;
+							} else if (t < reference.Hit.T) {
+								reference.Hit.Found = true;
+								reference.Hit.T = t;
+								reference.FrontFace = frontFace;
+							}
+						}
+					}
+					float boxT = 0.0f;
+					const bool boxFound = !(rayFlags & RAY_FLAG_SKIP_PROCEDURAL_PRIMITIVES) && !isOpacityCulled (isOpaque (false)) && TraceBoxReference (boxes, rays[i], &boxT);
+					if (reference.Hit.Ambiguous || (boxFound && reference.Hit.Found && IsSameDistance (boxT, reference.Hit.T))) {
+						continue;
+					}
+					const bool boxCloser = boxFound && boxT < reference.Hit.T;
+
+					RayHit hit;
+					const bool found = TraceRayClosestHit (topLevel.GetHeader (), rays[i], rayFlags, 0xFF, hitGroups, &hit);
+					Check (found == (reference.Hit.Found || boxFound), name + ": closest hit found, ray " + std::to_string (i));
+					if (found && boxCloser) {
+						Check (hit.InstanceIndex == 1 && hit.T == boxT, name + ": closest box, ray " + std::to_string (i));
+					} else if (found && reference.Hit.Found) {
+						Check (hit.InstanceIndex == 0 && IsSameDistance (hit.T, reference.Hit.T), name + ": closest triangle, ray " + std::to_string (i));
+						Check (hit.HitKind == (reference.FrontFace ? c_HitKindTriangleFrontFace : c_HitKindTriangleBackFace), name + ": hit kind, ray " + std::to_string (i));
+					}
+					Check (TraceRayOcclusion (topLevel.GetHeader (), rays[i], rayFlags, 0xFF, hitGroups) == (reference.Hit.Found || boxFound),
+						name + ": occlusion, ray " + std::to_string (i));
+				}
+			}
+		}
+	}
+
+	// Combinations DXR forbids are rejected by every entry point, and the others accepted.
+	void TestInvalidRayFlags (Device& device) {
+		Mesh mesh = CreateMesh (100, 47);
+		AlignedBuffer result;
+		Build (device, mesh.GetInputs (D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_NONE), result);
+		const RayDesc ray = CreateRays (1, 48)[0];
+		const HitGroupTable noHitGroups = {nullptr, 0, 0, 0};
+		const MissShader missShader;
+		const MissShader* missShaders[] = {&missShader};
+		const ShaderTables shaderTables = {nullptr, 0, missShaders, 1};
+
+		const auto isRejected = [&] (UINT rayFlags) {
+			RayHit hit;
+			const bool closestHit = Throws ([&] () { TraceRayClosestHit (result.GetHeader (), ray, rayFlags, 0xFF, noHitGroups, &hit); });
+			const bool occlusion = Throws ([&] () { TraceRayOcclusion (result.GetHeader (), ray, rayFlags, 0xFF, noHitGroups); });
+			const bool packet = Throws ([&] () { TraceRayPacketClosestHit (result.GetHeader (), 1, &ray, rayFlags, 0xFF, noHitGroups, &hit); });
+			const bool traceRay = Throws ([&] () {
+				UINT payload = 0;
+				TraceRay (shaderTables, result.GetHeader (), rayFlags | RAY_FLAG_SKIP_CLOSEST_HIT_SHADER, 0xFF, 0, 0, 0, ray, payload);
+			});
+			Check (closestHit == occlusion && occlusion == packet && packet == traceRay, "invalid ray flags: entry points disagree on " + std::to_string (rayFlags));
+			return closestHit;
+		};
+
+		const UINT c_InvalidRayFlags[] = {
+			RAY_FLAG_FORCE_OPAQUE | RAY_FLAG_FORCE_NON_OPAQUE,
+			RAY_FLAG_FORCE_OPAQUE | RAY_FLAG_CULL_OPAQUE,
+			RAY_FLAG_FORCE_NON_OPAQUE | RAY_FLAG_CULL_NON_OPAQUE,
+			RAY_FLAG_CULL_OPAQUE | RAY_FLAG_CULL_NON_OPAQUE,
+			RAY_FLAG_CULL_BACK_FACING_TRIANGLES | RAY_FLAG_CULL_FRONT_FACING_TRIANGLES,
+			RAY_FLAG_SKIP_TRIANGLES | RAY_FLAG_SKIP_PROCEDURAL_PRIMITIVES,
+			RAY_FLAG_SKIP_TRIANGLES | RAY_FLAG_CULL_BACK_FACING_TRIANGLES,
+			RAY_FLAG_SKIP_TRIANGLES | RAY_FLAG_CULL_FRONT_FACING_TRIANGLES,
+			0x400,
+		};
+		for (const UINT rayFlags : c_InvalidRayFlags) {
+			Check (isRejected (rayFlags), "invalid ray flags: accepted " + std::to_string (rayFlags));
+		}
+		const UINT c_ValidRayFlags[] = {
+			RAY_FLAG_NONE,
+			RAY_FLAG_FORCE_OPAQUE | RAY_FLAG_CULL_BACK_FACING_TRIANGLES | RAY_FLAG_SKIP_PROCEDURAL_PRIMITIVES,
+			RAY_FLAG_CULL_NON_OPAQUE | RAY_FLAG_SKIP_TRIANGLES | RAY_FLAG_ACCEPT_FIRST_HIT_AND_END_SEARCH,
+			RAY_FLAG_FORCE_NON_OPAQUE | RAY_FLAG_CULL_FRONT_FACING_TRIANGLES,
+		};
+		for (const UINT rayFlags : c_ValidRayFlags) {
+			Check (!isRejected (rayFlags), "invalid ray flags: rejected " + std::to_string (rayFlags));
+		}
+	}
+
+	// What the closest-hit and miss shaders of TestTraceRay () write.
+	struct ShadingPayload {
+		UINT HitGroupRecord;
+		UINT MissShaderIndex;
+		float T;
+		UINT PrimitiveIndex;
+		UINT InstanceID;
+	};
+
+	// TraceRay () runs the closest-hit shader of the record each hit selects, or the miss shader it is given.
+	void TestTraceRay (Device& device) {
+		Mesh mesh = CreateMesh (2000, 49);
+		AlignedBuffer bottomLevel;
+		Build (device, mesh.GetInputs (D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_NONE), bottomLevel);
+		std::vector<D3D12_RAYTRACING_INSTANCE_DESC> instanceDescs = {
+			GetInstanceDesc (Float3 (0.0f), 100, 0, bottomLevel.GetAddress ()),
+			GetInstanceDesc (Float3 (12.0f, 0.0f, 0.0f), 101, 0, bottomLevel.GetAddress ()),
+		};
+		instanceDescs[1].InstanceContributionToHitGroupIndex = 2;
+		AlignedBuffer topLevel;
+		Build (device, GetTopLevelInputs (instanceDescs, D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_NONE), topLevel);
+
+		// With a ray contribution of 1, records 1 and 2 serve the geometries of instance 0, and 3 and 4 those of
+		// instance 1.
+		HitGroup hitGroups[5];
+		const HitGroup* hitGroupRecords[5];
+		for (UINT record = 0; record < 5; record++) {
+			hitGroups[record].SetClosestHitShaderImport ([record] (ClosestHitContext& context) {
+				ShadingPayload& payload = context.GetPayload<ShadingPayload> ();
+				payload.HitGroupRecord = record;
+				payload.T = context.RayTCurrent ();
+				payload.PrimitiveIndex = context.PrimitiveIndex ();
+				payload.InstanceID = context.InstanceID ();
+			});
+			hitGroupRecords[record] = &hitGroups[record];
+		}
+		MissShader missShaders[2];
+		const MissShader* missShaderRecords[2];
+		for (UINT index = 0; index < 2; index++) {
+			missShaders[index] = [index] (MissContext& context) { context.GetPayload<ShadingPayload> ().MissShaderIndex = index; };
+			missShaderRecords[index] = &missShaders[index];
+		}
+		const ShaderTables shaderTables = {hitGroupRecords, 5, missShaderRecords, 2};
+
+		const ShadingPayload untouched = {~0u, ~0u, -1.0f, ~0u, ~0u};
+		const std::vector<RayDesc> rays = CreateSceneRays ({{&mesh, Float3 (0.0f), 0}, {&mesh, Float3 (12.0f, 0.0f, 0.0f), 0}}, 400, 50);
+		for (UINT i = 0; i < rays.size (); i++) {
+			RayHit hit;
+			const bool found = TraceRayClosestHit (topLevel.GetHeader (), rays[i], 0xFF, &hit);
+
+			ShadingPayload payload = untouched;
+			TraceRay (shaderTables, topLevel.GetHeader (), RAY_FLAG_NONE, 0xFF, 1, 1, 1, rays[i], payload);
+			if (found) {
+				Check (payload.HitGroupRecord == hit.InstanceContributionToHitGroupIndex + 1 + hit.GeometryIndex && payload.MissShaderIndex == ~0u,
+					"TraceRay: closest-hit record, ray " + std::to_string (i));
+				Check (payload.T == hit.T && payload.PrimitiveIndex == hit.PrimitiveIndex && payload.InstanceID == hit.InstanceID,
+					"TraceRay: closest-hit intrinsics, ray " + std::to_string (i));
+			} else {
+				Check (payload.MissShaderIndex == 1 && payload.HitGroupRecord == ~0u, "TraceRay: miss shader, ray " + std::to_string (i));
+			}
+
+			payload = untouched;
+			TraceRay (shaderTables, topLevel.GetHeader (), RAY_FLAG_SKIP_CLOSEST_HIT_SHADER, 0xFF, 1, 1, 0, rays[i], payload);
+			Check (payload.HitGroupRecord == ~0u && payload.MissShaderIndex == (found ? ~0u : 0u), "TraceRay: SKIP_CLOSEST_HIT_SHADER, ray " + std::to_string (i));
+
+			payload = untouched;
+			TraceRay (shaderTables, topLevel.GetHeader (), RAY_FLAG_ACCEPT_FIRST_HIT_AND_END_SEARCH | RAY_FLAG_SKIP_CLOSEST_HIT_SHADER, 0xFF, 1, 1, 0, rays[i], payload);
+			Check (payload.HitGroupRecord == ~0u && payload.MissShaderIndex == (found ? ~0u : 0u), "TraceRay: shadow ray, ray " + std::to_string (i));
+
+			Check (Throws ([&] () { TraceRay (shaderTables, topLevel.GetHeader (), RAY_FLAG_NONE, 0xFF, 5, 1, 2, rays[i], payload); }),
+				"TraceRay: record outside the tables accepted, ray " + std::to_string (i));
+		}
+	}
+
+	// An any-hit shader that ends the search runs once per ray that hits, whatever the layout.
+	void TestEndSearch (Device& device) {
+		Mesh mesh = CreateMesh (2000, 12);
+		const std::vector<RayDesc> rays = CreateRays (300, 13);
+		UINT anyHitCount = 0;
+		HitGroup hitGroup;
+		hitGroup.SetAnyHitShaderImport ([&anyHitCount] (AnyHitContext& context) {
+			anyHitCount++;
+			context.AcceptHitAndEndSearch ();
+		});
+		const HitGroup* records[] = {&hitGroup};
+		const HitGroupTable hitGroups = {records, 1, 0, 0};
+
+		for (const Layout& layout : c_Layouts) {
+			const std::string name = std::string ("end search ") + layout.Name;
+			const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS inputs = mesh.GetInputs (layout.Flags);
+			mesh.GeometryDescs[0].Flags = mesh.GeometryDescs[1].Flags = D3D12_RAYTRACING_GEOMETRY_FLAG_NONE;
+			AlignedBuffer result;
+			Build (device, inputs, result);
+
+			for (UINT i = 0; i < rays.size (); i++) {
+				const ReferenceHit reference = TraceReference (mesh, rays[i]);
+				if (reference.Ambiguous) {
+					continue;
+				}
+				anyHitCount = 0;
+				RayHit hit;
+				const bool found = TraceRayClosestHit (result.GetHeader (), rays[i], 0, 0xFF, hitGroups, &hit);
+				Check (found == reference.Found && anyHitCount == UINT (found), name + ": closest hit, ray " + std::to_string (i));
+				anyHitCount = 0;
+				Check (TraceRayOcclusion (result.GetHeader (), rays[i], 0, 0xFF, hitGroups) == reference.Found && anyHitCount == UINT (reference.Found),
+					name + ": occlusion, ray " + std::to_string (i));
+			}
+		}
+	}
+
+	// Any-hit shaders of packet rays see the payload of their own ray.
+	void TestPacketPayloads (Device& device) {
+		Mesh mesh = CreateMesh (2000, 14);
+		const std::vector<RayDesc> rays = CreateRays (c_MaxRayPacketSize, 15);
+		HitGroup hitGroup;
+		hitGroup.SetAnyHitShaderImport ([] (AnyHitContext& context) {
+			context.GetPayload<UINT> ()++;
+		});
+		const HitGroup* records[] = {&hitGroup};
+		const HitGroupTable hitGroups = {records, 1, 0, 0};
+
+		const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS inputs = mesh.GetInputs (c_BuildFlagBvh4);
+		mesh.GeometryDescs[0].Flags = mesh.GeometryDescs[1].Flags = D3D12_RAYTRACING_GEOMETRY_FLAG_NONE;
+		AlignedBuffer result;
+		Build (device, inputs, result);
+
+		UINT anyHitCounts[c_MaxRayPacketSize] = {};
+		void* payloads[c_MaxRayPacketSize];
+		for (UINT lane = 0; lane < c_MaxRayPacketSize; lane++) {
+			payloads[lane] = &anyHitCounts[lane];
+		}
+		RayHit hits[c_MaxRayPacketSize];
+		const UINT hitMask = TraceRayPacketClosestHit (result.GetHeader (), c_MaxRayPacketSize, rays.data (), 0, 0xFF, hitGroups, hits, payloads);
+		for (UINT lane = 0; lane < c_MaxRayPacketSize; lane++) {
+			Check (((hitMask >> lane) & 1) == UINT (anyHitCounts[lane] != 0), "packet payloads: any-hit count, ray " + std::to_string (lane));
+		}
+		Check (hitMask != 0, "packet payloads: no ray hit");
+	}
+
+	// Every ray of a batch comes back once, with its batch and payload index, and the hit it finds alone.
+	void TestRayStream (Device& device) {
+		Mesh mesh = CreateMesh (2000, 51);
+		AlignedBuffer bottomLevel;
+		Build (device, mesh.GetInputs (c_BuildFlagBvh8), bottomLevel);
+		const std::vector<SceneInstance> instances = {{&mesh, Float3 (0.0f), 0}, {&mesh, Float3 (12.0f, 0.0f, 0.0f), 0}};
+		const std::vector<D3D12_RAYTRACING_INSTANCE_DESC> instanceDescs = GetInstanceDescs (instances, bottomLevel.GetAddress ());
+		AlignedBuffer topLevel;
+		Build (device, GetTopLevelInputs (instanceDescs, c_BuildFlagBvh8), topLevel);
+
+		const HitGroupTable noHitGroups = {nullptr, 0, 0, 0};
+		RayStreamTracer tracer (device.GetThreadPool ());
+		for (const UINT rayCount : {1237u, 5u}) {
+			const std::vector<RayDesc> rays = CreateSceneRays (instances, rayCount, 52 + rayCount);
+			std::vector<UINT> payloadIndices (rayCount);
+			for (UINT i = 0; i < rayCount; i++) {
+				payloadIndices[i] = 7 * i + 3;
+			}
+			for (const bool top : {false, true}) {
+				const AccelerationStructureHeader* accelerationStructure = top ? topLevel.GetHeader () : bottomLevel.GetHeader ();
+				for (const UINT* pPayloadIndices : {static_cast<const UINT*> (nullptr), static_cast<const UINT*> (payloadIndices.data ())}) {
+					const std::string name = "ray stream of " + std::to_string (rayCount) + (top ? ", top level" : ", bottom level") + (pPayloadIndices ? ", payload indices" : "");
+					std::vector<RayStreamHit> streamHits (rayCount);
+					tracer.Trace (accelerationStructure, rayCount, rays.data (), pPayloadIndices, 0, 0xFF, noHitGroups, streamHits.data ());
+					std::vector<bool> seen (rayCount);
+					for (const RayStreamHit& streamHit : streamHits) {
+						if (streamHit.RayIndex >= rayCount || seen[streamHit.RayIndex]) {
+							Check (false, name + ": ray index " + std::to_string (streamHit.RayIndex));
+							continue;
+						}
+						seen[streamHit.RayIndex] = true;
+						const std::string rayName = name + ", ray " + std::to_string (streamHit.RayIndex);
+						Check (streamHit.PayloadIndex == (pPayloadIndices ? pPayloadIndices[streamHit.RayIndex] : streamHit.RayIndex), rayName + ": payload index");
+						RayHit hit;
+						const bool found = TraceRayClosestHit (accelerationStructure, rays[streamHit.RayIndex], 0xFF, &hit);
+						Check (streamHit.Found == found && (!found || (streamHit.Hit.T == hit.T && streamHit.Hit.InstanceID == hit.InstanceID)), rayName + ": hit");
+					}
+				}
+			}
+		}
+	}
+
+	// Rays through the shared vertices and edges of a flat grid, which a test that is not watertight lets through
+	// here and there.
+	void TestWatertight (Device& device) {
+		const UINT quadsPerSide = 64;
+		Mesh mesh = CreateGridMesh (quadsPerSide, true, 0);
+		std::mt19937 random (53);
+		std::vector<RayDesc> rays;
+		const float spacing = 10.0f / quadsPerSide;
+		for (UINT y = 1; y < quadsPerSide; y++) {
+			for (UINT x = 1; x < quadsPerSide; x++) {
+				const Float3 vertex (x * spacing, y * spacing, 5.0f);
+				const Float3 targets[4] = {vertex, vertex + Float3 (0.5f * spacing, 0.0f, 0.0f), vertex + Float3 (0.0f, 0.5f * spacing, 0.0f),
+					vertex + Float3 (0.5f * spacing, 0.5f * spacing, 0.0f)};
+				for (const Float3& target : targets) {
+					const Float3 direction = RandomPoint (random, -1.0f, 1.0f) * Float3 (1.0f, 1.0f, 0.0f) + Float3 (0.0f, 0.0f, (x + y) % 2 != 0 ? 1.0f : -1.0f);
+					rays.push_back ({target - direction * 6.0f, 0.0f, direction, std::numeric_limits<float>::infinity ()});
+				}
+			}
+		}
+		for (const Layout& layout : c_Layouts) {
+			const std::string name = std::string ("watertight ") + layout.Name;
+			AlignedBuffer result;
+			Build (device, mesh.GetInputs (layout.Flags), result);
+			for (UINT i = 0; i < rays.size (); i++) {
+				RayHit hit;
+				Check (TraceRayClosestHit (result.GetHeader (), rays[i], 0xFF, &hit) && IsSameDistance (hit.T, 6.0), name + ": closest hit, ray " + std::to_string (i));
+				Check (TraceRayOcclusion (result.GetHeader (), rays[i], 0xFF), name + ": occlusion, ray " + std::to_string (i));
+			}
+			CheckPackets (name, result.GetHeader (), rays);
+		}
+	}
+
+	struct Test {
+		const char* Name;
+		void (*Run) (Device& device);
+	};
+
+	const Test c_Tests[] = {
+		{"build flags", TestBuildFlags},
+		{"deep LBVH", TestDeepLbvh},
+		{"refit", TestRefit},
+		{"compaction", TestCompaction},
+		{"top level", TestTopLevel},
+		{"grazing quantized", TestGrazingQuantized},
+		{"serialization", TestSerialization},
+		{"serialized top level", TestSerializedTopLevel},
+		{"prebuild info", TestPrebuildInfo},
+		{"alignment", TestAlignment},
+		{"quality report", TestQualityReport},
+		{"batch build", TestBatchBuild},
+		{"procedural", TestProcedural},
+		{"formats", TestFormats},
+		{"transforms", TestTransforms},
+		{"instance flags", TestInstanceFlags},
+		{"manager", TestManager},
+		{"async manager", TestAsyncManager},
+		{"ray flags", TestRayFlags},
+		{"invalid ray flags", TestInvalidRayFlags},
+		{"TraceRay", TestTraceRay},
+		{"end search", TestEndSearch},
+		{"packet payloads", TestPacketPayloads},
+		{"ray stream", TestRayStream},
+		{"watertight", TestWatertight},
+	};
+
+}
+
+int main () {
+	Device device;
+	for (const Test& test : c_Tests) {
+		const UINT failureCount = g_FailureCount;
+		try {
+			test.Run (device);
+		} catch (const std::exception& exception) {
+			Check (false, std::string (test.Name) + ": " + exception.what ());
+		}
+		printf ("%s: %s\n", test.Name, g_FailureCount == failureCount ? "passed" : "FAILED");
+	}
+	return g_FailureCount == 0 ? 0 : 1;
+}
@@ -0,0 +1,133 @@
+#include "stdafx.h"
+#include "ThreadPool.h"
+
+namespace CpuRaytracing {
+
+	ThreadPool::ThreadPool (UINT threadCount) :
+		m_Tasks (c_MaxQueuedTasks),
+		m_TaskCount (0),
+		m_Stopping (false) {
+
+		if (threadCount == 0) {
+			threadCount = std::max (1u, std::thread::hardware_concurrency ());
+		}
+
+		for (UINT i = 1; i < threadCount; i++) {
+			m_Threads.emplace_back ([this] () { WorkerMain (); });
+		}
+	}
+
+	ThreadPool::~ThreadPool () {
+		{
+			std::lock_guard<std::mutex> lock (m_Mutex);
+			m_Stopping = true;
+		}
+		m_TaskAvailable.notify_all ();
+
+		for (auto& thread : m_Threads) {
+			thread.join ();
+		}
+	}
+
+	bool ThreadPool::TryPush (std::function<void ()>& function, TaskGroup* group) {
+		{
+			std::lock_guard<std::mutex> lock (m_Mutex);
+			if (m_TaskCount == c_MaxQueuedTasks) {
+				return false;
+			}
+			Task& task = m_Tasks[m_TaskCount];
+			task.Function.swap (function);
+			task.Group = group;
+			m_TaskCount++;
+		}
+		m_TaskAvailable.notify_one ();
+		return true;
+	}
+
+	bool ThreadPool::TryRunPendingTask () {
+		Task task;
+		{
+			std::lock_guard<std::mutex> lock (m_Mutex);
+			if (m_TaskCount == 0) {
+				return false;
+			}
+			// Newest first: nested fork-join work is depth-first and keeps the queue short.
+			Task& back = m_Tasks[--m_TaskCount];
+			task.Function.swap (back.Function);
+			task.Group = back.Group;
+		}
+
+		std::exception_ptr exception;
+		try {
+			task.Function ();
+		} catch (...) {
+			exception = std::current_exception ();
+		}
+		task.Group->Complete (exception);
+		return true;
+	}
+
+	void ThreadPool::WorkerMain () {
+		for (;;) {
+			{
+				std::unique_lock<std::mutex> lock (m_Mutex);
+				m_TaskAvailable.wait (lock, [this] () { return m_Stopping || m_TaskCount > 0; });
+				if (m_TaskCount == 0) {
+					return;
+				}
+			}
+			TryRunPendingTask ();
+		}
+	}
+
+	ThreadPool::TaskGroup::~TaskGroup () {
+		// Tasks reference the group, so never let it go out of scope with work in flight.
+		while (m_PendingCount.load () > 0) {
+			if (!m_Pool.TryRunPendingTask ()) {
+				std::this_thread::yield ();
+			}
+		}
+	}
+
+	void ThreadPool::TaskGroup::Run (std::function<void ()> task) {
+		m_PendingCount.fetch_add (1);
+		if (m_Pool.m_Threads.empty () || !m_Pool.TryPush (task, this)) {
+			// Nobody to hand the work to, or the queue is full: run inline.
+			std::exception_ptr exception;
+			try {
+				task ();
+			} catch (...) {
+				exception = std::current_exception ();
+			}
+			Complete (exception);
+		}
+	}
+
+	void ThreadPool::TaskGroup::Wait () {
+		while (m_PendingCount.load () > 0) {
+			if (!m_Pool.TryRunPendingTask ()) {
+				std::this_thread::yield ();
+			}
+		}
+
+		std::exception_ptr exception;
+		{
+			std::lock_guard<std::mutex> lock (m_ExceptionMutex);
+			std::swap (exception, m_Exception);
+		}
+		if (exception) {
+			std::rethrow_exception (exception);
+		}
+	}
+
+	void ThreadPool::TaskGroup::Complete (std::exception_ptr exception) {
+		if (exception) {
+			std::lock_guard<std::mutex> lock (m_ExceptionMutex);
+			if (!m_Exception) {
+				m_Exception = exception;
+			}
+		}
+		m_PendingCount.fetch_sub (1);
+	}
+
+}
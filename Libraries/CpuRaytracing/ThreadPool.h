@@ -0,0 +1,105 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "RaytracingCompat.h"
+
+namespace CpuRaytracing {
+
+	// Fork-join worker pool used by the builders. Threads waiting on a TaskGroup execute queued tasks
+	// instead of blocking, so groups can be nested (e.g. recursive subtree builds) without deadlocking.
+	// Tasks are queued on a fixed-capacity stack and run inline once it is full, so scheduling work whose
+	// closures fit std::function's small-object buffer never allocates.
+	class ThreadPool {
+	public:
+		// threadCount counts the calling thread; 0 selects the hardware concurrency.
+		explicit ThreadPool (UINT threadCount = 0);
+		~ThreadPool ();
+
+		ThreadPool (const ThreadPool&) = delete;
+		ThreadPool& operator= (const ThreadPool&) = delete;
+
+		UINT GetThreadCount () const { return static_cast<UINT> (m_Threads.size ()) + 1; }
+
+		// Calls body (chunkBegin, chunkEnd) over [begin, end) split into chunks of at least grainSize.
+		template <typename Body>
+		void ParallelFor (UINT begin, UINT end, UINT grainSize, const Body& body);
+
+		class TaskGroup {
+		public:
+			explicit TaskGroup (ThreadPool& pool) : m_Pool (pool), m_PendingCount (0) {}
+			~TaskGroup ();
+
+			TaskGroup (const TaskGroup&) = delete;
+			TaskGroup& operator= (const TaskGroup&) = delete;
+
+			void Run (std::function<void ()> task);
+
+			// Blocks until every task in the group finished. Rethrows the first exception a task threw.
+			void Wait ();
+
+		private:
+			friend class ThreadPool;
+
+			void Complete (std::exception_ptr exception);
+
+			ThreadPool& m_Pool;
+			std::atomic<UINT> m_PendingCount;
+			std::mutex m_ExceptionMutex;
+			std::exception_ptr m_Exception;
+		};
+
+	private:
+		static const UINT c_MaxQueuedTasks = 1024;
+
+		struct Task {
+			std::function<void ()> Function;
+			TaskGroup* Group;
+		};
+
+		bool TryPush (std::function<void ()>& function, TaskGroup* group);
+		bool TryRunPendingTask ();
+		void WorkerMain ();
+
+		std::vector<std::thread> m_Threads;
+		std::vector<Task> m_Tasks;     // c_MaxQueuedTasks entries, of which the first m_TaskCount are queued.
+		UINT m_TaskCount;
+		std::mutex m_Mutex;
+		std::condition_variable m_TaskAvailable;
+		bool m_Stopping;
+	};
+
+	template <typename Body>
+	void ThreadPool::ParallelFor (UINT begin, UINT end, UINT grainSize, const Body& body) {
+		if (begin >= end) {
+			return;
+		}
+
+		grainSize = std::max (1u, grainSize);
+		UINT count = end - begin;
+		UINT chunkCount = std::min ((count + grainSize - 1) / grainSize, GetThreadCount () * 4);
+		if (chunkCount <= 1) {
+			body (begin, end);
+			return;
+		}
+
+		// Chunk tasks only capture the body by reference, which keeps them within std::function's
+		// small-object buffer.
+		UINT chunkSize = (count + chunkCount - 1) / chunkCount;
+		TaskGroup group (*this);
+		for (UINT chunkBegin = begin + chunkSize; chunkBegin < end; chunkBegin += chunkSize) {
+			UINT chunkEnd = std::min (end, chunkBegin + chunkSize);
+			group.Run ([&body, chunkBegin, chunkEnd] () { body (chunkBegin, chunkEnd); });
+		}
+		body (begin, std::min (end, begin + chunkSize));
+		group.Wait ();
+	}
+
+}
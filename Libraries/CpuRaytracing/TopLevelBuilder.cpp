@@ -0,0 +1,144 @@
+#include "stdafx.h"
+#include "TopLevelBuilder.h"
+#include "GeometryReader.h"
+
+namespace CpuRaytracing {
+
+	namespace {
+
+		inline const Matrix3x4& GetTransform (const D3D12_RAYTRACING_INSTANCE_DESC& instanceDesc) {
+			return *reinterpret_cast<const Matrix3x4*> (instanceDesc.Transform);
+		}
+
+		// Fills record from instanceDesc and returns its world-space bounds, or an empty box if the instance is inactive.
+		Aabb ResolveInstance (const D3D12_RAYTRACING_INSTANCE_DESC& instanceDesc, UINT instanceIndex, InstanceRecord* record) {
+			record->ObjectToWorld = GetTransform (instanceDesc);
+			record->AccelerationStructure = instanceDesc.AccelerationStructure;
+			record->InstanceIndex = instanceIndex;
+			record->InstanceID = instanceDesc.InstanceID;
+			record->InstanceContributionToHitGroupIndex = instanceDesc.InstanceContributionToHitGroupIndex;
+			record->InstanceMask = static_cast<UINT8> (instanceDesc.InstanceMask);
+			record->Flags = static_cast<UINT8> (instanceDesc.Flags);
+			std::fill (std::begin (record->Reserved), std::end (record->Reserved), UINT16 (0));
+
+			if (instanceDesc.AccelerationStructure == 0 || !Invert (record->ObjectToWorld, &record->WorldToObject)) {
+				return Aabb::Empty ();
+			}
+			const AccelerationStructureHeader* bottomLevel = GetBottomLevelAccelerationStructure (instanceDesc.AccelerationStructure);
+			return record->ObjectToWorld.TransformAabb (bottomLevel->Bounds);
+		}
+
+	}
+
+	static_assert (sizeof (Matrix3x4) == sizeof (D3D12_RAYTRACING_INSTANCE_DESC::Transform), "Matrix3x4 must alias the instance transform.");
+
+	AccelerationStructureLayout TopLevelBuilder::GetResultLayout (D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS flags, UINT instanceCount) {
+		ThrowIfFalse (!(flags & c_SpatialSplitBudgetMask), "CpuRaytracing: spatial splits are only supported in bottom-level builds.");
+		const UINT nodeWidth = GetNodeWidth (flags);
+		return GetAccelerationStructureLayout (D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL, D3D12_RAYTRACING_GEOMETRY_TYPE_TRIANGLES, 0, GetNodeSize (nodeWidth, GetNodeFormat (flags)), GetMaxNodeCount (nodeWidth, instanceCount), instanceCount);
+	}
+
+	HierarchyBuilder::Settings TopLevelBuilder::GetHierarchySettings () {
+		// Entering an instance transforms the ray and restarts traversal in another tree, so every instance
+		// gets a leaf of its own.
+		HierarchyBuilder::Settings settings;
+		settings.MaxLeafSize = 1;
+		return settings;
+	}
+
+	void TopLevelBuilder::GetPrebuildInfo (const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs, D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO* pInfo) {
+		ThrowIfFalse (inputs.NumDescs < (1u << 31), "CpuRaytracing: too many instances in one top-level acceleration structure.");
+
+		pInfo->ResultDataMaxSizeInBytes = Align (GetResultLayout (inputs.Flags, inputs.NumDescs).SizeInBytes, D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BYTE_ALIGNMENT);
+		pInfo->ScratchDataSizeInBytes = Align (HierarchyBuilder::GetScratchLayout (inputs.Flags, inputs.NumDescs).SizeInBytes, D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BYTE_ALIGNMENT);
+		// Updates refit in place and need no scratch memory.
+		pInfo->UpdateScratchDataSizeInBytes = 0;
+	}
+
+	UINT TopLevelBuilder::GatherInstanceReferences (const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs, PrimitiveReference* references) {
+		m_ThreadPool.ParallelFor (0, inputs.NumDescs, 1024, [&] (UINT begin, UINT end) {
+			for (UINT instanceIndex = begin; instanceIndex < end; instanceIndex++) {
+				InstanceRecord record;
+				PrimitiveReference& ref = references[instanceIndex];
+				ref.Bounds = ResolveInstance (GetInstanceDesc (inputs, instanceIndex), instanceIndex, &record);
+				ref.GeometryIndex = 0;
+				ref.PrimitiveIndex = instanceIndex;
+			}
+		});
+
+		PrimitiveReference* end = std::remove_if (references, references + inputs.NumDescs, [] (const PrimitiveReference& ref) {
+			return ref.Bounds.IsEmpty ();
+		});
+		return static_cast<UINT> (end - references);
+	}
+
+	void TopLevelBuilder::WriteInstances (AccelerationStructureHeader* header, const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs) {
+		const PrimitiveRecord* primitives = header->GetPrimitives ();
+		InstanceRecord* instances = header->GetInstances ();
+
+		m_ThreadPool.ParallelFor (0, header->PrimitiveCount, 1024, [&] (UINT begin, UINT end) {
+			for (UINT i = begin; i < end; i++) {
+				UINT instanceIndex = primitives[i].PrimitiveIndex;
+				ResolveInstance (GetInstanceDesc (inputs, instanceIndex), instanceIndex, &instances[i]);
+			}
+		});
+	}
+
+	void TopLevelBuilder::Build (const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC& desc) {
+		const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs = desc.Inputs;
+		ThrowIfFalse (!(inputs.Flags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PERFORM_UPDATE), "CpuRaytracing: updates go through TopLevelBuilder::Update ().");
+
+		auto header = GetCpuPointer<AccelerationStructureHeader> (desc.DestAccelerationStructureData);
+		void* scratch = GetCpuPointer<void> (desc.ScratchAccelerationStructureData);
+		ThrowIfFalse (header != nullptr, "CpuRaytracing: DestAccelerationStructureData is required.");
+		ThrowIfFalse (inputs.NumDescs == 0 || (scratch != nullptr && inputs.InstanceDescs != 0), "CpuRaytracing: InstanceDescs and ScratchAccelerationStructureData are required.");
+
+		HierarchyBuilder::ScratchLayout scratchLayout = HierarchyBuilder::GetScratchLayout (inputs.Flags, inputs.NumDescs);
+		InitializeHeader (header, D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL, inputs.Flags, D3D12_RAYTRACING_GEOMETRY_TYPE_TRIANGLES, 0, GetResultLayout (inputs.Flags, inputs.NumDescs));
+		if (inputs.NumDescs == 0) {
+			return;
+		}
+
+		UINT instanceCount = GatherInstanceReferences (inputs, OffsetPointer<PrimitiveReference> (scratch, scratchLayout.ReferenceOffset));
+
+		HierarchyBuilder hierarchyBuilder (m_ThreadPool, GetHierarchySettings ());
+		hierarchyBuilder.Build (header, inputs.Flags, scratch, scratchLayout, instanceCount);
+
+		WriteInstances (header, inputs);
+	}
+
+	void TopLevelBuilder::Update (const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC& desc) {
+		const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs = desc.Inputs;
+		ThrowIfFalse ((inputs.Flags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_UPDATE) != 0, "CpuRaytracing: PERFORM_UPDATE requires ALLOW_UPDATE.");
+
+		const AccelerationStructureHeader* source = GetAccelerationStructure (desc.SourceAccelerationStructureData);
+		auto header = GetCpuPointer<AccelerationStructureHeader> (desc.DestAccelerationStructureData);
+		ThrowIfFalse (header != nullptr, "CpuRaytracing: DestAccelerationStructureData is required.");
+		ThrowIfFalse (source->Type == D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL, "CpuRaytracing: the update source is not a top-level acceleration structure.");
+		ThrowIfFalse ((source->BuildFlags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_UPDATE) != 0, "CpuRaytracing: the update source was not built with ALLOW_UPDATE.");
+
+		if (header != source) {
+			memcpy (header, source, source->SizeInBytes);
+		}
+		header->BuildFlags = inputs.Flags & ~D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PERFORM_UPDATE;
+
+		const PrimitiveRecord* primitives = header->GetPrimitives ();
+		for (UINT i = 0; i < header->PrimitiveCount; i++) {
+			ThrowIfFalse (primitives[i].PrimitiveIndex < inputs.NumDescs, "CpuRaytracing: an update must use the instance descs of the original build.");
+		}
+
+		InstanceRecord* instances = header->GetInstances ();
+		HierarchyBuilder hierarchyBuilder (m_ThreadPool, GetHierarchySettings ());
+		hierarchyBuilder.Refit (header, [&] (UINT firstPrimitive, UINT primitiveCount) {
+			Aabb bounds = Aabb::Empty ();
+			for (UINT i = firstPrimitive; i < firstPrimitive + primitiveCount; i++) {
+				UINT instanceIndex = primitives[i].PrimitiveIndex;
+				Aabb instanceBounds = ResolveInstance (GetInstanceDesc (inputs, instanceIndex), instanceIndex, &instances[i]);
+				ThrowIfFalse (!instanceBounds.IsEmpty (), "CpuRaytracing: an update cannot deactivate an instance.");
+				bounds.Grow (instanceBounds);
+			}
+			return bounds;
+		});
+	}
+
+}
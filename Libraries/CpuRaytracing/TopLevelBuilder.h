@@ -0,0 +1,34 @@
+#pragma once
+
+#include "AccelerationStructure.h"
+#include "HierarchyBuilder.h"
+#include "ThreadPool.h"
+
+namespace CpuRaytracing {
+
+	// Builds top-level acceleration structures over D3D12_RAYTRACING_INSTANCE_DESCs. Instances only reference
+	// their bottom-level structure, so any number of them can share one. Instances without a bottom-level
+	// structure, with an empty one or with a singular transform are inactive and left out of the tree.
+	class TopLevelBuilder {
+	public:
+		explicit TopLevelBuilder (ThreadPool& threadPool) : m_ThreadPool (threadPool) {}
+
+		static void GetPrebuildInfo (const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs, D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO* pInfo);
+
+		void Build (const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC& desc);
+
+		// PERFORM_UPDATE: re-reads every instance of the source structure (transform, mask, flags, bottom-level
+		// structure) and refits the tree. Instances that were inactive in the original build stay inactive.
+		void Update (const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC& desc);
+
+	private:
+		static AccelerationStructureLayout GetResultLayout (D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS flags, UINT instanceCount);
+		static HierarchyBuilder::Settings GetHierarchySettings ();
+
+		UINT GatherInstanceReferences (const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs, PrimitiveReference* references);
+		void WriteInstances (AccelerationStructureHeader* header, const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs);
+
+		ThreadPool& m_ThreadPool;
+	};
+
+}
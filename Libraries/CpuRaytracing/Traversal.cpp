@@ -0,0 +1,1359 @@
+#include "stdafx.h"
+#include "Traversal.h"
+#include "Simd.h"
+
+namespace CpuRaytracing {
+
+	namespace {
+
+		// Kz is the dominant axis of the direction, and Kx and Ky the others, swapped when Direction [Kz] is negative
+		// so the shear preserves the winding of triangles. Shear maps the ray onto +Kz: (Sx, Sy) = (Dx, Dy) / Dz
+		// and Sz = 1 / Dz on those axes.
+		struct TraversalRay {
+			Float3 Origin;
+			Float3 Direction;
+			Float3 InverseDirection;
+			float TMin;
+			UINT Kx;
+			UINT Ky;
+			UINT Kz;
+			Float3 Shear;
+		};
+
+		inline TraversalRay MakeTraversalRay (const Float3& origin, const Float3& direction, float tMin) {
+			// Keep zero direction components away from zero so the slab test never computes 0 * inf.
+			const float epsilon = 1e-20f;
+			Float3 inverse;
+			for (UINT axis = 0; axis < 3; axis++) {
+				float d = direction[axis];
+				inverse[axis] = 1.0f / (std::fabs (d) > epsilon ? d : std::copysign (epsilon, d));
+			}
+
+			UINT kz = std::fabs (direction.x) > std::fabs (direction.y) ? 0 : 1;
+			kz = std::fabs (direction[kz]) > std::fabs (direction.z) ? kz : 2;
+			UINT kx = (kz + 1) % 3;
+			UINT ky = (kx + 1) % 3;
+			if (direction[kz] < 0.0f) {
+				std::swap (kx, ky);
+			}
+			const Float3 shear (direction[kx] / direction[kz], direction[ky] / direction[kz], 1.0f / direction[kz]);
+			return TraversalRay {origin, direction, inverse, tMin, kx, ky, kz, shear};
+		}
+
+		// Slab distances carry up to three roundings each; scaling the exit distance by 1 + 2 gamma(3) keeps a ray
+		// that grazes a box edge from missing it, so no triangle the watertight test would hit is culled early
+		// (Ize, "Robust BVH Ray Traversal").
+		static const float c_Gamma3 = 3.0f * 0.5f * std::numeric_limits<float>::epsilon () / (1.0f - 3.0f * 0.5f * std::numeric_limits<float>::epsilon ());
+		static const float c_SlabExitScale = 1.0f + 2.0f * c_Gamma3;
+
+		// Entry distance of ray into box within [TMin, tMax], or infinity if it misses.
+		inline float IntersectAabb (const Aabb& box, const TraversalRay& ray, float tMax) {
+			float tNear = ray.TMin;
+			float tFar = tMax;
+			for (UINT axis = 0; axis < 3; axis++) {
+				float t0 = (box.Lower[axis] - ray.Origin[axis]) * ray.InverseDirection[axis];
+				float t1 = (box.Upper[axis] - ray.Origin[axis]) * ray.InverseDirection[axis];
+				tNear = std::max (tNear, std::min (t0, t1));
+				tFar = std::min (tFar, std::max (t0, t1));
+			}
+			return tNear <= tFar * c_SlabExitScale ? tNear : std::numeric_limits<float>::infinity ();
+		}
+
+		typedef SimdFloat<c_TriangleBlockWidth> TriangleVector;
+
+		struct TriangleBlockHits {
+			float T[c_TriangleBlockWidth];
+			float U[c_TriangleBlockWidth];      // Barycentric weight of V1, as in HitAttribute ().
+			float V[c_TriangleBlockWidth];      // Barycentric weight of V2.
+			UINT ClockwiseMask;                 // Lanes whose vertices appear clockwise from the ray origin.
+		};
+
+		// The 2D coordinates of vertex - origin in the sheared ray space, on Kx and Ky, and its distance along Kz
+		// unscaled.
+		struct ShearedVertex {
+			TriangleVector X;
+			TriangleVector Y;
+			TriangleVector Z;
+		};
+
+		inline ShearedVertex ShearVertex (const float (&vertex)[3][c_TriangleBlockWidth], const TraversalRay& ray) {
+			const TriangleVector z = TriangleVector::Load (vertex[ray.Kz]) - TriangleVector::Broadcast (ray.Origin[ray.Kz]);
+			const TriangleVector x = TriangleVector::Load (vertex[ray.Kx]) - TriangleVector::Broadcast (ray.Origin[ray.Kx]);
+			const TriangleVector y = TriangleVector::Load (vertex[ray.Ky]) - TriangleVector::Broadcast (ray.Origin[ray.Ky]);
+			return {x - TriangleVector::Broadcast (ray.Shear.x) * z, y - TriangleVector::Broadcast (ray.Shear.y) * z, z};
+		}
+
+		// One 2D edge function of the sheared triangle, U for the edge (B, C) and so on around the triangle.
+		inline double GetEdgeFunction (double ax, double ay, double bx, double by) {
+			return bx * ay - by * ax;
+		}
+
+		// The three 2D edge functions of the lanes of a block, with the sheared vertices they came from.
+		struct TriangleEdgeFunctions {
+			ShearedVertex A;
+			ShearedVertex B;
+			ShearedVertex C;
+			TriangleVector U;
+			TriangleVector V;
+			TriangleVector W;
+		};
+
+		// The triangle is moved into the space of the ray, where the ray runs along +Kz through the origin, and the
+		// ray hits it if the three 2D edge functions of the projected vertices share a sign. Neighbouring triangles
+		// compute the function of a shared edge from the same two vertices, so a ray through the edge hits at least
+		// one of them. An edge function that comes out exactly zero is recomputed in double precision, where the
+		// products of floats are exact, so its sign is never lost to rounding.
+		inline TriangleEdgeFunctions GetEdgeFunctions (const TriangleBlock& block, const TraversalRay& ray, UINT laneMask) {
+			TriangleEdgeFunctions edges;
+			edges.A = ShearVertex (block.V0, ray);
+			edges.B = ShearVertex (block.V1, ray);
+			edges.C = ShearVertex (block.V2, ray);
+			const ShearedVertex& a = edges.A;
+			const ShearedVertex& b = edges.B;
+			const ShearedVertex& c = edges.C;
+
+			const TriangleVector zero = TriangleVector::Broadcast (0.0f);
+			edges.U = c.X * b.Y - c.Y * b.X;
+			edges.V = a.X * c.Y - a.Y * c.X;
+			edges.W = b.X * a.Y - b.Y * a.X;
+			const UINT zeroMask = laneMask & ((LessEqualMask (edges.U, zero) & LessEqualMask (zero, edges.U)) |
+				(LessEqualMask (edges.V, zero) & LessEqualMask (zero, edges.V)) | (LessEqualMask (edges.W, zero) & LessEqualMask (zero, edges.W)));
+			if (zeroMask != 0) {
+				float ax[c_TriangleBlockWidth], ay[c_TriangleBlockWidth], bx[c_TriangleBlockWidth], by[c_TriangleBlockWidth];
+				float cx[c_TriangleBlockWidth], cy[c_TriangleBlockWidth];
+				float u[c_TriangleBlockWidth], v[c_TriangleBlockWidth], w[c_TriangleBlockWidth];
+				a.X.Store (ax);
+				a.Y.Store (ay);
+				b.X.Store (bx);
+				b.Y.Store (by);
+				c.X.Store (cx);
+				c.Y.Store (cy);
+				edges.U.Store (u);
+				edges.V.Store (v);
+				edges.W.Store (w);
+				for (UINT lanes = zeroMask; lanes != 0; lanes &= lanes - 1) {
+					const UINT lane = CountTrailingZeros (lanes);
+					u[lane] = static_cast<float> (GetEdgeFunction (bx[lane], by[lane], cx[lane], cy[lane]));
+					v[lane] = static_cast<float> (GetEdgeFunction (cx[lane], cy[lane], ax[lane], ay[lane]));
+					w[lane] = static_cast<float> (GetEdgeFunction (ax[lane], ay[lane], bx[lane], by[lane]));
+				}
+				edges.U = TriangleVector::Load (u);
+				edges.V = TriangleVector::Load (v);
+				edges.W = TriangleVector::Load (w);
+			}
+			return edges;
+		}
+
+		// The lanes of laneMask whose edge functions share a sign, excluding triangles seen edge-on.
+		inline UINT GetInsideMask (const TriangleEdgeFunctions& edges, const TriangleVector& det, UINT laneMask) {
+			const TriangleVector zero = TriangleVector::Broadcast (0.0f);
+			const UINT nonNegative = LessEqualMask (zero, edges.U) & LessEqualMask (zero, edges.V) & LessEqualMask (zero, edges.W);
+			const UINT nonPositive = LessEqualMask (edges.U, zero) & LessEqualMask (edges.V, zero) & LessEqualMask (edges.W, zero);
+			const UINT degenerate = LessEqualMask (det, zero) & LessEqualMask (zero, det);
+			return laneMask & (nonNegative | nonPositive) & ~degenerate;
+		}
+
+		// The interpolated Kz distance, scaled by 1 / Direction [Kz]: the hit distance along the ray times det.
+		inline TriangleVector GetScaledDistance (const TriangleEdgeFunctions& edges, const TraversalRay& ray) {
+			return (edges.U * edges.A.Z + edges.V * edges.B.Z + edges.W * edges.C.Z) * TriangleVector::Broadcast (ray.Shear.z);
+		}
+
+		// Watertight ray/triangle test (Woop, Benthin and Wald 2013) of the lanes of laneMask of a block. Returns the
+		// lanes hit within [TMin, tMax].
+		inline UINT IntersectTriangleBlock (const TriangleBlock& block, const TraversalRay& ray, float tMax, UINT laneMask, TriangleBlockHits* hits) {
+			const TriangleEdgeFunctions edges = GetEdgeFunctions (block, ray, laneMask);
+			const TriangleVector det = edges.U + edges.V + edges.W;
+			UINT hitMask = GetInsideMask (edges, det, laneMask);
+			if (hitMask == 0) {
+				return 0;
+			}
+
+			const TriangleVector t = GetScaledDistance (edges, ray) / det;
+			hitMask &= LessEqualMask (TriangleVector::Broadcast (ray.TMin), t) & LessEqualMask (t, TriangleVector::Broadcast (tMax));
+			if (hitMask == 0) {
+				return 0;
+			}
+
+			t.Store (hits->T);
+			(edges.V / det).Store (hits->U);
+			(edges.W / det).Store (hits->V);
+			hits->ClockwiseMask = ~LessEqualMask (det, TriangleVector::Broadcast (0.0f));
+			return hitMask;
+		}
+
+		// The same test when only whether a lane is hit matters: the distance is compared scaled by det, with no
+		// division, and no barycentrics are computed. Returns the lanes hit within [TMin, tMax], with the clockwise
+		// ones in *clockwiseMask for the facing culls.
+		inline UINT OccludesTriangleBlock (const TriangleBlock& block, const TraversalRay& ray, float tMax, UINT laneMask, UINT* clockwiseMask) {
+			const TriangleEdgeFunctions edges = GetEdgeFunctions (block, ray, laneMask);
+			const TriangleVector det = edges.U + edges.V + edges.W;
+			const UINT hitMask = GetInsideMask (edges, det, laneMask);
+			if (hitMask == 0) {
+				return 0;
+			}
+
+			const TriangleVector scaledT = GetScaledDistance (edges, ray);
+			const TriangleVector scaledTMin = TriangleVector::Broadcast (ray.TMin) * det;
+			const TriangleVector scaledTMax = TriangleVector::Broadcast (tMax) * det;
+			const UINT positive = ~LessEqualMask (det, TriangleVector::Broadcast (0.0f));
+			const UINT inRangePositive = LessEqualMask (scaledTMin, scaledT) & LessEqualMask (scaledT, scaledTMax);
+			const UINT inRangeNegative = LessEqualMask (scaledT, scaledTMin) & LessEqualMask (scaledTMax, scaledT);
+			*clockwiseMask = positive;
+			return hitMask & ((positive & inRangePositive) | (~positive & inRangeNegative));
+		}
+
+		// Depth-first traversal of a binary tree, or of the subtree under root, nearer child first. intersectLeaf
+		// (firstPrimitive, primitiveCount, tMax) tests the primitives of a leaf and shortens tMax to the closest hit so far.
+		template <typename IntersectLeaf>
+		void TraverseBinary (const AccelerationStructureHeader* header, const TraversalRay& ray, float& tMax, const IntersectLeaf& intersectLeaf, UINT root = 0) {
+			const BvhNode* nodes = header->GetNodes ();
+			if (IntersectAabb (nodes[root].Bounds, ray, tMax) == std::numeric_limits<float>::infinity ()) {
+				return;
+			}
+
+			UINT stack[c_MaxBvhDepth];
+			UINT stackSize = 0;
+			UINT nodeIndex = root;
+			for (;;) {
+				const BvhNode& node = nodes[nodeIndex];
+				if (node.IsLeaf ()) {
+					intersectLeaf (node.Offset, node.PrimitiveCount, tMax);
+					if (tMax < ray.TMin) {
+						return;
+					}
+				} else {
+					UINT first = nodeIndex + 1;
+					UINT second = node.Offset;
+					float tFirst = IntersectAabb (nodes[first].Bounds, ray, tMax);
+					float tSecond = IntersectAabb (nodes[second].Bounds, ray, tMax);
+					if (tSecond < tFirst) {
+						std::swap (first, second);
+						std::swap (tFirst, tSecond);
+					}
+
+					if (tFirst != std::numeric_limits<float>::infinity ()) {
+						if (tSecond != std::numeric_limits<float>::infinity ()) {
+							stack[stackSize++] = second;
+						}
+						nodeIndex = first;
+						continue;
+					}
+				}
+
+				if (stackSize == 0) {
+					return;
+				}
+				nodeIndex = stack[--stackSize];
+			}
+		}
+
+		// TraverseBinary () for rays that stop at the first hit, whose tMax never shrinks until it drops below TMin to
+		// end the search. Children are visited in node order, so neither their distances nor any swap is kept.
+		template <typename IntersectLeaf>
+		void TraverseBinaryAny (const AccelerationStructureHeader* header, const TraversalRay& ray, float& tMax, const IntersectLeaf& intersectLeaf) {
+			const BvhNode* nodes = header->GetNodes ();
+			if (IntersectAabb (nodes[0].Bounds, ray, tMax) == std::numeric_limits<float>::infinity ()) {
+				return;
+			}
+
+			UINT stack[c_MaxBvhDepth];
+			UINT stackSize = 0;
+			UINT nodeIndex = 0;
+			for (;;) {
+				const BvhNode& node = nodes[nodeIndex];
+				if (node.IsLeaf ()) {
+					intersectLeaf (node.Offset, node.PrimitiveCount, tMax);
+					if (tMax < ray.TMin) {
+						return;
+					}
+				} else {
+					const bool hitFirst = IntersectAabb (nodes[nodeIndex + 1].Bounds, ray, tMax) != std::numeric_limits<float>::infinity ();
+					const bool hitSecond = IntersectAabb (nodes[node.Offset].Bounds, ray, tMax) != std::numeric_limits<float>::infinity ();
+					if (hitFirst) {
+						if (hitSecond) {
+							stack[stackSize++] = node.Offset;
+						}
+						nodeIndex++;
+						continue;
+					}
+					if (hitSecond) {
+						nodeIndex = node.Offset;
+						continue;
+					}
+				}
+
+				if (stackSize == 0) {
+					return;
+				}
+				nodeIndex = stack[--stackSize];
+			}
+		}
+
+		// Distances along the ray to the lower and upper planes of all children of a wide node on one axis.
+		template <UINT Width>
+		struct SlabDistances {
+			SimdFloat<Width> Lower;
+			SimdFloat<Width> Upper;
+		};
+
+		template <UINT Width>
+		inline SlabDistances<Width> IntersectChildPlanes (const WideBvhNode<Width>& node, const TraversalRay& ray, UINT axis) {
+			typedef SimdFloat<Width> Vector;
+			const float* lower = axis == 0 ? node.LowerX : (axis == 1 ? node.LowerY : node.LowerZ);
+			const float* upper = axis == 0 ? node.UpperX : (axis == 1 ? node.UpperY : node.UpperZ);
+			const Vector origin = Vector::Broadcast (ray.Origin[axis]);
+			const Vector inverse = Vector::Broadcast (ray.InverseDirection[axis]);
+			return {(Vector::Load (lower) - origin) * inverse, (Vector::Load (upper) - origin) * inverse};
+		}
+
+		// The 8-bit planes are decoded in registers to the same world-space values DecodeQuantizedPlane () gives the
+		// builder (q * step is exact, so only the add rounds), then go through the float slab test. Folding origin
+		// into a per-node offset would save the subtract, but offset rounds in proportion to its own size, which
+		// c_SlabExitScale does not cover once the node is far from the ray origin relative to its extent.
+		template <UINT Width>
+		inline SlabDistances<Width> IntersectChildPlanes (const QuantizedBvhNode<Width>& node, const TraversalRay& ray, UINT axis) {
+			typedef SimdFloat<Width> Vector;
+			const Vector step = Vector::Broadcast (GetQuantizationStep (node.Exponent[axis]));
+			const Vector nodeOrigin = Vector::Broadcast (node.Origin[axis]);
+			const Vector origin = Vector::Broadcast (ray.Origin[axis]);
+			const Vector inverse = Vector::Broadcast (ray.InverseDirection[axis]);
+			const Vector lower = Vector::LoadUint8 (node.Lower[axis]) * step + nodeOrigin;
+			const Vector upper = Vector::LoadUint8 (node.Upper[axis]) * step + nodeOrigin;
+			return {(lower - origin) * inverse, (upper - origin) * inverse};
+		}
+
+		// Same contract for BVH4 / BVH8, float or quantized. All child boxes of a node are tested with one SIMD
+		// slab test against the near and far planes picked by the ray direction signs; hit children are pushed
+		// far to near, and entries whose entry distance falls behind a closer hit found meanwhile are skipped
+		// when popped.
+		template <typename Node, typename IntersectLeaf>
+		void TraverseWide (const Node* nodes, const TraversalRay& ray, float& tMax, const IntersectLeaf& intersectLeaf, UINT root = 0) {
+			static const UINT Width = Node::c_Width;
+			typedef SimdFloat<Width> Vector;
+
+			struct StackEntry {
+				float TNear;
+				UINT Child;
+				UINT PrimitiveCount;    // Zero for interior children.
+			};
+
+			const bool negative[3] = {ray.InverseDirection.x < 0.0f, ray.InverseDirection.y < 0.0f, ray.InverseDirection.z < 0.0f};
+			const Vector tMin = Vector::Broadcast (ray.TMin);
+
+			StackEntry stack[c_MaxBvhDepth * (Width - 1) + 1];
+			UINT stackSize = 0;
+			stack[stackSize++] = {ray.TMin, root, 0};
+			while (stackSize > 0) {
+				const StackEntry entry = stack[--stackSize];
+				if (entry.TNear > tMax) {
+					continue;
+				}
+				if (entry.PrimitiveCount != 0) {
+					intersectLeaf (entry.Child, entry.PrimitiveCount, tMax);
+					if (tMax < ray.TMin) {
+						return;
+					}
+					continue;
+				}
+
+				const Node& node = nodes[entry.Child];
+				const SlabDistances<Width> x = IntersectChildPlanes (node, ray, 0);
+				const SlabDistances<Width> y = IntersectChildPlanes (node, ray, 1);
+				const SlabDistances<Width> z = IntersectChildPlanes (node, ray, 2);
+				const Vector nearX = negative[0] ? x.Upper : x.Lower;
+				const Vector nearY = negative[1] ? y.Upper : y.Lower;
+				const Vector nearZ = negative[2] ? z.Upper : z.Lower;
+				const Vector farX = negative[0] ? x.Lower : x.Upper;
+				const Vector farY = negative[1] ? y.Lower : y.Upper;
+				const Vector farZ = negative[2] ? z.Lower : z.Upper;
+				const Vector tNear = Max (Max (nearX, nearY), Max (nearZ, tMin));
+				const Vector tFar = Min (Min (farX, farY), Min (farZ, Vector::Broadcast (tMax))) * Vector::Broadcast (c_SlabExitScale);
+				UINT hitMask = LessEqualMask (tNear, tFar) & ((1u << node.ChildCount) - 1);
+				if (hitMask == 0) {
+					continue;
+				}
+
+				float distances[Width];
+				tNear.Store (distances);
+
+				// Insertion sort of the hit children by decreasing distance so the nearest is popped first.
+				const UINT stackBase = stackSize;
+				for (; hitMask != 0; hitMask &= hitMask - 1) {
+					const UINT slot = CountTrailingZeros (hitMask);
+					StackEntry child = {distances[slot], node.GetChild (slot), node.GetPrimitiveCount (slot)};
+					UINT position = stackSize++;
+					while (position > stackBase && stack[position - 1].TNear < child.TNear) {
+						stack[position] = stack[position - 1];
+						position--;
+					}
+					stack[position] = child;
+				}
+			}
+		}
+
+		// TraverseWide () for rays that stop at the first hit, whose tMax never shrinks until it drops below TMin to
+		// end the search. Visiting near children first buys nothing there, so hit children are pushed in slot order,
+		// and the stack keeps no entry distances.
+		template <typename Node, typename IntersectLeaf>
+		void TraverseWideAny (const Node* nodes, const TraversalRay& ray, float& tMax, const IntersectLeaf& intersectLeaf) {
+			static const UINT Width = Node::c_Width;
+			typedef SimdFloat<Width> Vector;
+
+			struct StackEntry {
+				UINT Child;
+				UINT PrimitiveCount;    // Zero for interior children.
+			};
+
+			const bool negative[3] = {ray.InverseDirection.x < 0.0f, ray.InverseDirection.y < 0.0f, ray.InverseDirection.z < 0.0f};
+			const Vector tMin = Vector::Broadcast (ray.TMin);
+
+			StackEntry stack[c_MaxBvhDepth * (Width - 1) + 1];
+			UINT stackSize = 0;
+			stack[stackSize++] = {0, 0};
+			while (stackSize > 0) {
+				const StackEntry entry = stack[--stackSize];
+				if (entry.PrimitiveCount != 0) {
+					intersectLeaf (entry.Child, entry.PrimitiveCount, tMax);
+					if (tMax < ray.TMin) {
+						return;
+					}
+					continue;
+				}
+
+				const Node& node = nodes[entry.Child];
+				const SlabDistances<Width> x = IntersectChildPlanes (node, ray, 0);
+				const SlabDistances<Width> y = IntersectChildPlanes (node, ray, 1);
+				const SlabDistances<Width> z = IntersectChildPlanes (node, ray, 2);
+				const Vector tNear = Max (Max (negative[0] ? x.Upper : x.Lower, negative[1] ? y.Upper : y.Lower), Max (negative[2] ? z.Upper : z.Lower, tMin));
+				const Vector tFar = Min (Min (negative[0] ? x.Lower : x.Upper, negative[1] ? y.Lower : y.Upper), Min (negative[2] ? z.Lower : z.Upper,
+					Vector::Broadcast (tMax))) * Vector::Broadcast (c_SlabExitScale);
+				for (UINT hitMask = LessEqualMask (tNear, tFar) & ((1u << node.ChildCount) - 1); hitMask != 0; hitMask &= hitMask - 1) {
+					const UINT slot = CountTrailingZeros (hitMask);
+					stack[stackSize++] = {node.GetChild (slot), node.GetPrimitiveCount (slot)};
+				}
+			}
+		}
+
+		template <typename IntersectLeaf>
+		void Traverse (const AccelerationStructureHeader* header, const TraversalRay& ray, float& tMax, const IntersectLeaf& intersectLeaf) {
+			if (header->NodeCount == 0) {
+				return;
+			}
+			if (header->NodeFormat == c_NodeFormatQuantized) {
+				if (header->NodeWidth == 4) {
+					TraverseWide (header->GetQuantizedNodes<4> (), ray, tMax, intersectLeaf);
+				} else {
+					TraverseWide (header->GetQuantizedNodes<8> (), ray, tMax, intersectLeaf);
+				}
+			} else if (header->NodeWidth == 4) {
+				TraverseWide (header->GetWideNodes<4> (), ray, tMax, intersectLeaf);
+			} else if (header->NodeWidth == 8) {
+				TraverseWide (header->GetWideNodes<8> (), ray, tMax, intersectLeaf);
+			} else {
+				TraverseBinary (header, ray, tMax, intersectLeaf);
+			}
+		}
+
+		// Traverse () for rays that stop at the first hit.
+		template <typename IntersectLeaf>
+		void TraverseAny (const AccelerationStructureHeader* header, const TraversalRay& ray, float& tMax, const IntersectLeaf& intersectLeaf) {
+			if (header->NodeCount == 0) {
+				return;
+			}
+			if (header->NodeFormat == c_NodeFormatQuantized) {
+				if (header->NodeWidth == 4) {
+					TraverseWideAny (header->GetQuantizedNodes<4> (), ray, tMax, intersectLeaf);
+				} else {
+					TraverseWideAny (header->GetQuantizedNodes<8> (), ray, tMax, intersectLeaf);
+				}
+			} else if (header->NodeWidth == 4) {
+				TraverseWideAny (header->GetWideNodes<4> (), ray, tMax, intersectLeaf);
+			} else if (header->NodeWidth == 8) {
+				TraverseWideAny (header->GetWideNodes<8> (), ray, tMax, intersectLeaf);
+			} else {
+				TraverseBinaryAny (header, ray, tMax, intersectLeaf);
+			}
+		}
+
+		// The rays of a packet, one per lane, laid out so that one slab test checks a box against all of them.
+		template <UINT Width>
+		struct RayPacket {
+			SimdFloat<Width> Origin[3];
+			SimdFloat<Width> InverseDirection[3];
+			SimdFloat<Width> TMin;
+		};
+
+		// Lanes outside laneMask are zeroed rather than read.
+		template <UINT Width>
+		RayPacket<Width> MakeRayPacket (const TraversalRay* rays, UINT laneMask) {
+			float lanes[7][Width] = {};
+			for (UINT remaining = laneMask; remaining != 0; remaining &= remaining - 1) {
+				const UINT lane = CountTrailingZeros (remaining);
+				for (UINT axis = 0; axis < 3; axis++) {
+					lanes[axis][lane] = rays[lane].Origin[axis];
+					lanes[3 + axis][lane] = rays[lane].InverseDirection[axis];
+				}
+				lanes[6][lane] = rays[lane].TMin;
+			}
+
+			RayPacket<Width> packet;
+			for (UINT axis = 0; axis < 3; axis++) {
+				packet.Origin[axis] = SimdFloat<Width>::Load (lanes[axis]);
+				packet.InverseDirection[axis] = SimdFloat<Width>::Load (lanes[3 + axis]);
+			}
+			packet.TMin = SimdFloat<Width>::Load (lanes[6]);
+			return packet;
+		}
+
+		// Mask of the lanes whose ray enters box within [TMin, tMax], with the entry distances of all lanes.
+		template <UINT Width>
+		inline UINT IntersectAabb (const Aabb& box, const RayPacket<Width>& packet, SimdFloat<Width> tMax, float* tNear) {
+			typedef SimdFloat<Width> Vector;
+			Vector nearest = packet.TMin;
+			Vector farthest = tMax;
+			for (UINT axis = 0; axis < 3; axis++) {
+				const Vector t0 = (Vector::Broadcast (box.Lower[axis]) - packet.Origin[axis]) * packet.InverseDirection[axis];
+				const Vector t1 = (Vector::Broadcast (box.Upper[axis]) - packet.Origin[axis]) * packet.InverseDirection[axis];
+				nearest = Max (nearest, Min (t0, t1));
+				farthest = Min (farthest, Max (t0, t1));
+			}
+			nearest.Store (tNear);
+			return LessEqualMask (nearest, farthest * Vector::Broadcast (c_SlabExitScale));
+		}
+
+		// Lanes whose search has not ended, whose tMax is therefore not below their TMin.
+		template <UINT Width>
+		inline UINT GetLiveLanes (const RayPacket<Width>& packet, const float* tMax) {
+			return LessEqualMask (packet.TMin, SimdFloat<Width>::Load (tMax));
+		}
+
+		// A packet testing nodes for a quarter of its lanes or fewer wastes most of every slab test, so such lanes
+		// finish the subtree as single rays.
+		template <UINT Width>
+		inline bool IsSparse (UINT laneMask) {
+			return CountBits (laneMask) * 4 <= Width;
+		}
+
+		// Runs the single-ray traversal of the subtree under root for each lane of laneMask, with tMax [lane].
+		// intersectLeaf takes the lane mask of the packet traversals below.
+		template <typename IntersectLeaf>
+		void TraverseLanes (const AccelerationStructureHeader* header, const TraversalRay* rays, float* tMax, UINT laneMask, const IntersectLeaf& intersectLeaf, UINT root) {
+			for (; laneMask != 0; laneMask &= laneMask - 1) {
+				const UINT lane = CountTrailingZeros (laneMask);
+				const auto intersectLaneLeaf = [&] (UINT firstPrimitive, UINT primitiveCount, float&) {
+					intersectLeaf (1u << lane, firstPrimitive, primitiveCount);
+				};
+				if (header->NodeFormat == c_NodeFormatQuantized) {
+					if (header->NodeWidth == 4) {
+						TraverseWide (header->GetQuantizedNodes<4> (), rays[lane], tMax[lane], intersectLaneLeaf, root);
+					} else {
+						TraverseWide (header->GetQuantizedNodes<8> (), rays[lane], tMax[lane], intersectLaneLeaf, root);
+					}
+				} else if (header->NodeWidth == 4) {
+					TraverseWide (header->GetWideNodes<4> (), rays[lane], tMax[lane], intersectLaneLeaf, root);
+				} else if (header->NodeWidth == 8) {
+					TraverseWide (header->GetWideNodes<8> (), rays[lane], tMax[lane], intersectLaneLeaf, root);
+				} else {
+					TraverseBinary (header, rays[lane], tMax[lane], intersectLaneLeaf, root);
+				}
+			}
+		}
+
+		// Packet traversal: the rays of the lanes of laneMask share one stack, whose entries carry the lanes that
+		// entered the node. A popped node tests its children against those lanes, one SIMD slab test per child, and
+		// pushes each child with the lanes that enter it, nearer first by the distance of the lowest lane of the
+		// node. intersectLeaf (laneMask, firstPrimitive, primitiveCount) tests the primitives of a leaf against the
+		// rays of laneMask and shortens their tMax [lane] to the closest hit so far.
+		template <UINT Width, typename IntersectLeaf>
+		void TraversePacketBinary (const AccelerationStructureHeader* header, const TraversalRay* rays, float* tMax, UINT laneMask, const IntersectLeaf& intersectLeaf) {
+			struct StackEntry {
+				UINT Node;
+				UINT LaneMask;
+			};
+
+			const BvhNode* nodes = header->GetNodes ();
+			const RayPacket<Width> packet = MakeRayPacket<Width> (rays, laneMask);
+			float tFirst[Width];
+			float tSecond[Width];
+
+			StackEntry stack[c_MaxBvhDepth + 1];
+			UINT stackSize = 0;
+			stack[stackSize++] = {0, laneMask & IntersectAabb (nodes[0].Bounds, packet, SimdFloat<Width>::Load (tMax), tFirst)};
+			while (stackSize > 0) {
+				const StackEntry entry = stack[--stackSize];
+				const UINT lanes = entry.LaneMask & GetLiveLanes (packet, tMax);
+				if (lanes == 0) {
+					continue;
+				}
+				const BvhNode& node = nodes[entry.Node];
+				if (node.IsLeaf ()) {
+					intersectLeaf (lanes, node.Offset, node.PrimitiveCount);
+					continue;
+				}
+				if (IsSparse<Width> (lanes)) {
+					TraverseLanes (header, rays, tMax, lanes, intersectLeaf, entry.Node);
+					continue;
+				}
+
+				const SimdFloat<Width> currentTMax = SimdFloat<Width>::Load (tMax);
+				UINT first = entry.Node + 1;
+				UINT second = node.Offset;
+				UINT firstLanes = lanes & IntersectAabb (nodes[first].Bounds, packet, currentTMax, tFirst);
+				UINT secondLanes = lanes & IntersectAabb (nodes[second].Bounds, packet, currentTMax, tSecond);
+				const UINT lane = CountTrailingZeros (lanes);
+				const float firstDistance = (firstLanes >> lane) & 1 ? tFirst[lane] : std::numeric_limits<float>::infinity ();
+				const float secondDistance = (secondLanes >> lane) & 1 ? tSecond[lane] : std::numeric_limits<float>::infinity ();
+				if (secondDistance < firstDistance) {
+					std::swap (first, second);
+					std::swap (firstLanes, secondLanes);
+				}
+
+				if (secondLanes != 0) {
+					stack[stackSize++] = {second, secondLanes};
+				}
+				if (firstLanes != 0) {
+					stack[stackSize++] = {first, firstLanes};
+				}
+			}
+		}
+
+		// Same contract for BVH4 / BVH8, float or quantized.
+		template <UINT Width, typename Node, typename IntersectLeaf>
+		void TraversePacketWide (const AccelerationStructureHeader* header, const Node* nodes, const TraversalRay* rays, float* tMax, UINT laneMask,
+			const IntersectLeaf& intersectLeaf) {
+
+			struct StackEntry {
+				float Key;              // Entry distance of the lowest lane of the parent; infinity if it misses.
+				UINT Child;
+				UINT PrimitiveCount;    // Zero for interior children.
+				UINT LaneMask;
+			};
+
+			const RayPacket<Width> packet = MakeRayPacket<Width> (rays, laneMask);
+			float distances[Width];
+
+			StackEntry stack[c_MaxBvhDepth * (Node::c_Width - 1) + 1];
+			UINT stackSize = 0;
+			stack[stackSize++] = {0.0f, 0, 0, laneMask};
+			while (stackSize > 0) {
+				const StackEntry entry = stack[--stackSize];
+				const UINT lanes = entry.LaneMask & GetLiveLanes (packet, tMax);
+				if (lanes == 0) {
+					continue;
+				}
+				if (entry.PrimitiveCount != 0) {
+					intersectLeaf (lanes, entry.Child, entry.PrimitiveCount);
+					continue;
+				}
+				if (IsSparse<Width> (lanes)) {
+					TraverseLanes (header, rays, tMax, lanes, intersectLeaf, entry.Child);
+					continue;
+				}
+
+				const Node& node = nodes[entry.Child];
+				const SimdFloat<Width> currentTMax = SimdFloat<Width>::Load (tMax);
+				const UINT lane = CountTrailingZeros (lanes);
+				const UINT stackBase = stackSize;
+				for (UINT slot = 0; slot < node.ChildCount; slot++) {
+					const UINT childLanes = lanes & IntersectAabb (node.GetChildBounds (slot), packet, currentTMax, distances);
+					if (childLanes == 0) {
+						continue;
+					}
+
+					// Insertion sort by decreasing key so the nearest child is popped first.
+					StackEntry child = {(childLanes >> lane) & 1 ? distances[lane] : std::numeric_limits<float>::infinity (), node.GetChild (slot),
+						node.GetPrimitiveCount (slot), childLanes};
+					UINT position = stackSize++;
+					while (position > stackBase && stack[position - 1].Key < child.Key) {
+						stack[position] = stack[position - 1];
+						position--;
+					}
+					stack[position] = child;
+				}
+			}
+		}
+
+		template <UINT Width, typename IntersectLeaf>
+		void TraversePacket (const AccelerationStructureHeader* header, const TraversalRay* rays, float* tMax, UINT laneMask, const IntersectLeaf& intersectLeaf) {
+			if (header->NodeCount == 0 || laneMask == 0) {
+				return;
+			}
+			if (IsSparse<Width> (laneMask)) {
+				TraverseLanes (header, rays, tMax, laneMask, intersectLeaf, 0);
+			} else if (header->NodeFormat == c_NodeFormatQuantized) {
+				if (header->NodeWidth == 4) {
+					TraversePacketWide<Width> (header, header->GetQuantizedNodes<4> (), rays, tMax, laneMask, intersectLeaf);
+				} else {
+					TraversePacketWide<Width> (header, header->GetQuantizedNodes<8> (), rays, tMax, laneMask, intersectLeaf);
+				}
+			} else if (header->NodeWidth == 4) {
+				TraversePacketWide<Width> (header, header->GetWideNodes<4> (), rays, tMax, laneMask, intersectLeaf);
+			} else if (header->NodeWidth == 8) {
+				TraversePacketWide<Width> (header, header->GetWideNodes<8> (), rays, tMax, laneMask, intersectLeaf);
+			} else {
+				TraversePacketBinary<Width> (header, rays, tMax, laneMask, intersectLeaf);
+			}
+		}
+
+		// Set as tMax once an any-hit shader ends the search. It lies below every TMin, so the single-ray traversals
+		// return after the leaf that ended the search, and packet lanes drop out of every node still to be tested.
+		const float c_EndSearchTMax = -std::numeric_limits<float>::infinity ();
+
+		// What a trace carries into every bottom-level structure it enters.
+		struct TraceState {
+			const RayDesc* WorldRay;
+			UINT RayFlags;
+			const HitGroupTable* HitGroups;
+			bool HasAnyHitShaders;              // Whether any record of HitGroups has an any-hit shader.
+			const InstanceRecord* Instance;     // Null while tracing a bottom-level structure on its own.
+			void* Payload;
+			RayHit* Hit;
+		};
+
+		UINT GetInstanceFlags (const TraceState& state) {
+			return state.Instance ? state.Instance->Flags : 0;
+		}
+
+		// Ray flags take precedence over instance flags, which take precedence over the geometry flags.
+		bool IsOpaque (UINT rayFlags, UINT instanceFlags, UINT geometryFlags) {
+			if (rayFlags & (RAY_FLAG_FORCE_OPAQUE | RAY_FLAG_FORCE_NON_OPAQUE)) {
+				return (rayFlags & RAY_FLAG_FORCE_OPAQUE) != 0;
+			}
+			if (instanceFlags & (D3D12_RAYTRACING_INSTANCE_FLAG_FORCE_OPAQUE | D3D12_RAYTRACING_INSTANCE_FLAG_FORCE_NON_OPAQUE)) {
+				return (instanceFlags & D3D12_RAYTRACING_INSTANCE_FLAG_FORCE_OPAQUE) != 0;
+			}
+			return (geometryFlags & D3D12_RAYTRACING_GEOMETRY_FLAG_OPAQUE) != 0;
+		}
+
+		UINT GetHitGroupIndex (const TraceState& state, UINT geometryIndex) {
+			const UINT instanceContribution = state.Instance ? state.Instance->InstanceContributionToHitGroupIndex : 0;
+			return instanceContribution + state.HitGroups->RayContributionToHitGroupIndex + state.HitGroups->MultiplierForGeometryContributionToHitGroupIndex * geometryIndex;
+		}
+
+		const HitGroup& GetHitGroup (const TraceState& state, UINT geometryIndex) {
+			const HitGroupTable& hitGroups = *state.HitGroups;
+			const UINT hitGroupIndex = GetHitGroupIndex (state, geometryIndex);
+			ThrowIfFalse (hitGroupIndex < hitGroups.RecordCount && hitGroups.ppRecords[hitGroupIndex] != nullptr, "CpuRaytracing: a hit selects a hit group outside the hit-group table.");
+			return *hitGroups.ppRecords[hitGroupIndex];
+		}
+
+		const IntersectionShader& GetIntersectionShader (const HitGroup& hitGroup) {
+			ThrowIfFalse (hitGroup.GetHitGroupType () == D3D12_HIT_GROUP_TYPE_PROCEDURAL_PRIMITIVE && hitGroup.GetIntersectionShader (),
+				"CpuRaytracing: procedural primitives need a PROCEDURAL_PRIMITIVE hit group with an intersection shader.");
+			return hitGroup.GetIntersectionShader ();
+		}
+
+		const AnyHitShader* GetAnyHitShader (const HitGroup& hitGroup) {
+			return hitGroup.GetAnyHitShader () ? &hitGroup.GetAnyHitShader () : nullptr;
+		}
+
+		// The facing a triangle hit is reported with, and whether it is culled, for the instance being traced.
+		struct TriangleFacing {
+			bool FrontCounterClockwise;
+			bool CullFrontFacing;
+			bool CullBackFacing;
+
+			explicit TriangleFacing (const TraceState& state) {
+				const UINT instanceFlags = GetInstanceFlags (state);
+				const bool cull = !(instanceFlags & D3D12_RAYTRACING_INSTANCE_FLAG_TRIANGLE_CULL_DISABLE);
+				FrontCounterClockwise = (instanceFlags & D3D12_RAYTRACING_INSTANCE_FLAG_TRIANGLE_FRONT_COUNTERCLOCKWISE) != 0;
+				CullFrontFacing = cull && (state.RayFlags & RAY_FLAG_CULL_FRONT_FACING_TRIANGLES) != 0;
+				CullBackFacing = cull && (state.RayFlags & RAY_FLAG_CULL_BACK_FACING_TRIANGLES) != 0;
+			}
+		};
+
+		// The lanes of the block starting at primitive blockBase that hold primitives of [firstPrimitive, endPrimitive).
+		inline UINT GetBlockLaneMask (UINT blockBase, UINT firstPrimitive, UINT endPrimitive) {
+			const UINT firstLane = std::max (firstPrimitive, blockBase) - blockBase;
+			const UINT endLane = std::min (endPrimitive - blockBase, c_TriangleBlockWidth);
+			return ((1u << endLane) - 1) & ~((1u << firstLane) - 1);
+		}
+
+		// Tests the triangles of leaves against one ray at a time, committing the closest hits to state.Hit. The
+		// instance-wide settings are taken from the state it is constructed with, which every ray it tests shares.
+		//
+		// Opaque is true when every geometry of the instance is opaque, or when opacity changes nothing because no
+		// hit group has an any-hit shader and the ray culls by opacity neither way; that instantiation never reads
+		// geometry flags or hit groups.
+		template <bool Opaque>
+		struct TriangleLeafIntersector {
+			const TriangleBlock* Blocks;
+			const PrimitiveRecord* Primitives;
+			const GeometryInfo* Geometries;
+			TriangleFacing Facing;
+			UINT InstanceFlags;
+			bool CullOpaque;
+			bool CullNonOpaque;
+			bool AcceptFirstHit;
+
+			TriangleLeafIntersector (const AccelerationStructureHeader* header, const TraceState& state) :
+				Blocks (header->GetTriangleBlocks ()),
+				Primitives (header->GetPrimitives ()),
+				Geometries (header->GetGeometries ()),
+				Facing (state),
+				InstanceFlags (GetInstanceFlags (state)),
+				CullOpaque ((state.RayFlags & RAY_FLAG_CULL_OPAQUE) != 0),
+				CullNonOpaque ((state.RayFlags & RAY_FLAG_CULL_NON_OPAQUE) != 0),
+				AcceptFirstHit ((state.RayFlags & RAY_FLAG_ACCEPT_FIRST_HIT_AND_END_SEARCH) != 0) {}
+
+			// Shortens tMax to every hit committed, and returns whether there was one. The primitives are tested a
+			// block at a time; the hits of a block are then taken in primitive order, each against the tMax left by
+			// the ones before it, as if the primitives had been tested one by one.
+			bool Intersect (const TraversalRay& ray, const TraceState& state, UINT firstPrimitive, UINT primitiveCount, float& tMax) const {
+				RayHit* hit = state.Hit;
+				bool found = false;
+				const UINT endPrimitive = firstPrimitive + primitiveCount;
+				for (UINT block = firstPrimitive / c_TriangleBlockWidth; block * c_TriangleBlockWidth < endPrimitive; block++) {
+					const UINT blockBase = block * c_TriangleBlockWidth;
+					UINT laneMask = GetBlockLaneMask (blockBase, firstPrimitive, endPrimitive);
+					UINT opaqueMask = laneMask;
+					if (!Opaque) {
+						for (UINT lanes = laneMask; lanes != 0; lanes &= lanes - 1) {
+							const UINT lane = CountTrailingZeros (lanes);
+							const bool opaque = IsOpaque (state.RayFlags, InstanceFlags, Geometries[Primitives[blockBase + lane].GeometryIndex].Flags);
+							if (opaque ? CullOpaque : CullNonOpaque) {
+								laneMask &= ~(1u << lane);
+							}
+							opaqueMask &= opaque ? ~0u : ~(1u << lane);
+						}
+					}
+
+					TriangleBlockHits hits;
+					for (UINT lanes = IntersectTriangleBlock (Blocks[block], ray, tMax, laneMask, &hits); lanes != 0; lanes &= lanes - 1) {
+						const UINT lane = CountTrailingZeros (lanes);
+						const UINT i = blockBase + lane;
+						const float t = hits.T[lane];
+						if (!(t <= tMax)) {
+							continue;
+						}
+						const bool frontFace = ((hits.ClockwiseMask >> lane) & 1) != (Facing.FrontCounterClockwise ? 1u : 0u);
+						if (frontFace ? Facing.CullFrontFacing : Facing.CullBackFacing) {
+							continue;
+						}
+
+						const UINT hitKind = frontFace ? c_HitKindTriangleFrontFace : c_HitKindTriangleBackFace;
+						bool searchEnded = AcceptFirstHit;
+						if (!((opaqueMask >> lane) & 1) && state.HasAnyHitShaders) {
+							const AnyHitShader* anyHitShader = GetAnyHitShader (GetHitGroup (state, Primitives[i].GeometryIndex));
+							if (anyHitShader) {
+								const float barycentrics[2] = {hits.U[lane], hits.V[lane]};
+								AnyHitContext context (*state.WorldRay, state.RayFlags, ray.Origin, ray.Direction, Primitives[i].PrimitiveIndex,
+									Primitives[i].GeometryIndex, state.Instance, t, hitKind, reinterpret_cast<const UINT8*> (barycentrics), state.Payload);
+								(*anyHitShader) (context);
+								if (context.IsIgnored ()) {
+									continue;
+								}
+								searchEnded = searchEnded || context.IsSearchEnded ();
+							}
+						}
+
+						tMax = searchEnded ? c_EndSearchTMax : t;
+						hit->T = t;
+						hit->Barycentrics[0] = hits.U[lane];
+						hit->Barycentrics[1] = hits.V[lane];
+						hit->HitKind = hitKind;
+						hit->PrimitiveIndex = Primitives[i].PrimitiveIndex;
+						hit->GeometryIndex = Primitives[i].GeometryIndex;
+						found = true;
+						if (searchEnded) {
+							return true;
+						}
+					}
+				}
+				return found;
+			}
+		};
+
+		// The intersection shader runs for every primitive whose box the ray enters before the closest hit so far.
+		template <bool Opaque>
+		struct ProceduralLeafIntersector {
+			const Aabb* PrimitiveBounds;
+			const PrimitiveRecord* Primitives;
+			const GeometryInfo* Geometries;
+			UINT InstanceFlags;
+			bool CullOpaque;
+			bool CullNonOpaque;
+
+			ProceduralLeafIntersector (const AccelerationStructureHeader* header, const TraceState& state) :
+				PrimitiveBounds (header->GetProceduralBounds ()),
+				Primitives (header->GetPrimitives ()),
+				Geometries (header->GetGeometries ()),
+				InstanceFlags (GetInstanceFlags (state)),
+				CullOpaque ((state.RayFlags & RAY_FLAG_CULL_OPAQUE) != 0),
+				CullNonOpaque ((state.RayFlags & RAY_FLAG_CULL_NON_OPAQUE) != 0) {}
+
+			bool Intersect (const TraversalRay& ray, const TraceState& state, UINT firstPrimitive, UINT primitiveCount, float& tMax) const {
+				RayHit* hit = state.Hit;
+				bool found = false;
+				for (UINT i = firstPrimitive; i < firstPrimitive + primitiveCount; i++) {
+					bool opaque = true;
+					if (!Opaque) {
+						opaque = IsOpaque (state.RayFlags, InstanceFlags, Geometries[Primitives[i].GeometryIndex].Flags);
+						if (opaque ? CullOpaque : CullNonOpaque) {
+							continue;
+						}
+					}
+					if (IntersectAabb (PrimitiveBounds[i], ray, tMax) == std::numeric_limits<float>::infinity ()) {
+						continue;
+					}
+
+					const HitGroup& hitGroup = GetHitGroup (state, Primitives[i].GeometryIndex);
+					IntersectionContext context (*state.WorldRay, state.RayFlags, ray.Origin, ray.Direction, PrimitiveBounds[i], Primitives[i].PrimitiveIndex,
+						Primitives[i].GeometryIndex, state.Instance, tMax, opaque ? nullptr : GetAnyHitShader (hitGroup), state.Payload);
+					GetIntersectionShader (hitGroup) (context);
+					if (context.IsCommitted ()) {
+						tMax = context.IsSearchEnded () ? c_EndSearchTMax : context.RayTCurrent ();
+						hit->T = context.RayTCurrent ();
+						memcpy (hit->Attributes, context.GetAttributes (), sizeof (hit->Attributes));
+						hit->HitKind = context.GetHitKind ();
+						hit->PrimitiveIndex = Primitives[i].PrimitiveIndex;
+						hit->GeometryIndex = Primitives[i].GeometryIndex;
+						found = true;
+						if (context.IsSearchEnded ()) {
+							break;
+						}
+					}
+				}
+				return found;
+			}
+		};
+
+		// Tests the triangles of leaves for whether the ray hits any of them, for occlusion rays through instances
+		// that can be traced as opaque. With no any-hit shader to run, a hit needs neither its distance nor its
+		// barycentrics, and nothing is written to state.Hit.
+		struct TriangleLeafOccluder {
+			const TriangleBlock* Blocks;
+			TriangleFacing Facing;
+
+			TriangleLeafOccluder (const AccelerationStructureHeader* header, const TraceState& state) :
+				Blocks (header->GetTriangleBlocks ()),
+				Facing (state) {}
+
+			// Ends the search at the first hit the facing culls keep.
+			bool Intersect (const TraversalRay& ray, const TraceState&, UINT firstPrimitive, UINT primitiveCount, float& tMax) const {
+				const UINT endPrimitive = firstPrimitive + primitiveCount;
+				for (UINT block = firstPrimitive / c_TriangleBlockWidth; block * c_TriangleBlockWidth < endPrimitive; block++) {
+					const UINT laneMask = GetBlockLaneMask (block * c_TriangleBlockWidth, firstPrimitive, endPrimitive);
+					UINT clockwiseMask = 0;
+					UINT hitMask = OccludesTriangleBlock (Blocks[block], ray, tMax, laneMask, &clockwiseMask);
+					const UINT frontMask = Facing.FrontCounterClockwise ? ~clockwiseMask : clockwiseMask;
+					if (Facing.CullFrontFacing) {
+						hitMask &= ~frontMask;
+					}
+					if (Facing.CullBackFacing) {
+						hitMask &= frontMask;
+					}
+					if (hitMask != 0) {
+						tMax = c_EndSearchTMax;
+						return true;
+					}
+				}
+				return false;
+			}
+		};
+
+		template <typename LeafIntersector>
+		bool TraceLeaves (const AccelerationStructureHeader* header, const TraversalRay& ray, float& tMax, const TraceState& state) {
+			const LeafIntersector leafIntersector (header, state);
+			bool found = false;
+			Traverse (header, ray, tMax, [&] (UINT firstPrimitive, UINT primitiveCount, float& leafTMax) {
+				found = leafIntersector.Intersect (ray, state, firstPrimitive, primitiveCount, leafTMax) || found;
+			});
+			return found;
+		}
+
+		// TraceLeaves () for occlusion rays, which accept the first hit.
+		template <typename LeafIntersector>
+		bool OccludedLeaves (const AccelerationStructureHeader* header, const TraversalRay& ray, float& tMax, const TraceState& state) {
+			const LeafIntersector leafIntersector (header, state);
+			bool found = false;
+			TraverseAny (header, ray, tMax, [&] (UINT firstPrimitive, UINT primitiveCount, float& leafTMax) {
+				found = leafIntersector.Intersect (ray, state, firstPrimitive, primitiveCount, leafTMax) || found;
+			});
+			return found;
+		}
+
+		// The lanes of laneMask share the instance and ray flags; each has its own ray, tMax and state.
+		template <typename LeafIntersector, UINT Width>
+		UINT TraceLeavesPacket (const AccelerationStructureHeader* header, const TraversalRay* rays, float* tMax, const TraceState* states, UINT laneMask) {
+			const LeafIntersector leafIntersector (header, states[CountTrailingZeros (laneMask)]);
+			UINT foundMask = 0;
+			TraversePacket<Width> (header, rays, tMax, laneMask, [&] (UINT leafLanes, UINT firstPrimitive, UINT primitiveCount) {
+				for (; leafLanes != 0; leafLanes &= leafLanes - 1) {
+					const UINT lane = CountTrailingZeros (leafLanes);
+					if (leafIntersector.Intersect (rays[lane], states[lane], firstPrimitive, primitiveCount, tMax[lane])) {
+						foundMask |= 1u << lane;
+					}
+				}
+			});
+			return foundMask;
+		}
+
+		// Whether the ray enters a bottom-level structure at all, and if so whether its primitives can be traced as
+		// opaque throughout. The header holds the geometry flags all geometries share, so whole structures whose
+		// opacity the ray culls are skipped without entering them.
+		bool EntersBottomLevel (const AccelerationStructureHeader* header, const TraceState& state, bool* opaque) {
+			const bool procedural = header->GeometryType == D3D12_RAYTRACING_GEOMETRY_TYPE_PROCEDURAL_PRIMITIVE_AABBS;
+			if (state.RayFlags & (procedural ? RAY_FLAG_SKIP_PROCEDURAL_PRIMITIVES : RAY_FLAG_SKIP_TRIANGLES)) {
+				return false;
+			}
+
+			const UINT instanceFlags = GetInstanceFlags (state);
+			const bool allOpaque = IsOpaque (state.RayFlags, instanceFlags, header->GeometryFlags);
+			const bool allNonOpaque = !IsOpaque (state.RayFlags, instanceFlags, D3D12_RAYTRACING_GEOMETRY_FLAG_OPAQUE);
+			if ((allOpaque && (state.RayFlags & RAY_FLAG_CULL_OPAQUE)) || (allNonOpaque && (state.RayFlags & RAY_FLAG_CULL_NON_OPAQUE))) {
+				return false;
+			}
+
+			*opaque = allOpaque || !(state.HasAnyHitShaders || (state.RayFlags & (RAY_FLAG_CULL_OPAQUE | RAY_FLAG_CULL_NON_OPAQUE)));
+			return true;
+		}
+
+		bool TraceBottomLevel (const AccelerationStructureHeader* header, const TraversalRay& ray, float& tMax, const TraceState& state) {
+			bool opaque;
+			if (!EntersBottomLevel (header, state, &opaque)) {
+				return false;
+			}
+
+			bool found;
+			if (header->GeometryType == D3D12_RAYTRACING_GEOMETRY_TYPE_PROCEDURAL_PRIMITIVE_AABBS) {
+				found = opaque ? TraceLeaves<ProceduralLeafIntersector<true>> (header, ray, tMax, state) : TraceLeaves<ProceduralLeafIntersector<false>> (header, ray, tMax, state);
+			} else {
+				found = opaque ? TraceLeaves<TriangleLeafIntersector<true>> (header, ray, tMax, state) : TraceLeaves<TriangleLeafIntersector<false>> (header, ray, tMax, state);
+			}
+			if (found) {
+				state.Hit->HitGroupIndex = GetHitGroupIndex (state, state.Hit->GeometryIndex);
+			}
+			return found;
+		}
+
+		// Any-hit shaders on non-opaque triangles and intersection shaders on procedural primitives read the
+		// candidate hit, so only instances traced as opaque get by without one.
+		bool OccludedBottomLevel (const AccelerationStructureHeader* header, const TraversalRay& ray, float& tMax, const TraceState& state) {
+			bool opaque;
+			if (!EntersBottomLevel (header, state, &opaque)) {
+				return false;
+			}
+
+			if (header->GeometryType == D3D12_RAYTRACING_GEOMETRY_TYPE_PROCEDURAL_PRIMITIVE_AABBS) {
+				return opaque ? OccludedLeaves<ProceduralLeafIntersector<true>> (header, ray, tMax, state) :
+					OccludedLeaves<ProceduralLeafIntersector<false>> (header, ray, tMax, state);
+			}
+			return opaque ? OccludedLeaves<TriangleLeafOccluder> (header, ray, tMax, state) : OccludedLeaves<TriangleLeafIntersector<false>> (header, ray, tMax, state);
+		}
+
+		template <UINT Width>
+		UINT TraceBottomLevelPacket (const AccelerationStructureHeader* header, const TraversalRay* rays, float* tMax, const TraceState* states, UINT laneMask) {
+			bool opaque;
+			if (laneMask == 0 || !EntersBottomLevel (header, states[CountTrailingZeros (laneMask)], &opaque)) {
+				return 0;
+			}
+
+			UINT foundMask;
+			if (header->GeometryType == D3D12_RAYTRACING_GEOMETRY_TYPE_PROCEDURAL_PRIMITIVE_AABBS) {
+				foundMask = opaque ? TraceLeavesPacket<ProceduralLeafIntersector<true>, Width> (header, rays, tMax, states, laneMask) :
+					TraceLeavesPacket<ProceduralLeafIntersector<false>, Width> (header, rays, tMax, states, laneMask);
+			} else {
+				foundMask = opaque ? TraceLeavesPacket<TriangleLeafIntersector<true>, Width> (header, rays, tMax, states, laneMask) :
+					TraceLeavesPacket<TriangleLeafIntersector<false>, Width> (header, rays, tMax, states, laneMask);
+			}
+			for (UINT found = foundMask; found != 0; found &= found - 1) {
+				const TraceState& state = states[CountTrailingZeros (found)];
+				state.Hit->HitGroupIndex = GetHitGroupIndex (state, state.Hit->GeometryIndex);
+			}
+			return foundMask;
+		}
+
+		void SetInstance (const InstanceRecord* instance, RayHit* hit) {
+			hit->InstanceIndex = instance ? instance->InstanceIndex : 0;
+			hit->InstanceID = instance ? instance->InstanceID : 0;
+			hit->InstanceContributionToHitGroupIndex = instance ? instance->InstanceContributionToHitGroupIndex : 0;
+			hit->Instance = instance;
+		}
+
+		bool TraceTopLevel (const AccelerationStructureHeader* header, const TraversalRay& ray, UINT instanceInclusionMask, float& tMax, const TraceState& state) {
+			const InstanceRecord* instances = header->GetInstances ();
+			bool found = false;
+
+			Traverse (header, ray, tMax, [&] (UINT firstPrimitive, UINT primitiveCount, float& leafTMax) {
+				for (UINT i = firstPrimitive; i < firstPrimitive + primitiveCount; i++) {
+					const InstanceRecord& instance = instances[i];
+					if ((instance.InstanceMask & instanceInclusionMask) == 0) {
+						continue;
+					}
+
+					// The object-space direction is not renormalized, so distances stay comparable across instances.
+					TraversalRay objectRay = MakeTraversalRay (instance.WorldToObject.TransformPoint (ray.Origin), instance.WorldToObject.TransformVector (ray.Direction), ray.TMin);
+					TraceState instanceState = state;
+					instanceState.Instance = &instance;
+					if (TraceBottomLevel (GetCpuPointer<const AccelerationStructureHeader> (instance.AccelerationStructure), objectRay, leafTMax, instanceState)) {
+						SetInstance (&instance, state.Hit);
+						found = true;
+						if (leafTMax == c_EndSearchTMax) {
+							return;
+						}
+					}
+				}
+			});
+			return found;
+		}
+
+		bool OccludedTopLevel (const AccelerationStructureHeader* header, const TraversalRay& ray, UINT instanceInclusionMask, float& tMax, const TraceState& state) {
+			const InstanceRecord* instances = header->GetInstances ();
+			bool found = false;
+
+			TraverseAny (header, ray, tMax, [&] (UINT firstPrimitive, UINT primitiveCount, float& leafTMax) {
+				for (UINT i = firstPrimitive; i < firstPrimitive + primitiveCount; i++) {
+					const InstanceRecord& instance = instances[i];
+					if ((instance.InstanceMask & instanceInclusionMask) == 0) {
+						continue;
+					}
+
+					TraversalRay objectRay = MakeTraversalRay (instance.WorldToObject.TransformPoint (ray.Origin), instance.WorldToObject.TransformVector (ray.Direction), ray.TMin);
+					TraceState instanceState = state;
+					instanceState.Instance = &instance;
+					if (OccludedBottomLevel (GetCpuPointer<const AccelerationStructureHeader> (instance.AccelerationStructure), objectRay, leafTMax, instanceState)) {
+						found = true;
+						return;
+					}
+				}
+			});
+			return found;
+		}
+
+		// The lanes reaching an instance enter its bottom-level structure together, as a packet of object-space rays.
+		template <UINT Width>
+		UINT TraceTopLevelPacket (const AccelerationStructureHeader* header, const TraversalRay* rays, UINT instanceInclusionMask, float* tMax, const TraceState* states,
+			UINT laneMask) {
+
+			const InstanceRecord* instances = header->GetInstances ();
+			UINT foundMask = 0;
+
+			TraversePacket<Width> (header, rays, tMax, laneMask, [&] (UINT leafLanes, UINT firstPrimitive, UINT primitiveCount) {
+				for (UINT i = firstPrimitive; i < firstPrimitive + primitiveCount && leafLanes != 0; i++) {
+					const InstanceRecord& instance = instances[i];
+					if ((instance.InstanceMask & instanceInclusionMask) == 0) {
+						continue;
+					}
+
+					TraversalRay objectRays[Width];
+					TraceState instanceStates[Width];
+					for (UINT lanes = leafLanes; lanes != 0; lanes &= lanes - 1) {
+						const UINT lane = CountTrailingZeros (lanes);
+						objectRays[lane] = MakeTraversalRay (instance.WorldToObject.TransformPoint (rays[lane].Origin), instance.WorldToObject.TransformVector (rays[lane].Direction),
+							rays[lane].TMin);
+						instanceStates[lane] = states[lane];
+						instanceStates[lane].Instance = &instance;
+					}
+
+					const UINT hitLanes = TraceBottomLevelPacket<Width> (GetCpuPointer<const AccelerationStructureHeader> (instance.AccelerationStructure), objectRays, tMax,
+						instanceStates, leafLanes);
+					for (UINT lanes = hitLanes; lanes != 0; lanes &= lanes - 1) {
+						const UINT lane = CountTrailingZeros (lanes);
+						SetInstance (&instance, states[lane].Hit);
+						if (tMax[lane] == c_EndSearchTMax) {
+							leafLanes &= ~(1u << lane);
+						}
+					}
+					foundMask |= hitLanes;
+				}
+			});
+			return foundMask;
+		}
+
+		bool HasAnyHitShaders (const HitGroupTable& hitGroups) {
+			for (UINT i = 0; i < hitGroups.RecordCount; i++) {
+				if (hitGroups.ppRecords[i] && hitGroups.ppRecords[i]->GetAnyHitShader ()) {
+					return true;
+				}
+			}
+			return false;
+		}
+
+		const UINT c_SupportedRayFlags = RAY_FLAG_FORCE_OPAQUE | RAY_FLAG_FORCE_NON_OPAQUE | RAY_FLAG_ACCEPT_FIRST_HIT_AND_END_SEARCH |
+			RAY_FLAG_SKIP_CLOSEST_HIT_SHADER | RAY_FLAG_CULL_BACK_FACING_TRIANGLES | RAY_FLAG_CULL_FRONT_FACING_TRIANGLES | RAY_FLAG_CULL_OPAQUE |
+			RAY_FLAG_CULL_NON_OPAQUE | RAY_FLAG_SKIP_TRIANGLES | RAY_FLAG_SKIP_PROCEDURAL_PRIMITIVES;
+
+		bool HasAtMostOneBit (UINT bits) {
+			return (bits & (bits - 1)) == 0;
+		}
+
+		void ValidateRayFlags (UINT rayFlags) {
+			ThrowIfFalse ((rayFlags & ~c_SupportedRayFlags) == 0, "CpuRaytracing: unsupported ray flags.");
+			const UINT facingFlags = rayFlags & (RAY_FLAG_CULL_BACK_FACING_TRIANGLES | RAY_FLAG_CULL_FRONT_FACING_TRIANGLES);
+			ThrowIfFalse (HasAtMostOneBit (rayFlags & (RAY_FLAG_FORCE_OPAQUE | RAY_FLAG_FORCE_NON_OPAQUE | RAY_FLAG_CULL_OPAQUE | RAY_FLAG_CULL_NON_OPAQUE)) &&
+				HasAtMostOneBit (facingFlags) && HasAtMostOneBit (rayFlags & (RAY_FLAG_SKIP_TRIANGLES | RAY_FLAG_SKIP_PROCEDURAL_PRIMITIVES)) &&
+				!((rayFlags & RAY_FLAG_SKIP_TRIANGLES) && facingFlags),
+				"CpuRaytracing: conflicting ray flags: at most one FORCE_* or CULL_*OPAQUE flag, one facing cull and one SKIP_* flag, and no facing cull with SKIP_TRIANGLES.");
+		}
+
+		bool Trace (const AccelerationStructureHeader* accelerationStructure, const RayDesc& ray, UINT rayFlags, UINT instanceInclusionMask,
+			const HitGroupTable& hitGroups, void* payload, RayHit* hit) {
+
+			ThrowIfFalse (accelerationStructure && accelerationStructure->IsValid () && hit);
+			ThrowIfFalse (hitGroups.RecordCount == 0 || hitGroups.ppRecords != nullptr);
+			ValidateRayFlags (rayFlags);
+
+			TraversalRay traversalRay = MakeTraversalRay (ray.Origin, ray.Direction, ray.TMin);
+			TraceState state = {&ray, rayFlags, &hitGroups, HasAnyHitShaders (hitGroups), nullptr, payload, hit};
+			float tMax = ray.TMax;
+			if (accelerationStructure->Type == D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL) {
+				return TraceTopLevel (accelerationStructure, traversalRay, instanceInclusionMask & 0xFF, tMax, state);
+			}
+
+			if (!TraceBottomLevel (accelerationStructure, traversalRay, tMax, state)) {
+				return false;
+			}
+			SetInstance (nullptr, hit);
+			return true;
+		}
+
+		// Trace () with RAY_FLAG_ACCEPT_FIRST_HIT_AND_END_SEARCH, reporting only whether anything was hit.
+		bool Occluded (const AccelerationStructureHeader* accelerationStructure, const RayDesc& ray, UINT rayFlags, UINT instanceInclusionMask,
+			const HitGroupTable& hitGroups, void* payload) {
+
+			ThrowIfFalse (accelerationStructure && accelerationStructure->IsValid ());
+			ThrowIfFalse (hitGroups.RecordCount == 0 || hitGroups.ppRecords != nullptr);
+			ValidateRayFlags (rayFlags);
+
+			// Any-hit and intersection shaders still need somewhere to put the candidate hit.
+			RayHit candidate;
+			TraversalRay traversalRay = MakeTraversalRay (ray.Origin, ray.Direction, ray.TMin);
+			TraceState state = {&ray, rayFlags | RAY_FLAG_ACCEPT_FIRST_HIT_AND_END_SEARCH, &hitGroups, HasAnyHitShaders (hitGroups), nullptr, payload, &candidate};
+			float tMax = ray.TMax;
+			if (accelerationStructure->Type == D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL) {
+				return OccludedTopLevel (accelerationStructure, traversalRay, instanceInclusionMask & 0xFF, tMax, state);
+			}
+			return OccludedBottomLevel (accelerationStructure, traversalRay, tMax, state);
+		}
+
+		template <UINT Width>
+		UINT TracePacket (const AccelerationStructureHeader* accelerationStructure, UINT rayCount, const RayDesc* rays, UINT rayFlags, UINT instanceInclusionMask,
+			const HitGroupTable& hitGroups, void* const* payloads, RayHit* hits) {
+
+			TraversalRay traversalRays[Width];
+			TraceState states[Width];
+			float tMax[Width];
+			const bool hasAnyHitShaders = HasAnyHitShaders (hitGroups);
+			for (UINT lane = 0; lane < Width; lane++) {
+				if (lane < rayCount) {
+					traversalRays[lane] = MakeTraversalRay (rays[lane].Origin, rays[lane].Direction, rays[lane].TMin);
+					states[lane] = {&rays[lane], rayFlags, &hitGroups, hasAnyHitShaders, nullptr, payloads ? payloads[lane] : nullptr, &hits[lane]};
+					tMax[lane] = rays[lane].TMax;
+				} else {
+					tMax[lane] = c_EndSearchTMax;
+				}
+			}
+
+			const UINT laneMask = (1u << rayCount) - 1;
+			if (accelerationStructure->Type == D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL) {
+				return TraceTopLevelPacket<Width> (accelerationStructure, traversalRays, instanceInclusionMask & 0xFF, tMax, states, laneMask);
+			}
+
+			const UINT foundMask = TraceBottomLevelPacket<Width> (accelerationStructure, traversalRays, tMax, states, laneMask);
+			for (UINT found = foundMask; found != 0; found &= found - 1) {
+				SetInstance (nullptr, &hits[CountTrailingZeros (found)]);
+			}
+			return foundMask;
+		}
+
+	}
+
+	bool IntersectionContext::ReportHit (float tHit, UINT hitKind, const void* attributes, size_t sizeInBytes) {
+		ThrowIfFalse (hitKind <= c_MaxProceduralHitKind, "CpuRaytracing: ReportHit () takes hit kinds from 0 to 127.");
+		if (m_SearchEnded || !(tHit >= m_WorldRay.TMin && tHit <= m_TCurrent)) {
+			return false;
+		}
+
+		UINT8 candidate[D3D12_RAYTRACING_MAX_ATTRIBUTE_SIZE_IN_BYTES] = {};
+		memcpy (candidate, attributes, sizeInBytes);
+		if (m_AnyHitShader) {
+			AnyHitContext context (m_WorldRay, m_RayFlags, m_ObjectRayOrigin, m_ObjectRayDirection, m_PrimitiveIndex, m_GeometryIndex, m_Instance,
+				tHit, hitKind, candidate, m_Payload);
+			(*m_AnyHitShader) (context);
+			if (context.IsIgnored ()) {
+				return false;
+			}
+			m_SearchEnded = context.IsSearchEnded ();
+		}
+		m_SearchEnded = m_SearchEnded || (m_RayFlags & RAY_FLAG_ACCEPT_FIRST_HIT_AND_END_SEARCH) != 0;
+
+		m_TCurrent = tHit;
+		m_HitKind = hitKind;
+		m_Committed = true;
+		memcpy (m_Attributes, candidate, sizeof (m_Attributes));
+		return true;
+	}
+
+	bool TraceRayClosestHit (const AccelerationStructureHeader* accelerationStructure, const RayDesc& ray, UINT rayFlags, UINT instanceInclusionMask,
+		const HitGroupTable& hitGroups, RayHit* hit) {
+
+		return Trace (accelerationStructure, ray, rayFlags, instanceInclusionMask, hitGroups, nullptr, hit);
+	}
+
+	bool TraceRayClosestHit (const AccelerationStructureHeader* accelerationStructure, const RayDesc& ray, UINT instanceInclusionMask, RayHit* hit) {
+		const HitGroupTable noHitGroups = {nullptr, 0, 0, 0};
+		return TraceRayClosestHit (accelerationStructure, ray, RAY_FLAG_NONE, instanceInclusionMask, noHitGroups, hit);
+	}
+
+	bool TraceRayOcclusion (const AccelerationStructureHeader* accelerationStructure, const RayDesc& ray, UINT rayFlags, UINT instanceInclusionMask,
+		const HitGroupTable& hitGroups) {
+
+		return Occluded (accelerationStructure, ray, rayFlags, instanceInclusionMask, hitGroups, nullptr);
+	}
+
+	bool TraceRayOcclusion (const AccelerationStructureHeader* accelerationStructure, const RayDesc& ray, UINT instanceInclusionMask) {
+		const HitGroupTable noHitGroups = {nullptr, 0, 0, 0};
+		return TraceRayOcclusion (accelerationStructure, ray, RAY_FLAG_NONE, instanceInclusionMask, noHitGroups);
+	}
+
+	UINT TraceRayPacketClosestHit (const AccelerationStructureHeader* accelerationStructure, UINT rayCount, const RayDesc* pRays, UINT rayFlags,
+		UINT instanceInclusionMask, const HitGroupTable& hitGroups, RayHit* pHits, void* const* ppPayloads) {
+
+		ThrowIfFalse (accelerationStructure && accelerationStructure->IsValid () && pRays && pHits);
+		ThrowIfFalse (rayCount <= c_MaxRayPacketSize, "CpuRaytracing: a ray packet holds at most c_MaxRayPacketSize rays.");
+		ThrowIfFalse (hitGroups.RecordCount == 0 || hitGroups.ppRecords != nullptr);
+		ValidateRayFlags (rayFlags);
+
+		if (rayCount <= 4) {
+			return TracePacket<4> (accelerationStructure, rayCount, pRays, rayFlags, instanceInclusionMask, hitGroups, ppPayloads, pHits);
+		}
+		if (rayCount <= 8) {
+			return TracePacket<8> (accelerationStructure, rayCount, pRays, rayFlags, instanceInclusionMask, hitGroups, ppPayloads, pHits);
+		}
+		return TracePacket<16> (accelerationStructure, rayCount, pRays, rayFlags, instanceInclusionMask, hitGroups, ppPayloads, pHits);
+	}
+
+	void TraceRay (const ShaderTables& shaderTables, const AccelerationStructureHeader* accelerationStructure, UINT rayFlags, UINT instanceInclusionMask,
+		UINT rayContributionToHitGroupIndex, UINT multiplierForGeometryContributionToHitGroupIndex, UINT missShaderIndex, const RayDesc& ray, void* payload) {
+
+		ThrowIfFalse (shaderTables.MissShaderCount == 0 || shaderTables.ppMissShaders != nullptr);
+		const HitGroupTable hitGroups = {shaderTables.ppHitGroups, shaderTables.HitGroupCount, rayContributionToHitGroupIndex, multiplierForGeometryContributionToHitGroupIndex};
+		const UINT occlusionFlags = RAY_FLAG_ACCEPT_FIRST_HIT_AND_END_SEARCH | RAY_FLAG_SKIP_CLOSEST_HIT_SHADER;
+		RayHit hit;
+		const bool found = (rayFlags & occlusionFlags) == occlusionFlags ? Occluded (accelerationStructure, ray, rayFlags, instanceInclusionMask, hitGroups, payload) :
+			Trace (accelerationStructure, ray, rayFlags, instanceInclusionMask, hitGroups, payload, &hit);
+		if (!found) {
+			ThrowIfFalse (missShaderIndex < shaderTables.MissShaderCount && shaderTables.ppMissShaders[missShaderIndex] != nullptr,
+				"CpuRaytracing: a miss selects a miss shader outside the miss shader table.");
+			const MissShader& missShader = *shaderTables.ppMissShaders[missShaderIndex];
+			if (missShader) {
+				MissContext context (ray, rayFlags, payload);
+				missShader (context);
+			}
+			return;
+		}
+
+		if (rayFlags & RAY_FLAG_SKIP_CLOSEST_HIT_SHADER) {
+			return;
+		}
+		ThrowIfFalse (hit.HitGroupIndex < hitGroups.RecordCount && hitGroups.ppRecords[hit.HitGroupIndex] != nullptr,
+			"CpuRaytracing: a hit selects a hit group outside the hit-group table.");
+		const ClosestHitShader& closestHitShader = hitGroups.ppRecords[hit.HitGroupIndex]->GetClosestHitShader ();
+		if (closestHitShader) {
+			ClosestHitContext context (ray, rayFlags, hit, payload);
+			closestHitShader (context);
+		}
+	}
+
+}
@@ -0,0 +1,345 @@
+#pragma once
+
+#include "AccelerationStructure.h"
+
+#include <functional>
+#include <string>
+#include <type_traits>
+
+namespace CpuRaytracing {
+
+	// HLSL RayDesc.
+	struct RayDesc {
+		Float3 Origin;
+		float TMin;
+		Float3 Direction;
+		float TMax;
+	};
+
+	// HIT_KIND_TRIANGLE_FRONT_FACE / HIT_KIND_TRIANGLE_BACK_FACE.
+	static const UINT c_HitKindTriangleFrontFace = 0xFE;
+	static const UINT c_HitKindTriangleBackFace = 0xFF;
+
+	// Hit kinds an intersection shader may report; the others are reserved for triangles.
+	static const UINT c_MaxProceduralHitKind = 0x7F;
+
+	// The committed hit as the closest-hit stage sees it, named after the HLSL intrinsics that return each value.
+	struct RayHit {
+		float T;                                    // RayTCurrent ()
+		union {
+			float Barycentrics[2];                  // BuiltInTriangleIntersectionAttributes::barycentrics
+			UINT8 Attributes[D3D12_RAYTRACING_MAX_ATTRIBUTE_SIZE_IN_BYTES];    // As passed to ReportHit ()
+		};
+		UINT HitKind;                               // HitKind ()
+		UINT PrimitiveIndex;                        // PrimitiveIndex ()
+		UINT GeometryIndex;                         // GeometryIndex ()
+		UINT InstanceIndex;                         // InstanceIndex ()
+		UINT InstanceID;                            // InstanceID ()
+		UINT InstanceContributionToHitGroupIndex;
+		UINT HitGroupIndex;                         // Record of the hit-group table the hit selects.
+		const InstanceRecord* Instance;             // ObjectToWorld3x4 () / WorldToObject3x4 (); null without a top level.
+	};
+
+	// HLSL RAY_FLAG. As in DXR, at most one of FORCE_OPAQUE, FORCE_NON_OPAQUE, CULL_OPAQUE and CULL_NON_OPAQUE may be
+	// set, at most one of the two facing culls, and SKIP_TRIANGLES excludes SKIP_PROCEDURAL_PRIMITIVES and the facing
+	// culls.
+	enum RAY_FLAG {
+		RAY_FLAG_NONE = 0x00,
+		RAY_FLAG_FORCE_OPAQUE = 0x01,
+		RAY_FLAG_FORCE_NON_OPAQUE = 0x02,
+		RAY_FLAG_ACCEPT_FIRST_HIT_AND_END_SEARCH = 0x04,
+		RAY_FLAG_SKIP_CLOSEST_HIT_SHADER = 0x08,
+		RAY_FLAG_CULL_BACK_FACING_TRIANGLES = 0x10,
+		RAY_FLAG_CULL_FRONT_FACING_TRIANGLES = 0x20,
+		RAY_FLAG_CULL_OPAQUE = 0x40,
+		RAY_FLAG_CULL_NON_OPAQUE = 0x80,
+		RAY_FLAG_SKIP_TRIANGLES = 0x100,
+		RAY_FLAG_SKIP_PROCEDURAL_PRIMITIVES = 0x200,
+	};
+
+	// The ray and primitive intrinsics that intersection and any-hit shaders share, named after HLSL.
+	class PrimitiveContext {
+	public:
+		Float3 WorldRayOrigin () const { return m_WorldRay.Origin; }
+		Float3 WorldRayDirection () const { return m_WorldRay.Direction; }
+		Float3 ObjectRayOrigin () const { return m_ObjectRayOrigin; }
+		Float3 ObjectRayDirection () const { return m_ObjectRayDirection; }
+		float RayTMin () const { return m_WorldRay.TMin; }
+		float RayTCurrent () const { return m_TCurrent; }
+		UINT RayFlags () const { return m_RayFlags; }
+		UINT PrimitiveIndex () const { return m_PrimitiveIndex; }
+		UINT GeometryIndex () const { return m_GeometryIndex; }
+		UINT InstanceIndex () const { return m_Instance ? m_Instance->InstanceIndex : 0; }
+		UINT InstanceID () const { return m_Instance ? m_Instance->InstanceID : 0; }
+		const InstanceRecord* Instance () const { return m_Instance; }
+
+	protected:
+		PrimitiveContext (const RayDesc& worldRay, UINT rayFlags, const Float3& objectRayOrigin, const Float3& objectRayDirection,
+			UINT primitiveIndex, UINT geometryIndex, const InstanceRecord* instance, float tCurrent, void* payload) :
+			m_WorldRay (worldRay), m_RayFlags (rayFlags), m_ObjectRayOrigin (objectRayOrigin), m_ObjectRayDirection (objectRayDirection),
+			m_PrimitiveIndex (primitiveIndex), m_GeometryIndex (geometryIndex), m_Instance (instance), m_TCurrent (tCurrent), m_Payload (payload) {}
+
+		const RayDesc& m_WorldRay;
+		UINT m_RayFlags;
+		Float3 m_ObjectRayOrigin;
+		Float3 m_ObjectRayDirection;
+		UINT m_PrimitiveIndex;
+		UINT m_GeometryIndex;
+		const InstanceRecord* m_Instance;
+		float m_TCurrent;
+		void* m_Payload;                    // Of the TraceRay () call; null in TraceRayClosestHit ().
+	};
+
+	template <typename Payload>
+	inline Payload& GetPayload (void* payload) {
+		ThrowIfFalse (payload != nullptr, "CpuRaytracing: only shaders run by TraceRay () have a payload.");
+		return *static_cast<Payload*> (payload);
+	}
+
+	// What an any-hit shader sees of a candidate hit on non-opaque geometry. RayTCurrent () is the distance of the
+	// candidate. HLSL returns from the shader on IgnoreHit () and AcceptHitAndEndSearch (); here the shader returns
+	// itself after calling either. A candidate neither ignored nor ended is accepted and the search goes on.
+	class AnyHitContext : public PrimitiveContext {
+	public:
+		AnyHitContext (const RayDesc& worldRay, UINT rayFlags, const Float3& objectRayOrigin, const Float3& objectRayDirection,
+			UINT primitiveIndex, UINT geometryIndex, const InstanceRecord* instance, float tHit, UINT hitKind, const UINT8* attributes, void* payload) :
+			PrimitiveContext (worldRay, rayFlags, objectRayOrigin, objectRayDirection, primitiveIndex, geometryIndex, instance, tHit, payload),
+			m_HitKind (hitKind), m_Attributes (attributes), m_Ignored (false), m_SearchEnded (false) {}
+
+		UINT HitKind () const { return m_HitKind; }
+
+		// The attributes passed to ReportHit (), or the two barycentrics of a triangle as floats.
+		const UINT8* GetAttributes () const { return m_Attributes; }
+
+		// The payload of the TraceRay () call, whose type the shader has to know, as in HLSL.
+		template <typename Payload>
+		Payload& GetPayload () const { return CpuRaytracing::GetPayload<Payload> (m_Payload); }
+
+		void IgnoreHit () { m_Ignored = true; }
+		void AcceptHitAndEndSearch () { m_SearchEnded = true; }
+
+		bool IsIgnored () const { return m_Ignored; }
+		bool IsSearchEnded () const { return m_SearchEnded && !m_Ignored; }
+
+	private:
+		UINT m_HitKind;
+		const UINT8* m_Attributes;
+		bool m_Ignored;
+		bool m_SearchEnded;
+	};
+
+	typedef std::function<void (AnyHitContext& context)> AnyHitShader;
+
+	// What an intersection shader sees of the ray and the candidate primitive, and ReportHit (). Traversal
+	// creates one per procedural primitive whose box the ray enters.
+	class IntersectionContext : public PrimitiveContext {
+	public:
+		// anyHitShader is null for opaque primitives and for hit groups without an any-hit shader.
+		IntersectionContext (const RayDesc& worldRay, UINT rayFlags, const Float3& objectRayOrigin, const Float3& objectRayDirection,
+			const Aabb& primitiveBounds, UINT primitiveIndex, UINT geometryIndex, const InstanceRecord* instance, float tCurrent,
+			const AnyHitShader* anyHitShader, void* payload) :
+			PrimitiveContext (worldRay, rayFlags, objectRayOrigin, objectRayDirection, primitiveIndex, geometryIndex, instance, tCurrent, payload),
+			m_PrimitiveBounds (primitiveBounds), m_AnyHitShader (anyHitShader), m_HitKind (0), m_Committed (false), m_SearchEnded (false),
+			m_Attributes () {}
+
+		// The box of the primitive in object space, as its AABB buffer held it when the structure was built or updated.
+		const Aabb& PrimitiveBounds () const { return m_PrimitiveBounds; }
+
+		// Rejects tHit outside [RayTMin (), RayTCurrent ()]. Otherwise the any-hit shader, if there is one, runs on
+		// the candidate and may ignore it. An accepted hit is committed and becomes the new RayTCurrent ().
+		// Once the any-hit shader or RAY_FLAG_ACCEPT_FIRST_HIT_AND_END_SEARCH ends the search, further reports are
+		// rejected. hitKind must not exceed c_MaxProceduralHitKind.
+		template <typename Attributes>
+		bool ReportHit (float tHit, UINT hitKind, const Attributes& attributes) {
+			static_assert (sizeof (Attributes) <= D3D12_RAYTRACING_MAX_ATTRIBUTE_SIZE_IN_BYTES, "Hit attributes are limited to 32 bytes.");
+			static_assert (std::is_trivially_copyable<Attributes>::value, "Hit attributes must be trivially copyable.");
+			return ReportHit (tHit, hitKind, &attributes, sizeof (Attributes));
+		}
+
+		bool IsCommitted () const { return m_Committed; }
+		bool IsSearchEnded () const { return m_SearchEnded; }
+		UINT GetHitKind () const { return m_HitKind; }
+		const UINT8* GetAttributes () const { return m_Attributes; }
+
+	private:
+		bool ReportHit (float tHit, UINT hitKind, const void* attributes, size_t sizeInBytes);
+
+		Aabb m_PrimitiveBounds;
+		const AnyHitShader* m_AnyHitShader;
+		UINT m_HitKind;
+		bool m_Committed;
+		bool m_SearchEnded;
+		UINT8 m_Attributes[D3D12_RAYTRACING_MAX_ATTRIBUTE_SIZE_IN_BYTES];
+	};
+
+	typedef std::function<void (IntersectionContext& context)> IntersectionShader;
+
+	// What closest-hit and miss shaders see of the ray, and the payload, which TraceRay () hands them.
+	class RayContext {
+	public:
+		Float3 WorldRayOrigin () const { return m_WorldRay.Origin; }
+		Float3 WorldRayDirection () const { return m_WorldRay.Direction; }
+		float RayTMin () const { return m_WorldRay.TMin; }
+		UINT RayFlags () const { return m_RayFlags; }
+
+		template <typename Payload>
+		Payload& GetPayload () const { return CpuRaytracing::GetPayload<Payload> (m_Payload); }
+
+	protected:
+		RayContext (const RayDesc& worldRay, UINT rayFlags, void* payload) : m_WorldRay (worldRay), m_RayFlags (rayFlags), m_Payload (payload) {}
+
+		const RayDesc& m_WorldRay;
+		UINT m_RayFlags;
+		void* m_Payload;
+	};
+
+	// The committed hit, through the intrinsics of the closest-hit stage. Attributes are read from GetHit ().
+	class ClosestHitContext : public RayContext {
+	public:
+		ClosestHitContext (const RayDesc& worldRay, UINT rayFlags, const RayHit& hit, void* payload) : RayContext (worldRay, rayFlags, payload), m_Hit (hit) {}
+
+		float RayTCurrent () const { return m_Hit.T; }
+		UINT HitKind () const { return m_Hit.HitKind; }
+		UINT PrimitiveIndex () const { return m_Hit.PrimitiveIndex; }
+		UINT GeometryIndex () const { return m_Hit.GeometryIndex; }
+		UINT InstanceIndex () const { return m_Hit.InstanceIndex; }
+		UINT InstanceID () const { return m_Hit.InstanceID; }
+		Float3 ObjectRayOrigin () const { return m_Hit.Instance ? m_Hit.Instance->WorldToObject.TransformPoint (m_WorldRay.Origin) : m_WorldRay.Origin; }
+		Float3 ObjectRayDirection () const { return m_Hit.Instance ? m_Hit.Instance->WorldToObject.TransformVector (m_WorldRay.Direction) : m_WorldRay.Direction; }
+		const RayHit& GetHit () const { return m_Hit; }
+
+	private:
+		const RayHit& m_Hit;
+	};
+
+	class MissContext : public RayContext {
+	public:
+		MissContext (const RayDesc& worldRay, UINT rayFlags, void* payload) : RayContext (worldRay, rayFlags, payload) {}
+
+		float RayTCurrent () const { return m_WorldRay.TMax; }
+	};
+
+	typedef std::function<void (ClosestHitContext& context)> ClosestHitShader;
+	typedef std::function<void (MissContext& context)> MissShader;
+
+	// A hit group, declared the way CD3DX12_HIT_GROUP_SUBOBJECT declares one in a state object. The shaders that
+	// run inside traversal are the intersection shader, which tests procedural primitives for the
+	// PROCEDURAL_PRIMITIVE hit group their hit-group index selects, and the any-hit shader, which runs on candidate
+	// hits on non-opaque geometry. Triangles are tested by the built-in test. TraceRay () runs the closest-hit
+	// shader on the committed hit.
+	class HitGroup {
+	public:
+		HitGroup () : m_Type (D3D12_HIT_GROUP_TYPE_TRIANGLES) {}
+
+		void SetHitGroupExport (const std::string& exportName) { m_Export = exportName; }
+		void SetHitGroupType (D3D12_HIT_GROUP_TYPE type) { m_Type = type; }
+		void SetIntersectionShaderImport (IntersectionShader shader) { m_IntersectionShader = std::move (shader); }
+		void SetAnyHitShaderImport (AnyHitShader shader) { m_AnyHitShader = std::move (shader); }
+		void SetClosestHitShaderImport (ClosestHitShader shader) { m_ClosestHitShader = std::move (shader); }
+
+		const std::string& GetHitGroupExport () const { return m_Export; }
+		D3D12_HIT_GROUP_TYPE GetHitGroupType () const { return m_Type; }
+		const IntersectionShader& GetIntersectionShader () const { return m_IntersectionShader; }
+		const AnyHitShader& GetAnyHitShader () const { return m_AnyHitShader; }
+		const ClosestHitShader& GetClosestHitShader () const { return m_ClosestHitShader; }
+
+	private:
+		std::string m_Export;
+		D3D12_HIT_GROUP_TYPE m_Type;
+		IntersectionShader m_IntersectionShader;
+		AnyHitShader m_AnyHitShader;
+		ClosestHitShader m_ClosestHitShader;
+	};
+
+	// The hit-group shader table of a dispatch: one hit group per record, which records may share. A hit selects
+	// record InstanceContributionToHitGroupIndex + RayContributionToHitGroupIndex
+	// + MultiplierForGeometryContributionToHitGroupIndex * GeometryIndex (), as in DXR.
+	struct HitGroupTable {
+		const HitGroup* const* ppRecords;
+		UINT RecordCount;
+		UINT RayContributionToHitGroupIndex;
+		UINT MultiplierForGeometryContributionToHitGroupIndex;
+	};
+
+	// Finds the closest hit along ray in [TMin, TMax]. accelerationStructure is normally a top-level structure,
+	// whose instances are skipped unless InstanceMask & instanceInclusionMask is nonzero; a bottom-level one is
+	// traced in its own space.
+	//
+	// Geometry is opaque if it has the OPAQUE flag, unless the instance flags force it either way, unless rayFlags
+	// (RAY_FLAG) force it either way. Candidate hits on non-opaque geometry run the any-hit shader of their hit group.
+	// Instances that are opaque throughout are traced without looking at geometry flags or hit groups for any-hit
+	// shaders. RAY_FLAG_CULL_OPAQUE and RAY_FLAG_CULL_NON_OPAQUE skip primitives by that opacity.
+	//
+	// The facing culls skip triangles, except in instances with TRIANGLE_CULL_DISABLE. Triangles are front facing
+	// when clockwise from the ray origin, counterclockwise in instances with TRIANGLE_FRONT_COUNTERCLOCKWISE, which
+	// also decides the reported HitKind (). RAY_FLAG_SKIP_TRIANGLES and RAY_FLAG_SKIP_PROCEDURAL_PRIMITIVES skip whole
+	// bottom-level structures of that geometry type.
+	//
+	// RAY_FLAG_ACCEPT_FIRST_HIT_AND_END_SEARCH returns the first hit accepted, which need not be the closest, and ends
+	// traversal right there, which makes shadow and visibility rays cheap. RAY_FLAG_SKIP_CLOSEST_HIT_SHADER only
+	// affects TraceRay ().
+	//
+	// Procedural primitives are tested by the intersection shaders of hitGroups. Throws if a hit selects a record
+	// outside the table, or a procedural primitive one that is not PROCEDURAL_PRIMITIVE.
+	bool TraceRayClosestHit (const AccelerationStructureHeader* accelerationStructure, const RayDesc& ray, UINT rayFlags, UINT instanceInclusionMask,
+		const HitGroupTable& hitGroups, RayHit* hit);
+
+	// For structures over triangles only, with no ray flags and an empty hit-group table, so every hit is accepted.
+	bool TraceRayClosestHit (const AccelerationStructureHeader* accelerationStructure, const RayDesc& ray, UINT instanceInclusionMask, RayHit* hit);
+
+	// Whether anything in [TMin, TMax] occludes ray, for shadow and ambient-occlusion rays that need no more than
+	// that: TraceRayClosestHit () with RAY_FLAG_ACCEPT_FIRST_HIT_AND_END_SEARCH added to rayFlags, minus the hit. The
+	// search ends at the first hit accepted, and children are visited in node order rather than nearest first,
+	// with no distances kept on the stack. Triangles of instances traced as opaque are tested without computing
+	// distances or barycentrics. Any-hit and intersection shaders run as they would, and see the added flag.
+	bool TraceRayOcclusion (const AccelerationStructureHeader* accelerationStructure, const RayDesc& ray, UINT rayFlags, UINT instanceInclusionMask,
+		const HitGroupTable& hitGroups);
+
+	// For structures over triangles only, with no ray flags and an empty hit-group table, so every hit is accepted.
+	bool TraceRayOcclusion (const AccelerationStructureHeader* accelerationStructure, const RayDesc& ray, UINT instanceInclusionMask);
+
+	static const UINT c_MaxRayPacketSize = 16;
+
+	// TraceRayClosestHit () for rayCount rays at once, up to c_MaxRayPacketSize, which share rayFlags. The rays
+	// traverse as a packet of 4, 8 or 16 lanes with one stack: every node is tested against all the rays that
+	// reached it with one SIMD slab test per box, so coherent rays, such as the camera rays of a screen tile, fetch
+	// and test each node once rather than once per ray. Where rays diverge until a subtree is visited by a quarter of
+	// the lanes or fewer, those finish it as single rays.
+	//
+	// Closest hits are found at the same distances as ray by ray, but nodes are visited in a different order, so
+	// any-hit and intersection shaders may run in another order, ACCEPT_FIRST_HIT_AND_END_SEARCH may accept another
+	// hit, and hits at equal distances may resolve to another primitive. Returns the mask of the rays that hit;
+	// pHits [i] is written only for those.
+	//
+	// Any-hit and intersection shaders of ray i reach ppPayloads [i] through GetPayload<Payload> (). Without
+	// ppPayloads they have no payload, as in TraceRayClosestHit ().
+	UINT TraceRayPacketClosestHit (const AccelerationStructureHeader* accelerationStructure, UINT rayCount, const RayDesc* pRays, UINT rayFlags,
+		UINT instanceInclusionMask, const HitGroupTable& hitGroups, RayHit* pHits, void* const* ppPayloads = nullptr);
+
+	// The shader tables of a dispatch, as D3D12_DISPATCH_RAYS_DESC passes them. Records may be shared.
+	struct ShaderTables {
+		const HitGroup* const* ppHitGroups;
+		UINT HitGroupCount;
+		const MissShader* const* ppMissShaders;
+		UINT MissShaderCount;
+	};
+
+	// HLSL TraceRay (). Traverses as TraceRayClosestHit () does, with the hit-group contributions given here, then
+	// runs the closest-hit shader of the committed hit unless RAY_FLAG_SKIP_CLOSEST_HIT_SHADER is set, or the miss
+	// shader missShaderIndex if nothing was hit. With both RAY_FLAG_ACCEPT_FIRST_HIT_AND_END_SEARCH and
+	// RAY_FLAG_SKIP_CLOSEST_HIT_SHADER, no hit is ever read, so it traverses as TraceRayOcclusion () does. Hit groups
+	// and miss shaders without a shader do nothing. Any-hit, closest-hit and miss shaders reach payload through their
+	// context's GetPayload<Payload> (), and may call TraceRay () themselves. Throws if a hit or miss selects a record
+	// outside its table.
+	void TraceRay (const ShaderTables& shaderTables, const AccelerationStructureHeader* accelerationStructure, UINT rayFlags, UINT instanceInclusionMask,
+		UINT rayContributionToHitGroupIndex, UINT multiplierForGeometryContributionToHitGroupIndex, UINT missShaderIndex, const RayDesc& ray, void* payload);
+
+	template <typename Payload>
+	inline void TraceRay (const ShaderTables& shaderTables, const AccelerationStructureHeader* accelerationStructure, UINT rayFlags, UINT instanceInclusionMask,
+		UINT rayContributionToHitGroupIndex, UINT multiplierForGeometryContributionToHitGroupIndex, UINT missShaderIndex, const RayDesc& ray, Payload& payload) {
+
+		TraceRay (shaderTables, accelerationStructure, rayFlags, instanceInclusionMask, rayContributionToHitGroupIndex, multiplierForGeometryContributionToHitGroupIndex,
+			missShaderIndex, ray, static_cast<void*> (&payload));
+	}
+
+}